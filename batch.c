@@ -0,0 +1,280 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libmsr.h"
+
+/*
+ * Parallel batch decoding of capture journals.
+ *
+ * The records are split into chunks, which worker threads claim in
+ * order with an atomic counter. A chunk is decoded and formatted into
+ * one of a ring of output slots, and the calling thread hands the slots
+ * to the sink in chunk order. The only state the threads share is the
+ * counter and each slot's sequence numbers: a worker waits for its slot
+ * to be emptied, and the caller waits for it to be filled. Since chunks
+ * are claimed in order, the oldest chunk in progress always has a free
+ * slot, so nobody waits forever.
+ */
+#define MSR_BATCH_CHUNK 256
+#define MSR_BATCH_SLOTS_PER_THREAD 4
+#define MSR_BATCH_MAX_THREADS 256
+#define MSR_CACHELINE 64
+
+struct msr_batch_slot {
+	char		*buf;
+	size_t		len;
+	size_t		size;
+	size_t		filled; /* chunk number + 1 of the contents, or 0 */
+	size_t		free; /* the next chunk number that may use the slot */
+	int		err;
+	char		pad[MSR_CACHELINE]; /* keep neighbours' counters apart */
+};
+
+struct msr_batch_run {
+	const msr_journal_map_t *map;
+	const msr_batch_t *opts;
+	size_t		first;
+	size_t		count;
+	size_t		chunk;
+	size_t		nchunks;
+	size_t		next; /* the next chunk to claim */
+	int		stop;
+	size_t		nslots;
+	struct msr_batch_slot *slots;
+};
+
+struct msr_batch_worker {
+	struct msr_batch_run *run;
+	pthread_t	thread;
+	msr_batch_stats_t stats;
+};
+
+/* Wait a little, without holding anything. */
+static void msr_batch_pause (unsigned *spins)
+{
+	struct timespec ts = { 0, 20000 };
+
+	if (++*spins < 64)
+		return;
+	if (*spins < 128) {
+		sched_yield ();
+		return;
+	}
+	nanosleep (&ts, NULL);
+}
+
+/* Decode one record's tracks into the record's scratch space. */
+static void msr_batch_decode_rec (const msr_batch_t *opts,
+    msr_batch_rec_t *br, uint8_t scratch[MSR_MAX_TRACKS][MSR_DECODE_MAX],
+    msr_batch_stats_t *stats)
+{
+	const msr_journal_rec_t *rec = br->msr_br_rec;
+	size_t len;
+	int i, bpc;
+
+	for (i = 0; i < MSR_MAX_TRACKS; i++) {
+		/* ISO reads are characters already. */
+		if (rec->msr_jr_mode != MSR_JOURNAL_RAW) {
+			br->msr_br_tracks[i] = rec->msr_jr_tracks[i];
+			br->msr_br_result[i] = LIBMSR_ERR_OK;
+			continue;
+		}
+
+		bpc = opts->msr_bt_bpc ? opts->msr_bt_bpc :
+		    rec->msr_jr_bpc[i];
+		len = MSR_DECODE_MAX;
+		br->msr_br_result[i] = msr_decode_view (rec->msr_jr_tracks[i],
+		    scratch[i], &len, bpc);
+		if (br->msr_br_result[i] != LIBMSR_ERR_OK) {
+			len = 0;
+			stats->msr_bs_errors++;
+		}
+		br->msr_br_tracks[i].msr_tv_data = scratch[i];
+		br->msr_br_tracks[i].msr_tv_len = len;
+	}
+}
+
+/* Format a record onto the end of a slot, growing it as needed. */
+static int msr_batch_format (const msr_batch_t *opts,
+    const msr_batch_rec_t *br, struct msr_batch_slot *slot)
+{
+	size_t n, size;
+	char *nbuf;
+
+	for (;;) {
+		n = opts->msr_bt_format (br, slot->buf + slot->len,
+		    slot->size - slot->len, opts->msr_bt_cookie);
+		if (n <= slot->size - slot->len)
+			break;
+
+		for (size = slot->size ? slot->size * 2 : 65536;
+		    size - slot->len < n; size *= 2)
+			;
+		if ((nbuf = realloc (slot->buf, size)) == NULL)
+			return -1;
+		slot->buf = nbuf;
+		slot->size = size;
+	}
+
+	slot->len += n;
+
+	return 0;
+}
+
+static void *msr_batch_worker (void *arg)
+{
+	struct msr_batch_worker *w = arg;
+	struct msr_batch_run *run = w->run;
+	const msr_batch_t *opts = run->opts;
+	uint8_t scratch[MSR_MAX_TRACKS][MSR_DECODE_MAX];
+	struct msr_batch_slot *slot;
+	msr_batch_stats_t stats;
+	msr_journal_rec_t rec;
+	msr_batch_rec_t br;
+	size_t c, n, end;
+	unsigned spins;
+
+	/* Counted locally, so that workers don't share cache lines. */
+	memset (&stats, 0, sizeof(stats));
+
+	for (;;) {
+		c = __atomic_fetch_add (&run->next, 1, __ATOMIC_RELAXED);
+		if (c >= run->nchunks)
+			break;
+
+		slot = &run->slots[c % run->nslots];
+		spins = 0;
+		while (__atomic_load_n (&slot->free, __ATOMIC_ACQUIRE) != c) {
+			if (__atomic_load_n (&run->stop, __ATOMIC_RELAXED))
+				goto out;
+			msr_batch_pause (&spins);
+		}
+
+		slot->len = 0;
+		slot->err = 0;
+		n = run->first + c * run->chunk;
+		end = n + run->chunk;
+		if (end > run->first + run->count)
+			end = run->first + run->count;
+
+		for (; n < end && !slot->err; n++) {
+			memset (&br, 0, sizeof(br));
+			br.msr_br_index = n;
+			br.msr_br_rec = &rec;
+			if (msr_journal_get (run->map, n, &rec) != LIBMSR_ERR_OK) {
+				/* Report the damage, and carry on. */
+				memset (&rec, 0, sizeof(rec));
+				br.msr_br_corrupt = 1;
+				stats.msr_bs_corrupt++;
+			} else
+				msr_batch_decode_rec (opts, &br, scratch,
+				    &stats);
+			stats.msr_bs_records++;
+
+			if (opts->msr_bt_format != NULL &&
+			    msr_batch_format (opts, &br, slot) != 0)
+				slot->err = 1;
+		}
+
+		__atomic_store_n (&slot->filled, c + 1, __ATOMIC_RELEASE);
+	}
+
+out:
+	w->stats = stats;
+	return NULL;
+}
+
+int msr_batch_decode (const msr_journal_map_t *m, size_t first,
+    size_t count, const msr_batch_t *opts, msr_batch_stats_t *stats)
+{
+	struct msr_batch_worker *workers;
+	struct msr_batch_slot *slot;
+	struct msr_batch_run run;
+	int i, nthreads, started, r = LIBMSR_ERR_OK;
+	unsigned spins;
+	size_t c;
+
+	if (stats != NULL)
+		memset (stats, 0, sizeof(*stats));
+
+	if (first > msr_journal_count (m))
+		return LIBMSR_ERR_GENERIC;
+	if (count > msr_journal_count (m) - first)
+		count = msr_journal_count (m) - first;
+
+	nthreads = opts->msr_bt_threads;
+	if (nthreads <= 0)
+		nthreads = sysconf (_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0)
+		nthreads = 1;
+	if (nthreads > MSR_BATCH_MAX_THREADS)
+		nthreads = MSR_BATCH_MAX_THREADS;
+
+	memset (&run, 0, sizeof(run));
+	run.map = m;
+	run.opts = opts;
+	run.first = first;
+	run.count = count;
+	run.chunk = opts->msr_bt_chunk ? opts->msr_bt_chunk : MSR_BATCH_CHUNK;
+	run.nchunks = (count + run.chunk - 1) / run.chunk;
+	run.nslots = nthreads * MSR_BATCH_SLOTS_PER_THREAD;
+	run.slots = calloc (run.nslots, sizeof(*run.slots));
+	workers = calloc (nthreads, sizeof(*workers));
+	if (run.slots == NULL || workers == NULL) {
+		free (run.slots);
+		free (workers);
+		return LIBMSR_ERR_GENERIC;
+	}
+	for (c = 0; c < run.nslots; c++)
+		run.slots[c].free = c;
+
+	for (started = 0; started < nthreads; started++) {
+		workers[started].run = &run;
+		if (pthread_create (&workers[started].thread, NULL,
+		    msr_batch_worker, &workers[started]) != 0)
+			break;
+	}
+
+	if (started == 0)
+		r = LIBMSR_ERR_GENERIC;
+
+	/* Hand the chunks to the sink in order. */
+	for (c = 0; c < run.nchunks && r == LIBMSR_ERR_OK; c++) {
+		slot = &run.slots[c % run.nslots];
+		spins = 0;
+		while (__atomic_load_n (&slot->filled, __ATOMIC_ACQUIRE) != c + 1)
+			msr_batch_pause (&spins);
+
+		if (slot->err || (opts->msr_bt_sink != NULL && slot->len > 0 &&
+		    opts->msr_bt_sink (slot->buf, slot->len,
+		    opts->msr_bt_cookie) != 0))
+			r = LIBMSR_ERR_GENERIC;
+
+		__atomic_store_n (&slot->free, c + run.nslots, __ATOMIC_RELEASE);
+	}
+
+	if (r != LIBMSR_ERR_OK)
+		__atomic_store_n (&run.stop, 1, __ATOMIC_RELAXED);
+
+	for (i = 0; i < started; i++) {
+		pthread_join (workers[i].thread, NULL);
+		if (stats != NULL) {
+			stats->msr_bs_records += workers[i].stats.msr_bs_records;
+			stats->msr_bs_errors += workers[i].stats.msr_bs_errors;
+			stats->msr_bs_corrupt += workers[i].stats.msr_bs_corrupt;
+		}
+	}
+	if (stats != NULL)
+		stats->msr_bs_threads = started;
+
+	free (workers);
+	for (c = 0; c < run.nslots; c++)
+		free (run.slots[c].buf);
+	free (run.slots);
+
+	return r;
+}
@@ -0,0 +1,92 @@
+/*
+ * Shared helpers for the libmsr benchmarks.
+ *
+ * Each benchmark is a function that performs a given number of
+ * iterations. bench_run() grows the iteration count until a run takes
+ * long enough to time reliably, then keeps the best of several runs.
+ */
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_MIN_NS 50000000ULL /* 50 ms per timed run */
+#define BENCH_RUNS 5
+
+typedef void (*bench_fn)(void *arg, uint64_t iters);
+
+static inline uint64_t bench_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Returns the best observed time per iteration, in nanoseconds. */
+static inline double bench_run (bench_fn fn, void *arg)
+{
+	uint64_t iters = 1, t, best = 0;
+	int run;
+
+	/* Calibrate (and warm up) until one run takes long enough. */
+	for (;;) {
+		t = bench_now ();
+		fn (arg, iters);
+		t = bench_now () - t;
+		if (t >= BENCH_MIN_NS || iters >= (1ULL << 40))
+			break;
+		iters = (t > 0 && t < BENCH_MIN_NS / 16) ?
+		    iters * 16 : iters * 2;
+	}
+
+	for (run = 0; run < BENCH_RUNS; run++) {
+		t = bench_now ();
+		fn (arg, iters);
+		t = bench_now () - t;
+		if (run == 0 || t < best)
+			best = t;
+	}
+
+	return (double) best / iters;
+}
+
+/* A fixed-seed generator, so every run sees the same input. */
+static inline uint32_t bench_rand (uint32_t *state)
+{
+	uint32_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return (*state = x);
+}
+
+static inline void bench_header (void)
+{
+	printf ("%-28s %5s %4s %12s %10s\n",
+	    "benchmark", "len", "bpc", "ns/track", "MB/s");
+}
+
+/*
+ * Report a result. bytes is the amount of track data processed per
+ * iteration, tracks the number of tracks.
+ */
+static inline void bench_report (const char *name, int len, int bpc,
+    double ns, int tracks, double bytes)
+{
+	char b[8];
+
+	if (bpc)
+		snprintf (b, sizeof(b), "%d", bpc);
+	else
+		snprintf (b, sizeof(b), "-");
+
+	printf ("%-28s %5d %4s %12.1f %10.1f\n", name, len, b, ns / tracks,
+	    bytes * 1000.0 / ns);
+	fflush (stdout);
+}
+
+#endif /* BENCH_H */
@@ -0,0 +1,129 @@
+/*
+ * Decode a synthetic capture journal with msr_batch_decode() on more and
+ * more threads, and report the rate and the speedup over one thread.
+ *
+ * usage: bench_batch [records] [dir]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../libmsr.h"
+#include "bench.h"
+
+static size_t format_rec (const msr_batch_rec_t *br, char *buf, size_t size,
+    void *cookie)
+{
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < MSR_MAX_TRACKS; i++)
+		len += br->msr_br_tracks[i].msr_tv_len + 1;
+	if (len > size)
+		return len;
+
+	for (i = 0, len = 0; i < MSR_MAX_TRACKS; i++) {
+		memcpy (buf + len, br->msr_br_tracks[i].msr_tv_data,
+		    br->msr_br_tracks[i].msr_tv_len);
+		len += br->msr_br_tracks[i].msr_tv_len;
+		buf[len++] = (i == MSR_MAX_TRACKS - 1) ? '\n' : '\t';
+	}
+
+	return len;
+}
+
+/* Fold the output into a checksum, to check that it doesn't change. */
+static int sink (const void *buf, size_t len, void *cookie)
+{
+	msr_track_view_t v;
+	uint64_t *sum = cookie;
+
+	v.msr_tv_data = buf;
+	v.msr_tv_len = len;
+	*sum = *sum * 31 + msr_track_hash (v);
+
+	return 0;
+}
+
+int main (int argc, char **argv)
+{
+	uint8_t bpc[MSR_MAX_TRACKS] = { 7, 5, 5 };
+	msr_batch_stats_t stats;
+	msr_journal_map_t *m;
+	msr_journal_t *j;
+	msr_tracks_t tracks;
+	msr_batch_t opts;
+	char path[512], ipath[520];
+	uint64_t sum, sum1 = 0, t;
+	uint32_t seed = 1;
+	double rate, rate1 = 0;
+	long records, i, cpus;
+	int k, n, threads;
+
+	records = (argc > 1) ? atol (argv[1]) : 1000000;
+	snprintf (path, sizeof(path), "%s/bench_batch.%d",
+	    (argc > 2) ? argv[2] : "/tmp", (int) getpid ());
+	snprintf (ipath, sizeof(ipath), "%s.idx", path);
+
+	if (msr_journal_open (path, &j) != LIBMSR_ERR_OK) {
+		fprintf (stderr, "%s: can't create journal\n", path);
+		return 1;
+	}
+	for (i = 0; i < records; i++) {
+		for (k = 0; k < MSR_MAX_TRACKS; k++) {
+			n = 40 + bench_rand (&seed) % 60;
+			tracks.msr_tracks[k].msr_tk_len = n;
+			while (n--)
+				tracks.msr_tracks[k].msr_tk_data[n] =
+				    bench_rand (&seed);
+		}
+		msr_journal_append (j, i + 1, i % 48, MSR_JOURNAL_RAW, bpc,
+		    &tracks);
+	}
+	msr_journal_close (j);
+
+	if (msr_journal_map (path, &m) != LIBMSR_ERR_OK) {
+		fprintf (stderr, "%s: can't map journal\n", path);
+		return 1;
+	}
+
+	cpus = sysconf (_SC_NPROCESSORS_ONLN);
+	printf ("%ld records, %ld CPUs\n", records, cpus);
+	printf ("%8s %14s %9s\n", "threads", "records/s", "speedup");
+
+	memset (&opts, 0, sizeof(opts));
+	opts.msr_bt_format = format_rec;
+	opts.msr_bt_sink = sink;
+	opts.msr_bt_cookie = &sum;
+
+	for (threads = 1; threads <= 2 * cpus; threads *= 2) {
+		opts.msr_bt_threads = threads;
+		sum = 0;
+		t = bench_now ();
+		if (msr_batch_decode (m, 0, records, &opts, &stats) !=
+		    LIBMSR_ERR_OK) {
+			fprintf (stderr, "msr_batch_decode failed\n");
+			return 1;
+		}
+		t = bench_now () - t;
+
+		rate = stats.msr_bs_records * 1e9 / t;
+		if (threads == 1) {
+			rate1 = rate;
+			sum1 = sum;
+		} else if (sum != sum1) {
+			fprintf (stderr, "output differs with %d threads\n",
+			    threads);
+			return 1;
+		}
+		printf ("%8d %14.0f %8.2fx\n", threads, rate, rate / rate1);
+		fflush (stdout);
+	}
+
+	msr_journal_unmap (m);
+	unlink (path);
+	unlink (ipath);
+
+	return 0;
+}
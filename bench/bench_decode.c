@@ -0,0 +1,321 @@
+/*
+ * Microbenchmarks for the host-side bit manipulation, decode and
+ * formatting routines in libmsr.c.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../libmsr.h"
+#include "bench.h"
+
+static const int lengths[] = { 16, 64, 128, 255 };
+#define NLENGTHS (sizeof(lengths) / sizeof(lengths[0]))
+
+/* Characters per ISO track; 200 is about as many as track 1 can hold. */
+static const int isolengths[] = { 16, 40, 79, 200 };
+#define NISOLENGTHS (sizeof(isolengths) / sizeof(isolengths[0]))
+
+struct bench_arg {
+	msr_tracks_t tracks;
+	int len;
+	int bpc;
+	int fd;
+};
+
+static volatile int sink;
+
+static void fill (struct bench_arg *a, int len, int printable)
+{
+	uint32_t seed = 0x6d737221;
+	int t, i;
+
+	memset (&a->tracks, 0, sizeof(a->tracks));
+	for (t = 0; t < MSR_MAX_TRACKS; t++) {
+		for (i = 0; i < len; i++) {
+			uint8_t b = bench_rand (&seed);
+
+			if (printable)
+				b = 0x20 + b % 0x5f;
+			a->tracks.msr_tracks[t].msr_tk_data[i] = b;
+		}
+		a->tracks.msr_tracks[t].msr_tk_len = len;
+	}
+	a->len = len;
+}
+
+static void b_getbit (void *p, uint64_t iters)
+{
+	struct bench_arg *a = p;
+	msr_track_t *tk = &a->tracks.msr_tracks[0];
+	int acc = 0, i;
+
+	while (iters--)
+		for (i = 0; i < a->len * 8; i++)
+			acc += msr_getbit (tk->msr_tk_data, tk->msr_tk_len, i);
+
+	sink = acc;
+}
+
+static void b_setbit (void *p, uint64_t iters)
+{
+	struct bench_arg *a = p;
+	msr_track_t *tk = &a->tracks.msr_tracks[0];
+	int i;
+
+	while (iters--)
+		for (i = 0; i < a->len * 8; i++)
+			msr_setbit (tk->msr_tk_data, tk->msr_tk_len, i,
+			    (i ^ (int) iters) & 1);
+
+	sink = tk->msr_tk_data[0];
+}
+
+static void b_decode (void *p, uint64_t iters)
+{
+	struct bench_arg *a = p;
+	msr_track_t *tk = &a->tracks.msr_tracks[0];
+	uint8_t out[MSR_MAX_TRACK_LEN * 8];
+	size_t outlen;
+
+	/*
+	 * A full track decodes to more characters than msr_decode() can
+	 * return, so time the view API, which it wraps.
+	 */
+	while (iters--) {
+		outlen = sizeof(out);
+		sink = msr_decode_view (msr_track_view (tk), out, &outlen,
+		    a->bpc);
+		sink = outlen;
+	}
+}
+
+static void b_reverse (void *p, uint64_t iters)
+{
+	struct bench_arg *a = p;
+
+	while (iters--)
+		msr_reverse_tracks (&a->tracks);
+
+	sink = a->tracks.msr_tracks[0].msr_tk_data[0];
+}
+
+/* Fill the tracks with ISO characters, len on each track. */
+static void fill_iso (struct bench_arg *a, int len)
+{
+	uint32_t seed = 0x69736f21;
+	int t, i;
+
+	memset (&a->tracks, 0, sizeof(a->tracks));
+	for (t = 0; t < MSR_MAX_TRACKS; t++) {
+		for (i = 0; i < len; i++)
+			a->tracks.msr_tracks[t].msr_tk_data[i] = (t == 0) ?
+			    'A' + bench_rand (&seed) % 26 :
+			    '0' + bench_rand (&seed) % 10;
+		a->tracks.msr_tracks[t].msr_tk_len = len;
+	}
+	a->len = len;
+}
+
+static void b_iso_encode (void *p, uint64_t iters)
+{
+	struct bench_arg *a = p;
+	msr_tracks_t raw;
+
+	while (iters--)
+		msr_iso_encode (&a->tracks, &raw, NULL);
+
+	sink = raw.msr_tracks[0].msr_tk_len;
+}
+
+static void b_iso_decode (void *p, uint64_t iters)
+{
+	struct bench_arg *a = p;
+	msr_tracks_t iso;
+
+	while (iters--)
+		msr_iso_decode (&a->tracks, &iso, NULL);
+
+	sink = iso.msr_tracks[0].msr_tk_len;
+}
+
+static void b_iso_correct (void *p, uint64_t iters)
+{
+	struct bench_arg *a = p;
+	msr_tracks_t iso;
+
+	while (iters--)
+		msr_iso_decode_correct (&a->tracks, &iso, NULL);
+
+	sink = iso.msr_tracks[0].msr_tk_len;
+}
+
+static void b_analyze (void *p, uint64_t iters)
+{
+	struct bench_arg *a = p;
+	msr_tracks_t iso;
+
+	while (iters--)
+		msr_analyze_tracks (&a->tracks, &iso, NULL);
+
+	sink = iso.msr_tracks[0].msr_tk_len;
+}
+
+/* Compare track 0 with track 1, a copy of it with one bit flipped. */
+static void b_diff (void *p, uint64_t iters)
+{
+	struct bench_arg *a = p;
+	msr_bitdiff_t d;
+
+	while (iters--)
+		msr_track_diff (msr_track_view (&a->tracks.msr_tracks[0]),
+		    msr_track_view (&a->tracks.msr_tracks[1]), a->bpc, &d);
+
+	sink = d.msr_bd_distance;
+}
+
+static void b_hex (void *p, uint64_t iters)
+{
+	struct bench_arg *a = p;
+
+	while (iters--)
+		msr_pretty_output_hex_ptr (a->fd, &a->tracks);
+}
+
+static void b_string (void *p, uint64_t iters)
+{
+	struct bench_arg *a = p;
+
+	while (iters--)
+		msr_pretty_output_string_ptr (a->fd, &a->tracks);
+}
+
+static void b_bits (void *p, uint64_t iters)
+{
+	struct bench_arg *a = p;
+
+	while (iters--)
+		msr_pretty_output_bits_ptr (a->fd, &a->tracks);
+}
+
+int main (void)
+{
+	struct bench_arg a;
+	uint8_t out[MSR_MAX_TRACK_LEN * 8];
+	size_t outlen;
+	unsigned i;
+	double ns;
+	int bpc, len, t;
+
+	if ((a.fd = open ("/dev/null", O_WRONLY)) == -1) {
+		perror ("/dev/null");
+		return 1;
+	}
+
+	bench_header ();
+
+	for (i = 0; i < NLENGTHS; i++) {
+		len = lengths[i];
+		fill (&a, len, 0);
+		a.bpc = 0;
+
+		ns = bench_run (b_getbit, &a);
+		bench_report ("msr_getbit (whole track)", len, 0, ns, 1, len);
+		ns = bench_run (b_setbit, &a);
+		bench_report ("msr_setbit (whole track)", len, 0, ns, 1, len);
+	}
+
+	for (bpc = 1; bpc <= 8; bpc++) {
+		for (i = 0; i < NLENGTHS; i++) {
+			len = lengths[i];
+			fill (&a, len, 0);
+			a.bpc = bpc;
+
+			/* Make sure we time whole decodes. */
+			outlen = sizeof(out);
+			if (msr_decode_view (msr_track_view (
+			    &a.tracks.msr_tracks[0]), out, &outlen, bpc) !=
+			    LIBMSR_ERR_OK || outlen != (size_t) len * 8 / bpc) {
+				fprintf (stderr, "msr_decode_view failed\n");
+				return 1;
+			}
+
+			ns = bench_run (b_decode, &a);
+			bench_report ("msr_decode_view", len, bpc, ns, 1, len);
+		}
+	}
+
+	for (i = 0; i < NISOLENGTHS; i++) {
+		len = isolengths[i];
+		fill_iso (&a, len);
+
+		ns = bench_run (b_iso_encode, &a);
+		bench_report ("msr_iso_encode", len, 0, ns,
+		    MSR_MAX_TRACKS, MSR_MAX_TRACKS * len);
+
+		msr_iso_encode (&a.tracks, &a.tracks, NULL);
+		ns = bench_run (b_iso_decode, &a);
+		bench_report ("msr_iso_decode", len, 0, ns,
+		    MSR_MAX_TRACKS, MSR_MAX_TRACKS * len);
+		ns = bench_run (b_analyze, &a);
+		bench_report ("msr_analyze_tracks", len, 0, ns,
+		    MSR_MAX_TRACKS, MSR_MAX_TRACKS * len);
+
+		/* A flipped data bit in the middle of each track. */
+		for (t = 0; t < MSR_MAX_TRACKS; t++)
+			a.tracks.msr_tracks[t].msr_tk_data[len / 4] ^= 0x10;
+		ns = bench_run (b_iso_correct, &a);
+		bench_report ("msr_iso_decode_correct", len, 0, ns,
+		    MSR_MAX_TRACKS, MSR_MAX_TRACKS * len);
+	}
+
+	/* The shift is reported in the bpc column. */
+	for (i = 0; i < NLENGTHS; i++) {
+		len = lengths[i];
+		fill (&a, len, 0);
+		a.tracks.msr_tracks[1] = a.tracks.msr_tracks[0];
+		a.tracks.msr_tracks[1].msr_tk_data[len / 2] ^= 0x08;
+
+		for (a.bpc = 0; a.bpc <= 64; a.bpc = a.bpc ? a.bpc * 8 : 1) {
+			ns = bench_run (b_diff, &a);
+			bench_report ("msr_track_diff", len, a.bpc, ns, 1,
+			    len);
+		}
+	}
+
+	for (i = 0; i < NLENGTHS; i++) {
+		len = lengths[i];
+		fill (&a, len, 0);
+
+		ns = bench_run (b_reverse, &a);
+		bench_report ("msr_reverse_tracks", len, 0, ns,
+		    MSR_MAX_TRACKS, MSR_MAX_TRACKS * len);
+	}
+
+	for (i = 0; i < NLENGTHS; i++) {
+		len = lengths[i];
+
+		fill (&a, len, 0);
+		ns = bench_run (b_hex, &a);
+		bench_report ("msr_pretty_output_hex", len, 0, ns,
+		    MSR_MAX_TRACKS, MSR_MAX_TRACKS * len);
+
+		/* String output wants NUL-terminated printable data. */
+		fill (&a, len, 1);
+		for (t = 0; t < MSR_MAX_TRACKS; t++)
+			a.tracks.msr_tracks[t].msr_tk_data[len - 1] = '\0';
+		ns = bench_run (b_string, &a);
+		bench_report ("msr_pretty_output_string", len, 0, ns,
+		    MSR_MAX_TRACKS, MSR_MAX_TRACKS * len);
+
+		fill (&a, len, 0);
+		ns = bench_run (b_bits, &a);
+		bench_report ("msr_pretty_output_bits", len, 0, ns,
+		    MSR_MAX_TRACKS, MSR_MAX_TRACKS * len);
+	}
+
+	close (a.fd);
+
+	return 0;
+}
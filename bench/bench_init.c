@@ -0,0 +1,164 @@
+/*
+ * Time msr_init() against emulated readers that take different times to
+ * reset: cold start (straight after opening the port), and recovery
+ * (with a read abandoned while waiting for a card). For comparison,
+ * "fixed sleeps" does what msr_init() used to: reset, sleep 100 ms,
+ * commtest, reset and sleep 100 ms again.
+ *
+ * usage: bench_init [reps]
+ */
+#include <sys/wait.h>
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../tools/msremu.h"
+
+static const unsigned reset_times[] = { 0, 5, 20, 50 };
+#define NRESET_TIMES (sizeof(reset_times) / sizeof(reset_times[0]))
+
+static double now_ms (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void send_cmd (int fd, uint8_t c)
+{
+	msr_cmd_t cmd;
+
+	cmd.msr_esc = MSR_ESC;
+	cmd.msr_cmd = c;
+	msr_serial_write (fd, &cmd, sizeof(cmd));
+}
+
+static int fixed_sleeps (int fd)
+{
+	struct timespec pause = { 0, 100000000 };
+	int r;
+
+	send_cmd (fd, MSR_CMD_RESET);
+	nanosleep (&pause, NULL);
+	if ((r = msr_commtest (fd)) != LIBMSR_ERR_OK)
+		return r;
+	send_cmd (fd, MSR_CMD_RESET);
+	nanosleep (&pause, NULL);
+
+	return LIBMSR_ERR_OK;
+}
+
+/* Open the port, and time the first initialization. */
+static double cold (const char *path, int (*init)(int))
+{
+	double t;
+	int fd, r;
+
+	if (msr_serial_open ((char *) path, &fd, MSR_BLOCKING, MSR_BAUD) != 0) {
+		fprintf (stderr, "%s: can't open\n", path);
+		exit (1);
+	}
+
+	t = now_ms ();
+	r = init (fd);
+	t = now_ms () - t;
+	msr_serial_close (fd);
+
+	if (r != LIBMSR_ERR_OK) {
+		fprintf (stderr, "init failed: 0x%x\n", r);
+		exit (1);
+	}
+
+	return t;
+}
+
+/* Time initialization of a device that is waiting for a card. */
+static double recover (int fd, int (*init)(int))
+{
+	double t;
+	int r;
+
+	send_cmd (fd, MSR_CMD_READ);
+
+	t = now_ms ();
+	r = init (fd);
+	t = now_ms () - t;
+
+	if (r != LIBMSR_ERR_OK) {
+		fprintf (stderr, "init failed: 0x%x\n", r);
+		exit (1);
+	}
+
+	/* The reader must be usable again. */
+	if (msr_commtest (fd) != LIBMSR_ERR_OK) {
+		fprintf (stderr, "reader out of step after init\n");
+		exit (1);
+	}
+
+	return t;
+}
+
+static void run (unsigned reset_ms, int reps, const char *name,
+    int (*init)(int))
+{
+	msremu_config_t cfg;
+	msremu_t *emu;
+	char path[256];
+	double tc = 0, tr = 0, tl;
+	pid_t pid;
+	int fd, i;
+
+	memset (&cfg, 0, sizeof(cfg));
+	cfg.reset_time = reset_ms;
+	if ((emu = msremu_new (&cfg)) == NULL ||
+	    (pid = msremu_spawn (emu, path, sizeof(path))) == -1) {
+		fprintf (stderr, "can't start emulator\n");
+		exit (1);
+	}
+	msremu_free (emu);
+
+	for (i = 0; i < reps; i++)
+		tc += cold (path, init);
+
+	if (msr_serial_open (path, &fd, MSR_BLOCKING, MSR_BAUD) != 0) {
+		fprintf (stderr, "%s: can't open\n", path);
+		exit (1);
+	}
+	msr_serial_set_timeout (fd, 1000);
+	for (i = 0; i < reps; i++)
+		tr += recover (fd, init);
+
+	tl = now_ms ();
+	for (i = 0; i < reps; i++)
+		msr_flash_led (fd, MSR_CMD_LED_GRN_ON);
+	tl = now_ms () - tl;
+	msr_serial_close (fd);
+
+	kill (pid, SIGTERM);
+	waitpid (pid, NULL, 0);
+
+	printf ("%-16s %8u %10.2f %10.2f %10.3f\n", name, reset_ms,
+	    tc / reps, tr / reps, tl / reps);
+	fflush (stdout);
+}
+
+int main (int argc, char **argv)
+{
+	int reps = argc > 1 ? atoi (argv[1]) : 10;
+	size_t i;
+
+	printf ("%d runs each, times in ms\n", reps);
+	printf ("%-16s %8s %10s %10s %10s\n", "benchmark", "reset",
+	    "cold", "recovery", "led");
+
+	for (i = 0; i < NRESET_TIMES; i++)
+		run (reset_times[i], reps, "msr_init", msr_init);
+	run (reset_times[NRESET_TIMES - 1], 2, "fixed sleeps", fixed_sleeps);
+
+	return 0;
+}
@@ -0,0 +1,168 @@
+/*
+ * Issue cards to an emulated reader that swipes written cards back, and
+ * report cards per minute and first-pass yield. Runs the naive loop
+ * (write, read back, compare) and msr_issue_run(), for ISO and raw
+ * writes, with and without corrupted replies.
+ *
+ * usage: bench_issue [cards]
+ */
+#include <sys/wait.h>
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../tools/msremu.h"
+
+#define SWIPE_MS 2
+
+static msr_tracks_t *make_cards (int n, int raw)
+{
+	msr_tracks_t *cards, iso;
+	int i;
+
+	if ((cards = calloc (n, sizeof(*cards))) == NULL)
+		return NULL;
+
+	for (i = 0; i < n; i++) {
+		memset (&iso, 0, sizeof(iso));
+		iso.msr_tracks[0].msr_tk_len = snprintf (
+		    (char *) iso.msr_tracks[0].msr_tk_data, MSR_MAX_TRACK_LEN,
+		    "B4000%011d^CARDHOLDER/TEST^2912101", i);
+		iso.msr_tracks[1].msr_tk_len = snprintf (
+		    (char *) iso.msr_tracks[1].msr_tk_data, MSR_MAX_TRACK_LEN,
+		    "4000%011d=2912101", i);
+
+		if (raw)
+			msr_iso_encode (&iso, &cards[i], NULL);
+		else
+			cards[i] = iso;
+	}
+
+	return cards;
+}
+
+static double now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Write, read back and compare, one step at a time. */
+static void naive (int fd, msr_tracks_t *cards, int n, int raw)
+{
+	msr_tracks_t back;
+	double t;
+	int i, t2, ok = 0;
+
+	t = now_ns ();
+	for (i = 0; i < n; i++) {
+		if ((raw ? msr_raw_write (fd, &cards[i]) :
+		    msr_iso_write (fd, &cards[i])) != LIBMSR_ERR_OK)
+			continue;
+		for (t2 = 0; t2 < MSR_MAX_TRACKS; t2++)
+			back.msr_tracks[t2].msr_tk_len = MSR_MAX_TRACK_LEN;
+		if ((raw ? msr_raw_read (fd, &back) :
+		    msr_iso_read (fd, &back)) != LIBMSR_ERR_OK)
+			continue;
+		ok += memcmp (back.msr_tracks[0].msr_tk_data,
+		    cards[i].msr_tracks[0].msr_tk_data,
+		    cards[i].msr_tracks[0].msr_tk_len) == 0;
+	}
+	t = now_ns () - t;
+
+	printf ("%-24s %5s %10.0f %9d%%\n", "naive", raw ? "raw" : "iso",
+	    ok * 60e9 / t, ok * 100 / n);
+}
+
+static void engine (int fd, msr_tracks_t *cards, int n, int raw,
+    const char *name)
+{
+	msr_issue_job_t *jobs;
+	msr_issue_stats_t st;
+	msr_issue_t opts;
+	int i, r;
+
+	if ((jobs = calloc (n, sizeof(*jobs))) == NULL)
+		exit (1);
+	for (i = 0; i < n; i++)
+		jobs[i].msr_ij_tracks = &cards[i];
+
+	memset (&opts, 0, sizeof(opts));
+	opts.msr_iss_raw = raw;
+	opts.msr_iss_retries = 2;
+
+	r = msr_issue_run (fd, jobs, n, &opts, &st);
+	if (r & LIBMSR_ERR_SERIAL) {
+		fprintf (stderr, "msr_issue_run failed: 0x%x\n", r);
+		exit (1);
+	}
+
+	printf ("%-24s %5s %10llu %9u%% %7llu/%llu\n", name,
+	    raw ? "raw" : "iso", (unsigned long long) st.msr_ist_per_minute,
+	    st.msr_ist_yield, (unsigned long long) st.msr_ist_verified,
+	    (unsigned long long) st.msr_ist_cards);
+
+	free (jobs);
+}
+
+static int run (unsigned corrupt, int n)
+{
+	msremu_config_t cfg;
+	msr_tracks_t *cards;
+	msremu_t *emu;
+	char path[256];
+	pid_t pid;
+	int fd, raw;
+
+	memset (&cfg, 0, sizeof(cfg));
+	cfg.loopback = 1;
+	cfg.swipe_delay = SWIPE_MS;
+	cfg.corrupt_every = corrupt;
+	if ((emu = msremu_new (&cfg)) == NULL ||
+	    (pid = msremu_spawn (emu, path, sizeof(path))) == -1) {
+		fprintf (stderr, "can't start emulator\n");
+		return 1;
+	}
+	msremu_free (emu);
+
+	if (msr_serial_open (path, &fd, MSR_BLOCKING, MSR_BAUD) != 0) {
+		fprintf (stderr, "%s: can't open\n", path);
+		return 1;
+	}
+	/* A corrupted reply mustn't hang us. */
+	msr_serial_set_timeout (fd, 200);
+
+	for (raw = 0; raw < 2; raw++) {
+		if ((cards = make_cards (n, raw)) == NULL)
+			return 1;
+		if (!corrupt)
+			naive (fd, cards, n, raw);
+		engine (fd, cards, n, raw, corrupt ? "msr_issue_run faulty" :
+		    "msr_issue_run");
+		free (cards);
+		fflush (stdout);
+	}
+
+	msr_serial_close (fd);
+	kill (pid, SIGTERM);
+	waitpid (pid, NULL, 0);
+
+	return 0;
+}
+
+int main (int argc, char **argv)
+{
+	int n = argc > 1 ? atoi (argv[1]) : 200;
+
+	printf ("%d cards, %d ms per swipe\n", n, SWIPE_MS);
+	printf ("%-24s %5s %10s %10s %11s\n", "benchmark", "mode",
+	    "cards/min", "first-pass", "verified");
+
+	return run (0, n) || run (1499, n);
+}
@@ -0,0 +1,99 @@
+/*
+ * Time appends to a capture journal, and random lookups in a mapping of
+ * it.
+ *
+ * usage: bench_journal [dir]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../libmsr.h"
+#include "bench.h"
+
+struct bench_journal {
+	msr_journal_t	*j;
+	msr_journal_map_t *m;
+	msr_tracks_t	tracks;
+	uint32_t	seed;
+	uint64_t	sum;
+};
+
+static void bench_append (void *arg, uint64_t iters)
+{
+	struct bench_journal *b = arg;
+	uint8_t bpc[MSR_MAX_TRACKS] = { 7, 5, 5 };
+
+	while (iters--)
+		if (msr_journal_append (b->j, 0, 1, MSR_JOURNAL_ISO, bpc,
+		    &b->tracks) != LIBMSR_ERR_OK) {
+			fprintf (stderr, "msr_journal_append failed\n");
+			exit (1);
+		}
+}
+
+static void bench_get (void *arg, uint64_t iters)
+{
+	struct bench_journal *b = arg;
+	size_t n = msr_journal_count (b->m);
+	msr_journal_rec_t rec;
+
+	while (iters--) {
+		if (msr_journal_get (b->m, bench_rand (&b->seed) % n, &rec) !=
+		    LIBMSR_ERR_OK) {
+			fprintf (stderr, "msr_journal_get failed\n");
+			exit (1);
+		}
+		b->sum += rec.msr_jr_tracks[1].msr_tv_data[0];
+	}
+}
+
+int main (int argc, char **argv)
+{
+	static struct bench_journal b;
+	char path[512], ipath[520];
+	const char *tk[MSR_MAX_TRACKS] = {
+		"B4111111111111111^DOE/JOHN^2512101",
+		"4111111111111111=2512101",
+		""
+	};
+	double ns;
+	int i;
+
+	snprintf (path, sizeof(path), "%s/bench_journal.%d",
+	    (argc > 1) ? argv[1] : "/tmp", (int) getpid ());
+	snprintf (ipath, sizeof(ipath), "%s.idx", path);
+
+	for (i = 0; i < MSR_MAX_TRACKS; i++) {
+		b.tracks.msr_tracks[i].msr_tk_len = strlen (tk[i]);
+		memcpy (b.tracks.msr_tracks[i].msr_tk_data, tk[i],
+		    strlen (tk[i]));
+	}
+
+	if (msr_journal_open (path, &b.j) != LIBMSR_ERR_OK) {
+		fprintf (stderr, "%s: can't open journal\n", path);
+		return 1;
+	}
+
+	printf ("%-28s %12s\n", "benchmark", "ns/record");
+	ns = bench_run (bench_append, &b);
+	printf ("%-28s %12.1f\n", "append", ns);
+	fflush (stdout);
+	msr_journal_close (b.j);
+
+	if (msr_journal_map (path, &b.m) != LIBMSR_ERR_OK) {
+		fprintf (stderr, "%s: can't map journal\n", path);
+		return 1;
+	}
+	b.seed = 1;
+	ns = bench_run (bench_get, &b);
+	printf ("%-28s %12.1f   (%zu records)\n", "random get", ns,
+	    msr_journal_count (b.m));
+	msr_journal_unmap (b.m);
+
+	unlink (path);
+	unlink (ipath);
+
+	return 0;
+}
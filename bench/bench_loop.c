@@ -0,0 +1,143 @@
+/*
+ * Drive many emulated readers from one msr_loop_t and report the swipe
+ * rate and the CPU time the loop needed for it, once waiting in epoll(7)
+ * and once through io_uring (if libmsr was built with it).
+ *
+ * usage: bench_loop [readers] [seconds]
+ */
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../tools/msremu.h"
+#include "bench.h"
+
+#define MAX_READERS 256
+
+struct reader {
+	pid_t		pid;
+	msr_device_t	*dev;
+	uint64_t	swipes;
+	uint64_t	bad;
+};
+
+static int on_swipe (msr_device_t *dev, int result,
+    const msr_tracks_t *tracks, void *cookie)
+{
+	struct reader *rd = cookie;
+
+	if (result == LIBMSR_ERR_OK && tracks->msr_tracks[1].msr_tk_len == 16 &&
+	    memcmp (tracks->msr_tracks[1].msr_tk_data, "4111111111111111",
+	    16) == 0)
+		rd->swipes++;
+	else
+		rd->bad++;
+
+	return 0;
+}
+
+static double cpu_seconds (void)
+{
+	struct rusage ru;
+
+	getrusage (RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+	    (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/* Returns the number of bad swipes, or -1 if the mode is unavailable. */
+static int run (int n, int dur, int uring)
+{
+	static struct reader readers[MAX_READERS];
+	msremu_config_t cfg;
+	msr_loop_t *loop;
+	msremu_t *emu;
+	char path[256];
+	uint64_t swipes = 0, bad = 0, t0, t;
+	double cpu0, cpu, secs;
+	int i;
+
+	memset (readers, 0, sizeof(readers));
+	memset (&cfg, 0, sizeof(cfg));
+	cfg.loop = 1;
+	cfg.swipe_delay = 5;
+
+	if (msr_loop_new (&loop) != LIBMSR_ERR_OK) {
+		fprintf (stderr, "msr_loop_new failed\n");
+		exit (1);
+	}
+	if (msr_loop_set_uring (loop, uring) != LIBMSR_ERR_OK) {
+		msr_loop_free (loop);
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if ((emu = msremu_new (&cfg)) == NULL ||
+		    msremu_add_iso (emu, "B4111111111111111^DOE/JOHN^2512",
+		    "4111111111111111", NULL) != 0 ||
+		    (readers[i].pid = msremu_spawn (emu, path,
+		    sizeof(path))) == -1) {
+			fprintf (stderr, "can't start emulator %d\n", i);
+			exit (1);
+		}
+		msremu_free (emu);
+
+		if (msr_device_open (path, &readers[i].dev, MSR_BLOCKING,
+		    MSR_BAUD) != LIBMSR_ERR_OK ||
+		    msr_loop_add (loop, readers[i].dev, 0, on_swipe,
+		    &readers[i]) != LIBMSR_ERR_OK) {
+			fprintf (stderr, "%s: can't open reader\n", path);
+			exit (1);
+		}
+	}
+
+	cpu0 = cpu_seconds ();
+	t0 = bench_now ();
+	do {
+		msr_loop_run (loop, 100);
+		t = bench_now () - t0;
+	} while (t < (uint64_t) dur * 1000000000ULL &&
+	    msr_loop_devices (loop) > 0);
+	cpu = cpu_seconds () - cpu0;
+	secs = t / 1e9;
+
+	for (i = 0; i < n; i++) {
+		swipes += readers[i].swipes;
+		bad += readers[i].bad;
+		msr_loop_remove (loop, readers[i].dev);
+		msr_device_close (readers[i].dev);
+		kill (readers[i].pid, SIGTERM);
+		waitpid (readers[i].pid, NULL, 0);
+	}
+	msr_loop_free (loop);
+
+	printf ("%-8s %d readers, %.1f s: %llu swipes (%.0f/s), %llu bad, "
+	    "loop used %.1f%% of one core\n", uring ? "io_uring" : "epoll",
+	    n, secs, (unsigned long long) swipes, swipes / secs,
+	    (unsigned long long) bad, 100.0 * cpu / secs);
+	fflush (stdout);
+
+	return bad != 0;
+}
+
+int main (int argc, char **argv)
+{
+	int n, dur, bad;
+
+	n = (argc > 1) ? atoi (argv[1]) : 48;
+	dur = (argc > 2) ? atoi (argv[2]) : 3;
+	if (n < 1 || n > MAX_READERS || dur < 1) {
+		fprintf (stderr, "usage: %s [readers] [seconds]\n", argv[0]);
+		return 1;
+	}
+
+	bad = run (n, dur, 0);
+	if (run (n, dur, 1) > 0)
+		bad = 1;
+
+	return bad != 0;
+}
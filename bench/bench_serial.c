@@ -0,0 +1,78 @@
+/*
+ * Time synchronous command round trips to an emulated reader over a
+ * pseudo-terminal, once with the poll(2) serial backend and once with
+ * io_uring (if libmsr was built with it).
+ *
+ * usage: bench_serial
+ */
+#include <sys/wait.h>
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../tools/msremu.h"
+#include "bench.h"
+
+static void bench_commtest (void *arg, uint64_t iters)
+{
+	int fd = *(int *) arg;
+
+	while (iters--)
+		if (msr_commtest (fd) != LIBMSR_ERR_OK) {
+			fprintf (stderr, "msr_commtest failed\n");
+			exit (1);
+		}
+}
+
+static void bench_get_co (void *arg, uint64_t iters)
+{
+	int fd = *(int *) arg;
+
+	while (iters--)
+		if (msr_get_co (fd) < 0) {
+			fprintf (stderr, "msr_get_co failed\n");
+			exit (1);
+		}
+}
+
+int main (void)
+{
+	msremu_config_t cfg;
+	msremu_t *emu;
+	char path[256];
+	pid_t pid;
+	int fd, uring;
+
+	memset (&cfg, 0, sizeof(cfg));
+	if ((emu = msremu_new (&cfg)) == NULL ||
+	    (pid = msremu_spawn (emu, path, sizeof(path))) == -1) {
+		fprintf (stderr, "can't start emulator\n");
+		return 1;
+	}
+	msremu_free (emu);
+
+	if (msr_serial_open (path, &fd, MSR_BLOCKING, MSR_BAUD) != 0) {
+		fprintf (stderr, "%s: can't open\n", path);
+		return 1;
+	}
+
+	printf ("%-28s %12s\n", "benchmark", "ns/op");
+	for (uring = 0; uring < 2; uring++) {
+		if (msr_serial_set_uring (fd, uring) != LIBMSR_ERR_OK)
+			break;
+		printf ("%-28s %12.0f\n", uring ? "commtest io_uring" :
+		    "commtest poll", bench_run (bench_commtest, &fd));
+		printf ("%-28s %12.0f\n", uring ? "get_co io_uring" :
+		    "get_co poll", bench_run (bench_get_co, &fd));
+		fflush (stdout);
+	}
+
+	msr_serial_set_uring (fd, 0);
+	msr_serial_close (fd);
+	kill (pid, SIGTERM);
+	waitpid (pid, NULL, 0);
+
+	return 0;
+}
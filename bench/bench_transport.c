@@ -0,0 +1,121 @@
+/*
+ * Run the protocol code against the emulator over an in-memory loopback
+ * and over a pseudo-terminal, to separate libmsr's own cost from that of
+ * the link.
+ *
+ * usage: bench_transport
+ */
+#include <sys/wait.h>
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../tools/msremu.h"
+#include "bench.h"
+
+/* The emulator, as the device on the far end of a loopback. */
+static void emu_device (int fd, const uint8_t *buf, size_t len, void *cookie)
+{
+	msremu_t *emu = cookie;
+	uint8_t out[1024];
+	size_t n;
+
+	msremu_feed (emu, buf, len);
+	while ((n = msremu_output (emu, out, sizeof(out))) > 0)
+		msr_loopback_push (fd, out, n);
+}
+
+static void bench_commtest (void *arg, uint64_t iters)
+{
+	int fd = *(int *) arg;
+
+	while (iters--)
+		if (msr_commtest (fd) != LIBMSR_ERR_OK) {
+			fprintf (stderr, "msr_commtest failed\n");
+			exit (1);
+		}
+}
+
+static void bench_iso_read (void *arg, uint64_t iters)
+{
+	int fd = *(int *) arg, i;
+	msr_tracks_t tracks;
+
+	while (iters--) {
+		for (i = 0; i < MSR_MAX_TRACKS; i++)
+			tracks.msr_tracks[i].msr_tk_len = MSR_MAX_TRACK_LEN;
+		if (msr_iso_read (fd, &tracks) != LIBMSR_ERR_OK ||
+		    tracks.msr_tracks[1].msr_tk_len != 16) {
+			fprintf (stderr, "msr_iso_read failed\n");
+			exit (1);
+		}
+	}
+}
+
+static msremu_t *new_emu (void)
+{
+	msremu_config_t cfg;
+	msremu_t *emu;
+
+	memset (&cfg, 0, sizeof(cfg));
+	cfg.loop = 1;
+	if ((emu = msremu_new (&cfg)) == NULL ||
+	    msremu_add_iso (emu, "B4111111111111111^DOE/JOHN^2512",
+	    "4111111111111111", NULL) != 0) {
+		fprintf (stderr, "can't create emulator\n");
+		exit (1);
+	}
+
+	return emu;
+}
+
+static void run (const char *name, int fd)
+{
+	char label[64];
+
+	snprintf (label, sizeof(label), "commtest %s", name);
+	printf ("%-28s %12.0f\n", label, bench_run (bench_commtest, &fd));
+	snprintf (label, sizeof(label), "iso_read %s", name);
+	printf ("%-28s %12.0f\n", label, bench_run (bench_iso_read, &fd));
+	fflush (stdout);
+}
+
+int main (void)
+{
+	msremu_t *emu;
+	char path[256];
+	pid_t pid;
+	int fd;
+
+	printf ("%-28s %12s\n", "benchmark", "ns/op");
+
+	emu = new_emu ();
+	if (msr_transport_open (&msr_transport_loopback, "", &fd, 0, 0) !=
+	    LIBMSR_ERR_OK) {
+		fprintf (stderr, "can't open loopback\n");
+		return 1;
+	}
+	msr_loopback_attach (fd, emu_device, emu);
+	run ("loopback", fd);
+	msr_serial_close (fd);
+	msremu_free (emu);
+
+	emu = new_emu ();
+	if ((pid = msremu_spawn (emu, path, sizeof(path))) == -1) {
+		fprintf (stderr, "can't start emulator\n");
+		return 1;
+	}
+	msremu_free (emu);
+	if (msr_serial_open (path, &fd, MSR_BLOCKING, MSR_BAUD) != 0) {
+		fprintf (stderr, "%s: can't open\n", path);
+		return 1;
+	}
+	run ("pty", fd);
+	msr_serial_close (fd);
+	kill (pid, SIGTERM);
+	waitpid (pid, NULL, 0);
+
+	return 0;
+}
@@ -0,0 +1,613 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libmsr.h"
+
+/*
+ * Device handles.
+ *
+ * A handle owns the fd (and, through serialio.c, its receive buffer) and
+ * remembers what we last told the device, so that configuration that is
+ * already in effect doesn't cost another round trip. Anything we can't
+ * be sure of is forgotten: a reset puts the device back to its defaults,
+ * and a failed configuration command leaves the setting unknown.
+ *
+ * Every command, whether called directly or queued for the worker
+ * thread, runs under the handle's lock, so commands from different
+ * threads never interleave on the wire.
+ */
+#define MSR_DEV_UNKNOWN (-1)
+
+/* Request states. */
+#define MSR_RQ_QUEUED	1
+#define MSR_RQ_DONE	2
+
+struct msr_rq_list {
+	msr_request_t	*head;
+	msr_request_t	*tail;
+};
+
+struct msr_device {
+	int	fd;
+	int	co; /* MSR_CO_HI, MSR_CO_LO or MSR_DEV_UNKNOWN */
+	int	bpi[MSR_MAX_TRACKS]; /* last BPI command byte per track */
+	int	bpc[MSR_MAX_TRACKS];
+	int	have_model;
+	int	have_fwrev;
+	uint8_t	model[10];
+	uint8_t	fwrev[9];
+	msr_device_stats_t stats;
+	pthread_mutex_t lock; /* held while a command runs */
+
+	/* Worker thread and its queues, protected by qlock. */
+	pthread_mutex_t qlock;
+	pthread_cond_t	qcond; /* work queued, or stopping */
+	pthread_cond_t	done; /* a request finished */
+	pthread_t	worker;
+	int		running;
+	int		stopping;
+	struct msr_rq_list quick; /* commands that answer at once */
+	struct msr_rq_list slow; /* commands that wait for a swipe */
+};
+
+/* The track each MSR_CMD_SETBPI argument applies to, or -1. */
+static int msr_bpi_track (uint8_t bpi)
+{
+	switch (bpi) {
+	case 0xA0: case 0xA1:
+		return 0;
+	case 0x4B: case 0xD2:
+		return 1;
+	case 0xC0: case 0xC1:
+		return 2;
+	default:
+		return -1;
+	}
+}
+
+static void msr_dev_forget (msr_device_t *dev)
+{
+	int i;
+
+	dev->co = MSR_DEV_UNKNOWN;
+	for (i = 0; i < MSR_MAX_TRACKS; i++) {
+		dev->bpi[i] = MSR_DEV_UNKNOWN;
+		dev->bpc[i] = MSR_DEV_UNKNOWN;
+	}
+}
+
+static int msr_dev_fwrev (msr_device_t *dev, uint8_t *buf)
+{
+	int r;
+
+	if (!dev->have_fwrev) {
+		dev->stats.msr_ds_issued++;
+		if ((r = msr_fwrev (dev->fd, dev->fwrev)) != LIBMSR_ERR_OK)
+			return r;
+		dev->have_fwrev = 1;
+	} else
+		dev->stats.msr_ds_avoided++;
+
+	memcpy (buf, dev->fwrev, sizeof(dev->fwrev));
+
+	return LIBMSR_ERR_OK;
+}
+
+static int msr_dev_model (msr_device_t *dev, uint8_t *buf)
+{
+	int r;
+
+	if (!dev->have_model) {
+		dev->stats.msr_ds_issued++;
+		if ((r = msr_model (dev->fd, dev->model)) != LIBMSR_ERR_OK)
+			return r;
+		dev->have_model = 1;
+	} else
+		dev->stats.msr_ds_avoided++;
+
+	memcpy (buf, dev->model, sizeof(dev->model));
+
+	return LIBMSR_ERR_OK;
+}
+
+static int msr_dev_get_co (msr_device_t *dev)
+{
+	int r;
+
+	if (dev->co != MSR_DEV_UNKNOWN) {
+		dev->stats.msr_ds_avoided++;
+		return dev->co;
+	}
+
+	dev->stats.msr_ds_issued++;
+	r = msr_get_co (dev->fd);
+	if (r == MSR_CO_HI || r == MSR_CO_LO)
+		dev->co = r;
+
+	return r;
+}
+
+static int msr_dev_set_co (msr_device_t *dev, int co)
+{
+	int r;
+
+	if (dev->co == co) {
+		dev->stats.msr_ds_avoided++;
+		return LIBMSR_ERR_OK;
+	}
+
+	dev->stats.msr_ds_issued++;
+	if (co == MSR_CO_HI)
+		r = msr_set_hi_co (dev->fd);
+	else
+		r = msr_set_lo_co (dev->fd);
+
+	dev->co = (r == LIBMSR_ERR_OK) ? co : MSR_DEV_UNKNOWN;
+
+	return r;
+}
+
+static int msr_dev_set_bpi (msr_device_t *dev, uint8_t bpi)
+{
+	int r, tk;
+
+	tk = msr_bpi_track (bpi);
+	if (tk >= 0 && dev->bpi[tk] == bpi) {
+		dev->stats.msr_ds_avoided++;
+		return LIBMSR_ERR_OK;
+	}
+
+	dev->stats.msr_ds_issued++;
+	r = msr_set_bpi (dev->fd, bpi);
+
+	if (tk >= 0)
+		dev->bpi[tk] = (r == LIBMSR_ERR_OK) ? bpi : MSR_DEV_UNKNOWN;
+
+	return r;
+}
+
+static int msr_dev_set_bpc (msr_device_t *dev, const uint8_t *bpc)
+{
+	int r, i;
+
+	if (dev->bpc[0] == bpc[0] && dev->bpc[1] == bpc[1] &&
+	    dev->bpc[2] == bpc[2]) {
+		dev->stats.msr_ds_avoided++;
+		return LIBMSR_ERR_OK;
+	}
+
+	dev->stats.msr_ds_issued++;
+	r = msr_set_bpc (dev->fd, bpc[0], bpc[1], bpc[2]);
+
+	for (i = 0; i < MSR_MAX_TRACKS; i++)
+		dev->bpc[i] = (r == LIBMSR_ERR_OK) ? bpc[i] : MSR_DEV_UNKNOWN;
+
+	return r;
+}
+
+/* Run one request. The caller holds dev->lock. */
+static int msr_dev_exec (msr_device_t *dev, msr_request_t *req)
+{
+	switch (req->msr_rq_cmd) {
+	case MSR_RQ_INIT:
+		msr_dev_forget (dev);
+		return msr_init (dev->fd);
+	case MSR_RQ_RESET:
+		msr_dev_forget (dev);
+		return msr_reset (dev->fd);
+	case MSR_RQ_COMMTEST:
+		return msr_commtest (dev->fd);
+	case MSR_RQ_RAM_TEST:
+		return msr_ram_test (dev->fd);
+	case MSR_RQ_SENSOR_TEST:
+		return msr_sensor_test (dev->fd);
+	case MSR_RQ_FWREV:
+		return msr_dev_fwrev (dev, req->msr_rq_buf);
+	case MSR_RQ_MODEL:
+		return msr_dev_model (dev, req->msr_rq_buf);
+	case MSR_RQ_GET_CO:
+		return msr_dev_get_co (dev);
+	case MSR_RQ_SET_HI_CO:
+		return msr_dev_set_co (dev, MSR_CO_HI);
+	case MSR_RQ_SET_LO_CO:
+		return msr_dev_set_co (dev, MSR_CO_LO);
+	case MSR_RQ_SET_BPI:
+		return msr_dev_set_bpi (dev, req->msr_rq_args[0]);
+	case MSR_RQ_SET_BPC:
+		return msr_dev_set_bpc (dev, req->msr_rq_args);
+	case MSR_RQ_FLASH_LED:
+		return msr_flash_led (dev->fd, req->msr_rq_args[0]);
+	case MSR_RQ_ISO_READ:
+		return msr_iso_read (dev->fd, req->msr_rq_tracks);
+	case MSR_RQ_ISO_WRITE:
+		return msr_iso_write (dev->fd, req->msr_rq_tracks);
+	case MSR_RQ_RAW_READ:
+		return msr_raw_read (dev->fd, req->msr_rq_tracks);
+	case MSR_RQ_RAW_WRITE:
+		return msr_raw_write (dev->fd, req->msr_rq_tracks);
+	case MSR_RQ_ERASE:
+		return msr_erase (dev->fd, req->msr_rq_args[0]);
+	default:
+		return LIBMSR_ERR_GENERIC;
+	}
+}
+
+/* Run a request on the calling thread. */
+static int msr_dev_run (msr_device_t *dev, msr_request_t *req)
+{
+	pthread_mutex_lock (&dev->lock);
+	req->msr_rq_result = msr_dev_exec (dev, req);
+	pthread_mutex_unlock (&dev->lock);
+
+	return req->msr_rq_result;
+}
+
+/* Commands that wait for a card to be swiped. */
+static int msr_rq_slow (const msr_request_t *req)
+{
+	switch (req->msr_rq_cmd) {
+	case MSR_RQ_SENSOR_TEST:
+	case MSR_RQ_ISO_READ:
+	case MSR_RQ_ISO_WRITE:
+	case MSR_RQ_RAW_READ:
+	case MSR_RQ_RAW_WRITE:
+	case MSR_RQ_ERASE:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static void msr_rq_push (struct msr_rq_list *l, msr_request_t *req)
+{
+	req->msr_rq_next = NULL;
+	if (l->tail != NULL)
+		l->tail->msr_rq_next = req;
+	else
+		l->head = req;
+	l->tail = req;
+}
+
+static msr_request_t *msr_rq_pop (struct msr_rq_list *l)
+{
+	msr_request_t *req;
+
+	if ((req = l->head) != NULL) {
+		l->head = req->msr_rq_next;
+		if (l->head == NULL)
+			l->tail = NULL;
+	}
+
+	return req;
+}
+
+/*
+ * The worker takes quick commands before slow ones, so a status query
+ * queued behind a batch of card reads only waits for the read in
+ * progress, not the whole batch.
+ */
+static void *msr_dev_worker (void *arg)
+{
+	msr_device_t *dev = arg;
+	msr_request_t *req;
+
+	pthread_mutex_lock (&dev->qlock);
+	for (;;) {
+		if ((req = msr_rq_pop (&dev->quick)) == NULL)
+			req = msr_rq_pop (&dev->slow);
+		if (req == NULL) {
+			if (dev->stopping)
+				break;
+			pthread_cond_wait (&dev->qcond, &dev->qlock);
+			continue;
+		}
+		pthread_mutex_unlock (&dev->qlock);
+
+		msr_dev_run (dev, req);
+
+		/* A request with a callback belongs to the callback now. */
+		if (req->msr_rq_done != NULL) {
+			req->msr_rq_done (req, req->msr_rq_cookie);
+			pthread_mutex_lock (&dev->qlock);
+		} else {
+			pthread_mutex_lock (&dev->qlock);
+			req->msr_rq_state = MSR_RQ_DONE;
+			pthread_cond_broadcast (&dev->done);
+		}
+	}
+	pthread_mutex_unlock (&dev->qlock);
+
+	return NULL;
+}
+
+int msr_device_attach (int fd, msr_device_t **devp)
+{
+	msr_device_t *dev;
+
+	if ((dev = calloc (1, sizeof(*dev))) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	dev->fd = fd;
+	msr_dev_forget (dev);
+	pthread_mutex_init (&dev->lock, NULL);
+	pthread_mutex_init (&dev->qlock, NULL);
+	pthread_cond_init (&dev->qcond, NULL);
+	pthread_cond_init (&dev->done, NULL);
+	*devp = dev;
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_device_open (char *path, msr_device_t **devp, int blocking,
+    speed_t baud)
+{
+	int fd, r;
+
+	if ((r = msr_serial_open (path, &fd, blocking, baud)) != LIBMSR_ERR_OK)
+		return r;
+
+	if ((r = msr_device_attach (fd, devp)) != LIBMSR_ERR_OK)
+		msr_serial_close (fd);
+
+	return r;
+}
+
+int msr_device_close (msr_device_t *dev)
+{
+	if (dev == NULL)
+		return LIBMSR_ERR_OK;
+
+	msr_device_stop (dev);
+	msr_serial_close (dev->fd);
+	pthread_cond_destroy (&dev->done);
+	pthread_cond_destroy (&dev->qcond);
+	pthread_mutex_destroy (&dev->qlock);
+	pthread_mutex_destroy (&dev->lock);
+	free (dev);
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_device_fd (const msr_device_t *dev)
+{
+	return dev->fd;
+}
+
+void msr_device_invalidate (msr_device_t *dev)
+{
+	pthread_mutex_lock (&dev->lock);
+	msr_dev_forget (dev);
+	pthread_mutex_unlock (&dev->lock);
+}
+
+void msr_device_stats (msr_device_t *dev, msr_device_stats_t *stats)
+{
+	pthread_mutex_lock (&dev->lock);
+	*stats = dev->stats;
+	pthread_mutex_unlock (&dev->lock);
+}
+
+void msr_device_stats_reset (msr_device_t *dev)
+{
+	pthread_mutex_lock (&dev->lock);
+	memset (&dev->stats, 0, sizeof(dev->stats));
+	pthread_mutex_unlock (&dev->lock);
+}
+
+int msr_device_start (msr_device_t *dev)
+{
+	int r = LIBMSR_ERR_OK;
+
+	pthread_mutex_lock (&dev->qlock);
+	if (!dev->running) {
+		dev->stopping = 0;
+		if (pthread_create (&dev->worker, NULL, msr_dev_worker, dev) == 0)
+			dev->running = 1;
+		else
+			r = LIBMSR_ERR_GENERIC;
+	}
+	pthread_mutex_unlock (&dev->qlock);
+
+	return r;
+}
+
+int msr_device_stop (msr_device_t *dev)
+{
+	pthread_mutex_lock (&dev->qlock);
+	if (!dev->running) {
+		pthread_mutex_unlock (&dev->qlock);
+		return LIBMSR_ERR_OK;
+	}
+	dev->stopping = 1;
+	pthread_cond_signal (&dev->qcond);
+	pthread_mutex_unlock (&dev->qlock);
+
+	pthread_join (dev->worker, NULL);
+
+	pthread_mutex_lock (&dev->qlock);
+	dev->running = 0;
+	pthread_mutex_unlock (&dev->qlock);
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_device_submit (msr_device_t *dev, msr_request_t *req)
+{
+	pthread_mutex_lock (&dev->qlock);
+	if (!dev->running || dev->stopping) {
+		pthread_mutex_unlock (&dev->qlock);
+		return LIBMSR_ERR_GENERIC;
+	}
+
+	req->msr_rq_state = MSR_RQ_QUEUED;
+	req->msr_rq_result = LIBMSR_ERR_GENERIC;
+	msr_rq_push (msr_rq_slow (req) ? &dev->slow : &dev->quick, req);
+	pthread_cond_signal (&dev->qcond);
+	pthread_mutex_unlock (&dev->qlock);
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_device_wait (msr_device_t *dev, msr_request_t *req)
+{
+	pthread_mutex_lock (&dev->qlock);
+	while (req->msr_rq_state != MSR_RQ_DONE)
+		pthread_cond_wait (&dev->done, &dev->qlock);
+	pthread_mutex_unlock (&dev->qlock);
+
+	return req->msr_rq_result;
+}
+
+int msr_device_done (msr_device_t *dev, const msr_request_t *req)
+{
+	int done;
+
+	pthread_mutex_lock (&dev->qlock);
+	done = (req->msr_rq_state == MSR_RQ_DONE);
+	pthread_mutex_unlock (&dev->qlock);
+
+	return done;
+}
+
+/*
+ * Synchronous commands. These run on the calling thread, but still take
+ * turns with the worker and with each other.
+ */
+
+static int msr_dev_simple (msr_device_t *dev, int cmd)
+{
+	msr_request_t req;
+
+	memset (&req, 0, sizeof(req));
+	req.msr_rq_cmd = cmd;
+
+	return msr_dev_run (dev, &req);
+}
+
+static int msr_dev_tracks (msr_device_t *dev, int cmd, msr_tracks_t *tracks)
+{
+	msr_request_t req;
+
+	memset (&req, 0, sizeof(req));
+	req.msr_rq_cmd = cmd;
+	req.msr_rq_tracks = tracks;
+
+	return msr_dev_run (dev, &req);
+}
+
+static int msr_dev_args (msr_device_t *dev, int cmd, uint8_t a0, uint8_t a1,
+    uint8_t a2)
+{
+	msr_request_t req;
+
+	memset (&req, 0, sizeof(req));
+	req.msr_rq_cmd = cmd;
+	req.msr_rq_args[0] = a0;
+	req.msr_rq_args[1] = a1;
+	req.msr_rq_args[2] = a2;
+
+	return msr_dev_run (dev, &req);
+}
+
+static int msr_dev_buf (msr_device_t *dev, int cmd, uint8_t *buf)
+{
+	msr_request_t req;
+
+	memset (&req, 0, sizeof(req));
+	req.msr_rq_cmd = cmd;
+	req.msr_rq_buf = buf;
+
+	return msr_dev_run (dev, &req);
+}
+
+int msr_device_init (msr_device_t *dev)
+{
+	return msr_dev_simple (dev, MSR_RQ_INIT);
+}
+
+int msr_device_reset (msr_device_t *dev)
+{
+	return msr_dev_simple (dev, MSR_RQ_RESET);
+}
+
+int msr_device_commtest (msr_device_t *dev)
+{
+	return msr_dev_simple (dev, MSR_RQ_COMMTEST);
+}
+
+int msr_device_ram_test (msr_device_t *dev)
+{
+	return msr_dev_simple (dev, MSR_RQ_RAM_TEST);
+}
+
+int msr_device_sensor_test (msr_device_t *dev)
+{
+	return msr_dev_simple (dev, MSR_RQ_SENSOR_TEST);
+}
+
+int msr_device_fwrev (msr_device_t *dev, uint8_t *buf)
+{
+	return msr_dev_buf (dev, MSR_RQ_FWREV, buf);
+}
+
+int msr_device_model (msr_device_t *dev, uint8_t *buf)
+{
+	return msr_dev_buf (dev, MSR_RQ_MODEL, buf);
+}
+
+int msr_device_get_co (msr_device_t *dev)
+{
+	return msr_dev_simple (dev, MSR_RQ_GET_CO);
+}
+
+int msr_device_set_hi_co (msr_device_t *dev)
+{
+	return msr_dev_simple (dev, MSR_RQ_SET_HI_CO);
+}
+
+int msr_device_set_lo_co (msr_device_t *dev)
+{
+	return msr_dev_simple (dev, MSR_RQ_SET_LO_CO);
+}
+
+int msr_device_set_bpi (msr_device_t *dev, uint8_t bpi)
+{
+	return msr_dev_args (dev, MSR_RQ_SET_BPI, bpi, 0, 0);
+}
+
+int msr_device_set_bpc (msr_device_t *dev, uint8_t bpc1, uint8_t bpc2,
+    uint8_t bpc3)
+{
+	return msr_dev_args (dev, MSR_RQ_SET_BPC, bpc1, bpc2, bpc3);
+}
+
+int msr_device_iso_read (msr_device_t *dev, msr_tracks_t *tracks)
+{
+	return msr_dev_tracks (dev, MSR_RQ_ISO_READ, tracks);
+}
+
+int msr_device_iso_write (msr_device_t *dev, msr_tracks_t *tracks)
+{
+	return msr_dev_tracks (dev, MSR_RQ_ISO_WRITE, tracks);
+}
+
+int msr_device_raw_read (msr_device_t *dev, msr_tracks_t *tracks)
+{
+	return msr_dev_tracks (dev, MSR_RQ_RAW_READ, tracks);
+}
+
+int msr_device_raw_write (msr_device_t *dev, msr_tracks_t *tracks)
+{
+	return msr_dev_tracks (dev, MSR_RQ_RAW_WRITE, tracks);
+}
+
+int msr_device_erase (msr_device_t *dev, uint8_t tracks)
+{
+	return msr_dev_args (dev, MSR_RQ_ERASE, tracks, 0, 0);
+}
+
+int msr_device_flash_led (msr_device_t *dev, uint8_t led)
+{
+	return msr_dev_args (dev, MSR_RQ_FLASH_LED, led, 0, 0);
+}
@@ -0,0 +1,430 @@
+#include <sys/epoll.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libmsr.h"
+#include "msrint.h"
+#include "uring.h"
+
+/*
+ * Event loop.
+ *
+ * Each watched device has a read command outstanding. Whatever the
+ * device sends is pushed into the device's msr_parser_t, so a swipe can
+ * arrive a few bytes at a time across any number of wakeups.
+ *
+ * By default the loop waits in epoll(7). In io_uring mode, each device
+ * instead has a POLLIN poll linked to a read posted on the thread's
+ * ring, and the read commands that re-arm the devices are queued there
+ * too, so a whole batch of swipes costs one io_uring_enter(2).
+ */
+
+struct msr_loop_dev {
+	msr_device_t	*dev;
+	int		fd;
+	int		raw;
+	int		dead;
+	msr_loop_cb	cb;
+	void		*cookie;
+	msr_parser_t	parser;
+	msr_tracks_t	tracks;
+	struct msr_loop_dev *next;
+#ifdef MSR_URING
+	msr_loop_t	*loop;
+	struct msr_uring_op poll_op;
+	struct msr_uring_op read_op;
+	int		read_res;
+	struct msr_loop_dev *ready_next;
+	uint8_t		rbuf[256];
+#endif
+};
+
+struct msr_loop {
+	int		epfd;
+	int		ndevs;
+	struct msr_loop_dev *devs;
+#ifdef MSR_URING
+	int		uring;
+	struct msr_loop_dev *ready; /* completed reads, in no order */
+#endif
+};
+
+#ifdef MSR_URING
+#define MSR_LOOP_DEV_OF(op, member) ((struct msr_loop_dev *) \
+	((char *) (op) - offsetof(struct msr_loop_dev, member)))
+
+static void msr_loop_poll_done (struct msr_uring_op *op, int res)
+{
+}
+
+static void msr_loop_read_done (struct msr_uring_op *op, int res)
+{
+	struct msr_loop_dev *d = MSR_LOOP_DEV_OF(op, read_op);
+
+	d->read_res = res;
+	d->ready_next = d->loop->ready;
+	d->loop->ready = d;
+}
+
+/* Queue a read for whatever the device sends next. */
+static int msr_loop_post_read (struct msr_loop_dev *d)
+{
+	struct io_uring_sqe *sqe;
+
+	if (msr_uring_reserve (2) != 0 ||
+	    (sqe = msr_uring_sqe (&d->poll_op)) == NULL)
+		return LIBMSR_ERR_SERIAL;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = d->fd;
+	sqe->poll32_events = POLLIN;
+	sqe->flags = IOSQE_IO_LINK;
+
+	if ((sqe = msr_uring_sqe (&d->read_op)) == NULL)
+		return LIBMSR_ERR_SERIAL;
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = d->fd;
+	sqe->addr = (uint64_t) (uintptr_t) d->rbuf;
+	sqe->len = sizeof(d->rbuf);
+
+	return LIBMSR_ERR_OK;
+}
+
+/* Cancel the device's read, if any, and wait for it to go away. */
+static void msr_loop_quiesce (struct msr_loop_dev *d)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!d->read_op.busy)
+		return;
+
+	if ((sqe = msr_uring_sqe (NULL)) != NULL) {
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = (uint64_t) (uintptr_t) (d->poll_op.busy ?
+		    &d->poll_op : &d->read_op);
+	}
+
+	while (d->read_op.busy || d->poll_op.busy)
+		if (msr_uring_submit (1, -1) != 0)
+			break;
+}
+#endif /* MSR_URING */
+
+int msr_loop_new (msr_loop_t **loopp)
+{
+	msr_loop_t *loop;
+
+	if ((loop = calloc (1, sizeof(*loop))) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	if ((loop->epfd = epoll_create1 (EPOLL_CLOEXEC)) == -1) {
+		free (loop);
+		return LIBMSR_ERR_GENERIC;
+	}
+
+	*loopp = loop;
+
+	return LIBMSR_ERR_OK;
+}
+
+/* Reap devices removed while their events were being handled. */
+static void msr_loop_reap (msr_loop_t *loop)
+{
+	struct msr_loop_dev **pp, *d;
+
+	for (pp = &loop->devs; (d = *pp) != NULL; ) {
+		if (d->dead) {
+			*pp = d->next;
+			free (d);
+		} else
+			pp = &d->next;
+	}
+}
+
+static void msr_loop_drop (msr_loop_t *loop, struct msr_loop_dev *d);
+
+void msr_loop_free (msr_loop_t *loop)
+{
+	struct msr_loop_dev *d;
+
+	if (loop == NULL)
+		return;
+
+	for (d = loop->devs; d != NULL; d = d->next)
+		if (!d->dead)
+			msr_loop_drop (loop, d);
+	msr_loop_reap (loop);
+	close (loop->epfd);
+	free (loop);
+}
+
+/* Send the next read command and reset the parser. */
+static int msr_loop_arm (struct msr_loop_dev *d)
+{
+	msr_cmd_t cmd;
+	int i;
+
+	for (i = 0; i < MSR_MAX_TRACKS; i++)
+		d->tracks.msr_tracks[i].msr_tk_len = MSR_MAX_TRACK_LEN;
+	msr_parser_init (&d->parser, d->raw, &d->tracks, NULL, NULL);
+
+	cmd.msr_esc = MSR_ESC;
+	cmd.msr_cmd = d->raw ? MSR_CMD_RAW_READ : MSR_CMD_READ;
+	if (msr_serial_write (d->fd, &cmd, sizeof(cmd)) != sizeof(cmd))
+		return LIBMSR_ERR_SERIAL;
+
+	return LIBMSR_ERR_OK;
+}
+
+static struct msr_loop_dev *msr_loop_find (msr_loop_t *loop,
+    msr_device_t *dev)
+{
+	struct msr_loop_dev *d;
+
+	for (d = loop->devs; d != NULL; d = d->next)
+		if (d->dev == dev && !d->dead)
+			return d;
+
+	return NULL;
+}
+
+int msr_loop_add (msr_loop_t *loop, msr_device_t *dev, int raw,
+    msr_loop_cb cb, void *cookie)
+{
+	struct epoll_event ev;
+	struct msr_loop_dev *d;
+	int r;
+
+	if (msr_loop_find (loop, dev) != NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	if ((d = calloc (1, sizeof(*d))) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	d->dev = dev;
+	d->fd = msr_device_fd (dev);
+	d->raw = raw;
+	d->cb = cb;
+	d->cookie = cookie;
+
+#ifdef MSR_URING
+	if (loop->uring) {
+		d->loop = loop;
+		d->poll_op.done = msr_loop_poll_done;
+		d->read_op.done = msr_loop_read_done;
+
+		/* Nothing the device sent before the read command matters. */
+		msr_serial_flush (d->fd);
+		if (msr_serial_set_uring (d->fd, 1) != LIBMSR_ERR_OK) {
+			free (d);
+			return LIBMSR_ERR_GENERIC;
+		}
+		if ((r = msr_loop_arm (d)) != LIBMSR_ERR_OK ||
+		    (r = msr_loop_post_read (d)) != LIBMSR_ERR_OK) {
+			msr_loop_quiesce (d);
+			msr_serial_set_uring (d->fd, 0);
+			free (d);
+			return r;
+		}
+		goto added;
+	}
+#endif
+
+	memset (&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = d;
+	if (epoll_ctl (loop->epfd, EPOLL_CTL_ADD, d->fd, &ev) == -1) {
+		free (d);
+		return LIBMSR_ERR_GENERIC;
+	}
+
+	if ((r = msr_loop_arm (d)) != LIBMSR_ERR_OK) {
+		epoll_ctl (loop->epfd, EPOLL_CTL_DEL, d->fd, NULL);
+		free (d);
+		return r;
+	}
+
+#ifdef MSR_URING
+added:
+#endif
+	d->next = loop->devs;
+	loop->devs = d;
+	loop->ndevs++;
+
+	return LIBMSR_ERR_OK;
+}
+
+static void msr_loop_drop (msr_loop_t *loop, struct msr_loop_dev *d)
+{
+#ifdef MSR_URING
+	if (loop->uring) {
+		msr_loop_quiesce (d);
+		msr_serial_set_uring (d->fd, 0);
+	} else
+#endif
+	epoll_ctl (loop->epfd, EPOLL_CTL_DEL, d->fd, NULL);
+	d->dead = 1;
+	loop->ndevs--;
+}
+
+int msr_loop_remove (msr_loop_t *loop, msr_device_t *dev)
+{
+	struct msr_loop_dev *d;
+	int r;
+
+	if ((d = msr_loop_find (loop, dev)) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	/*
+	 * Abandon the outstanding read, and throw away whatever came of
+	 * it. The reset undoes the device's settings, so the handle
+	 * mustn't go on trusting its copies.
+	 */
+	msr_loop_drop (loop, d);
+	msr_device_invalidate (dev);
+	r = msr_reset (d->fd);
+	msr_serial_flush (d->fd);
+
+	return r;
+}
+
+int msr_loop_set_uring (msr_loop_t *loop, int on)
+{
+	if (loop->devs != NULL)
+		return LIBMSR_ERR_GENERIC;
+
+#ifdef MSR_URING
+	/* Make sure this thread can have a ring. */
+	if (on && msr_serial_submit () != LIBMSR_ERR_OK)
+		return LIBMSR_ERR_GENERIC;
+	loop->uring = on;
+
+	return LIBMSR_ERR_OK;
+#else
+	return on ? LIBMSR_ERR_GENERIC : LIBMSR_ERR_OK;
+#endif
+}
+
+int msr_loop_devices (const msr_loop_t *loop)
+{
+	return loop->ndevs;
+}
+
+/* Deliver a result, then either re-arm the device or stop watching it. */
+static void msr_loop_deliver (msr_loop_t *loop, struct msr_loop_dev *d,
+    int result)
+{
+	int r;
+
+	if (d->cb (d->dev, result, &d->tracks, d->cookie) != 0 || d->dead) {
+		if (!d->dead)
+			msr_loop_drop (loop, d);
+		return;
+	}
+
+	if (MSR_IO_ERR(result))
+		msr_loop_drop (loop, d);
+	else if ((r = msr_loop_arm (d)) != LIBMSR_ERR_OK)
+		msr_loop_deliver (loop, d, r);
+}
+
+/* Push received bytes into the device's parser. */
+static void msr_loop_push (msr_loop_t *loop, struct msr_loop_dev *d,
+    const uint8_t *buf, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n && !d->dead; ) {
+		i += msr_parser_push (&d->parser, &buf[i], n - i);
+		if (msr_parser_done (&d->parser))
+			msr_loop_deliver (loop, d,
+			    msr_parser_result (&d->parser));
+	}
+}
+
+static void msr_loop_input (msr_loop_t *loop, struct msr_loop_dev *d)
+{
+	uint8_t buf[256];
+	int n;
+
+	/*
+	 * Keep going until the receive buffer is empty: epoll only knows
+	 * about bytes still in the tty, not ones serialio.c already read.
+	 */
+	do {
+		if ((n = msr_serial_read_avail (d->fd, buf, sizeof(buf))) < 0) {
+			msr_loop_deliver (loop, d, LIBMSR_ERR_SERIAL);
+			return;
+		}
+
+		msr_loop_push (loop, d, buf, n);
+	} while (n == sizeof(buf) && !d->dead);
+}
+
+#ifdef MSR_URING
+static int msr_loop_run_uring (msr_loop_t *loop, int timeout)
+{
+	struct msr_loop_dev *d;
+	int r;
+
+	/* This also sends the read commands queued since the last call. */
+	if (msr_uring_submit (1, timeout) != 0)
+		return (errno == EINTR) ? LIBMSR_ERR_OK : LIBMSR_ERR_GENERIC;
+
+	/* Callbacks can complete more reads; those go on the list too. */
+	while ((d = loop->ready) != NULL) {
+		loop->ready = d->ready_next;
+		if (d->dead)
+			continue;
+
+		r = d->read_res;
+		if (r == -EAGAIN || r == -EINTR || r == -ECANCELED)
+			r = 0;
+		else if (r <= 0) {
+			/* An error, or end of file. */
+			msr_loop_deliver (loop, d, LIBMSR_ERR_SERIAL);
+			continue;
+		} else
+			msr_loop_push (loop, d, d->rbuf, r);
+
+		if (!d->dead && !d->read_op.busy &&
+		    (r = msr_loop_post_read (d)) != LIBMSR_ERR_OK)
+			msr_loop_deliver (loop, d, r);
+	}
+
+	msr_loop_reap (loop);
+
+	return LIBMSR_ERR_OK;
+}
+#endif
+
+int msr_loop_run (msr_loop_t *loop, int timeout)
+{
+	struct epoll_event evs[64];
+	struct msr_loop_dev *d;
+	int i, n;
+
+#ifdef MSR_URING
+	if (loop->uring)
+		return msr_loop_run_uring (loop, timeout);
+#endif
+
+	n = epoll_wait (loop->epfd, evs, sizeof(evs) / sizeof(evs[0]),
+	    timeout);
+	if (n == -1)
+		return (errno == EINTR) ? LIBMSR_ERR_OK : LIBMSR_ERR_GENERIC;
+
+	for (i = 0; i < n; i++) {
+		d = evs[i].data.ptr;
+		if (!d->dead)
+			msr_loop_input (loop, d);
+	}
+
+	msr_loop_reap (loop);
+
+	return LIBMSR_ERR_OK;
+}
@@ -0,0 +1,190 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libmsr.h"
+#include "msrint.h"
+
+/*
+ * Write-and-verify for card issuance.
+ *
+ * Each card is written, read back and compared, and written again, up
+ * to a limit, until it matches. The device takes far longer over a card
+ * than we take to frame one, so frames are built ahead while it works:
+ * the write frame is sent, the ring of frames for the following cards
+ * is topped up, and only then do we wait for the write's status.
+ */
+#define MSR_ISSUE_LOOKAHEAD 4
+
+struct msr_issue_run {
+	msr_issue_job_t	*jobs;
+	size_t		njobs;
+	int		raw;
+	int		max_shift; /* for comparing raw tracks */
+	msr_frame_t	*frames; /* job n's frame is frames[n % nframes] */
+	size_t		nframes;
+	size_t		built; /* jobs before this one have frames */
+};
+
+/* Frame the jobs after cur, as far as the ring reaches. */
+static void msr_issue_fill (struct msr_issue_run *run, size_t cur)
+{
+	while (run->built < run->njobs && run->built < cur + run->nframes) {
+		msr_frame_tracks (&run->frames[run->built % run->nframes],
+		    run->raw, run->jobs[run->built].msr_ij_tracks);
+		run->built++;
+	}
+}
+
+/*
+ * The number of bits by which the tracks read back differ from those
+ * written. Tracks that weren't written aren't compared. Raw tracks may
+ * come back with their leading zeros shifted, by up to max_shift bits.
+ */
+static size_t msr_issue_distance (const msr_tracks_t *want,
+    const msr_tracks_t *got, int max_shift)
+{
+	const msr_track_t *w;
+	msr_bitdiff_t diff;
+	size_t d = 0;
+	int i;
+
+	for (i = 0; i < MSR_MAX_TRACKS; i++) {
+		w = &want->msr_tracks[i];
+		if (w->msr_tk_len == 0)
+			continue;
+		msr_track_diff (msr_track_view (w),
+		    msr_track_view (&got->msr_tracks[i]), max_shift, &diff);
+		d += diff.msr_bd_distance;
+	}
+
+	return d;
+}
+
+/* Write a card once and read it back. */
+static int msr_issue_attempt (int fd, struct msr_issue_run *run, size_t cur)
+{
+	msr_issue_job_t *job = &run->jobs[cur];
+	msr_tracks_t back;
+	int r, i;
+
+	r = msr_frame_send (fd, &run->frames[cur % run->nframes]);
+	if (r != LIBMSR_ERR_OK)
+		return r;
+
+	/* The device is busy with the card; get the next ones ready. */
+	msr_issue_fill (run, cur);
+
+	if ((r = msr_write_status (fd)) != LIBMSR_ERR_OK)
+		return r;
+
+	for (i = 0; i < MSR_MAX_TRACKS; i++)
+		back.msr_tracks[i].msr_tk_len = MSR_MAX_TRACK_LEN;
+	r = run->raw ? msr_raw_read (fd, &back) : msr_iso_read (fd, &back);
+	if (r != LIBMSR_ERR_OK)
+		return r;
+
+	job->msr_ij_distance = msr_issue_distance (job->msr_ij_tracks, &back,
+	    run->max_shift);
+	if (job->msr_ij_distance != 0)
+		return LIBMSR_ERR_DEVICE;
+
+	return LIBMSR_ERR_OK;
+}
+
+static uint64_t msr_issue_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int msr_issue_run (int fd, msr_issue_job_t *jobs, size_t njobs,
+    const msr_issue_t *opts, msr_issue_stats_t *stats)
+{
+	struct msr_issue_run run;
+	msr_issue_stats_t st;
+	msr_issue_job_t *job;
+	uint64_t start;
+	size_t cur;
+	int r = LIBMSR_ERR_OK, attempt;
+
+	memset (&st, 0, sizeof(st));
+	memset (&run, 0, sizeof(run));
+	run.jobs = jobs;
+	run.njobs = njobs;
+	run.raw = opts->msr_iss_raw;
+	run.max_shift = run.raw ? opts->msr_iss_max_shift : 0;
+	run.nframes = 1 + (opts->msr_iss_lookahead > 0 ?
+	    opts->msr_iss_lookahead : MSR_ISSUE_LOOKAHEAD);
+	if ((run.frames = malloc (run.nframes * sizeof(*run.frames))) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	start = msr_issue_now ();
+	msr_issue_fill (&run, 0);
+
+	for (cur = 0; cur < njobs; cur++) {
+		job = &jobs[cur];
+		job->msr_ij_writes = 0;
+		job->msr_ij_distance = 0;
+
+		for (attempt = 0; attempt <= opts->msr_iss_retries; attempt++) {
+			/*
+			 * A reader that timed out may still be in the middle
+			 * of the write, so start it over; otherwise, just drop
+			 * whatever the failed attempt left behind.
+			 */
+			if (attempt > 0 &&
+			    job->msr_ij_result == LIBMSR_ERR_TIMEOUT) {
+				if ((job->msr_ij_result = msr_reset (fd)) !=
+				    LIBMSR_ERR_OK)
+					break;
+			} else if (attempt > 0)
+				msr_serial_flush (fd);
+
+			job->msr_ij_result = msr_issue_attempt (fd, &run, cur);
+			job->msr_ij_writes++;
+			st.msr_ist_writes++;
+			if (job->msr_ij_result == LIBMSR_ERR_OK ||
+			    (MSR_IO_ERR(job->msr_ij_result) &&
+			    job->msr_ij_result != LIBMSR_ERR_TIMEOUT))
+				break;
+		}
+
+		st.msr_ist_cards++;
+		if (job->msr_ij_result == LIBMSR_ERR_OK) {
+			st.msr_ist_verified++;
+			if (job->msr_ij_writes == 1)
+				st.msr_ist_first_pass++;
+		} else if (r == LIBMSR_ERR_OK)
+			r = LIBMSR_ERR_DEVICE;
+
+		/* The link is gone, or the device has stopped answering. */
+		if (MSR_IO_ERR(job->msr_ij_result)) {
+			r = job->msr_ij_result;
+			break;
+		}
+
+		if (opts->msr_iss_progress != NULL &&
+		    opts->msr_iss_progress (job, opts->msr_iss_cookie) != 0) {
+			r = LIBMSR_ERR_CANCELED;
+			break;
+		}
+	}
+
+	st.msr_ist_ns = msr_issue_now () - start;
+	if (st.msr_ist_ns > 0)
+		st.msr_ist_per_minute = st.msr_ist_verified *
+		    60000000000ULL / st.msr_ist_ns;
+	if (st.msr_ist_cards > 0)
+		st.msr_ist_yield = st.msr_ist_first_pass * 100 /
+		    st.msr_ist_cards;
+	if (stats != NULL)
+		*stats = st;
+
+	free (run.frames);
+
+	return r;
+}
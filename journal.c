@@ -0,0 +1,597 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libmsr.h"
+
+/*
+ * Swipe capture journal.
+ *
+ * A journal is a file header followed by records, each padded to a
+ * multiple of 8 bytes so that the record headers can be read in place
+ * from a mapping. All integers are little-endian.
+ *
+ * File header (32 bytes):
+ *   0  "MSRJ"
+ *   4  u16 version (1)
+ *   6  u16 header size (32)
+ *   8  u64 creation time, ns since the epoch
+ *   16 reserved, zero
+ *
+ * Record (32-byte header, then the track data back to back):
+ *   0  u32 length, header and data, without the padding
+ *   4  u32 check: the low 32 bits of msr_track_hash() over bytes 8..length
+ *   8  u64 timestamp, ns since the epoch
+ *   16 u32 device id
+ *   20 u8  mode (MSR_JOURNAL_ISO or MSR_JOURNAL_RAW)
+ *   21 u8  bpc of tracks 1-3
+ *   24 u8  length of tracks 1-3
+ *   27 reserved, zero
+ *
+ * The sidecar index (the journal's path plus ".idx") is a 16-byte header,
+ * "MSRI", u16 version, then zeros, followed by the u64 offset of each
+ * record. It is only a cache: appends batch their index entries, and a
+ * reader indexes any records past the end of the index itself. So an
+ * append is a single write(2), and a crash costs nothing but a rescan.
+ *
+ * A scan that meets a damaged record tries each later 8-byte boundary
+ * until a record checks out again, so one bad record doesn't hide the
+ * rest of the journal.
+ */
+#define MSR_JOURNAL_VERSION 1
+#define MSR_JOURNAL_HDRSZ 32
+#define MSR_JOURNAL_RECSZ 32
+#define MSR_JOURNAL_IDXSZ 16
+#define MSR_JOURNAL_MAXREC \
+	(MSR_JOURNAL_RECSZ + MSR_MAX_TRACKS * MSR_MAX_TRACK_LEN)
+
+/* Index entries held back before being written out. */
+#define MSR_JOURNAL_BATCH 512
+
+#define MSR_ALIGN8(n) (((n) + 7) & ~(size_t) 7)
+
+struct msr_journal {
+	pthread_mutex_t	lock;
+	int		fd;
+	int		idxfd;
+	uint64_t	end; /* offset of the next record */
+	uint64_t	pending[MSR_JOURNAL_BATCH]; /* unwritten index entries */
+	int		npending;
+	uint64_t	indexed; /* entries in the index file */
+};
+
+struct msr_journal_map {
+	const uint8_t	*base;
+	size_t		size;
+	const uint8_t	*idx; /* the index file, or NULL */
+	size_t		idxsize;
+	size_t		nidx; /* records found through the index */
+	uint64_t	*extra; /* offsets of the records past those */
+	size_t		nextra;
+	int		damaged; /* the scan skipped over a damaged record */
+};
+
+static void put16 (uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32 (uint8_t *p, uint32_t v)
+{
+	put16 (p, v);
+	put16 (p + 2, v >> 16);
+}
+
+static void put64 (uint8_t *p, uint64_t v)
+{
+	put32 (p, v);
+	put32 (p + 4, v >> 32);
+}
+
+static uint16_t get16 (const uint8_t *p)
+{
+	return p[0] | (uint16_t) p[1] << 8;
+}
+
+static uint32_t get32 (const uint8_t *p)
+{
+	return get16 (p) | (uint32_t) get16 (p + 2) << 16;
+}
+
+static uint64_t get64 (const uint8_t *p)
+{
+	return get32 (p) | (uint64_t) get32 (p + 4) << 32;
+}
+
+static uint32_t msr_journal_check (const uint8_t *rec, size_t len)
+{
+	msr_track_view_t v;
+
+	v.msr_tv_data = rec + 8;
+	v.msr_tv_len = len - 8;
+
+	return (uint32_t) msr_track_hash (v);
+}
+
+static uint64_t msr_journal_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_REALTIME, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Check the record at off in a journal of size bytes. Returns its padded
+ * length, or 0 if there is no valid record there.
+ */
+static size_t msr_journal_valid (const uint8_t *base, uint64_t size,
+    uint64_t off)
+{
+	const uint8_t *rec;
+	uint32_t len;
+
+	if (off < MSR_JOURNAL_HDRSZ || off % 8 || off > size ||
+	    size - off < MSR_JOURNAL_RECSZ)
+		return 0;
+
+	rec = base + off;
+	len = get32 (rec);
+	if (len < MSR_JOURNAL_RECSZ || len > MSR_JOURNAL_MAXREC ||
+	    len > size - off ||
+	    len != MSR_JOURNAL_RECSZ + rec[24] + rec[25] + rec[26] ||
+	    get32 (rec + 4) != msr_journal_check (rec, len))
+		return 0;
+
+	/* The padding of the last record may be missing; that's harmless. */
+	return MSR_ALIGN8(len);
+}
+
+/*
+ * Whether what follows the last good record, at off, is what an
+ * interrupted append leaves behind: a record whose declared length runs
+ * past the end of the file, a partial record header, or zeros.
+ */
+static int msr_journal_torn (const uint8_t *base, uint64_t size,
+    uint64_t off)
+{
+	uint64_t i;
+
+	if (size - off < MSR_JOURNAL_RECSZ ||
+	    get32 (base + off) > size - off)
+		return 1;
+
+	for (i = off; i < size; i++)
+		if (base[i] != 0)
+			return 0;
+
+	return 1;
+}
+
+static int msr_journal_hdr_ok (const uint8_t *hdr)
+{
+	return memcmp (hdr, "MSRJ", 4) == 0 &&
+	    get16 (hdr + 4) == MSR_JOURNAL_VERSION &&
+	    get16 (hdr + 6) == MSR_JOURNAL_HDRSZ;
+}
+
+static int msr_journal_idx_ok (const uint8_t *hdr)
+{
+	return memcmp (hdr, "MSRI", 4) == 0 &&
+	    get16 (hdr + 4) == MSR_JOURNAL_VERSION;
+}
+
+static char *msr_journal_idxpath (const char *path)
+{
+	char *p;
+
+	if ((p = malloc (strlen (path) + 5)) != NULL)
+		sprintf (p, "%s.idx", path);
+
+	return p;
+}
+
+/* Write all of buf at off. */
+static int msr_journal_pwrite (int fd, const void *buf, size_t len,
+    off_t off)
+{
+	ssize_t r;
+
+	while (len > 0) {
+		if ((r = pwrite (fd, buf, len, off)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf = (const uint8_t *) buf + r;
+		len -= r;
+		off += r;
+	}
+
+	return 0;
+}
+
+/*
+ * Map the index, and return the number of its entries that can be used.
+ * Only the last entry is checked against the journal: the others are
+ * checked when they are looked up, so opening a journal doesn't touch
+ * every record in it.
+ */
+static size_t msr_journal_map_idx (msr_journal_map_t *m, const char *path)
+{
+	struct stat st;
+	size_t n, i;
+	uint64_t prev, off;
+	char *ipath;
+	int fd;
+
+	if ((ipath = msr_journal_idxpath (path)) == NULL)
+		return 0;
+	fd = open (ipath, O_RDONLY | O_CLOEXEC);
+	free (ipath);
+	if (fd == -1)
+		return 0;
+
+	if (fstat (fd, &st) == 0 && st.st_size > MSR_JOURNAL_IDXSZ) {
+		m->idxsize = st.st_size;
+		m->idx = mmap (NULL, m->idxsize, PROT_READ, MAP_SHARED, fd, 0);
+		if (m->idx == MAP_FAILED)
+			m->idx = NULL;
+	}
+	close (fd);
+
+	if (m->idx == NULL || !msr_journal_idx_ok (m->idx))
+		return 0;
+
+	n = (m->idxsize - MSR_JOURNAL_IDXSZ) / 8;
+
+	/* An index longer than its journal was truncated along with it. */
+	for (i = 0, prev = 0; i < n; i++, prev = off) {
+		off = get64 (m->idx + MSR_JOURNAL_IDXSZ + i * 8);
+		if (off <= prev || off >= m->size)
+			break;
+	}
+	while (i > 0 && msr_journal_valid (m->base, m->size,
+	    get64 (m->idx + MSR_JOURNAL_IDXSZ + (i - 1) * 8)) == 0)
+		i--;
+
+	return i;
+}
+
+int msr_journal_map (const char *path, msr_journal_map_t **mapp)
+{
+	msr_journal_map_t *m;
+	struct stat st;
+	uint64_t off, *nx;
+	size_t len, cap = 0;
+	int fd, bad;
+
+	if ((m = calloc (1, sizeof(*m))) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	if ((fd = open (path, O_RDONLY | O_CLOEXEC)) == -1) {
+		free (m);
+		return LIBMSR_ERR_GENERIC;
+	}
+	if (fstat (fd, &st) == -1 || st.st_size < MSR_JOURNAL_HDRSZ ||
+	    (m->base = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED,
+	    fd, 0)) == MAP_FAILED) {
+		close (fd);
+		free (m);
+		return LIBMSR_ERR_GENERIC;
+	}
+	close (fd);
+	m->size = st.st_size;
+
+	if (!msr_journal_hdr_ok (m->base)) {
+		msr_journal_unmap (m);
+		return LIBMSR_ERR_GENERIC;
+	}
+
+	m->nidx = msr_journal_map_idx (m, path);
+	off = MSR_JOURNAL_HDRSZ;
+	if (m->nidx > 0) {
+		off = get64 (m->idx + MSR_JOURNAL_IDXSZ + (m->nidx - 1) * 8);
+		off += msr_journal_valid (m->base, m->size, off);
+	}
+
+	/*
+	 * Find whatever was appended since the index was last written,
+	 * stepping over anything that isn't a record.
+	 */
+	for (bad = 0; off + MSR_JOURNAL_RECSZ <= m->size; off += len) {
+		if ((len = msr_journal_valid (m->base, m->size, off)) == 0) {
+			len = 8;
+			bad = 1;
+			continue;
+		}
+		m->damaged |= bad;
+		if (m->nextra == cap) {
+			cap = cap ? cap * 2 : 64;
+			if ((nx = realloc (m->extra, cap * sizeof(*nx))) == NULL) {
+				msr_journal_unmap (m);
+				return LIBMSR_ERR_GENERIC;
+			}
+			m->extra = nx;
+		}
+		m->extra[m->nextra++] = off;
+	}
+
+	*mapp = m;
+
+	return LIBMSR_ERR_OK;
+}
+
+void msr_journal_unmap (msr_journal_map_t *m)
+{
+	if (m == NULL)
+		return;
+
+	if (m->idx != NULL)
+		munmap ((void *) m->idx, m->idxsize);
+	munmap ((void *) m->base, m->size);
+	free (m->extra);
+	free (m);
+}
+
+size_t msr_journal_count (const msr_journal_map_t *m)
+{
+	return m->nidx + m->nextra;
+}
+
+int msr_journal_get (const msr_journal_map_t *m, size_t n,
+    msr_journal_rec_t *rec)
+{
+	const uint8_t *p, *data;
+	uint64_t off;
+	int i;
+
+	if (n < m->nidx)
+		off = get64 (m->idx + MSR_JOURNAL_IDXSZ + n * 8);
+	else if (n - m->nidx < m->nextra)
+		off = m->extra[n - m->nidx];
+	else
+		return LIBMSR_ERR_GENERIC;
+
+	if (msr_journal_valid (m->base, m->size, off) == 0)
+		return LIBMSR_ERR_GENERIC;
+
+	p = m->base + off;
+	rec->msr_jr_time = get64 (p + 8);
+	rec->msr_jr_device = get32 (p + 16);
+	rec->msr_jr_mode = p[20];
+
+	data = p + MSR_JOURNAL_RECSZ;
+	for (i = 0; i < MSR_MAX_TRACKS; i++) {
+		rec->msr_jr_bpc[i] = p[21 + i];
+		rec->msr_jr_tracks[i].msr_tv_data = data;
+		rec->msr_jr_tracks[i].msr_tv_len = p[24 + i];
+		data += p[24 + i];
+	}
+
+	return LIBMSR_ERR_OK;
+}
+
+/* Write out the held-back index entries. Called with j->lock held. */
+static int msr_journal_flush_idx (msr_journal_t *j)
+{
+	uint8_t buf[MSR_JOURNAL_BATCH * 8];
+	int i;
+
+	if (j->npending == 0)
+		return 0;
+
+	/* Without an index, there's nowhere for the entries to go. */
+	if (j->idxfd == -1) {
+		j->npending = 0;
+		return 0;
+	}
+
+	for (i = 0; i < j->npending; i++)
+		put64 (&buf[i * 8], j->pending[i]);
+
+	if (msr_journal_pwrite (j->idxfd, buf, j->npending * 8,
+	    MSR_JOURNAL_IDXSZ + j->indexed * 8) != 0) {
+		/* Readers will rescan; stop maintaining the index. */
+		close (j->idxfd);
+		j->idxfd = -1;
+		j->npending = 0;
+		return -1;
+	}
+
+	j->indexed += j->npending;
+	j->npending = 0;
+
+	return 0;
+}
+
+/*
+ * Open (or create) the index for appending, bringing it up to date
+ * with the journal first.
+ */
+static void msr_journal_open_idx (msr_journal_t *j, const char *path)
+{
+	msr_journal_map_t *m = NULL;
+	uint8_t hdr[MSR_JOURNAL_IDXSZ];
+	size_t i, n;
+	char *ipath;
+
+	j->idxfd = -1;
+	if ((ipath = msr_journal_idxpath (path)) == NULL)
+		return;
+	j->idxfd = open (ipath, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	free (ipath);
+	if (j->idxfd == -1)
+		return;
+
+	memset (hdr, 0, sizeof(hdr));
+	memcpy (hdr, "MSRI", 4);
+	put16 (hdr + 4, MSR_JOURNAL_VERSION);
+
+	if (msr_journal_map (path, &m) != LIBMSR_ERR_OK ||
+	    msr_journal_pwrite (j->idxfd, hdr, sizeof(hdr), 0) != 0 ||
+	    ftruncate (j->idxfd, MSR_JOURNAL_IDXSZ + m->nidx * 8) != 0) {
+		if (m != NULL)
+			msr_journal_unmap (m);
+		close (j->idxfd);
+		j->idxfd = -1;
+		return;
+	}
+
+	j->indexed = m->nidx;
+	for (i = 0; i < m->nextra; i += n) {
+		n = m->nextra - i;
+		if (n > MSR_JOURNAL_BATCH)
+			n = MSR_JOURNAL_BATCH;
+		memcpy (j->pending, &m->extra[i], n * sizeof(uint64_t));
+		j->npending = n;
+		if (msr_journal_flush_idx (j) != 0)
+			break;
+	}
+
+	msr_journal_unmap (m);
+}
+
+int msr_journal_open (const char *path, msr_journal_t **jp)
+{
+	uint8_t hdr[MSR_JOURNAL_HDRSZ];
+	msr_journal_map_t *m;
+	msr_journal_t *j;
+	size_t n;
+	int torn;
+
+	if ((j = calloc (1, sizeof(*j))) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	if ((j->fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1) {
+		free (j);
+		return LIBMSR_ERR_GENERIC;
+	}
+
+	if (lseek (j->fd, 0, SEEK_END) == 0) {
+		memset (hdr, 0, sizeof(hdr));
+		memcpy (hdr, "MSRJ", 4);
+		put16 (hdr + 4, MSR_JOURNAL_VERSION);
+		put16 (hdr + 6, MSR_JOURNAL_HDRSZ);
+		put64 (hdr + 8, msr_journal_now ());
+		if (msr_journal_pwrite (j->fd, hdr, sizeof(hdr), 0) != 0)
+			goto fail;
+	}
+
+	/*
+	 * Find the end of the last good record, and cut off a torn append.
+	 * Any other damage isn't something a crash leaves behind: leave the
+	 * file as it is rather than add to it.
+	 */
+	if (msr_journal_map (path, &m) != LIBMSR_ERR_OK)
+		goto fail;
+	n = msr_journal_count (m);
+	j->end = MSR_JOURNAL_HDRSZ;
+	if (n > 0) {
+		j->end = (n > m->nidx) ? m->extra[n - m->nidx - 1] :
+		    get64 (m->idx + MSR_JOURNAL_IDXSZ + (n - 1) * 8);
+		j->end += msr_journal_valid (m->base, m->size, j->end);
+	}
+	/* The last record's padding may be missing; ftruncate() adds it. */
+	torn = !m->damaged && (j->end >= m->size ||
+	    msr_journal_torn (m->base, m->size, j->end));
+	msr_journal_unmap (m);
+	if (!torn || ftruncate (j->fd, j->end) != 0)
+		goto fail;
+
+	msr_journal_open_idx (j, path);
+	pthread_mutex_init (&j->lock, NULL);
+
+	*jp = j;
+
+	return LIBMSR_ERR_OK;
+
+fail:
+	close (j->fd);
+	free (j);
+	return LIBMSR_ERR_GENERIC;
+}
+
+int msr_journal_append (msr_journal_t *j, uint64_t time, uint32_t device,
+    int mode, const uint8_t *bpc, const msr_tracks_t *tracks)
+{
+	uint8_t rec[MSR_ALIGN8(MSR_JOURNAL_MAXREC)];
+	size_t len, tk;
+	int i, r = LIBMSR_ERR_OK;
+
+	memset (rec, 0, MSR_JOURNAL_RECSZ);
+	put64 (rec + 8, time ? time : msr_journal_now ());
+	put32 (rec + 16, device);
+	rec[20] = mode;
+
+	len = MSR_JOURNAL_RECSZ;
+	for (i = 0; i < MSR_MAX_TRACKS; i++) {
+		tk = tracks->msr_tracks[i].msr_tk_len;
+		rec[21 + i] = (bpc != NULL) ? bpc[i] : 0;
+		rec[24 + i] = tk;
+		memcpy (&rec[len], tracks->msr_tracks[i].msr_tk_data, tk);
+		len += tk;
+	}
+	put32 (rec, len);
+	put32 (rec + 4, msr_journal_check (rec, len));
+
+	/* Pad with zeros, so the next record is aligned. */
+	memset (&rec[len], 0, MSR_ALIGN8(len) - len);
+	len = MSR_ALIGN8(len);
+
+	pthread_mutex_lock (&j->lock);
+
+	if (msr_journal_pwrite (j->fd, rec, len, j->end) != 0) {
+		/* Don't leave a torn record behind. */
+		ftruncate (j->fd, j->end);
+		r = LIBMSR_ERR_GENERIC;
+	} else {
+		j->pending[j->npending++] = j->end;
+		j->end += len;
+		if (j->npending == MSR_JOURNAL_BATCH)
+			msr_journal_flush_idx (j);
+	}
+
+	pthread_mutex_unlock (&j->lock);
+
+	return r;
+}
+
+int msr_journal_sync (msr_journal_t *j)
+{
+	int r = LIBMSR_ERR_OK;
+
+	pthread_mutex_lock (&j->lock);
+	if (fdatasync (j->fd) != 0)
+		r = LIBMSR_ERR_GENERIC;
+	msr_journal_flush_idx (j);
+	pthread_mutex_unlock (&j->lock);
+
+	return r;
+}
+
+int msr_journal_close (msr_journal_t *j)
+{
+	int r = LIBMSR_ERR_OK;
+
+	if (j == NULL)
+		return r;
+
+	msr_journal_flush_idx (j);
+	if (j->idxfd != -1)
+		close (j->idxfd);
+	if (close (j->fd) != 0)
+		r = LIBMSR_ERR_GENERIC;
+	pthread_mutex_destroy (&j->lock);
+	free (j);
+
+	return r;
+}
@@ -1,33 +1,117 @@
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "libmsr.h"
 
-static void output_bits(int fd, uint8_t *buf, int len)
+/*
+ * Text formatting.
+ *
+ * Everything is formatted into a buffer and written out with a single
+ * write(2), rather than a dprintf() per bit or byte. A msr_fmt tracks a
+ * bounded buffer the way snprintf() does: output past the end is
+ * dropped, but still counted.
+ */
+struct msr_fmt {
+	char	*buf;
+	size_t	size;
+	size_t	len;
+};
+
+static const char msr_hexdigits[] = "0123456789abcdef";
+
+static const char msr_nibble_bits[16][4] = {
+	"0000", "0001", "0010", "0011", "0100", "0101", "0110", "0111",
+	"1000", "1001", "1010", "1011", "1100", "1101", "1110", "1111",
+};
+
+static void fmt_put(struct msr_fmt *f, const char *s, size_t n)
 {
-	int	bytes, i;
+	if (f->len < f->size)
+		memcpy(f->buf + f->len, s,
+		    (f->size - f->len < n) ? f->size - f->len : n);
+	f->len += n;
+}
+
+static void fmt_track_label(struct msr_fmt *f, int tn)
+{
+	char label[] = "Track 0: \n";
+
+	label[6] = '1' + tn;
+	fmt_put(f, label, sizeof(label) - 1);
+}
+
+static void fmt_bits(struct msr_fmt *f, const uint8_t *buf, size_t len)
+{
+	char bits[8];
+	size_t	bytes;
+
+	/*
+	 * Note: we want to display the bits in the order in
+	 * which they're read off the card, which means we
+	 * have to decode each byte from most significant bit
+	 * to least significant bit.
+	 */
 
 	for (bytes = 0; bytes < len; bytes++) {
+		memcpy(bits, msr_nibble_bits[buf[bytes] >> 4], 4);
+		memcpy(bits + 4, msr_nibble_bits[buf[bytes] & 0xF], 4);
+		fmt_put(f, bits, 8);
+	}
+}
 
-		/*
-		 * Note: we want to display the bits in the order in
-		 * which they're read off the card, which means we
-		 * have to decode each byte from most significant bit
-		 * to least significant bit.
-		 */
-
-		for (i = 7; i > -1; i--) {
-			if (buf[bytes] & (1 << i))
-				dprintf(fd, "1");
-			else
-				dprintf(fd, "0");
-		}
+/* NUL-terminate like snprintf() and return the untruncated length. */
+static int fmt_finish(struct msr_fmt *f)
+{
+	if (f->size)
+		f->buf[(f->len < f->size) ? f->len : f->size - 1] = '\0';
+
+	return f->len;
+}
+
+static void write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t r;
+
+	while (len > 0) {
+		r = write(fd, buf, len);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return;
+		buf += r;
+		len -= r;
 	}
-	dprintf(fd, "\n");
 }
 
 int msr_dumpbits (uint8_t * buf, int len)
 {
-	output_bits(1, buf, len);
+	char out[MSR_MAX_TRACK_LEN * 8 + 1];
+	struct msr_fmt f;
+	int n;
+
+	/* Nothing to show: just end the line, as ever. */
+	if (len <= 0) {
+		write_all(1, "\n", 1);
+		return LIBMSR_ERR_OK;
+	}
+
+	/* Arbitrarily long buffers go out a chunk at a time. */
+	do {
+		n = (len > MSR_MAX_TRACK_LEN) ? MSR_MAX_TRACK_LEN : len;
+		f.buf = out;
+		f.size = sizeof(out);
+		f.len = 0;
+		fmt_bits(&f, buf, n);
+		if (n == len)
+			fmt_put(&f, "\n", 1);
+		write_all(1, out, f.len);
+		buf += n;
+		len -= n;
+	} while (len > 0);
 
 	return LIBMSR_ERR_OK;
 }
@@ -72,7 +156,116 @@ int msr_setbit (uint8_t * buf, uint8_t len, int bit, int val)
 }
 
 
-int msr_decode(uint8_t * inbuf, uint8_t inlen,
+/* Bit-reversed values of every byte, for flipping the card's bit order. */
+static const uint8_t msr_bitrev[256] = {
+	0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0,
+	0x10, 0x90, 0x50, 0xd0, 0x30, 0xb0, 0x70, 0xf0,
+	0x08, 0x88, 0x48, 0xc8, 0x28, 0xa8, 0x68, 0xe8,
+	0x18, 0x98, 0x58, 0xd8, 0x38, 0xb8, 0x78, 0xf8,
+	0x04, 0x84, 0x44, 0xc4, 0x24, 0xa4, 0x64, 0xe4,
+	0x14, 0x94, 0x54, 0xd4, 0x34, 0xb4, 0x74, 0xf4,
+	0x0c, 0x8c, 0x4c, 0xcc, 0x2c, 0xac, 0x6c, 0xec,
+	0x1c, 0x9c, 0x5c, 0xdc, 0x3c, 0xbc, 0x7c, 0xfc,
+	0x02, 0x82, 0x42, 0xc2, 0x22, 0xa2, 0x62, 0xe2,
+	0x12, 0x92, 0x52, 0xd2, 0x32, 0xb2, 0x72, 0xf2,
+	0x0a, 0x8a, 0x4a, 0xca, 0x2a, 0xaa, 0x6a, 0xea,
+	0x1a, 0x9a, 0x5a, 0xda, 0x3a, 0xba, 0x7a, 0xfa,
+	0x06, 0x86, 0x46, 0xc6, 0x26, 0xa6, 0x66, 0xe6,
+	0x16, 0x96, 0x56, 0xd6, 0x36, 0xb6, 0x76, 0xf6,
+	0x0e, 0x8e, 0x4e, 0xce, 0x2e, 0xae, 0x6e, 0xee,
+	0x1e, 0x9e, 0x5e, 0xde, 0x3e, 0xbe, 0x7e, 0xfe,
+	0x01, 0x81, 0x41, 0xc1, 0x21, 0xa1, 0x61, 0xe1,
+	0x11, 0x91, 0x51, 0xd1, 0x31, 0xb1, 0x71, 0xf1,
+	0x09, 0x89, 0x49, 0xc9, 0x29, 0xa9, 0x69, 0xe9,
+	0x19, 0x99, 0x59, 0xd9, 0x39, 0xb9, 0x79, 0xf9,
+	0x05, 0x85, 0x45, 0xc5, 0x25, 0xa5, 0x65, 0xe5,
+	0x15, 0x95, 0x55, 0xd5, 0x35, 0xb5, 0x75, 0xf5,
+	0x0d, 0x8d, 0x4d, 0xcd, 0x2d, 0xad, 0x6d, 0xed,
+	0x1d, 0x9d, 0x5d, 0xdd, 0x3d, 0xbd, 0x7d, 0xfd,
+	0x03, 0x83, 0x43, 0xc3, 0x23, 0xa3, 0x63, 0xe3,
+	0x13, 0x93, 0x53, 0xd3, 0x33, 0xb3, 0x73, 0xf3,
+	0x0b, 0x8b, 0x4b, 0xcb, 0x2b, 0xab, 0x6b, 0xeb,
+	0x1b, 0x9b, 0x5b, 0xdb, 0x3b, 0xbb, 0x7b, 0xfb,
+	0x07, 0x87, 0x47, 0xc7, 0x27, 0xa7, 0x67, 0xe7,
+	0x17, 0x97, 0x57, 0xd7, 0x37, 0xb7, 0x77, 0xf7,
+	0x0f, 0x8f, 0x4f, 0xcf, 0x2f, 0xaf, 0x6f, 0xef,
+	0x1f, 0x9f, 0x5f, 0xdf, 0x3f, 0xbf, 0x7f, 0xff,
+};
+
+#if defined(__GNUC__)
+#define MSR_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define MSR_ALWAYS_INLINE inline
+#endif
+
+/*
+ * Map a raw character code, parity bit included, to ASCII. 5 and 6-bit
+ * characters are offset from '0'. For 7 and 8-bit characters, the
+ * original "< 0x20 ? | 0x20 : (| 0x40) - 0x20" dance works out to
+ * ' ' plus the low six bits.
+ */
+static MSR_ALWAYS_INLINE uint8_t msr_decode_char (uint32_t code,
+    const int bpc)
+{
+	code &= ~(1U << (bpc - 1));
+
+	if (bpc < 7)
+		return code | 0x30;
+
+	return 0x20 + (code & 0x3F);
+}
+
+/*
+ * Decode a track a word at a time. Characters are sent least significant
+ * bit first but we keep the bits in card order, so each byte is flipped
+ * on the way into a little-endian bit accumulator. Every bpc bytes hold
+ * exactly eight characters, which we peel off with constant shifts; the
+ * compiler specializes this for each bpc that calls it.
+ *
+ * Returns the number of characters written, stopping early once max
+ * have been written (max == 0 means no limit).
+ */
+static MSR_ALWAYS_INLINE int msr_decode_words (const uint8_t *in, int inlen,
+    uint8_t *out, int max, const int bpc)
+{
+	const uint32_t mask = (1U << bpc) - 1;
+	uint64_t w;
+	int i = 0, x = 0, nbits, k, nchars;
+
+	nchars = inlen * 8 / bpc;
+	if (max && nchars > max)
+		nchars = max;
+
+	for (; i + bpc <= inlen && x + 8 <= nchars; i += bpc) {
+		w = 0;
+		for (k = 0; k < bpc; k++)
+			w |= (uint64_t) msr_bitrev[in[i + k]] << (8 * k);
+
+		for (k = 0; k < 8; k++)
+			out[x + k] = msr_decode_char ((w >> (k * bpc)) & mask,
+			    bpc);
+		x += 8;
+	}
+
+	/* Fewer than eight characters left. */
+	w = 0;
+	nbits = 0;
+	while (x < nchars) {
+		while (nbits < bpc) {
+			w |= (uint64_t) msr_bitrev[in[i++]] << nbits;
+			nbits += 8;
+		}
+
+		out[x++] = msr_decode_char (w & mask, bpc);
+		w >>= bpc;
+		nbits -= bpc;
+	}
+
+	return x;
+}
+
+/* The bit-at-a-time decoder, kept for out-of-range bpc values. */
+static int msr_decode_bits (uint8_t * inbuf, uint8_t inlen,
     uint8_t * outbuf, uint8_t * outlen, int bpc)
 {
 	uint8_t * b;
@@ -106,17 +299,45 @@ int msr_decode(uint8_t * inbuf, uint8_t inlen,
 			/* Don't overflow output buffer */
 			if (x == *outlen)
 				break;
-#ifdef DEBUG
-			printf ("%c", byte);
-#endif
 			ch = 0;
 			byte = 0;
 		} else
 			ch++;
 	}
 
+	return x;
+}
+
+/* Pick the decoder specialized for bpc, which must be between 1 and 8. */
+static int msr_decode_fast (const uint8_t *in, int inlen, uint8_t *out,
+    int max, int bpc)
+{
+	switch (bpc) {
+	case 5:
+		return msr_decode_words (in, inlen, out, max, 5);
+	case 6:
+		return msr_decode_words (in, inlen, out, max, 6);
+	case 7:
+		return msr_decode_words (in, inlen, out, max, 7);
+	case 8:
+		return msr_decode_words (in, inlen, out, max, 8);
+	default:
+		return msr_decode_words (in, inlen, out, max, bpc);
+	}
+}
+
+int msr_decode(uint8_t * inbuf, uint8_t inlen,
+    uint8_t * outbuf, uint8_t * outlen, int bpc)
+{
+	int x;
+
+	if (bpc >= 1 && bpc <= 8)
+		x = msr_decode_fast (inbuf, inlen, outbuf, *outlen, bpc);
+	else
+		x = msr_decode_bits (inbuf, inlen, outbuf, outlen, bpc);
+
 #ifdef DEBUG
-	printf ("\n");
+	printf ("%.*s\n", x, outbuf);
 #endif
 
 	/* Output buffer was too small. */
@@ -127,6 +348,877 @@ int msr_decode(uint8_t * inbuf, uint8_t inlen,
 	return LIBMSR_ERR_OK;
 }
 
+/*
+ * Track views.
+ */
+
+msr_track_view_t msr_track_view (const msr_track_t *track)
+{
+	msr_track_view_t view;
+
+	view.msr_tv_data = track->msr_tk_data;
+	view.msr_tv_len = track->msr_tk_len;
+
+	return view;
+}
+
+int msr_decode_view (msr_track_view_t view, uint8_t *outbuf, size_t *outlen,
+    int bpc)
+{
+	size_t nchars;
+
+	if (bpc < 1 || bpc > 8 || view.msr_tv_len > INT_MAX / 8)
+		return LIBMSR_ERR_GENERIC;
+
+	nchars = view.msr_tv_len * 8 / bpc;
+
+	if (nchars > *outlen) {
+		if (*outlen)
+			msr_decode_fast (view.msr_tv_data, view.msr_tv_len,
+			    outbuf, *outlen, bpc);
+		return LIBMSR_ERR_GENERIC;
+	}
+
+	*outlen = msr_decode_fast (view.msr_tv_data, view.msr_tv_len, outbuf,
+	    0, bpc);
+
+	return LIBMSR_ERR_OK;
+}
+
+/* 64-bit FNV-1a. */
+uint64_t msr_track_hash (msr_track_view_t view)
+{
+	uint64_t h = 0xCBF29CE484222325ULL;
+	size_t i;
+
+	for (i = 0; i < view.msr_tv_len; i++) {
+		h ^= view.msr_tv_data[i];
+		h *= 0x100000001B3ULL;
+	}
+
+	return h;
+}
+
+/*
+ * ISO 7811 decoding of raw reads.
+ *
+ * An ISO track is some clocking zeros, a start sentinel, the data, an
+ * end sentinel and a longitudinal redundancy check (LRC) character.
+ * Every character has an odd parity bit on top of its data bits, and
+ * the LRC's data bits are the XOR of all the other characters' data
+ * bits, sentinels included. Its own parity bit covers only itself.
+ */
+
+/* Takes characters off a track at any bit offset, like msr_decode_words. */
+struct msr_bitreader {
+	const uint8_t	*p;
+	const uint8_t	*end;
+	uint64_t	w;
+	int		n; /* the number of bits in w */
+};
+
+/* Start reading at bit, which must be within the track. */
+static void msr_bitreader_init (struct msr_bitreader *br,
+    msr_track_view_t view, size_t bit)
+{
+	br->p = view.msr_tv_data + bit / 8;
+	br->end = view.msr_tv_data + view.msr_tv_len;
+	br->w = 0;
+	br->n = 0;
+
+	if (bit % 8) {
+		br->w = msr_bitrev[*br->p++] >> (bit % 8);
+		br->n = 8 - bit % 8;
+	}
+}
+
+/* Returns the next bpc-bit code, or -1 if the track ends first. */
+static MSR_ALWAYS_INLINE int msr_bitreader_take (struct msr_bitreader *br,
+    int bpc)
+{
+	int code;
+
+	while (br->n < bpc) {
+		if (br->p == br->end)
+			return -1;
+		br->w |= (uint64_t) msr_bitrev[*br->p++] << br->n;
+		br->n += 8;
+	}
+
+	code = br->w & ((1U << bpc) - 1);
+	br->w >>= bpc;
+	br->n -= bpc;
+
+	return code;
+}
+
+static MSR_ALWAYS_INLINE int msr_parity (uint32_t x)
+{
+#if defined(__GNUC__)
+	return __builtin_parity (x);
+#else
+	x ^= x >> 16;
+	x ^= x >> 8;
+	x ^= x >> 4;
+	x ^= x >> 2;
+	x ^= x >> 1;
+
+	return x & 1;
+#endif
+}
+
+/* The inverse of msr_decode_char(): c's code, with odd parity. */
+static uint32_t msr_iso_code (uint8_t c, int bpc)
+{
+	uint32_t code;
+
+	code = c - (bpc < 7 ? 0x30 : 0x20);
+
+	return code | (uint32_t) !msr_parity (code) << (bpc - 1);
+}
+
+/* Find the first set bit of a track. Returns 0 if there isn't one. */
+static int msr_iso_first_bit (msr_track_view_t view, size_t *bit)
+{
+	size_t i;
+	int k;
+
+	for (i = 0; i < view.msr_tv_len; i++) {
+		if (view.msr_tv_data[i] == 0)
+			continue;
+		for (k = 0; !(view.msr_tv_data[i] & (0x80 >> k)); k++)
+			;
+		*bit = i * 8 + k;
+		return 1;
+	}
+
+	return 0;
+}
+
+int msr_iso_decode_view (msr_track_view_t view, int bpc, uint8_t *outbuf,
+    size_t *outlen, msr_iso_info_t *info)
+{
+	struct msr_bitreader br;
+	msr_iso_info_t scratch;
+	uint32_t ss, es, dmask, lrc;
+	size_t bit, x = 0;
+	int code, b;
+	uint8_t c;
+
+	if (info == NULL)
+		info = &scratch;
+	memset (info, 0, sizeof(*info));
+
+	if (bpc < 5 || bpc > 8 || view.msr_tv_len > INT_MAX / 8)
+		return LIBMSR_ERR_GENERIC;
+
+	ss = msr_iso_code (bpc < 7 ? ';' : '%', bpc);
+	es = msr_iso_code ('?', bpc);
+	dmask = (1U << (bpc - 1)) - 1;
+
+	if (!msr_iso_first_bit (view, &bit)) {
+		info->msr_ii_status = MSR_ISO_BLANK;
+		*outlen = 0;
+		return LIBMSR_ERR_OK;
+	}
+
+	/* Slide a character-wide window past any noise to the sentinel. */
+	msr_bitreader_init (&br, view, bit);
+	code = msr_bitreader_take (&br, bpc);
+	while (code >= 0 && (uint32_t) code != ss) {
+		if ((b = msr_bitreader_take (&br, 1)) < 0)
+			code = -1;
+		else
+			code = (code >> 1) | b << (bpc - 1);
+		bit++;
+	}
+	if (code < 0) {
+		info->msr_ii_status = MSR_ISO_NO_START;
+		*outlen = 0;
+		return LIBMSR_ERR_ISO;
+	}
+
+	info->msr_ii_start = bit;
+	info->msr_ii_chars = 1;
+	lrc = ss & dmask;
+
+	/*
+	 * The data, up to and including the end sentinel. A parity error
+	 * in the end sentinel still ends the data: its data bits match.
+	 */
+	for (;;) {
+		if ((code = msr_bitreader_take (&br, bpc)) < 0) {
+			info->msr_ii_status = MSR_ISO_NO_END;
+			*outlen = 0;
+			return LIBMSR_ERR_ISO;
+		}
+		if (!msr_parity (code) && info->msr_ii_parity_errors++ == 0)
+			info->msr_ii_bad = info->msr_ii_chars;
+		info->msr_ii_chars++;
+		lrc ^= code & dmask;
+
+		if ((code & dmask) == (es & dmask))
+			break;
+
+		/* msr_iso_read() drops sentinels wherever they turn up. */
+		c = msr_decode_char (code, bpc);
+		if (c == '%' || c == ';')
+			continue;
+		if (x < *outlen)
+			outbuf[x] = c;
+		x++;
+	}
+
+	if ((code = msr_bitreader_take (&br, bpc)) < 0) {
+		info->msr_ii_status = MSR_ISO_NO_END;
+		*outlen = 0;
+		return LIBMSR_ERR_ISO;
+	}
+	if (!msr_parity (code) && info->msr_ii_parity_errors++ == 0)
+		info->msr_ii_bad = info->msr_ii_chars;
+	info->msr_ii_chars++;
+	info->msr_ii_lrc = (lrc ^ code) & dmask;
+
+	if (info->msr_ii_parity_errors || info->msr_ii_lrc) {
+		info->msr_ii_status = info->msr_ii_parity_errors ?
+		    MSR_ISO_PARITY : MSR_ISO_LRC;
+		*outlen = 0;
+		return LIBMSR_ERR_ISO;
+	}
+
+	if (x > *outlen)
+		return LIBMSR_ERR_GENERIC;
+	*outlen = x;
+
+	return LIBMSR_ERR_OK;
+}
+
+/* The ISO 7811 character sizes of tracks 1, 2 and 3. */
+static const int msr_iso_bpc[MSR_MAX_TRACKS] = { 7, 5, 5 };
+
+int msr_iso_decode (const msr_tracks_t *raw, msr_tracks_t *iso,
+    msr_iso_info_t *info)
+{
+	uint8_t buf[MSR_MAX_TRACK_LEN];
+	size_t len;
+	int i, r, ret = LIBMSR_ERR_OK;
+
+	for (i = 0; i < MSR_MAX_TRACKS; i++) {
+		/* Decode into buf, so that raw and iso may be the same. */
+		len = sizeof(buf);
+		r = msr_iso_decode_view (msr_track_view (&raw->msr_tracks[i]),
+		    msr_iso_bpc[i], buf, &len, info ? &info[i] : NULL);
+		if (r != LIBMSR_ERR_OK) {
+			len = 0;
+			if (ret != LIBMSR_ERR_GENERIC)
+				ret = r;
+		}
+
+		memcpy (iso->msr_tracks[i].msr_tk_data, buf, len);
+		iso->msr_tracks[i].msr_tk_len = len;
+	}
+
+	return ret;
+}
+
+/*
+ * Swipe direction and character size detection.
+ *
+ * A track is decoded as ISO data both ways round, with 7, 5 and 8-bit
+ * characters. Each candidate gains a point for every character with
+ * good parity and loses four for every bad one, since a wrong guess
+ * gets parity right half the time, and gains bpc - 1 more if the LRC
+ * checks. A score is then roughly the number of bits of evidence for
+ * its candidate, and the winner's confidence comes from its lead.
+ */
+#define MSR_ANALYZE_NBPC 3
+
+static const int msr_analyze_bpc[MSR_ANALYZE_NBPC] = { 7, 5, 8 };
+
+struct msr_analysis {
+	uint8_t		rev[MSR_MAX_TRACK_LEN]; /* the track, reversed */
+	msr_iso_info_t	info[2][MSR_ANALYZE_NBPC];
+	int		score[2][MSR_ANALYZE_NBPC];
+	int		blank;
+};
+
+static int msr_analyze_score (const msr_iso_info_t *info, int bpc)
+{
+	int good, bad, score;
+
+	if (info->msr_ii_status == MSR_ISO_BLANK ||
+	    info->msr_ii_status == MSR_ISO_NO_START)
+		return 0;
+
+	bad = info->msr_ii_parity_errors;
+	good = info->msr_ii_chars - bad;
+	score = good - 4 * bad;
+
+	/* The LRC was only read if the status is one of these. */
+	if ((info->msr_ii_status == MSR_ISO_OK ||
+	    info->msr_ii_status == MSR_ISO_PARITY) && info->msr_ii_lrc == 0)
+		score += bpc - 1;
+
+	return score;
+}
+
+/* Decode every candidate, keeping their scores. */
+static int msr_analyze_run (msr_track_view_t view, struct msr_analysis *a)
+{
+	uint8_t scratch[MSR_DECODE_MAX];
+	msr_track_view_t v;
+	size_t i, len;
+	int d, k;
+
+	if (view.msr_tv_len > MSR_MAX_TRACK_LEN)
+		return LIBMSR_ERR_GENERIC;
+
+	for (i = 0; i < view.msr_tv_len; i++)
+		a->rev[i] = msr_bitrev[view.msr_tv_data[view.msr_tv_len - 1 - i]];
+
+	for (d = 0; d < 2; d++) {
+		v = view;
+		if (d)
+			v.msr_tv_data = a->rev;
+		for (k = 0; k < MSR_ANALYZE_NBPC; k++) {
+			len = sizeof(scratch);
+			msr_iso_decode_view (v, msr_analyze_bpc[k], scratch,
+			    &len, &a->info[d][k]);
+			a->score[d][k] = msr_analyze_score (&a->info[d][k],
+			    msr_analyze_bpc[k]);
+		}
+	}
+
+	a->blank = a->info[0][0].msr_ii_status == MSR_ISO_BLANK;
+
+	return LIBMSR_ERR_OK;
+}
+
+/* The best candidate in direction d, trying prefer's bpc first. */
+static int msr_analyze_best (const struct msr_analysis *a, int d, int prefer)
+{
+	int k, best;
+
+	for (best = 0; best < MSR_ANALYZE_NBPC; best++)
+		if (msr_analyze_bpc[best] == prefer)
+			break;
+	if (best == MSR_ANALYZE_NBPC)
+		best = 0;
+
+	for (k = 0; k < MSR_ANALYZE_NBPC; k++)
+		if (a->score[d][k] > a->score[d][best])
+			best = k;
+
+	return best;
+}
+
+/* Describe candidate (d, k) in guess, and decode it into outbuf. */
+static int msr_analyze_pick (msr_track_view_t view,
+    const struct msr_analysis *a, int d, int k, uint8_t *outbuf,
+    size_t *outlen, msr_track_guess_t *guess)
+{
+	int e, j, lead, conf;
+
+	memset (guess, 0, sizeof(*guess));
+
+	if (a->blank) {
+		guess->msr_tg_info = a->info[0][0];
+		*outlen = 0;
+		return LIBMSR_ERR_OK;
+	}
+
+	/* The lead over the runner-up, of either direction. */
+	lead = INT_MAX;
+	for (e = 0; e < 2; e++)
+		for (j = 0; j < MSR_ANALYZE_NBPC; j++)
+			if ((e != d || j != k) &&
+			    a->score[d][k] - a->score[e][j] < lead)
+				lead = a->score[d][k] - a->score[e][j];
+	if (lead > a->score[d][k])
+		lead = a->score[d][k];
+
+	conf = 0;
+	if (lead > 0)
+		conf = lead < 7 ? 100 - (100 >> lead) : 100;
+	if (a->info[d][k].msr_ii_status != MSR_ISO_OK)
+		conf /= 2;
+
+	guess->msr_tg_bpc = msr_analyze_bpc[k];
+	guess->msr_tg_reversed = d;
+	guess->msr_tg_score = a->score[d][k];
+	guess->msr_tg_confidence = conf;
+	guess->msr_tg_info = a->info[d][k];
+
+	if (d)
+		view.msr_tv_data = a->rev;
+
+	return msr_iso_decode_view (view, guess->msr_tg_bpc, outbuf, outlen,
+	    NULL);
+}
+
+int msr_analyze_view (msr_track_view_t view, uint8_t *outbuf,
+    size_t *outlen, msr_track_guess_t *guess)
+{
+	struct msr_analysis a;
+	int r, best, rbest;
+
+	if ((r = msr_analyze_run (view, &a)) != LIBMSR_ERR_OK)
+		return r;
+
+	best = msr_analyze_best (&a, 0, 0);
+	rbest = msr_analyze_best (&a, 1, 0);
+	if (a.score[1][rbest] > a.score[0][best])
+		return msr_analyze_pick (view, &a, 1, rbest, outbuf, outlen,
+		    guess);
+
+	return msr_analyze_pick (view, &a, 0, best, outbuf, outlen, guess);
+}
+
+int msr_analyze_tracks (const msr_tracks_t *raw, msr_tracks_t *iso,
+    msr_track_guess_t *guess)
+{
+	static const int prefer[MSR_MAX_TRACKS] = { 7, 5, 5 };
+	struct msr_analysis a[MSR_MAX_TRACKS];
+	msr_track_guess_t scratch;
+	uint8_t buf[MSR_MAX_TRACK_LEN];
+	int i, d, r, sum[2], ret = LIBMSR_ERR_OK;
+	size_t len;
+
+	/* A card is swiped one way, so pick the direction for all tracks. */
+	sum[0] = sum[1] = 0;
+	for (i = 0; i < MSR_MAX_TRACKS; i++) {
+		msr_analyze_run (msr_track_view (&raw->msr_tracks[i]), &a[i]);
+		for (d = 0; d < 2; d++)
+			sum[d] += a[i].score[d][msr_analyze_best (&a[i], d,
+			    prefer[i])];
+	}
+	d = sum[1] > sum[0];
+
+	for (i = 0; i < MSR_MAX_TRACKS; i++) {
+		len = sizeof(buf);
+		r = msr_analyze_pick (msr_track_view (&raw->msr_tracks[i]),
+		    &a[i], d, msr_analyze_best (&a[i], d, prefer[i]), buf,
+		    &len, guess ? &guess[i] : &scratch);
+		if (r != LIBMSR_ERR_OK) {
+			len = 0;
+			if (ret != LIBMSR_ERR_GENERIC)
+				ret = r;
+		}
+
+		memcpy (iso->msr_tracks[i].msr_tk_data, buf, len);
+		iso->msr_tracks[i].msr_tk_len = len;
+	}
+
+	return ret;
+}
+
+/*
+ * Single-bit error correction.
+ *
+ * Parity and the LRC are a two-dimensional check: one flipped bit fails
+ * the parity of its character, and flips the same bit of the LRC
+ * syndrome unless it was a parity bit. The two together say which bit
+ * to flip back. Two bad characters are more than one error, and are
+ * left alone, as are errors in the start sentinel or in the end
+ * sentinel's data bits, which hide where the track starts or ends.
+ * Whatever we flip, the track must then decode cleanly.
+ */
+static void msr_iso_flip (msr_track_t *track, int bit)
+{
+	track->msr_tk_data[bit / 8] ^= 0x80 >> (bit % 8);
+}
+
+/*
+ * Whether a track decodes without errors, with nothing but zeros after
+ * its LRC. A flip that turns a bad character into an end sentinel can
+ * leave a track that decodes, short, with the rest of the data after it.
+ */
+static int msr_iso_clean (msr_track_t *track, int bpc)
+{
+	uint8_t scratch[MSR_DECODE_MAX];
+	size_t len = sizeof(scratch), bit;
+	msr_iso_info_t info;
+
+	if (msr_iso_decode_view (msr_track_view (track), bpc, scratch,
+	    &len, &info) != LIBMSR_ERR_OK)
+		return 0;
+
+	for (bit = info.msr_ii_start + info.msr_ii_chars * bpc;
+	    bit < (size_t) track->msr_tk_len * 8; bit++)
+		if (track->msr_tk_data[bit / 8] & (0x80 >> (bit % 8)))
+			return 0;
+
+	return 1;
+}
+
+int msr_iso_correct_track (msr_track_t *track, int bpc, msr_iso_fix_t *fix)
+{
+	uint8_t scratch[MSR_DECODE_MAX];
+	msr_iso_info_t info;
+	msr_iso_fix_t unused;
+	size_t len;
+	int r, k, j, first;
+
+	if (fix == NULL)
+		fix = &unused;
+	memset (fix, 0, sizeof(*fix));
+
+	len = sizeof(scratch);
+	r = msr_iso_decode_view (msr_track_view (track), bpc, scratch, &len,
+	    &info);
+	fix->msr_if_status = info.msr_ii_status;
+	if (r != LIBMSR_ERR_ISO)
+		return r;
+
+	if (info.msr_ii_status != MSR_ISO_PARITY ||
+	    info.msr_ii_parity_errors != 1)
+		return LIBMSR_ERR_ISO;
+
+	first = info.msr_ii_start + info.msr_ii_bad * bpc;
+
+	/* The syndrome's bit, or the parity bit if the syndrome is clear. */
+	for (k = 0; k < bpc - 1 && !(info.msr_ii_lrc & (1 << k)); k++)
+		;
+	if ((info.msr_ii_lrc & (info.msr_ii_lrc - 1)) == 0) {
+		msr_iso_flip (track, first + k);
+		if (msr_iso_clean (track, bpc))
+			goto fixed;
+		msr_iso_flip (track, first + k);
+	}
+
+	/*
+	 * A data character flipped into an end sentinel ends the track
+	 * early, and the syndrome is then meaningless. Parity still points
+	 * at the character, so try each of its bits, and take the only one
+	 * that works.
+	 */
+	for (j = 0, k = -1; j < bpc; j++) {
+		msr_iso_flip (track, first + j);
+		if (msr_iso_clean (track, bpc)) {
+			if (k >= 0) {
+				msr_iso_flip (track, first + j);
+				return LIBMSR_ERR_ISO;
+			}
+			k = j;
+		}
+		msr_iso_flip (track, first + j);
+	}
+	if (k < 0)
+		return LIBMSR_ERR_ISO;
+	msr_iso_flip (track, first + k);
+
+fixed:
+	fix->msr_if_corrected = 1;
+	fix->msr_if_bit = first + k;
+	fix->msr_if_char = info.msr_ii_bad;
+	fix->msr_if_char_bit = k;
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_iso_decode_correct (const msr_tracks_t *raw, msr_tracks_t *iso,
+    msr_iso_fix_t *fix)
+{
+	msr_track_t track;
+	size_t len;
+	int i, r, ret = LIBMSR_ERR_OK;
+
+	for (i = 0; i < MSR_MAX_TRACKS; i++) {
+		/* Correct a copy, so that raw and iso may be the same. */
+		track = raw->msr_tracks[i];
+		r = msr_iso_correct_track (&track, msr_iso_bpc[i],
+		    fix ? &fix[i] : NULL);
+
+		len = sizeof(iso->msr_tracks[i].msr_tk_data);
+		if (r == LIBMSR_ERR_OK)
+			r = msr_iso_decode_view (msr_track_view (&track),
+			    msr_iso_bpc[i], iso->msr_tracks[i].msr_tk_data,
+			    &len, NULL);
+		if (r != LIBMSR_ERR_OK) {
+			len = 0;
+			if (ret != LIBMSR_ERR_GENERIC)
+				ret = r;
+		}
+
+		iso->msr_tracks[i].msr_tk_len = len;
+	}
+
+	return ret;
+}
+
+/*
+ * ISO 7811 encoding.
+ *
+ * Characters are packed into a little-endian bit accumulator, least
+ * significant bit first, and each full byte is flipped into card order
+ * on the way out: msr_decode_words() run backwards.
+ */
+struct msr_bitwriter {
+	uint8_t		*p;
+	uint64_t	w;
+	int		n; /* the number of bits in w */
+};
+
+static MSR_ALWAYS_INLINE void msr_bitwriter_put (struct msr_bitwriter *bw,
+    uint32_t code, int bpc)
+{
+	bw->w |= (uint64_t) code << bw->n;
+	bw->n += bpc;
+
+	/* Once there's a word's worth, write it a byte at a time. */
+	if (bw->n >= 32) {
+		bw->p[0] = msr_bitrev[bw->w & 0xFF];
+		bw->p[1] = msr_bitrev[(bw->w >> 8) & 0xFF];
+		bw->p[2] = msr_bitrev[(bw->w >> 16) & 0xFF];
+		bw->p[3] = msr_bitrev[(bw->w >> 24) & 0xFF];
+		bw->p += 4;
+		bw->w >>= 32;
+		bw->n -= 32;
+	}
+}
+
+/* Write out what's left, padded with zeros to a whole byte. */
+static void msr_bitwriter_flush (struct msr_bitwriter *bw)
+{
+	while (bw->n > 0) {
+		*bw->p++ = msr_bitrev[bw->w & 0xFF];
+		bw->w >>= 8;
+		bw->n -= 8;
+	}
+	bw->w = 0;
+	bw->n = 0;
+}
+
+static MSR_ALWAYS_INLINE int msr_iso_encode_words (const uint8_t *data,
+    size_t len, size_t lead, msr_track_t *track, const int bpc)
+{
+	const uint32_t dmask = (1U << (bpc - 1)) - 1;
+	const uint8_t base = bpc < 7 ? 0x30 : 0x20;
+	/* The character sets are 16 and 64 characters, whatever the bpc. */
+	const uint32_t cmask = bpc < 7 ? 0x0F : 0x3F;
+	const uint32_t ss = msr_iso_code (bpc < 7 ? ';' : '%', bpc);
+	const uint32_t es = msr_iso_code ('?', bpc);
+	struct msr_bitwriter bw;
+	uint32_t code, lrc;
+	size_t i;
+
+	memset (track->msr_tk_data, 0, lead / 8);
+	bw.p = track->msr_tk_data + lead / 8;
+	bw.w = 0;
+	bw.n = lead % 8;
+
+	msr_bitwriter_put (&bw, ss, bpc);
+	lrc = ss & dmask;
+
+	for (i = 0; i < len; i++) {
+		/* Leave out anything msr_iso_decode() wouldn't give back. */
+		code = (uint8_t) (data[i] - base);
+		if (code > cmask || data[i] == '%' || data[i] == ';' ||
+		    data[i] == '?')
+			return LIBMSR_ERR_ISO;
+		lrc ^= code;
+		msr_bitwriter_put (&bw, code |
+		    (uint32_t) !msr_parity (code) << (bpc - 1), bpc);
+	}
+
+	msr_bitwriter_put (&bw, es, bpc);
+	lrc ^= es & dmask;
+	msr_bitwriter_put (&bw, lrc | (uint32_t) !msr_parity (lrc) << (bpc - 1),
+	    bpc);
+	msr_bitwriter_flush (&bw);
+
+	track->msr_tk_len = bw.p - track->msr_tk_data;
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_iso_encode_track (const uint8_t *data, size_t len, int bpc,
+    size_t lead, msr_track_t *track)
+{
+	int r;
+
+	track->msr_tk_len = 0;
+
+	if (bpc < 5 || bpc > 8 || len > MSR_DECODE_MAX ||
+	    lead > MSR_MAX_TRACK_LEN * 8 ||
+	    (len + 3) * bpc > MSR_MAX_TRACK_LEN * 8 - lead)
+		return LIBMSR_ERR_GENERIC;
+
+	switch (bpc) {
+	case 5:
+		r = msr_iso_encode_words (data, len, lead, track, 5);
+		break;
+	case 7:
+		r = msr_iso_encode_words (data, len, lead, track, 7);
+		break;
+	default:
+		r = msr_iso_encode_words (data, len, lead, track, bpc);
+		break;
+	}
+
+	if (r != LIBMSR_ERR_OK)
+		track->msr_tk_len = 0;
+
+	return r;
+}
+
+int msr_iso_encode (const msr_tracks_t *iso, msr_tracks_t *raw,
+    const msr_lz_t *lz)
+{
+	msr_track_t track;
+	size_t lead;
+	int i, r, ret = LIBMSR_ERR_OK;
+
+	for (i = 0; i < MSR_MAX_TRACKS; i++) {
+		lead = 0;
+		if (lz != NULL)
+			lead = (i == 1) ? lz->msr_lz_tk2 : lz->msr_lz_tk1_3;
+
+		/* Blank tracks stay blank. */
+		if (iso->msr_tracks[i].msr_tk_len == 0) {
+			raw->msr_tracks[i].msr_tk_len = 0;
+			continue;
+		}
+
+		/* Encode into track, so that iso and raw may be the same. */
+		r = msr_iso_encode_track (iso->msr_tracks[i].msr_tk_data,
+		    iso->msr_tracks[i].msr_tk_len, msr_iso_bpc[i], lead,
+		    &track);
+		if (r != LIBMSR_ERR_OK && ret != LIBMSR_ERR_GENERIC)
+			ret = r;
+
+		memcpy (raw->msr_tracks[i].msr_tk_data, track.msr_tk_data,
+		    track.msr_tk_len);
+		raw->msr_tracks[i].msr_tk_len = track.msr_tk_len;
+	}
+
+	return ret;
+}
+
+/*
+ * Bit-level track comparison.
+ *
+ * Tracks are loaded into zero-padded arrays of big-endian 64-bit words,
+ * so that bit 0 of a track is the top bit of its first word, as it is
+ * for msr_getbit(). Comparing at a shift is then a funnel shift of one
+ * array, an XOR and a popcount per word, in loops simple enough for the
+ * compiler to unroll and vectorize.
+ */
+#define MSR_DIFF_WORDS ((MSR_MAX_TRACK_LEN + 7) / 8)
+#define MSR_DIFF_PAD (MSR_DIFF_WORDS + 1) /* words on each side */
+
+static MSR_ALWAYS_INLINE unsigned msr_popcount64 (uint64_t x)
+{
+#if defined(__GNUC__) && defined(__POPCNT__)
+	return __builtin_popcountll (x);
+#else
+	x = x - ((x >> 1) & 0x5555555555555555ULL);
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+
+	return (x * 0x0101010101010101ULL) >> 56;
+#endif
+}
+
+/* Load a view into words, starting at word off of w. */
+static void msr_diff_load (uint64_t *w, size_t off, msr_track_view_t view)
+{
+	const uint8_t *p = view.msr_tv_data;
+	size_t i, n = view.msr_tv_len / 8;
+
+	/* Compilers turn this into a load and a byte swap. */
+	for (i = 0; i < n; i++, p += 8)
+		w[off + i] = (uint64_t) p[0] << 56 | (uint64_t) p[1] << 48 |
+		    (uint64_t) p[2] << 40 | (uint64_t) p[3] << 32 |
+		    (uint64_t) p[4] << 24 | (uint64_t) p[5] << 16 |
+		    (uint64_t) p[6] << 8 | p[7];
+
+	for (i = 0; i < view.msr_tv_len % 8; i++)
+		w[off + n] |= (uint64_t) p[i] << (56 - 8 * i);
+}
+
+/*
+ * The number of bits that differ between a's words and b's, shifted so
+ * that word k of a lines up with bit 64 * k + shift of b. Counting is
+ * given up, and limit returned, once it reaches limit; it's checked
+ * every few words, so that the inner loop stays simple.
+ */
+#define MSR_DIFF_BLOCK 4
+
+static size_t msr_diff_at (const uint64_t *a, const uint64_t *b,
+    size_t nwords, size_t shift, size_t limit)
+{
+	const uint64_t *p = b + shift / 64;
+	unsigned r = shift % 64;
+	size_t k, j, end, d = 0;
+
+	for (k = 0; k < nwords; k = end) {
+		end = k + MSR_DIFF_BLOCK < nwords ? k + MSR_DIFF_BLOCK : nwords;
+		if (r == 0) {
+			for (j = k; j < end; j++)
+				d += msr_popcount64 (a[j] ^ p[j]);
+		} else {
+			for (j = k; j < end; j++)
+				d += msr_popcount64 (a[j] ^
+				    ((p[j] << r) | (p[j + 1] >> (64 - r))));
+		}
+		if (d >= limit)
+			return limit;
+	}
+
+	return d;
+}
+
+int msr_track_diff (msr_track_view_t a, msr_track_view_t b, int max_shift,
+    msr_bitdiff_t *diff)
+{
+	/*
+	 * a sits MSR_DIFF_PAD words in, and b twice that, so that every
+	 * shift of b up to a whole track either way stays in bounds.
+	 */
+	uint64_t wa[MSR_DIFF_WORDS + 2 * MSR_DIFF_PAD];
+	uint64_t wb[MSR_DIFF_WORDS + 4 * MSR_DIFF_PAD + 1];
+	size_t nwords, lo, reach, d, best;
+	int s, i, bshift;
+
+	if (a.msr_tv_len > MSR_MAX_TRACK_LEN ||
+	    b.msr_tv_len > MSR_MAX_TRACK_LEN || max_shift < 0)
+		return LIBMSR_ERR_GENERIC;
+	if (max_shift > MSR_MAX_TRACK_LEN * 8)
+		max_shift = MSR_MAX_TRACK_LEN * 8;
+
+	memset (wa, 0, sizeof(wa));
+	memset (wb, 0, sizeof(wb));
+	msr_diff_load (wa, MSR_DIFF_PAD, a);
+	msr_diff_load (wb, 2 * MSR_DIFF_PAD, b);
+
+	/* Only the words that a, or b at some shift, can reach. */
+	reach = (max_shift + 63) / 64 + 1;
+	lo = MSR_DIFF_PAD - reach;
+	nwords = (a.msr_tv_len > b.msr_tv_len ? a.msr_tv_len :
+	    b.msr_tv_len) / 8 + 1 + 2 * reach;
+
+	best = (size_t) -1;
+	bshift = 0;
+	/* Try 0, 1, -1, 2, -2 and so on, so that ties go to small shifts. */
+	for (i = 0; i <= 2 * max_shift; i++) {
+		s = (i & 1) ? (i + 1) / 2 : -(i / 2);
+		d = msr_diff_at (wa + lo, wb + lo, nwords,
+		    MSR_DIFF_PAD * 64 + s, best);
+		if (d < best) {
+			best = d;
+			bshift = s;
+			if (d == 0)
+				break;
+		}
+	}
+
+	diff->msr_bd_distance = best;
+	diff->msr_bd_shift = bshift;
+
+	return LIBMSR_ERR_OK;
+}
+
 /* Some cards require a swipe in the opposite direction of the reader. */
 /* We can get the expected bit stream by reversing the data in place. */
 int msr_reverse_tracks (msr_tracks_t * tracks)
@@ -139,100 +1231,242 @@ int msr_reverse_tracks (msr_tracks_t * tracks)
 	return LIBMSR_ERR_OK;
 }
 
+/*
+ * Reverse the bits of a 64-bit word: flip the bits within each byte,
+ * then reverse the byte order. The byte swap reverses the bytes' order
+ * in memory whatever the host's endianness, so the word can be loaded
+ * and stored with plain memcpy().
+ */
+static uint64_t msr_bitrev64 (uint64_t x)
+{
+	x = ((x >> 1) & 0x5555555555555555ULL) |
+	    ((x & 0x5555555555555555ULL) << 1);
+	x = ((x >> 2) & 0x3333333333333333ULL) |
+	    ((x & 0x3333333333333333ULL) << 2);
+	x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) |
+	    ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+	x = ((x >> 8) & 0x00FF00FF00FF00FFULL) |
+	    ((x & 0x00FF00FF00FF00FFULL) << 8);
+	x = ((x >> 16) & 0x0000FFFF0000FFFFULL) |
+	    ((x & 0x0000FFFF0000FFFFULL) << 16);
+
+	return (x >> 32) | (x << 32);
+}
+
 /* We want to take a track and reverse the order of each byte. */
 /* Additionally, we want to flip each byte. */
 int msr_reverse_track (msr_track_t * track)
 {
-	int i;
-	int bytes_to_shuffle;
-	char first_byte;
-	char last_byte;
-	unsigned char * head;
-	unsigned char * tail;
-
-	/* First we need to know the size of the track */
-	bytes_to_shuffle = track->msr_tk_len;
-
-	/* Then we need to read each byte from a track */
-	for (i=0; i <= bytes_to_shuffle / 2; i++) {
-		head = &track->msr_tk_data[i];
-		tail = &track->msr_tk_data[(bytes_to_shuffle -1) -i];
-		/* Reverse the full track byte order */
-		first_byte = msr_reverse_byte(*head);
-		last_byte = msr_reverse_byte(*tail);
-		/* Reverse the byte order */
-		*head = last_byte;
-		*tail = first_byte;
+	uint8_t * head;
+	uint8_t * tail;
+	uint64_t first, last;
+	uint8_t b;
+
+	head = track->msr_tk_data;
+	tail = head + track->msr_tk_len;
+
+	/* Swap and flip eight bytes from each end at a time... */
+	while (tail - head >= 16) {
+		memcpy (&first, head, 8);
+		memcpy (&last, tail - 8, 8);
+		first = msr_bitrev64 (first);
+		last = msr_bitrev64 (last);
+		memcpy (head, &last, 8);
+		memcpy (tail - 8, &first, 8);
+		head += 8;
+		tail -= 8;
 	}
 
+	/* ...then a byte at a time... */
+	while (tail - head >= 2) {
+		tail--;
+		b = msr_bitrev[*head];
+		*head = msr_bitrev[*tail];
+		*tail = b;
+		head++;
+	}
+
+	/* ...and flip the middle byte of an odd-length track in place. */
+	if (head < tail)
+		*head = msr_bitrev[*head];
+
 	return LIBMSR_ERR_OK;
 }
 
-/* Take a track structure and write it as hex bytes. */
-void msr_pretty_output_hex(int fd, msr_tracks_t tracks)
+static void fmt_hex_bytes(struct msr_fmt *f, const uint8_t *buf, size_t len)
+{
+	char hex[3];
+	size_t x;
+
+	hex[2] = ' ';
+	for (x = 0; x < len; x++) {
+		hex[0] = msr_hexdigits[buf[x] >> 4];
+		hex[1] = msr_hexdigits[buf[x] & 0xF];
+		fmt_put(f, hex, 3);
+	}
+}
+
+static void fmt_hex(struct msr_fmt *f, const msr_tracks_t *tracks)
 {
 	int tn;
+
 	for (tn = 0; tn < MSR_MAX_TRACKS; tn++) {
-		int x;
-		dprintf(fd, "Track %d: \n", tn + 1);
-		for (x = 0; x < tracks.msr_tracks[tn].msr_tk_len; x++) {
-			dprintf(fd, "%02x ", tracks.msr_tracks[tn].msr_tk_data[x]);
-		}
-		dprintf(fd, "\n");
+		fmt_track_label(f, tn);
+		fmt_hex_bytes(f, tracks->msr_tracks[tn].msr_tk_data,
+		    tracks->msr_tracks[tn].msr_tk_len);
+		fmt_put(f, "\n", 1);
 	}
 }
 
-/* Take a track structure and write it as a string. */
-void msr_pretty_output_string(int fd, msr_tracks_t tracks)
+/*
+ * Track data isn't necessarily NUL-terminated, so stop at the end of the
+ * track if we don't find one first.
+ */
+static void fmt_string(struct msr_fmt *f, const msr_tracks_t *tracks)
 {
+	const msr_track_t *tk;
+	const uint8_t *nul;
 	int tn;
+
 	for (tn = 0; tn < MSR_MAX_TRACKS; tn++) {
-		if (tracks.msr_tracks[tn].msr_tk_len) {
-			dprintf(fd, "Track %d: \n[%s]\n", tn + 1,
-				tracks.msr_tracks[tn].msr_tk_data);
+		tk = &tracks->msr_tracks[tn];
+		if (tk->msr_tk_len) {
+			nul = memchr(tk->msr_tk_data, '\0', tk->msr_tk_len);
+			fmt_track_label(f, tn);
+			fmt_put(f, "[", 1);
+			fmt_put(f, (const char *) tk->msr_tk_data, nul ?
+			    (size_t) (nul - tk->msr_tk_data) : tk->msr_tk_len);
+			fmt_put(f, "]\n", 2);
 		}
 	}
 }
 
-/* Take a track structure and write it as bits. */
-void msr_pretty_output_bits(int fd, msr_tracks_t tracks)
+static void fmt_tracks_bits(struct msr_fmt *f, const msr_tracks_t *tracks)
 {
 	int tn;
+
 	for (tn = 0; tn < MSR_MAX_TRACKS; tn++) {
-		dprintf(fd, "Track %d: \n", tn + 1);
-		output_bits(fd, tracks.msr_tracks[tn].msr_tk_data,
-			tracks.msr_tracks[tn].msr_tk_len);
+		fmt_track_label(f, tn);
+		fmt_bits(f, tracks->msr_tracks[tn].msr_tk_data,
+		    tracks->msr_tracks[tn].msr_tk_len);
+		fmt_put(f, "\n", 1);
 	}
 }
 
+int msr_format_hex(char *buf, size_t size, const msr_tracks_t *tracks)
+{
+	struct msr_fmt f = { buf, size, 0 };
+
+	fmt_hex(&f, tracks);
+	return fmt_finish(&f);
+}
+
+int msr_format_string(char *buf, size_t size, const msr_tracks_t *tracks)
+{
+	struct msr_fmt f = { buf, size, 0 };
+
+	fmt_string(&f, tracks);
+	return fmt_finish(&f);
+}
+
+int msr_format_bits(char *buf, size_t size, const msr_tracks_t *tracks)
+{
+	struct msr_fmt f = { buf, size, 0 };
+
+	fmt_tracks_bits(&f, tracks);
+	return fmt_finish(&f);
+}
+
+int msr_format_view_hex(char *buf, size_t size, msr_track_view_t view)
+{
+	struct msr_fmt f = { buf, size, 0 };
+
+	fmt_hex_bytes(&f, view.msr_tv_data, view.msr_tv_len);
+	return fmt_finish(&f);
+}
+
+int msr_format_view_bits(char *buf, size_t size, msr_track_view_t view)
+{
+	struct msr_fmt f = { buf, size, 0 };
+
+	fmt_bits(&f, view.msr_tv_data, view.msr_tv_len);
+	return fmt_finish(&f);
+}
+
+/* Take a track structure and write it as hex bytes. */
+void msr_pretty_output_hex_ptr(int fd, const msr_tracks_t *tracks)
+{
+	char out[MSR_FORMAT_HEX_MAX];
+
+	write_all(fd, out, msr_format_hex(out, sizeof(out), tracks));
+}
+
+/* Take a track structure and write it as a string. */
+void msr_pretty_output_string_ptr(int fd, const msr_tracks_t *tracks)
+{
+	char out[MSR_FORMAT_STRING_MAX];
+
+	write_all(fd, out, msr_format_string(out, sizeof(out), tracks));
+}
+
+/* Take a track structure and write it as bits. */
+void msr_pretty_output_bits_ptr(int fd, const msr_tracks_t *tracks)
+{
+	char out[MSR_FORMAT_BITS_MAX];
+
+	write_all(fd, out, msr_format_bits(out, sizeof(out), tracks));
+}
+
+void msr_pretty_output_hex(int fd, msr_tracks_t tracks)
+{
+	msr_pretty_output_hex_ptr(fd, &tracks);
+}
+
+void msr_pretty_output_string(int fd, msr_tracks_t tracks)
+{
+	msr_pretty_output_string_ptr(fd, &tracks);
+}
+
+void msr_pretty_output_bits(int fd, msr_tracks_t tracks)
+{
+	msr_pretty_output_bits_ptr(fd, &tracks);
+}
+
 /* Take a track structure and print it as hex bytes. */
-void msr_pretty_printer_hex (msr_tracks_t tracks)
+void msr_pretty_printer_hex_ptr (const msr_tracks_t *tracks)
 {
-	msr_pretty_output_hex(1, tracks);
+	msr_pretty_output_hex_ptr(1, tracks);
 }
 
 /* Take a track structure and print it as a string. */
-void msr_pretty_printer_string (msr_tracks_t tracks)
+void msr_pretty_printer_string_ptr (const msr_tracks_t *tracks)
 {
-	msr_pretty_output_string(1, tracks);
+	msr_pretty_output_string_ptr(1, tracks);
 }
 
 /* Take a track structure and print it as bits. */
+void msr_pretty_printer_bits_ptr (const msr_tracks_t *tracks)
+{
+	msr_pretty_output_bits_ptr(1, tracks);
+}
+
+void msr_pretty_printer_hex (msr_tracks_t tracks)
+{
+	msr_pretty_output_hex_ptr(1, &tracks);
+}
+
+void msr_pretty_printer_string (msr_tracks_t tracks)
+{
+	msr_pretty_output_string_ptr(1, &tracks);
+}
+
 void msr_pretty_printer_bits(msr_tracks_t tracks)
 {
-	msr_pretty_output_bits(1, tracks);
+	msr_pretty_output_bits_ptr(1, &tracks);
 }
 
 /* Reverse a byte. */
 const unsigned char msr_reverse_byte(const unsigned char byte)
 {
-	return
-	((byte & 1<<7) >> 7) |
-	((byte & 1<<6) >> 5) |
-	((byte & 1<<5) >> 3) |
-	((byte & 1<<4) >> 1) |
-	((byte & 1<<3) << 1) |
-	((byte & 1<<2) << 3) |
-	((byte & 1<<1) << 5) |
-	((byte & 1<<0) << 7);
+	return msr_bitrev[byte];
 }
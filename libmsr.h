@@ -30,6 +30,17 @@
  */
 #define LIBMSR_ERR_SERIAL 0x4000
 
+/**
+ * Returned when serial I/O did not complete before its deadline.
+ */
+#define LIBMSR_ERR_TIMEOUT 0x4100
+
+/**
+ * Returned when serial I/O was canceled through the fd's cancellation fd.
+ * @see msr_serial_set_cancel_fd()
+ */
+#define LIBMSR_ERR_CANCELED 0x4200
+
 /**
  * The maximum length, in bytes, of a track.
  */
@@ -418,6 +429,174 @@ typedef struct msr_tracks {
 	msr_track_t	msr_tracks[MSR_MAX_TRACKS]; /** The array of tracks */
 } msr_tracks_t;
 
+/**
+ * @brief A read-only view of track data held elsewhere.
+ * @details Views let track data be formatted, decoded and hashed in
+ * place, without copying it into a ::msr_track_t. The viewed data must
+ * outlive the view.
+ */
+typedef struct msr_track_view {
+	const uint8_t	*msr_tv_data; /**< The track data */
+	size_t		msr_tv_len; /**< The track length */
+} msr_track_view_t;
+
+/**
+ * @brief Receive counters for a serial connection.
+ * @details Bytes are read from the device in bursts and handed out from a
+ * per-fd buffer, so a single read(2) usually serves many bytes. The
+ * "saved" counters are the number of read(2) calls avoided compared to
+ * reading one byte at a time. The msr_cmd_* counters cover only the bytes
+ * received since the last write to the device, i.e. the current command.
+ *
+ * @see msr_serial_stats()
+ */
+typedef struct msr_serial_stats {
+	uint64_t msr_rx_bytes; /**< Bytes delivered to callers */
+	uint64_t msr_rx_reads; /**< read(2) calls that returned data */
+	uint64_t msr_rx_saved; /**< read(2) calls avoided */
+	uint64_t msr_cmd_bytes; /**< Bytes delivered for the current command */
+	uint64_t msr_cmd_reads; /**< read(2) calls for the current command */
+	uint64_t msr_cmd_saved; /**< read(2) calls avoided for the current command */
+} msr_serial_stats_t;
+
+/**
+ * @brief A link to an MSR device.
+ * @details libmsr talks to devices through file descriptors, which it
+ * reads and writes through the transport they were opened with (see
+ * msr_transport_open()). Descriptors opened some other way use
+ * ::msr_transport_serial.
+ *
+ * Every operation gets the descriptor and the state stored by
+ * msr_tr_open. The read, write and wait operations behave like read(2),
+ * write(2) and poll(2) on a non-blocking descriptor: read returns -1 with
+ * errno set to EAGAIN when nothing is available, and write may write
+ * less than asked.
+ *
+ * A transport whose descriptor is not a real device must still hand out
+ * a descriptor that stays open until msr_tr_close. It keeps the
+ * descriptor unique, and can be polled by msr_loop_t.
+ */
+typedef struct msr_transport {
+	const char *msr_tr_name; /**< The transport's name */
+	/**
+	 * Open a link, returning its descriptor, or -1 with errno set. The
+	 * meaning of path, flags and baud is up to the transport.
+	 */
+	int (*msr_tr_open)(const char *path, int flags, speed_t baud,
+	    void **priv);
+	/** Read up to len bytes: the count, 0 at end of file, or -1. */
+	ssize_t (*msr_tr_read)(int fd, void *priv, void *buf, size_t len);
+	/** Write up to len bytes: the count, or -1. */
+	ssize_t (*msr_tr_write)(int fd, void *priv, const void *buf,
+	    size_t len);
+	/**
+	 * Wait up to timeout ms (-1: forever) for events (POLLIN or
+	 * POLLOUT). Returns 1 when ready, 0 on timeout, or -1 with errno
+	 * set; ECANCELED means cancelfd (if not -1) became readable first.
+	 */
+	int (*msr_tr_wait)(int fd, void *priv, int events, int cancelfd,
+	    int timeout);
+	/** Discard received data. May be NULL. */
+	int (*msr_tr_flush)(int fd, void *priv);
+	/** Close the link and free priv. */
+	int (*msr_tr_close)(int fd, void *priv);
+} msr_transport_t;
+
+/** A serial port, through termios. The path names the tty. */
+extern const msr_transport_t msr_transport_serial;
+
+/**
+ * An in-memory loopback. The descriptor is an eventfd(2) that is
+ * readable while there is data to read; nothing else touches the
+ * kernel. Bytes written are read back unless a device is attached with
+ * msr_loopback_attach(). The path, flags and baud are ignored.
+ */
+extern const msr_transport_t msr_transport_loopback;
+
+/**
+ * Replay of a recording. Reads return the contents of the file named by
+ * the path, as if the device had sent them, and writes are discarded.
+ */
+extern const msr_transport_t msr_transport_file;
+
+/**
+ * A Unix domain stream socket, connected to the path. flags may include
+ * O_NONBLOCK, which applies once the connection is made.
+ */
+extern const msr_transport_t msr_transport_unix;
+
+/**
+ * @brief Open a connection to an MSR device over a transport.
+ * @details The returned descriptor can be used with every function
+ * that takes one, and must be closed with msr_serial_close().
+ *
+ * @param tr The transport (e.g., ::msr_transport_serial).
+ * @param path The device to open, as the transport understands it.
+ * @param fd The int pointer to store the descriptor in.
+ * @param flags Flags for the transport (e.g., ::MSR_BLOCKING).
+ * @param baud The baud rate, for transports that have one.
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_SERIAL if the transport could not open the device
+ * @return ::LIBMSR_ERR_GENERIC on failure
+ */
+extern int msr_transport_open(const msr_transport_t *tr, const char *path,
+    int *fd, int flags, speed_t baud);
+
+/**
+ * @brief Get the transport of a connection.
+ *
+ * @param fd The descriptor.
+ * @param tr A pointer to store the transport in.
+ * @param priv A pointer to store the transport's state in.
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_GENERIC on failure
+ */
+extern int msr_transport_get(int fd, const msr_transport_t **tr,
+    void **priv);
+
+/*
+ * Transport operations on plain descriptors, with read(2), write(2),
+ * poll(2) and close(2), for building fd-based transports.
+ */
+extern ssize_t msr_fd_read(int fd, void *priv, void *buf, size_t len);
+extern ssize_t msr_fd_write(int fd, void *priv, const void *buf,
+    size_t len);
+extern int msr_fd_wait(int fd, void *priv, int events, int cancelfd,
+    int timeout);
+extern int msr_fd_close(int fd, void *priv);
+
+/**
+ * A device on the far end of a loopback: called with each write to the
+ * descriptor, it answers with msr_loopback_push().
+ */
+typedef void (*msr_loopback_cb)(int fd, const uint8_t *buf, size_t len,
+    void *cookie);
+
+/**
+ * @brief Attach a device to a loopback connection.
+ * @details Writes to the descriptor go to cb instead of being read back.
+ * cb runs on the writing thread, and may call msr_loopback_push().
+ *
+ * @param fd A descriptor opened with ::msr_transport_loopback.
+ * @param cb The device, or NULL to loop writes back again.
+ * @param cookie Passed to cb.
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_GENERIC if fd is not a loopback
+ */
+extern int msr_loopback_attach(int fd, msr_loopback_cb cb, void *cookie);
+
+/**
+ * @brief Send bytes from the device end of a loopback connection.
+ * @details This may be called from any thread.
+ *
+ * @param fd A descriptor opened with ::msr_transport_loopback.
+ * @param buf The bytes to queue for reading.
+ * @param len The number of bytes.
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_GENERIC if fd is not a loopback, or on failure
+ */
+extern int msr_loopback_push(int fd, const void *buf, size_t len);
+
 /**
  * @brief Open a serial connection to the MSR device.
  *
@@ -431,7 +610,25 @@ typedef struct msr_tracks {
 extern int msr_serial_open(char *path, int *fd, int blocking, speed_t baud);
 
 /**
- * @brief Close a serial connection to the MSR device.
+ * @brief Open a serial connection to the MSR device, with open(2) flags.
+ * @details Unlike msr_serial_open(), this does not force O_FSYNC, so
+ * writes to the device don't wait for synchronous completion. Pass
+ * ::MSR_BLOCKING (plus O_FSYNC, if wanted) in flags. This is
+ * msr_transport_open() with ::msr_transport_serial.
+ *
+ * @param path The path to the serial device.
+ * @param fd The int pointer to store the file descriptor in.
+ * @param flags Additional open(2) flags; O_RDWR is always added.
+ * @param baud The baud rate of the serial device (e.g., ::MSR_BAUD)
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_SERIAL on failure
+ */
+extern int msr_serial_open_flags(char *path, int *fd, int flags,
+    speed_t baud);
+
+/**
+ * @brief Close a connection to the MSR device.
+ * @details This closes the descriptor through its transport.
  *
  * @param fd The file descriptor to close.
  * @return ::LIBMSR_ERR_OK
@@ -440,34 +637,201 @@ extern int msr_serial_close(int fd);
 
 /**
  * @brief Read a single character from the MSR device.
+ * @details Characters are served from a per-fd receive buffer, which is
+ * refilled with everything the device has sent in a single read(2). When
+ * the buffer is empty, this blocks in poll(2) until the device sends
+ * something.
  *
  * @param fd The file descriptor to read from.
  * @param c A pointer to write the character into.
  *
- * @return The character read
+ * @return The number of characters read (1), 0 if the device hung up, or
+ * -1 on error (errno is ETIMEDOUT or ECANCELED if the operation timed out
+ * or was canceled)
  */
 extern int msr_serial_readchar(int fd, uint8_t *c);
 
+/**
+ * @brief Read a single character from the MSR device, with a deadline.
+ *
+ * @param fd The file descriptor to read from.
+ * @param c A pointer to write the character into.
+ * @param timeout The maximum time to wait, in milliseconds, or -1 to
+ * wait forever.
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_TIMEOUT if no character arrived in time
+ * @return ::LIBMSR_ERR_SERIAL on serial I/O failure
+ */
+extern int msr_serial_readchar_timeout(int fd, uint8_t *c, int timeout);
+
 /**
  * @brief Write a series of bytes to the MSR device.
+ * @details The whole buffer is written, waiting for room in the tty's
+ * output queue if necessary (up to the fd's operation timeout).
  *
  * @param fd The file descriptor to write to.
  * @param buf The buffer to write.
  * @param len The length of the buffer.
- * @return The number of bytes written, or -1 on error.
+ * @return The number of bytes written (len), or -1 on error.
  */
 extern int msr_serial_write(int fd, void *buf, size_t len);
 
 /**
  * @brief Read a series of bytes from the MSR device.
+ * @details This waits for as long as the fd's operation timeout allows.
  *
  * @param fd The file descriptor to read from.
  * @param buf The buffer to read into.
  * @param len The length of the buffer.
- * @return ::LIBMSR_ERR_OK
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_TIMEOUT if the operation timed out
+ * @return ::LIBMSR_ERR_CANCELED if the operation was canceled
+ * @return ::LIBMSR_ERR_SERIAL if the device hung up
+ * @see msr_serial_set_timeout()
  */
 extern int msr_serial_read(int fd, void *buf, size_t len);
 
+/**
+ * @brief Read a series of bytes from the MSR device, with a deadline.
+ * @details The deadline covers the whole read, not each byte. On timeout,
+ * the bytes received so far have been consumed and are left in buf.
+ *
+ * @param fd The file descriptor to read from.
+ * @param buf The buffer to read into.
+ * @param len The length of the buffer.
+ * @param timeout The maximum time to wait, in milliseconds, or -1 to
+ * wait forever.
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_TIMEOUT if the buffer was not filled in time
+ * @return ::LIBMSR_ERR_SERIAL on serial I/O failure
+ */
+extern int msr_serial_read_timeout(int fd, void *buf, size_t len,
+    int timeout);
+
+/**
+ * @brief Read whatever the MSR device has already sent, without waiting.
+ * @details Buffered bytes are returned first; if there are none, the fd
+ * is read once. This is meant for event loops that learn from epoll(7)
+ * or poll(2) that the fd is readable.
+ *
+ * @param fd The file descriptor to read from.
+ * @param buf The buffer to read into.
+ * @param len The size of the buffer.
+ * @return The number of bytes read, 0 if nothing was available, or -1
+ * on error or if the device hung up (errno is EPIPE)
+ */
+extern int msr_serial_read_avail(int fd, void *buf, size_t len);
+
+/**
+ * @brief Set the per-operation timeout for a serial connection.
+ * @details Every command sent to the device (i.e. every
+ * msr_serial_write()) starts a new operation. The reads made while
+ * processing its response share a single deadline, after which they fail
+ * with ::LIBMSR_ERR_TIMEOUT. This bounds how long any of the device
+ * commands (msr_iso_read(), msr_commtest(), msr_erase() and so on) can
+ * block. A timed out response may leave stray bytes behind, so callers
+ * should msr_serial_flush() or msr_init() before the next command.
+ *
+ * @param fd The file descriptor to configure.
+ * @param timeout The timeout in milliseconds, or -1 to wait forever
+ * (the default).
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_GENERIC on failure
+ */
+extern int msr_serial_set_timeout(int fd, int timeout);
+
+/**
+ * @brief Set a cancellation fd for a serial connection.
+ * @details While cancelfd is readable, any wait for data on fd fails
+ * with ::LIBMSR_ERR_CANCELED. Another thread cancels a blocked command
+ * by writing to a pipe (or eventfd) whose read end is cancelfd. The
+ * library never reads from cancelfd, so it stays signaled until the
+ * caller drains it.
+ *
+ * @param fd The file descriptor to configure.
+ * @param cancelfd The cancellation fd, or -1 to disable cancellation.
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_GENERIC on failure
+ */
+extern int msr_serial_set_cancel_fd(int fd, int cancelfd);
+
+/**
+ * @brief Switch a serial connection to or from the io_uring backend.
+ * @details With the io_uring backend, msr_serial_write() copies the data
+ * and queues the write without a system call, and returns at once. The
+ * queued writes of every io_uring connection on the calling thread go
+ * out together with the next read on any of them, which waits for the
+ * response in the same io_uring_enter(2) call. A failed write is
+ * reported by the next read or write on the connection.
+ *
+ * The backend is only available if libmsr was built with it (see the
+ * Makefile) and the kernel supports it (Linux 5.11 or later). A
+ * connection using it must only be used by one thread at a time, and
+ * the thread that queued writes must submit them (see msr_serial_drain()).
+ *
+ * @param fd The file descriptor to switch.
+ * @param on Non-zero to use io_uring, zero for the poll(2) backend.
+ * Switching off waits for queued writes to complete.
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_GENERIC if io_uring is unavailable, or fd doesn't
+ * use ::msr_transport_serial
+ * @return ::LIBMSR_ERR_SERIAL if a queued write failed
+ */
+extern int msr_serial_set_uring(int fd, int on);
+
+/**
+ * @brief Submit the calling thread's queued io_uring writes.
+ * @details This starts the writes without waiting for them to complete.
+ * It does nothing if libmsr was built without io_uring.
+ *
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_SERIAL on failure
+ */
+extern int msr_serial_submit(void);
+
+/**
+ * @brief Wait for a connection's queued writes to complete.
+ * @details Call this after a command that has no response, like
+ * ::MSR_CMD_RESET, if the device must see it before the next one. It
+ * does nothing on a connection that isn't using io_uring.
+ *
+ * @param fd The file descriptor.
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_SERIAL if a queued write failed
+ * @return ::LIBMSR_ERR_GENERIC on failure
+ */
+extern int msr_serial_drain(int fd);
+
+/**
+ * @brief Discard any received but unread data.
+ * @details Use this to resynchronize with the device after an operation
+ * times out or is canceled.
+ *
+ * @param fd The file descriptor to flush.
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_GENERIC on failure
+ */
+extern int msr_serial_flush(int fd);
+
+/**
+ * @brief Retrieve the receive counters for a serial connection.
+ *
+ * @param fd The file descriptor to query.
+ * @param stats A pointer to the ::msr_serial_stats_t to populate.
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_GENERIC on failure
+ */
+extern int msr_serial_stats(int fd, msr_serial_stats_t *stats);
+
+/**
+ * @brief Reset the receive counters for a serial connection.
+ *
+ * @param fd The file descriptor to reset.
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_GENERIC on failure
+ */
+extern int msr_serial_stats_reset(int fd);
+
 /**
  * @brief Get the MSR device's current leading-zero setting.
  * @details The leading-zero setting is used by the device to determine
@@ -497,16 +861,19 @@ extern int msr_commtest(int fd);
 
 /**
  * @brief Initialize the MSR device.
- * @details This function issues a reset command to the MSR206 device, and
- * then performs a communications diagnostic test. If the test
- * succeeds, another reset is issued to ready the device for a
- * read or write operation. Typically, msr_init() must be called
- * before any significant operation, including reading and writing
- * cards.
+ * @details This function resets the MSR206 device with msr_reset(),
+ * which waits until the device passes a communications diagnostic test,
+ * leaving it ready for a read or write operation. Typically, msr_init()
+ * must be called before any significant operation, including reading
+ * and writing cards. It also resynchronizes with a device after an
+ * operation times out or is canceled.
  *
  * @param fd The device's fd.
  * @return ::LIBMSR_ERR_OK on success.
  * @return ::LIBMSR_ERR_DEVICE on device failure.
+ * @return ::LIBMSR_ERR_TIMEOUT if the device didn't come back from the
+ * reset.
+ * @return ::LIBMSR_ERR_SERIAL on serial I/O failure.
  */
 extern int msr_init(int fd);
 
@@ -610,11 +977,17 @@ extern int msr_set_lo_co(int fd);
 /**
  * @brief Reset the MSR device.
  * @details This function issues an ::MSR_CMD_RESET command to reset the device.
- * This command does not return a status code. The routine pauses
- * for a tenth of a second to wait for the reset to complete.
+ * This command does not return a status code, and the device ignores
+ * what it is sent until the reset is complete, so the routine sends
+ * ::MSR_CMD_DIAG_COMM probes, with short timeouts, until one is
+ * answered. It gives up after a second. Any input left over from
+ * before the reset is discarded.
  *
  * @param fd The device's fd.
- * @return ::LIBMSR_ERR_OK.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_DEVICE if the device answered with garbage.
+ * @return ::LIBMSR_ERR_TIMEOUT if the device didn't answer in time.
+ * @return ::LIBMSR_ERR_SERIAL on serial I/O failure.
  */
 extern int msr_reset(int fd);
 
@@ -645,9 +1018,9 @@ extern int msr_iso_read(int fd, msr_tracks_t *tracks);
  * via the tracks argument. The data in the tracks must meet the
  * ISO requirements.
  *
- * After the write command is issued and the track data is written
- * to the device, the function will block until a status code is
- * read from the device.
+ * The command and all of the track data are sent to the device as a
+ * single frame, in one write. The function then blocks until a status
+ * code is read from the device.
  *
  * @param fd The device's fd.
  * @param tracks A pointer to the ::msr_tracks_t data to write.
@@ -687,9 +1060,9 @@ extern int msr_raw_read(int fd, msr_tracks_t *tracks);
  * to be written to the card, then supply a pointer to this structure
  * via the tracks argument. The data can be in any format.
  *
- * After the write command is issued and the track data is written
- * to the device, the function will block until a status code is
- * read from the device.
+ * The command and all of the track data are sent to the device as a
+ * single frame, in one write. The function then blocks until a status
+ * code is read from the device.
  *
  * Unlike the msr_iso_write() routine, this function bypasses the
  * MSR206's internal parser and writes the bit pattern represented
@@ -703,6 +1076,60 @@ extern int msr_raw_read(int fd, msr_tracks_t *tracks);
  */
 extern int msr_raw_write(int fd, msr_tracks_t *tracks);
 
+/**
+ * The size of the largest write command frame: the command, the start
+ * delimiter, each track with its delimiter and length, and the end
+ * delimiter.
+ */
+#define MSR_WRITE_FRAME_MAX \
+	(4 + MSR_MAX_TRACKS * (3 + MSR_MAX_TRACK_LEN) + 2)
+
+/**
+ * @brief A write command, framed for the wire.
+ * @details msr_iso_write() and msr_raw_write() build their frame and
+ * send it in one write. Building frames ahead of time with
+ * msr_frame_tracks(), and sending them with msr_frame_send(), lets a
+ * caller prepare the next card's frame while the device is busy.
+ */
+typedef struct msr_frame {
+	uint8_t	msr_fr_data[MSR_WRITE_FRAME_MAX]; /**< The frame's bytes */
+	size_t	msr_fr_len; /**< The frame's length */
+} msr_frame_t;
+
+/**
+ * @brief Frame a write command for a set of tracks.
+ *
+ * @param frame The frame to build.
+ * @param raw Non-zero for an ::MSR_CMD_RAW_WRITE, zero for an
+ * ::MSR_CMD_WRITE.
+ * @param tracks The tracks to write.
+ */
+extern void msr_frame_tracks(msr_frame_t *frame, int raw,
+    const msr_tracks_t *tracks);
+
+/**
+ * @brief Send a framed write command to the device.
+ * @details The device's status is read with msr_write_status(), once
+ * it has written the card.
+ *
+ * @param fd The device's fd.
+ * @param frame The frame to send.
+ * @return ::LIBMSR_ERR_OK on success.
+ * @return ::LIBMSR_ERR_SERIAL on serial I/O failure.
+ */
+extern int msr_frame_send(int fd, const msr_frame_t *frame);
+
+/**
+ * @brief Wait for the status of a write command.
+ *
+ * @param fd The device's fd.
+ * @return ::LIBMSR_ERR_OK if the card was written.
+ * @return ::LIBMSR_ERR_DEVICE on device failure.
+ * @return ::LIBMSR_ERR_SERIAL, ::LIBMSR_ERR_TIMEOUT or
+ * ::LIBMSR_ERR_CANCELED on serial I/O failure.
+ */
+extern int msr_write_status(int fd);
+
 /**
  * @brief Erase one or more tracks on a card.
  * @details This routine issues an ::MSR_CMD_ERASE command to the device to
@@ -750,9 +1177,8 @@ extern int msr_erase(int fd, uint8_t tracks);
  *
  * ::MSR_CMD_LED_OFF - turn all LEDs off
  *
- * After an LED control command is issued to the device, the
- * routine will pause for a tenth of a second to allow time for the
- * command to be processed and the LED to light up.
+ * The device doesn't answer LED control commands, so the routine
+ * returns as soon as the command has been sent.
  *
  * @param fd The device's fd.
  * @param led The LED to control.
@@ -793,6 +1219,376 @@ extern int msr_set_bpi(int fd, uint8_t bpi);
  */
 extern int msr_set_bpc(int fd, uint8_t bpc1, uint8_t bpc2, uint8_t bpc3);
 
+/**
+ * @brief Dump a buffer as a string of bits to stdout.
+ * @details Bits are printed most significant first, which is the order
+ * in which they are read off the card.
+ *
+ * @param buf The buffer to dump.
+ * @param len The length of the buffer.
+ * @return ::LIBMSR_ERR_OK
+ */
+extern int msr_dumpbits(uint8_t *buf, int len);
+
+/**
+ * @brief Get a single bit from a buffer.
+ * @details Bit 0 is the most significant bit of the first byte.
+ *
+ * @param buf The buffer to read from.
+ * @param len The length of the buffer.
+ * @param bit The index of the bit to read.
+ * @return The bit's value (0 or 1), or -1 if bit is out of range.
+ */
+extern int msr_getbit(uint8_t *buf, uint8_t len, int bit);
+
+/**
+ * @brief Set a single bit in a buffer.
+ * @details Bit 0 is the most significant bit of the first byte.
+ *
+ * @param buf The buffer to modify.
+ * @param len The length of the buffer.
+ * @param bit The index of the bit to set.
+ * @param val The bit's new value (zero or non-zero).
+ * @return ::LIBMSR_ERR_OK on success, or -1 if bit is out of range.
+ */
+extern int msr_setbit(uint8_t *buf, uint8_t len, int bit, int val);
+
+/**
+ * @brief Decode raw track data into characters.
+ * @details The input is split into characters of bpc bits each, least
+ * significant bit first. The high (parity) bit of each character is
+ * stripped and the remainder is mapped to ASCII: 5 and 6-bit characters
+ * are offset from '0', 7 and 8-bit characters from ' '.
+ *
+ * @param inbuf The raw track data.
+ * @param inlen The length of the raw track data.
+ * @param outbuf The buffer to write the characters to.
+ * @param outlen On input, the size of outbuf; on output, the number of
+ * characters decoded.
+ * @param bpc The number of bits per character, including parity.
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_GENERIC if outbuf was too small
+ */
+extern int msr_decode(uint8_t *inbuf, uint8_t inlen, uint8_t *outbuf,
+    uint8_t *outlen, int bpc);
+
+/**
+ * @brief Make a view of a track's data.
+ *
+ * @param track The track to view.
+ * @return A view of the track's data and length.
+ */
+extern msr_track_view_t msr_track_view(const msr_track_t *track);
+
+/**
+ * @brief Decode a view of raw track data into characters.
+ * @details This is msr_decode() for a ::msr_track_view_t, with
+ * size_t lengths.
+ *
+ * @param view The raw track data.
+ * @param outbuf The buffer to write the characters to.
+ * @param outlen On input, the size of outbuf; on output, the number of
+ * characters decoded.
+ * @param bpc The number of bits per character, between 1 and 8.
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_GENERIC if outbuf was too small (it is filled)
+ * or bpc is out of range
+ */
+extern int msr_decode_view(msr_track_view_t view, uint8_t *outbuf,
+    size_t *outlen, int bpc);
+
+/**
+ * @brief Hash a view of track data.
+ * @details The hash is 64-bit FNV-1a over the viewed bytes. It is
+ * stable across runs and hosts, so it can be used to spot repeated
+ * swipes, but it is not cryptographic.
+ *
+ * @param view The track data to hash.
+ * @return The hash of the data.
+ */
+extern uint64_t msr_track_hash(msr_track_view_t view);
+
+/**
+ * @brief How far apart two tracks are, bit for bit.
+ *
+ * @see msr_track_diff()
+ */
+typedef struct msr_bitdiff {
+	size_t	msr_bd_distance; /**< The number of bits that differ */
+	int	msr_bd_shift; /**< How far b is shifted from a, in bits */
+} msr_bitdiff_t;
+
+/**
+ * @brief Measure the Hamming distance between two tracks.
+ * @details Bit i of a is compared with bit i + shift of b, for every
+ * shift from -max_shift to max_shift, and the shift with the fewest
+ * differing bits wins (ties go to the smallest shift). Bits past either
+ * end of a track count as zeros, so a track compared with a copy that
+ * has more or fewer leading zeros is at distance 0, shifted by the
+ * difference. Passing the leading-zero count from msr_zeros() as
+ * max_shift tolerates the device writing a track's leading zeros
+ * differently.
+ *
+ * Tracks are compared 64 bits at a time, so this is cheap enough to run
+ * after every write.
+ *
+ * @param a The first track, at most ::MSR_MAX_TRACK_LEN bytes.
+ * @param b The second track, at most ::MSR_MAX_TRACK_LEN bytes.
+ * @param max_shift The largest shift to try, in bits.
+ * @param diff Where to store the distance and the best shift.
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_GENERIC if a track is too long or max_shift is
+ * negative
+ */
+extern int msr_track_diff(msr_track_view_t a, msr_track_view_t b,
+    int max_shift, msr_bitdiff_t *diff);
+
+/*
+ * Host-side ISO decoding.
+ */
+
+/** The track decoded cleanly. */
+#define MSR_ISO_OK 0
+/** The track has no set bits at all; it decodes to no characters. */
+#define MSR_ISO_BLANK 1
+/** No start sentinel was found. */
+#define MSR_ISO_NO_START 2
+/** The track ends before the end sentinel and LRC character. */
+#define MSR_ISO_NO_END 3
+/** At least one character has bad parity. */
+#define MSR_ISO_PARITY 4
+/** Every character's parity is good, but the LRC doesn't check. */
+#define MSR_ISO_LRC 5
+
+/**
+ * @brief What host-side ISO decoding made of a track.
+ * @details Characters are counted from the start sentinel (character 0)
+ * up to and including the LRC character.
+ *
+ * @see msr_iso_decode_view()
+ */
+typedef struct msr_iso_info {
+	int	msr_ii_status; /**< One of the MSR_ISO_* values */
+	size_t	msr_ii_start; /**< The bit offset of the start sentinel */
+	size_t	msr_ii_chars; /**< The number of characters read */
+	size_t	msr_ii_parity_errors; /**< Characters with bad parity */
+	size_t	msr_ii_bad; /**< The first character with bad parity */
+	uint8_t	msr_ii_lrc; /**< The data bits the LRC disagrees on */
+} msr_iso_info_t;
+
+/**
+ * @brief Decode a view of raw track data as an ISO 7811 track.
+ * @details This does on the host what the device's ISO mode does: it
+ * skips to the start sentinel ('%' for 7 and 8-bit characters, ';'
+ * otherwise), decodes characters up to the '?' end sentinel, and checks
+ * each character's odd parity and the LRC character that follows. The
+ * characters are mapped as by msr_decode_view(), and the output matches
+ * msr_iso_read()'s: the sentinels and LRC are left out.
+ *
+ * A track with no set bits is blank, which isn't an error.
+ *
+ * @param view The raw track data, as read by msr_raw_read().
+ * @param bpc The number of bits per character, parity included, between
+ * 5 and 8.
+ * @param outbuf The buffer to write the characters to.
+ * @param outlen On input, the size of outbuf; on output, the number of
+ * characters decoded (0 on failure).
+ * @param info Where to store the details, or NULL.
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_ISO if the track isn't valid ISO data
+ * @return ::LIBMSR_ERR_GENERIC if outbuf was too small or bpc is out of
+ * range
+ */
+extern int msr_iso_decode_view(msr_track_view_t view, int bpc,
+    uint8_t *outbuf, size_t *outlen, msr_iso_info_t *info);
+
+/**
+ * @brief Decode a raw read's tracks as ISO 7811 tracks.
+ * @details Track 1 is decoded with 7 bits per character and tracks 2
+ * and 3 with 5, as by msr_iso_decode_view(). This turns the result of
+ * one msr_raw_read() into what msr_iso_read() would have returned for
+ * the same swipe, so the raw bits can be kept without a second swipe.
+ * Tracks that fail to decode are left empty, and the others are still
+ * decoded. raw and iso may point to the same tracks.
+ *
+ * @param raw The tracks from msr_raw_read().
+ * @param iso The tracks to fill in.
+ * @param info An array of ::MSR_MAX_TRACKS ::msr_iso_info_t to fill in,
+ * or NULL.
+ * @return ::LIBMSR_ERR_OK if every track decoded or was blank
+ * @return ::LIBMSR_ERR_ISO if a track isn't valid ISO data
+ * @return ::LIBMSR_ERR_GENERIC if a track decoded to more than
+ * ::MSR_MAX_TRACK_LEN characters
+ */
+extern int msr_iso_decode(const msr_tracks_t *raw, msr_tracks_t *iso,
+    msr_iso_info_t *info);
+
+/**
+ * @brief The outcome of guessing how a raw track was recorded.
+ * @details The score is roughly the number of bits of evidence for the
+ * guess: one for each character with good parity, less four for each
+ * with bad parity, plus bpc - 1 if the LRC checks. The confidence, from
+ * 0 to 100, grows with the guess's lead over the next best one (and
+ * over no evidence at all), and is halved if the track doesn't decode
+ * cleanly. It rates the guess, not the data; see msr_tg_info for that.
+ *
+ * @see msr_analyze_view()
+ */
+typedef struct msr_track_guess {
+	int	msr_tg_bpc; /**< The bits per character, or 0 if blank */
+	int	msr_tg_reversed; /**< Whether the track was swiped backwards */
+	int	msr_tg_score; /**< The evidence for the guess */
+	int	msr_tg_confidence; /**< How sure the guess is, 0 to 100 */
+	msr_iso_info_t msr_tg_info; /**< The ISO decoding of the guess */
+} msr_track_guess_t;
+
+/**
+ * @brief Work out the direction and character size of a raw track, and
+ * decode it.
+ * @details The track is decoded by msr_iso_decode_view() both forwards
+ * and reversed, with 7, 5 and 8 bits per character, and each of the six
+ * candidates is scored on its sentinels, parity and LRC. The best one is
+ * decoded into outbuf. Ties go to forwards, then to 7, 5 and 8 bits in
+ * that order.
+ *
+ * @param view The raw track data, at most ::MSR_MAX_TRACK_LEN bytes.
+ * @param outbuf The buffer to write the characters to.
+ * @param outlen On input, the size of outbuf; on output, the number of
+ * characters decoded (0 on failure).
+ * @param guess Where to describe the best candidate.
+ * @return ::LIBMSR_ERR_OK if the best candidate decoded, or the track is
+ * blank
+ * @return ::LIBMSR_ERR_ISO if no candidate is valid ISO data
+ * @return ::LIBMSR_ERR_GENERIC if outbuf was too small or the track too
+ * long
+ */
+extern int msr_analyze_view(msr_track_view_t view, uint8_t *outbuf,
+    size_t *outlen, msr_track_guess_t *guess);
+
+/**
+ * @brief Work out the swipe direction and character sizes of a raw
+ * read, and decode it.
+ * @details This is msr_analyze_view() for a whole card, with one
+ * difference: a card is swiped in one direction, so the direction is
+ * chosen for all tracks at once, by their total score. Ties for track 1
+ * go to 7 bits per character and for tracks 2 and 3 to 5, as in ISO
+ * 7811. Tracks that fail to decode are left empty, as by
+ * msr_iso_decode(); raw and iso may point to the same tracks.
+ *
+ * @param raw The tracks from msr_raw_read().
+ * @param iso The tracks to fill in.
+ * @param guess An array of ::MSR_MAX_TRACKS ::msr_track_guess_t to fill
+ * in, or NULL.
+ * @return ::LIBMSR_ERR_OK if every track decoded or was blank
+ * @return ::LIBMSR_ERR_ISO if a track isn't valid ISO data either way
+ * @return ::LIBMSR_ERR_GENERIC if a track decoded to more than
+ * ::MSR_MAX_TRACK_LEN characters
+ */
+extern int msr_analyze_tracks(const msr_tracks_t *raw, msr_tracks_t *iso,
+    msr_track_guess_t *guess);
+
+/**
+ * @brief A single-bit error correction made to a raw track.
+ *
+ * @see msr_iso_correct_track()
+ */
+typedef struct msr_iso_fix {
+	int	msr_if_status; /**< The track's MSR_ISO_* status before */
+	int	msr_if_corrected; /**< Whether a bit was flipped */
+	size_t	msr_if_bit; /**< The flipped bit's offset in the track */
+	size_t	msr_if_char; /**< Its character, from the start sentinel */
+	int	msr_if_char_bit; /**< Its bit in the character; bpc - 1 is parity */
+} msr_iso_fix_t;
+
+/**
+ * @brief Correct a single flipped bit in a raw ISO track.
+ * @details One flipped bit fails its character's parity and, unless it
+ * is the parity bit, shows up as the matching bit of the LRC syndrome.
+ * When the track's only faults fit that pattern, the bit is flipped back
+ * in place, as long as the track then decodes cleanly with
+ * msr_iso_decode_view() and has nothing but zeros after its LRC
+ * character. Errors in the sentinels can't be located, and
+ * more than one error is left alone, along with the track.
+ *
+ * @param track The raw track, corrected in place.
+ * @param bpc The number of bits per character, parity included, between
+ * 5 and 8.
+ * @param fix Where to report the correction, or NULL.
+ * @return ::LIBMSR_ERR_OK if the track decodes cleanly, is blank, or
+ * was corrected (see msr_if_corrected)
+ * @return ::LIBMSR_ERR_ISO if the track has errors that can't be
+ * corrected
+ * @return ::LIBMSR_ERR_GENERIC if bpc is out of range or the track
+ * decodes to too many characters
+ */
+extern int msr_iso_correct_track(msr_track_t *track, int bpc,
+    msr_iso_fix_t *fix);
+
+/**
+ * @brief Decode a raw read's tracks as ISO 7811 tracks, correcting
+ * single-bit errors.
+ * @details This is msr_iso_decode(), with each track first corrected by
+ * msr_iso_correct_track(). The raw tracks are not changed; the
+ * corrections are reported in fix so that they can be logged.
+ *
+ * @param raw The tracks from msr_raw_read().
+ * @param iso The tracks to fill in.
+ * @param fix An array of ::MSR_MAX_TRACKS ::msr_iso_fix_t to fill in, or
+ * NULL.
+ * @return ::LIBMSR_ERR_OK if every track decoded, after correction, or
+ * was blank
+ * @return ::LIBMSR_ERR_ISO if a track has errors that can't be corrected
+ * @return ::LIBMSR_ERR_GENERIC if a track decoded to more than
+ * ::MSR_MAX_TRACK_LEN characters
+ */
+extern int msr_iso_decode_correct(const msr_tracks_t *raw,
+    msr_tracks_t *iso, msr_iso_fix_t *fix);
+
+/**
+ * @brief Encode characters as a raw ISO 7811 track.
+ * @details This is the inverse of msr_iso_decode_view(). The track gets
+ * lead zero bits, the start sentinel ('%' for 7 and 8-bit characters,
+ * ';' otherwise), the characters, the '?' end sentinel and the LRC
+ * character, each with odd parity, padded with zeros to a whole byte.
+ * The result can be written with msr_raw_write().
+ *
+ * Characters must be in the track's character set, from '0' to '?' for
+ * 5 and 6-bit characters or from ' ' to '_' for 7 and 8-bit ones, and
+ * not be sentinels ('%', ';' or '?').
+ *
+ * @param data The characters to encode, without sentinels.
+ * @param len The number of characters.
+ * @param bpc The number of bits per character, parity included, between
+ * 5 and 8.
+ * @param lead The number of leading zero bits.
+ * @param track The track to fill in.
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_ISO if a character can't be encoded
+ * @return ::LIBMSR_ERR_GENERIC if the result won't fit in a track or bpc
+ * is out of range
+ */
+extern int msr_iso_encode_track(const uint8_t *data, size_t len, int bpc,
+    size_t lead, msr_track_t *track);
+
+/**
+ * @brief Encode ISO tracks as raw tracks.
+ * @details Track 1 is encoded with 7 bits per character and tracks 2 and
+ * 3 with 5, by msr_iso_encode_track(), and empty tracks are left empty.
+ * msr_iso_decode() turns the result back into iso. Tracks that can't be
+ * encoded are left empty. iso and raw may point to the same tracks.
+ *
+ * @param iso The tracks to encode, as for msr_iso_write().
+ * @param raw The tracks to fill in.
+ * @param lz The leading zero bits for tracks 1 and 3 and for track 2, as
+ * from msr_zeros(), or NULL for none.
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_ISO if a track has a character that can't be
+ * encoded
+ * @return ::LIBMSR_ERR_GENERIC if a track won't fit
+ */
+extern int msr_iso_encode(const msr_tracks_t *iso, msr_tracks_t *raw,
+    const msr_lz_t *lz);
+
 /**
  * @brief Reverse a ::msr_tracks_t structure in-place.
  *
@@ -803,14 +1599,111 @@ extern int msr_reverse_tracks(msr_tracks_t *tracks);
 
 /**
  * @brief Reverse a ::msr_track_t structure in-place.
+ * @details The track's whole bitstream is reversed, as if the card had
+ * been swiped in the opposite direction: the byte order is reversed and
+ * the bits within each byte are flipped.
  *
  * @param track A point to the ::msr_track_t to reverse.
  * @return ::LIBMSR_ERR_OK
  */
 extern int msr_reverse_track(msr_track_t *track);
 
+/*
+ * Each track in the "pretty" formats below starts with a "Track N: \n"
+ * label, ten characters long.
+ */
+
+/**
+ * The size of a buffer that can hold any output of msr_format_hex(),
+ * including the terminating NUL.
+ */
+#define MSR_FORMAT_HEX_MAX \
+	(MSR_MAX_TRACKS * (10 + MSR_MAX_TRACK_LEN * 3 + 1) + 1)
+
+/**
+ * The size of a buffer that can hold any output of msr_format_string(),
+ * including the terminating NUL.
+ */
+#define MSR_FORMAT_STRING_MAX \
+	(MSR_MAX_TRACKS * (10 + 1 + MSR_MAX_TRACK_LEN + 2) + 1)
+
+/**
+ * The size of a buffer that can hold any output of msr_format_bits(),
+ * including the terminating NUL.
+ */
+#define MSR_FORMAT_BITS_MAX \
+	(MSR_MAX_TRACKS * (10 + MSR_MAX_TRACK_LEN * 8 + 1) + 1)
+
+/**
+ * @brief Format a "pretty" hexadecimal representation of tracks.
+ * @details This produces the same text as msr_pretty_output_hex(), with
+ * snprintf() semantics: at most size - 1 characters are stored, the
+ * result is always NUL-terminated (if size is non-zero), and the return
+ * value is the length the full text would have had.
+ *
+ * @param buf The buffer to format into.
+ * @param size The size of the buffer (see ::MSR_FORMAT_HEX_MAX).
+ * @param tracks The tracks to format.
+ * @return The length of the full text, excluding the terminating NUL.
+ */
+extern int msr_format_hex(char *buf, size_t size, const msr_tracks_t *tracks);
+
+/**
+ * @brief Format a "pretty" string representation of tracks.
+ * @details See msr_format_hex() for the buffer semantics. Each track's
+ * data ends at the track length or the first NUL, whichever comes first.
+ *
+ * @param buf The buffer to format into.
+ * @param size The size of the buffer (see ::MSR_FORMAT_STRING_MAX).
+ * @param tracks The tracks to format.
+ * @return The length of the full text, excluding the terminating NUL.
+ */
+extern int msr_format_string(char *buf, size_t size,
+    const msr_tracks_t *tracks);
+
+/**
+ * @brief Format a "pretty" binary representation of tracks.
+ * @details See msr_format_hex() for the buffer semantics.
+ *
+ * @param buf The buffer to format into.
+ * @param size The size of the buffer (see ::MSR_FORMAT_BITS_MAX).
+ * @param tracks The tracks to format.
+ * @return The length of the full text, excluding the terminating NUL.
+ */
+extern int msr_format_bits(char *buf, size_t size,
+    const msr_tracks_t *tracks);
+
+/**
+ * @brief Format a view of track data as hexadecimal.
+ * @details Each byte is written as two hex digits and a space, as in
+ * msr_format_hex(), with no label or newline. See msr_format_hex() for
+ * the buffer semantics.
+ *
+ * @param buf The buffer to format into.
+ * @param size The size of the buffer.
+ * @param view The track data to format.
+ * @return The length of the full text, excluding the terminating NUL.
+ */
+extern int msr_format_view_hex(char *buf, size_t size,
+    msr_track_view_t view);
+
+/**
+ * @brief Format a view of track data as bits.
+ * @details Each byte is written as eight '0' or '1' characters, most
+ * significant bit first, with no label or newline. See msr_format_hex()
+ * for the buffer semantics.
+ *
+ * @param buf The buffer to format into.
+ * @param size The size of the buffer.
+ * @param view The track data to format.
+ * @return The length of the full text, excluding the terminating NUL.
+ */
+extern int msr_format_view_bits(char *buf, size_t size,
+    msr_track_view_t view);
+
 /**
  * @brief Dump a "pretty" hexadecimal representation of tracks to a fd.
+ * @details The text is written with a single write(2).
  *
  * @param fd The fd to write to.
  * @param tracks The tracks to dump.
@@ -818,41 +1711,88 @@ extern int msr_reverse_track(msr_track_t *track);
 extern void msr_pretty_output_hex(int fd, msr_tracks_t tracks);
 
 /**
- * @brief Dump a "pretty" string representation of tracks to a fd.
+ * @brief Like msr_pretty_output_hex(), but without copying the tracks.
  *
  * @param fd The fd to write to.
  * @param tracks The tracks to dump.
  */
-extern void msr_pretty_output_string(int fd, msr_tracks_t tracks);
+extern void msr_pretty_output_hex_ptr(int fd, const msr_tracks_t *tracks);
 
 /**
- * @brief Dump a "pretty" binary representation of tracks to a fd.
+ * @brief Dump a "pretty" string representation of tracks to a fd.
+ * @details The text is written with a single write(2).
  *
  * @param fd The fd to write to.
  * @param tracks The tracks to dump.
  */
-extern void msr_pretty_output_bits(int fd, msr_tracks_t tracks);
+extern void msr_pretty_output_string(int fd, msr_tracks_t tracks);
 
 /**
- * @brief Dump a "pretty" hexadecimal representation of tracks to stdout.
+ * @brief Like msr_pretty_output_string(), but without copying the tracks.
  *
+ * @param fd The fd to write to.
  * @param tracks The tracks to dump.
  */
-extern void msr_pretty_printer_hex(msr_tracks_t tracks);
+extern void msr_pretty_output_string_ptr(int fd, const msr_tracks_t *tracks);
 
 /**
- * @brief Dump a "pretty" string representation of tracks to stdout.
+ * @brief Dump a "pretty" binary representation of tracks to a fd.
+ * @details The text is written with a single write(2).
  *
+ * @param fd The fd to write to.
  * @param tracks The tracks to dump.
  */
-extern void msr_pretty_printer_string(msr_tracks_t tracks);
+extern void msr_pretty_output_bits(int fd, msr_tracks_t tracks);
 
 /**
- * @brief Dump a "pretty" binary representation of tracks to stdout.
+ * @brief Like msr_pretty_output_bits(), but without copying the tracks.
  *
+ * @param fd The fd to write to.
  * @param tracks The tracks to dump.
  */
-extern void msr_pretty_printer_bits(msr_tracks_t tracks);
+extern void msr_pretty_output_bits_ptr(int fd, const msr_tracks_t *tracks);
+
+/**
+ * @brief Dump a "pretty" hexadecimal representation of tracks to stdout.
+ *
+ * @param tracks The tracks to dump.
+ */
+extern void msr_pretty_printer_hex(msr_tracks_t tracks);
+
+/**
+ * @brief Like msr_pretty_printer_hex(), but without copying the tracks.
+ *
+ * @param tracks The tracks to dump.
+ */
+extern void msr_pretty_printer_hex_ptr(const msr_tracks_t *tracks);
+
+/**
+ * @brief Dump a "pretty" string representation of tracks to stdout.
+ *
+ * @param tracks The tracks to dump.
+ */
+extern void msr_pretty_printer_string(msr_tracks_t tracks);
+
+/**
+ * @brief Like msr_pretty_printer_string(), but without copying the tracks.
+ *
+ * @param tracks The tracks to dump.
+ */
+extern void msr_pretty_printer_string_ptr(const msr_tracks_t *tracks);
+
+/**
+ * @brief Dump a "pretty" binary representation of tracks to stdout.
+ *
+ * @param tracks The tracks to dump.
+ */
+extern void msr_pretty_printer_bits(msr_tracks_t tracks);
+
+/**
+ * @brief Like msr_pretty_printer_bits(), but without copying the tracks.
+ *
+ * @param tracks The tracks to dump.
+ */
+extern void msr_pretty_printer_bits_ptr(const msr_tracks_t *tracks);
 
 /**
  * @brief Reverse a single byte.
@@ -861,3 +1801,829 @@ extern void msr_pretty_printer_bits(msr_tracks_t tracks);
  * @return The reversed byte.
  */
 extern const unsigned char msr_reverse_byte(const unsigned char byte);
+
+/*
+ * Device handles.
+ */
+
+/**
+ * @brief An open MSR device.
+ * @details A handle owns the device's fd and remembers the last-known
+ * coercivity, BPI and BPC settings, model and firmware revision.
+ * Configuration requests that match the remembered state are answered
+ * without talking to the device. Settings are forgotten when the device
+ * is reset or a configuration command fails.
+ *
+ * A handle may be shared between threads. Each command runs atomically:
+ * the msr_device_*() command functions run on the calling thread, and
+ * requests passed to msr_device_submit() run on the handle's worker
+ * thread, but never two at once.
+ */
+typedef struct msr_device msr_device_t;
+
+/**
+ * @brief Counters for the round trips a ::msr_device_t has made or saved.
+ */
+typedef struct msr_device_stats {
+	uint64_t msr_ds_issued; /**< Cacheable commands sent to the device */
+	uint64_t msr_ds_avoided; /**< Cacheable commands answered from cache */
+} msr_device_stats_t;
+
+/*
+ * Commands that can be queued on a ::msr_device_t, in
+ * ::msr_request_t's msr_rq_cmd.
+ */
+#define MSR_RQ_INIT		1 /**< msr_init() */
+#define MSR_RQ_RESET		2 /**< msr_reset() */
+#define MSR_RQ_COMMTEST		3 /**< msr_commtest() */
+#define MSR_RQ_RAM_TEST		4 /**< msr_ram_test() */
+#define MSR_RQ_SENSOR_TEST	5 /**< msr_sensor_test() */
+#define MSR_RQ_FWREV		6 /**< msr_fwrev() into msr_rq_buf */
+#define MSR_RQ_MODEL		7 /**< msr_model() into msr_rq_buf */
+#define MSR_RQ_GET_CO		8 /**< msr_get_co() */
+#define MSR_RQ_SET_HI_CO	9 /**< msr_set_hi_co() */
+#define MSR_RQ_SET_LO_CO	10 /**< msr_set_lo_co() */
+#define MSR_RQ_SET_BPI		11 /**< msr_set_bpi() with msr_rq_args[0] */
+#define MSR_RQ_SET_BPC		12 /**< msr_set_bpc() with msr_rq_args */
+#define MSR_RQ_FLASH_LED	13 /**< msr_flash_led() with msr_rq_args[0] */
+#define MSR_RQ_ISO_READ		14 /**< msr_iso_read() into msr_rq_tracks */
+#define MSR_RQ_ISO_WRITE	15 /**< msr_iso_write() of msr_rq_tracks */
+#define MSR_RQ_RAW_READ		16 /**< msr_raw_read() into msr_rq_tracks */
+#define MSR_RQ_RAW_WRITE	17 /**< msr_raw_write() of msr_rq_tracks */
+#define MSR_RQ_ERASE		18 /**< msr_erase() with msr_rq_args[0] */
+
+struct msr_request;
+
+/**
+ * A completion callback for a queued ::msr_request_t. It is called on
+ * the device's worker thread.
+ */
+typedef void (*msr_request_cb)(struct msr_request *req, void *cookie);
+
+/**
+ * @brief A command queued on a ::msr_device_t.
+ * @details The caller owns the request and must keep it alive until it
+ * completes. Fill in the command and its arguments, zeroing the rest,
+ * and pass it to msr_device_submit(). Completion is signaled either
+ * through msr_device_wait() (if msr_rq_done is NULL) or by calling
+ * msr_rq_done, which then owns the request.
+ */
+typedef struct msr_request {
+	int		msr_rq_cmd; /**< The command (e.g., ::MSR_RQ_ISO_READ) */
+	uint8_t		msr_rq_args[3]; /**< Byte arguments */
+	uint8_t		*msr_rq_buf; /**< Output buffer for text results */
+	msr_tracks_t	*msr_rq_tracks; /**< Tracks to read into or write */
+	msr_request_cb	msr_rq_done; /**< Completion callback, or NULL */
+	void		*msr_rq_cookie; /**< Passed to msr_rq_done */
+	int		msr_rq_result; /**< The command's return value */
+
+	/* Private to the device. */
+	int		msr_rq_state;
+	struct msr_request *msr_rq_next;
+} msr_request_t;
+
+/**
+ * @brief Open an MSR device and return a handle to it.
+ * @details The device is opened with msr_serial_open().
+ *
+ * @param path The path to the serial device.
+ * @param dev A pointer to store the new handle in.
+ * @param blocking The blocking flag (e.g., ::MSR_BLOCKING)
+ * @param baud The baud rate of the serial device (e.g., ::MSR_BAUD)
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_SERIAL if the device could not be opened
+ * @return ::LIBMSR_ERR_GENERIC if the handle could not be allocated
+ */
+extern int msr_device_open(char *path, msr_device_t **dev, int blocking,
+    speed_t baud);
+
+/**
+ * @brief Make a handle for an already-open serial fd.
+ * @details The handle takes ownership of the fd, which is closed by
+ * msr_device_close(). Nothing is assumed about the device's settings.
+ *
+ * @param fd The device's fd.
+ * @param dev A pointer to store the new handle in.
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_GENERIC if the handle could not be allocated
+ */
+extern int msr_device_attach(int fd, msr_device_t **dev);
+
+/**
+ * @brief Close a device and free its handle.
+ *
+ * @param dev The handle to close, or NULL.
+ * @return ::LIBMSR_ERR_OK
+ */
+extern int msr_device_close(msr_device_t *dev);
+
+/**
+ * @brief Get the fd a handle owns.
+ * @details The fd can be used with the msr_serial_*() functions. If it
+ * is used to change the device's settings directly, call
+ * msr_device_invalidate() afterwards.
+ *
+ * @param dev The device handle.
+ * @return The device's fd.
+ */
+extern int msr_device_fd(const msr_device_t *dev);
+
+/**
+ * @brief Forget a device's remembered settings.
+ * @details The next configuration request for each setting is sent to
+ * the device. The model and firmware revision are kept.
+ *
+ * @param dev The device handle.
+ */
+extern void msr_device_invalidate(msr_device_t *dev);
+
+/**
+ * @brief Get a device's round-trip counters.
+ *
+ * @param dev The device handle.
+ * @param stats A pointer to store the counters in.
+ */
+extern void msr_device_stats(msr_device_t *dev, msr_device_stats_t *stats);
+
+/**
+ * @brief Zero a device's round-trip counters.
+ *
+ * @param dev The device handle.
+ */
+extern void msr_device_stats_reset(msr_device_t *dev);
+
+/**
+ * @brief Start a device's worker thread.
+ * @details Requests can only be submitted while the worker is running.
+ *
+ * @param dev The device handle.
+ * @return ::LIBMSR_ERR_OK on success, or if the worker is already running
+ * @return ::LIBMSR_ERR_GENERIC if the thread could not be created
+ */
+extern int msr_device_start(msr_device_t *dev);
+
+/**
+ * @brief Stop a device's worker thread.
+ * @details Requests already queued are run first. msr_device_close()
+ * stops the worker.
+ *
+ * @param dev The device handle.
+ * @return ::LIBMSR_ERR_OK
+ */
+extern int msr_device_stop(msr_device_t *dev);
+
+/**
+ * @brief Queue a request on a device's worker thread.
+ * @details Commands that answer immediately (configuration, status and
+ * diagnostics other than the sensor test) are run before queued commands
+ * that wait for a card swipe, but never interrupt one in progress.
+ * Within each class, requests run in the order they were submitted.
+ *
+ * @param dev The device handle.
+ * @param req The request to queue.
+ * @return ::LIBMSR_ERR_OK if the request was queued
+ * @return ::LIBMSR_ERR_GENERIC if the worker is not running
+ */
+extern int msr_device_submit(msr_device_t *dev, msr_request_t *req);
+
+/**
+ * @brief Wait for a submitted request without a callback to complete.
+ *
+ * @param dev The device handle.
+ * @param req The request to wait for.
+ * @return The request's result.
+ */
+extern int msr_device_wait(msr_device_t *dev, msr_request_t *req);
+
+/**
+ * @brief Check whether a submitted request without a callback is done.
+ *
+ * @param dev The device handle.
+ * @param req The request to check.
+ * @return 1 if the request has completed, 0 otherwise.
+ */
+extern int msr_device_done(msr_device_t *dev, const msr_request_t *req);
+
+/**
+ * @brief msr_init() for a device handle.
+ * @details The device's remembered settings are forgotten.
+ */
+extern int msr_device_init(msr_device_t *dev);
+
+/**
+ * @brief msr_reset() for a device handle.
+ * @details The device's remembered settings are forgotten.
+ */
+extern int msr_device_reset(msr_device_t *dev);
+
+/**
+ * @brief msr_commtest() for a device handle.
+ */
+extern int msr_device_commtest(msr_device_t *dev);
+
+/**
+ * @brief msr_ram_test() for a device handle.
+ */
+extern int msr_device_ram_test(msr_device_t *dev);
+
+/**
+ * @brief msr_sensor_test() for a device handle.
+ */
+extern int msr_device_sensor_test(msr_device_t *dev);
+
+/**
+ * @brief msr_fwrev() for a device handle.
+ * @details The revision is only requested from the device once.
+ */
+extern int msr_device_fwrev(msr_device_t *dev, uint8_t *buf);
+
+/**
+ * @brief msr_model() for a device handle.
+ * @details The model is only requested from the device once.
+ */
+extern int msr_device_model(msr_device_t *dev, uint8_t *buf);
+
+/**
+ * @brief msr_get_co() for a device handle.
+ * @details If the coercivity is known, the device is not asked.
+ */
+extern int msr_device_get_co(msr_device_t *dev);
+
+/**
+ * @brief msr_set_hi_co() for a device handle.
+ * @details Nothing is sent if the device is known to be in hi-co mode.
+ */
+extern int msr_device_set_hi_co(msr_device_t *dev);
+
+/**
+ * @brief msr_set_lo_co() for a device handle.
+ * @details Nothing is sent if the device is known to be in lo-co mode.
+ */
+extern int msr_device_set_lo_co(msr_device_t *dev);
+
+/**
+ * @brief msr_set_bpi() for a device handle.
+ * @details Nothing is sent if the track the BPI value applies to is
+ * known to be set to it already.
+ */
+extern int msr_device_set_bpi(msr_device_t *dev, uint8_t bpi);
+
+/**
+ * @brief msr_set_bpc() for a device handle.
+ * @details Nothing is sent if all three tracks are known to be set to
+ * the requested values already.
+ */
+extern int msr_device_set_bpc(msr_device_t *dev, uint8_t bpc1, uint8_t bpc2,
+    uint8_t bpc3);
+
+/**
+ * @brief msr_iso_read() for a device handle.
+ */
+extern int msr_device_iso_read(msr_device_t *dev, msr_tracks_t *tracks);
+
+/**
+ * @brief msr_iso_write() for a device handle.
+ */
+extern int msr_device_iso_write(msr_device_t *dev, msr_tracks_t *tracks);
+
+/**
+ * @brief msr_raw_read() for a device handle.
+ */
+extern int msr_device_raw_read(msr_device_t *dev, msr_tracks_t *tracks);
+
+/**
+ * @brief msr_raw_write() for a device handle.
+ */
+extern int msr_device_raw_write(msr_device_t *dev, msr_tracks_t *tracks);
+
+/**
+ * @brief msr_erase() for a device handle.
+ */
+extern int msr_device_erase(msr_device_t *dev, uint8_t tracks);
+
+/**
+ * @brief msr_flash_led() for a device handle.
+ */
+extern int msr_device_flash_led(msr_device_t *dev, uint8_t led);
+
+/*
+ * Event loop.
+ */
+
+/**
+ * @brief An event loop that reads swipes from many devices on one thread.
+ * @details Each device added to the loop has a read command outstanding
+ * at all times. Responses are parsed incrementally as bytes arrive, and
+ * each completed swipe is delivered to the device's callback, after
+ * which the next read is issued. While a device is in a loop, it must
+ * not be used in any other way.
+ */
+typedef struct msr_loop msr_loop_t;
+
+/**
+ * A swipe callback for a device in a ::msr_loop_t.
+ *
+ * @param dev The device the swipe came from.
+ * @param result ::LIBMSR_ERR_OK if the device reported success,
+ * ::LIBMSR_ERR_DEVICE if it reported an error status, or a serial error
+ * if the device can no longer be read (it is then removed from the loop).
+ * @param tracks The tracks read, valid until the callback returns. Track
+ * contents follow msr_iso_read() or msr_raw_read().
+ * @param cookie The cookie given to msr_loop_add().
+ * @return 0 to keep reading from the device, or non-zero to remove it
+ * from the loop.
+ */
+typedef int (*msr_loop_cb)(msr_device_t *dev, int result,
+    const msr_tracks_t *tracks, void *cookie);
+
+/**
+ * @brief Create an event loop.
+ *
+ * @param loop A pointer to store the new loop in.
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_GENERIC on failure
+ */
+extern int msr_loop_new(msr_loop_t **loop);
+
+/**
+ * @brief Free an event loop.
+ * @details The loop's devices are not closed or reset.
+ *
+ * @param loop The loop to free, or NULL.
+ */
+extern void msr_loop_free(msr_loop_t *loop);
+
+/**
+ * @brief Start reading swipes from a device.
+ * @details A read command is sent to the device immediately.
+ *
+ * @param loop The event loop.
+ * @param dev The device to read from.
+ * @param raw Non-zero for raw reads (msr_raw_read()), zero for ISO
+ * reads (msr_iso_read()).
+ * @param cb The callback for each swipe.
+ * @param cookie Passed to cb.
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_SERIAL if the read command could not be sent
+ * @return ::LIBMSR_ERR_GENERIC if the device is already in the loop, or
+ * on failure
+ */
+extern int msr_loop_add(msr_loop_t *loop, msr_device_t *dev, int raw,
+    msr_loop_cb cb, void *cookie);
+
+/**
+ * @brief Stop reading swipes from a device.
+ * @details The outstanding read is abandoned by resetting the device
+ * with msr_reset(), which waits for the device to come back, and the
+ * handle's remembered settings are forgotten (see
+ * msr_device_invalidate()). This may be called from a callback.
+ *
+ * @param loop The event loop.
+ * @param dev The device to remove.
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_GENERIC if the device is not in the loop
+ * @return any error from msr_reset(), in which case the device is still
+ * removed
+ */
+extern int msr_loop_remove(msr_loop_t *loop, msr_device_t *dev);
+
+/**
+ * @brief Switch an event loop to or from io_uring.
+ * @details In io_uring mode, the loop reads through the calling thread's
+ * io_uring (see msr_serial_set_uring()) instead of epoll(7), and the read
+ * commands that follow each swipe are queued rather than written, going
+ * out together with the next msr_loop_run(). This saves several system
+ * calls per swipe when there are many devices. The loop must then be
+ * used from a single thread, and its devices are switched back to the
+ * poll(2) backend when they leave it.
+ *
+ * @param loop The event loop, which must have no devices.
+ * @param on Non-zero for io_uring, zero for epoll(7).
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_GENERIC if the loop has devices or io_uring is
+ * unavailable
+ */
+extern int msr_loop_set_uring(msr_loop_t *loop, int on);
+
+/**
+ * @brief Get the number of devices in an event loop.
+ *
+ * @param loop The event loop.
+ * @return The number of devices being read from.
+ */
+extern int msr_loop_devices(const msr_loop_t *loop);
+
+/**
+ * @brief Wait for input and handle it.
+ * @details This waits once in epoll_wait(2), or io_uring_enter(2) (see
+ * msr_loop_set_uring()), and handles everything that is ready, calling the callbacks for any swipes completed. Call it in a
+ * loop for as long as msr_loop_devices() is non-zero.
+ *
+ * @param loop The event loop.
+ * @param timeout The maximum time to wait, in milliseconds, or -1 to
+ * wait forever.
+ * @return ::LIBMSR_ERR_OK on success, including timeouts and interrupts
+ * @return ::LIBMSR_ERR_GENERIC if the wait failed
+ */
+extern int msr_loop_run(msr_loop_t *loop, int timeout);
+
+/*
+ * Capture journal.
+ */
+
+/** Journal record modes. */
+#define MSR_JOURNAL_ISO 0 /**< Tracks from msr_iso_read() */
+#define MSR_JOURNAL_RAW 1 /**< Tracks from msr_raw_read() */
+
+/**
+ * @brief A capture journal open for appending.
+ * @details A journal is an append-only file of swipes, each stored with a
+ * timestamp, a device id, the read mode and the tracks' bits per
+ * character. Tracks take only as much room as their data. A sidecar
+ * index (the journal's path with ".idx" added) holds the offset of each
+ * record, so that a ::msr_journal_map_t can find any record by number
+ * without reading the ones before it.
+ *
+ * Appending takes a single write(2). Index entries are written out in
+ * batches, and readers find records that aren't in the index yet by
+ * scanning, so the journal stays consistent after a crash. A torn
+ * record at the end is discarded by the next msr_journal_open(), which
+ * refuses to append if scanning finds a damaged record before a good
+ * one.
+ *
+ * Only one ::msr_journal_t may have a journal open at a time. It may be
+ * shared between threads.
+ */
+typedef struct msr_journal msr_journal_t;
+
+/**
+ * @brief A read-only mapping of a capture journal.
+ * @details The mapping covers the records present when it was made.
+ */
+typedef struct msr_journal_map msr_journal_map_t;
+
+/**
+ * @brief A journal record.
+ * @details The track views point into the journal mapping, and are
+ * valid until it is unmapped.
+ */
+typedef struct msr_journal_rec {
+	uint64_t msr_jr_time; /**< When the swipe was recorded, in ns since the epoch */
+	uint32_t msr_jr_device; /**< The device id given to msr_journal_append() */
+	uint8_t msr_jr_mode; /**< ::MSR_JOURNAL_ISO or ::MSR_JOURNAL_RAW */
+	uint8_t msr_jr_bpc[MSR_MAX_TRACKS]; /**< Bits per character of each track */
+	msr_track_view_t msr_jr_tracks[MSR_MAX_TRACKS]; /**< The track data */
+} msr_journal_rec_t;
+
+/**
+ * @brief Open a capture journal for appending, creating it if needed.
+ *
+ * @param path The journal's path.
+ * @param j A pointer to store the journal in.
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_GENERIC if the file is not a journal, if a damaged
+ * record is found before a good one (the file is left as it is, and can
+ * still be read with msr_journal_map()), or on failure
+ */
+extern int msr_journal_open(const char *path, msr_journal_t **j);
+
+/**
+ * @brief Append a swipe to a capture journal.
+ *
+ * @param j The journal.
+ * @param time The time of the swipe in ns since the epoch, or 0 for now.
+ * @param device An id for the device the swipe came from.
+ * @param mode ::MSR_JOURNAL_ISO or ::MSR_JOURNAL_RAW.
+ * @param bpc The bits per character of each track, or NULL if unknown.
+ * @param tracks The tracks to record.
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_GENERIC on failure, in which case nothing is
+ * recorded
+ */
+extern int msr_journal_append(msr_journal_t *j, uint64_t time,
+    uint32_t device, int mode, const uint8_t *bpc,
+    const msr_tracks_t *tracks);
+
+/**
+ * @brief Flush a capture journal to stable storage.
+ * @details This also writes out the pending index entries.
+ *
+ * @param j The journal.
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_GENERIC on failure
+ */
+extern int msr_journal_sync(msr_journal_t *j);
+
+/**
+ * @brief Close a capture journal.
+ *
+ * @param j The journal, or NULL.
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_GENERIC on failure
+ */
+extern int msr_journal_close(msr_journal_t *j);
+
+/**
+ * @brief Map a capture journal for reading.
+ * @details This can be done while the journal is being appended to.
+ * Records past the end of the index are found by scanning, which skips
+ * any damaged record and carries on with the good ones after it; a
+ * damaged record the index points to is still counted, but can't be
+ * looked up.
+ *
+ * @param path The journal's path.
+ * @param m A pointer to store the mapping in.
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_GENERIC if the file is not a journal, or on
+ * failure
+ */
+extern int msr_journal_map(const char *path, msr_journal_map_t **m);
+
+/**
+ * @brief Unmap a capture journal.
+ *
+ * @param m The mapping, or NULL.
+ */
+extern void msr_journal_unmap(msr_journal_map_t *m);
+
+/**
+ * @brief Get the number of records in a journal mapping.
+ *
+ * @param m The mapping.
+ * @return The number of records.
+ */
+extern size_t msr_journal_count(const msr_journal_map_t *m);
+
+/**
+ * @brief Look up a journal record by number.
+ * @details The record is not copied: its tracks point into the mapping.
+ *
+ * @param m The mapping.
+ * @param n The record number, from 0.
+ * @param rec The ::msr_journal_rec_t to populate.
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_GENERIC if there is no such record, or it is
+ * corrupt
+ */
+extern int msr_journal_get(const msr_journal_map_t *m, size_t n,
+    msr_journal_rec_t *rec);
+
+/*
+ * Batch decoding.
+ */
+
+/** The most characters msr_decode_view() can make of one track. */
+#define MSR_DECODE_MAX (MSR_MAX_TRACK_LEN * 8)
+
+/**
+ * @brief A decoded journal record, as given to a batch formatter.
+ */
+typedef struct msr_batch_rec {
+	size_t msr_br_index; /**< The record number */
+	const msr_journal_rec_t *msr_br_rec; /**< The record itself */
+	int msr_br_corrupt; /**< Non-zero if the record could not be read */
+	msr_track_view_t msr_br_tracks[MSR_MAX_TRACKS]; /**< Decoded characters */
+	int msr_br_result[MSR_MAX_TRACKS]; /**< msr_decode_view()'s result for each track */
+} msr_batch_rec_t;
+
+/**
+ * @brief Options for msr_batch_decode().
+ */
+typedef struct msr_batch {
+	int msr_bt_threads; /**< Worker threads, or 0 for one per CPU */
+	size_t msr_bt_chunk; /**< Records per chunk of work, or 0 for the default */
+	int msr_bt_bpc; /**< Decode raw tracks with this bpc, or 0 for the recorded one */
+	/**
+	 * Format a record into buf, which has room for size bytes, and
+	 * return the length of the output. If that is more than size, the
+	 * call is repeated with a larger buffer, as with snprintf(3). This
+	 * runs on the worker threads, concurrently. May be NULL.
+	 */
+	size_t (*msr_bt_format)(const msr_batch_rec_t *rec, char *buf,
+	    size_t size, void *cookie);
+	/**
+	 * Consume formatted output. This runs on the calling thread, and
+	 * sees the records' output in order. Return non-zero to stop.
+	 * May be NULL.
+	 */
+	int (*msr_bt_sink)(const void *buf, size_t len, void *cookie);
+	void *msr_bt_cookie; /**< Passed to msr_bt_format and msr_bt_sink */
+} msr_batch_t;
+
+/**
+ * @brief Counters from msr_batch_decode().
+ */
+typedef struct msr_batch_stats {
+	uint64_t msr_bs_records; /**< Records processed */
+	uint64_t msr_bs_errors; /**< Raw tracks that could not be decoded */
+	uint64_t msr_bs_corrupt; /**< Records that could not be read */
+	int msr_bs_threads; /**< Worker threads used */
+} msr_batch_stats_t;
+
+/**
+ * @brief Decode a range of journal records across many threads.
+ * @details Raw records are decoded with msr_decode_view(); ISO records
+ * are passed through as they are. The records are split into chunks
+ * that the worker threads take in turn, each formatting its chunk into
+ * a buffer of its own, and the buffers are passed to the sink in record
+ * order, so the output doesn't depend on the number of threads.
+ *
+ * @param m The journal mapping.
+ * @param first The first record to decode.
+ * @param count The number of records to decode; the range is clipped to
+ * the end of the journal.
+ * @param opts The options.
+ * @param stats The ::msr_batch_stats_t to populate, or NULL. It is
+ * cleared first, even if the call fails.
+ * @return ::LIBMSR_ERR_OK on success
+ * @return ::LIBMSR_ERR_GENERIC if the sink stopped the run, or on failure
+ */
+extern int msr_batch_decode(const msr_journal_map_t *m, size_t first,
+    size_t count, const msr_batch_t *opts, msr_batch_stats_t *stats);
+
+/*
+ * Response parser.
+ */
+
+/* Event types for a ::msr_parse_event_t. */
+#define MSR_PE_TRACK_START	1 /**< A track's header was read */
+#define MSR_PE_TRACK_DATA	2 /**< A run of a track's data */
+#define MSR_PE_TRACK_END	3 /**< A track is complete */
+#define MSR_PE_STATUS		4 /**< The response is complete */
+
+/**
+ * @brief An event reported by a ::msr_parser_t.
+ */
+typedef struct msr_parse_event {
+	int		msr_pe_type; /**< The event type (e.g., ::MSR_PE_TRACK_DATA) */
+	int		msr_pe_track; /**< The track index, from 0 */
+	const uint8_t	*msr_pe_data; /**< Track data, for ::MSR_PE_TRACK_DATA */
+	size_t		msr_pe_len; /**< Data length, or the track's length for ::MSR_PE_TRACK_END */
+	int		msr_pe_result; /**< ::LIBMSR_ERR_DEVICE for a malformed track or error status */
+	uint8_t		msr_pe_status; /**< The device's status byte, for ::MSR_PE_STATUS */
+} msr_parse_event_t;
+
+struct msr_parser;
+
+/**
+ * An event callback for a ::msr_parser_t. Data pointers are only valid
+ * until the callback returns.
+ */
+typedef void (*msr_parse_cb)(struct msr_parser *p,
+    const msr_parse_event_t *ev, void *cookie);
+
+/**
+ * @brief A resumable parser for the response to a read command.
+ * @details Bytes of an ::MSR_CMD_READ or ::MSR_CMD_RAW_READ response can
+ * be pushed in chunks of any size, from any source (a serial port, a
+ * recorded trace, an event loop). The parser produces the same tracks as
+ * msr_iso_read() and msr_raw_read() would for the same bytes, and
+ * reports its progress as events. All of its state is in this
+ * structure, which holds no pointers of its own beyond the ones given
+ * to msr_parser_init(); the fields are private.
+ */
+typedef struct msr_parser {
+	int		msr_ps_raw;
+	int		msr_ps_state;
+	int		msr_ps_track;
+	int		msr_ps_tries;
+	int		msr_ps_pos;
+	int		msr_ps_kept;
+	int		msr_ps_need;
+	int		msr_ps_endlen;
+	int		msr_ps_result;
+	uint8_t		msr_ps_cap[MSR_MAX_TRACKS];
+	uint8_t		msr_ps_end[4];
+	msr_tracks_t	*msr_ps_tracks;
+	msr_parse_cb	msr_ps_cb;
+	void		*msr_ps_cookie;
+} msr_parser_t;
+
+/**
+ * @brief Prepare a parser for a new response.
+ *
+ * @param p The parser.
+ * @param raw Non-zero to parse a raw read response, zero for ISO.
+ * @param tracks Tracks to store the data in, or NULL. As with
+ * msr_iso_read(), each track's msr_tk_len must be set to the room
+ * available for it; on completion it holds the track's length.
+ * @param cb A callback for events, or NULL.
+ * @param cookie Passed to cb.
+ */
+extern void msr_parser_init(msr_parser_t *p, int raw, msr_tracks_t *tracks,
+    msr_parse_cb cb, void *cookie);
+
+/**
+ * @brief Push response bytes into a parser.
+ * @details Parsing stops at the end of the response. Any bytes after it
+ * are left unconsumed; they belong to whatever comes next.
+ *
+ * @param p The parser.
+ * @param buf The bytes to parse.
+ * @param len The number of bytes.
+ * @return The number of bytes consumed.
+ */
+extern size_t msr_parser_push(msr_parser_t *p, const void *buf, size_t len);
+
+/**
+ * @brief Check whether a parser has seen the whole response.
+ *
+ * @param p The parser.
+ * @return 1 if the response is complete, 0 otherwise.
+ */
+extern int msr_parser_done(const msr_parser_t *p);
+
+/**
+ * @brief Get the outcome of a complete response.
+ * @details Unlike msr_iso_read() and msr_raw_read(), which ignore it,
+ * this reports the status byte the device sent at the end.
+ *
+ * @param p The parser.
+ * @return ::LIBMSR_ERR_OK if the device reported success
+ * @return ::LIBMSR_ERR_DEVICE if it reported an error
+ * @return ::LIBMSR_ERR_GENERIC if the response isn't complete yet
+ */
+extern int msr_parser_result(const msr_parser_t *p);
+
+/*
+ * Card issuance.
+ */
+
+/**
+ * @brief A card to write and verify with msr_issue_run().
+ */
+typedef struct msr_issue_job {
+	const msr_tracks_t *msr_ij_tracks; /**< The tracks to write */
+	int	msr_ij_result; /**< ::LIBMSR_ERR_OK once verified */
+	int	msr_ij_writes; /**< The number of writes made */
+	size_t	msr_ij_distance; /**< Bits wrong in the last read-back */
+} msr_issue_job_t;
+
+/**
+ * A progress callback for msr_issue_run(), called after each card. A
+ * non-zero return stops the run.
+ */
+typedef int (*msr_issue_cb)(const msr_issue_job_t *job, void *cookie);
+
+/**
+ * @brief How msr_issue_run() writes and verifies cards.
+ */
+typedef struct msr_issue {
+	int		msr_iss_raw; /**< Non-zero for raw writes and reads */
+	int		msr_iss_retries; /**< Writes after the first, per card */
+	int		msr_iss_lookahead; /**< Frames to build ahead (0: 4) */
+	int		msr_iss_max_shift; /**< Raw read-back shift, in bits */
+	msr_issue_cb	msr_iss_progress; /**< Called after each card, or NULL */
+	void		*msr_iss_cookie; /**< Passed to msr_iss_progress */
+} msr_issue_t;
+
+/**
+ * @brief The throughput and yield of a msr_issue_run().
+ * @details The first-pass yield is the share of cards verified on
+ * their first write.
+ */
+typedef struct msr_issue_stats {
+	uint64_t msr_ist_cards; /**< Cards handled */
+	uint64_t msr_ist_verified; /**< Cards written and verified */
+	uint64_t msr_ist_first_pass; /**< Cards verified on the first write */
+	uint64_t msr_ist_writes; /**< Writes made, retries included */
+	uint64_t msr_ist_ns; /**< The run's duration, in nanoseconds */
+	uint64_t msr_ist_per_minute; /**< Verified cards per minute */
+	unsigned msr_ist_yield; /**< The first-pass yield, in percent */
+} msr_issue_stats_t;
+
+/**
+ * @brief Write and verify a queue of cards.
+ * @details Each card is written with msr_iso_write() or msr_raw_write()
+ * semantics, read back with msr_iso_read() or msr_raw_read(), and
+ * compared with what was written by msr_track_diff(). A card that fails
+ * to write, or reads back differently, is written again, up to
+ * msr_iss_retries times. Only the tracks with data are compared. Raw
+ * tracks may read back with trailing zeros, or with their leading zeros
+ * shifted by up to msr_iss_max_shift bits (see msr_zeros()). The number
+ * of bits that differed is kept in msr_ij_distance.
+ *
+ * Write frames are built with msr_frame_tracks() ahead of time: each
+ * card's frame is sent, then the frames for the following cards are
+ * built while the device writes, before the status is read.
+ *
+ * Stray bytes are flushed before each retry. A device that timed out
+ * (see msr_serial_set_timeout()) may still be busy with the write, so
+ * it is reset with msr_reset() before the card is retried. A card that
+ * still ends in a serial I/O failure stops the run, since the device
+ * can't be relied on after it.
+ *
+ * @param fd The device's fd.
+ * @param jobs The cards to write; their results are filled in.
+ * @param njobs The number of cards.
+ * @param opts How to write them.
+ * @param stats Where to store the run's statistics, or NULL.
+ * @return ::LIBMSR_ERR_OK if every card was verified
+ * @return ::LIBMSR_ERR_DEVICE if a card couldn't be verified
+ * @return ::LIBMSR_ERR_CANCELED if msr_iss_progress stopped the run
+ * @return ::LIBMSR_ERR_SERIAL, ::LIBMSR_ERR_TIMEOUT or
+ * ::LIBMSR_ERR_CANCELED on serial I/O failure
+ * @return ::LIBMSR_ERR_GENERIC on failure
+ */
+extern int msr_issue_run(int fd, msr_issue_job_t *jobs, size_t njobs,
+    const msr_issue_t *opts, msr_issue_stats_t *stats);
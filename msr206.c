@@ -1,4 +1,3 @@
-#include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -7,9 +6,16 @@
 #include <string.h>
 
 #include "libmsr.h"
+#include "msrint.h"
 
 /* Thanks Club Mate and h1kari! Toorcon 10 */
 
+/* Read one byte, honoring the fd's operation timeout and cancellation. */
+static int msr_getc (int fd, uint8_t *b)
+{
+	return msr_serial_read (fd, b, 1);
+}
+
 int msr_cmd (int fd, uint8_t c)
 {
 	msr_cmd_t	cmd;
@@ -20,10 +26,87 @@ int msr_cmd (int fd, uint8_t c)
 	return (msr_serial_write (fd, &cmd, sizeof(cmd)));
 }
 
+/* Send a command and its arguments in a single write. */
+static int msr_cmd_arg (int fd, uint8_t c, const void *arg, size_t len)
+{
+	uint8_t buf[8];
+
+	buf[0] = MSR_ESC;
+	buf[1] = c;
+	memcpy (&buf[2], arg, len);
+
+	return (msr_serial_write (fd, buf, 2 + len));
+}
+
+/*
+ * Frame a write command: the command, the start delimiter, each track
+ * (prefixed with its length for raw writes) and the end delimiter. The
+ * frame is sent with one write, rather than one per piece.
+ */
+void msr_frame_tracks (msr_frame_t *frame, int raw,
+    const msr_tracks_t *tracks)
+{
+	const msr_track_t *tk;
+	uint8_t *p = frame->msr_fr_data;
+	size_t n = 0;
+	int i;
+
+	p[n++] = MSR_ESC;
+	p[n++] = raw ? MSR_CMD_RAW_WRITE : MSR_CMD_WRITE;
+	p[n++] = MSR_ESC;
+	p[n++] = MSR_RW_START;
+
+	for (i = 0; i < MSR_MAX_TRACKS; i++) {
+		tk = &tracks->msr_tracks[i];
+		p[n++] = MSR_ESC; /* start delimiter */
+		p[n++] = i + 1; /* track number */
+		if (raw)
+			p[n++] = tk->msr_tk_len; /* data length */
+		memcpy (&p[n], tk->msr_tk_data, tk->msr_tk_len);
+		n += tk->msr_tk_len;
+	}
+
+	p[n++] = MSR_RW_END;
+	p[n++] = MSR_FS;
+
+	frame->msr_fr_len = n;
+}
+
+int msr_frame_send (int fd, const msr_frame_t *frame)
+{
+	/* msr_serial_write() only reads the buffer. */
+	if (msr_serial_write (fd, (void *) frame->msr_fr_data,
+	    frame->msr_fr_len) == -1)
+		return LIBMSR_ERR_SERIAL;
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_write_status (int fd)
+{
+	uint8_t buf[2];
+	int r;
+
+	if ((r = msr_serial_read(fd, buf, 2)) != LIBMSR_ERR_OK)
+		return r;
+
+	if (buf[1] != MSR_STS_OK) {
+#ifdef DEBUG
+		warnx("write failed: 0x%02x", buf[1]);
+#endif
+		return LIBMSR_ERR_DEVICE;
+	}
+
+	return LIBMSR_ERR_OK;
+}
+
 int msr_zeros (int fd, msr_lz_t *lz)
 {
+	int r;
+
 	msr_cmd (fd, MSR_CMD_CLZ);
-	msr_serial_read (fd, lz, sizeof(msr_lz_t));
+	if ((r = msr_serial_read (fd, lz, sizeof(msr_lz_t))) != LIBMSR_ERR_OK)
+		return r;
 
 #ifdef DEBUG
 	printf("zero13: %d zero: %d\n", lz->msr_lz_tk1_3, lz->msr_lz_tk2);
@@ -35,10 +118,11 @@ int msr_zeros (int fd, msr_lz_t *lz)
 static int getstart (int fd)
 {
 	uint8_t b;
-	int i;
+	int i, r;
 
 	for (i = 0; i < 3; i++) {
-		msr_serial_readchar(fd, &b);
+		if ((r = msr_getc (fd, &b)) != LIBMSR_ERR_OK)
+			return r;
 		if (b == MSR_RW_START)
 			break;
 	}
@@ -65,8 +149,10 @@ static int getstart (int fd)
 static int getend (int fd)
 {
 	msr_end_t m;
+	int r;
 
-	msr_serial_read (fd, &m, sizeof(m));
+	if ((r = msr_serial_read (fd, &m, sizeof(m))) != LIBMSR_ERR_OK)
+		return r;
 
 	if (m.msr_sts != MSR_STS_OK) {
 #ifdef DEBUG
@@ -101,7 +187,8 @@ int msr_commtest (int fd)
 	 */
 
 	while (1) {
-		msr_serial_readchar (fd, &buf[0]);
+		if ((r = msr_getc (fd, &buf[0])) != LIBMSR_ERR_OK)
+			return r;
 		if (buf[0] == MSR_STS_COMM_OK)
 			break;
 	}
@@ -118,14 +205,18 @@ int msr_commtest (int fd)
 
 int msr_fwrev (int fd, uint8_t *buf)
 {
+	int r;
+
 	if (msr_cmd (fd, MSR_CMD_FWREV) < 0)
             return LIBMSR_ERR_SERIAL;
 
-	msr_serial_readchar (fd, &buf[0]);
+	if ((r = msr_getc (fd, &buf[0])) != LIBMSR_ERR_OK)
+		return r;
 
 	/* read the result "REV?X.XX" */
 
-	msr_serial_read (fd, buf, 8);
+	if ((r = msr_serial_read (fd, buf, 8)) != LIBMSR_ERR_OK)
+		return r;
 	buf[8] = '\0';
 
 #ifdef DEBUG
@@ -138,12 +229,14 @@ int msr_fwrev (int fd, uint8_t *buf)
 int msr_model (int fd, uint8_t *buf)
 {
 	msr_model_t	m;
+	int r;
 
 	msr_cmd (fd, MSR_CMD_MODEL);
 
 	/* read the result as the value of X in "MSR206-X" */
 
-	msr_serial_read (fd, &m, sizeof(m));
+	if ((r = msr_serial_read (fd, &m, sizeof(m))) != LIBMSR_ERR_OK)
+		return r;
 
 	if (m.msr_s != MSR_STS_MODEL_OK)
 		return LIBMSR_ERR_DEVICE;
@@ -159,16 +252,13 @@ int msr_model (int fd, uint8_t *buf)
 
 int msr_flash_led (int fd, uint8_t led)
 {
-	struct timespec pause = { .tv_sec = 0, .tv_nsec = 100000000};
 	int r;
 
 	r = msr_cmd (fd, led);
 
-	if (r == -1)
+	if (r == -1 || msr_serial_drain (fd) != LIBMSR_ERR_OK)
 		return LIBMSR_ERR_SERIAL | LIBMSR_ERR_DEVICE;
 
-	nanosleep(&pause, NULL);
-
 	/* No response, look at the lights Dr. Love */
 	return LIBMSR_ERR_OK;
 }
@@ -178,23 +268,25 @@ static int gettrack_iso (int fd, int t, uint8_t * buf, uint8_t * len)
 	uint8_t b;
 	int i = 0;
 	int l = 0;
+	int r;
 
 	/* Start delimiter should be ESC <track number> */
 
-	msr_serial_readchar (fd, &b);
-	if (b != MSR_ESC) {
+	if ((r = msr_getc (fd, &b)) != LIBMSR_ERR_OK || b != MSR_ESC) {
 		*len = 0;
-		return LIBMSR_ERR_DEVICE;
+		return MSR_IO_ERR(r) ? r : LIBMSR_ERR_DEVICE;
 	}
 
-	msr_serial_readchar (fd, &b);
-	if (b != t) {
+	if ((r = msr_getc (fd, &b)) != LIBMSR_ERR_OK || b != t) {
 		*len = 0;
-		return LIBMSR_ERR_DEVICE;
+		return MSR_IO_ERR(r) ? r : LIBMSR_ERR_DEVICE;
 	}
 
 	while (1) {
-		msr_serial_readchar (fd, &b);
+		if ((r = msr_getc (fd, &b)) != LIBMSR_ERR_OK) {
+			*len = 0;
+			return r;
+		}
 		if (b == '%')
 			continue;
 		if (b == ';')
@@ -216,7 +308,8 @@ static int gettrack_iso (int fd, int t, uint8_t * buf, uint8_t * len)
 		return LIBMSR_ERR_OK;
 	} else {
 		*len = 0;
-		msr_serial_readchar (fd, &b);
+		if ((r = msr_getc (fd, &b)) != LIBMSR_ERR_OK)
+			return r;
 	}
 
 	return LIBMSR_ERR_DEVICE;
@@ -227,22 +320,24 @@ static int gettrack_raw (int fd, int t, uint8_t * buf, uint8_t * len)
 	uint8_t b, s;
 	int i = 0;
 	int l = 0;
+	int r;
 
 	/* Start delimiter should be ESC <track number> */
 
-	msr_serial_readchar (fd, &b);
-	if (b != MSR_ESC) {
+	if ((r = msr_getc (fd, &b)) != LIBMSR_ERR_OK || b != MSR_ESC) {
 		*len = 0;
-		return LIBMSR_ERR_DEVICE;
+		return MSR_IO_ERR(r) ? r : LIBMSR_ERR_DEVICE;
 	}
 
-	msr_serial_readchar (fd, &b);
-	if (b != t) {
+	if ((r = msr_getc (fd, &b)) != LIBMSR_ERR_OK || b != t) {
 		*len = 0;
-		return LIBMSR_ERR_DEVICE;
+		return MSR_IO_ERR(r) ? r : LIBMSR_ERR_DEVICE;
 	}
 
-	msr_serial_readchar (fd, &s);
+	if ((r = msr_getc (fd, &s)) != LIBMSR_ERR_OK) {
+		*len = 0;
+		return r;
+	}
 
 	if (!s) {
 		*len = 0;
@@ -250,7 +345,10 @@ static int gettrack_raw (int fd, int t, uint8_t * buf, uint8_t * len)
 	}
 
 	for (i = 0; i < s; i++) {
-		msr_serial_readchar (fd, &b);
+		if ((r = msr_getc (fd, &b)) != LIBMSR_ERR_OK) {
+			*len = 0;
+			return r;
+		}
 		/* Avoid overflowing the buffer */
 		if (i < *len) {
 			l++;
@@ -266,6 +364,7 @@ static int gettrack_raw (int fd, int t, uint8_t * buf, uint8_t * len)
 int msr_sensor_test (int fd)
 {
 	uint8_t b[4];
+	int r;
 
 	msr_cmd (fd, MSR_CMD_DIAG_SENSOR);
 
@@ -273,7 +372,8 @@ int msr_sensor_test (int fd)
 	printf("Attempting sensor test -- please slide a card...\n");
 #endif
 
-	msr_serial_read (fd, &b, 2);
+	if ((r = msr_serial_read (fd, &b, 2)) != LIBMSR_ERR_OK)
+		return r;
 
 	if (b[0] == MSR_ESC && b[1] == MSR_STS_SENSOR_OK) {
 		return LIBMSR_ERR_OK;
@@ -289,10 +389,12 @@ int msr_sensor_test (int fd)
 int msr_ram_test (int fd)
 {
 	uint8_t b[2] = {0};
+	int r;
 
 	msr_cmd (fd, MSR_CMD_DIAG_RAM);
 
-	msr_serial_read(fd, b, sizeof(b));
+	if ((r = msr_serial_read(fd, b, sizeof(b))) != LIBMSR_ERR_OK)
+		return r;
 
 	if (b[0] == MSR_ESC && b[1] == MSR_STS_RAM_OK) {
  		return LIBMSR_ERR_OK;
@@ -309,10 +411,12 @@ int msr_ram_test (int fd)
 int msr_get_co(int fd)
 {
 	char b[2] = {0};
+	int r;
 
 	msr_cmd(fd, MSR_CMD_GETCO);
 
-	msr_serial_read(fd, &b, 2);
+	if ((r = msr_serial_read(fd, &b, 2)) != LIBMSR_ERR_OK)
+		return r;
 
 	if (b[0] == MSR_ESC && (b[1] == MSR_CO_HI || b[1] == MSR_CO_LO)) {
 		return b[1];
@@ -329,11 +433,13 @@ int msr_get_co(int fd)
 int msr_set_hi_co (int fd)
 {
 	char b[2] = {0};
+	int r;
 
 	msr_cmd (fd, MSR_CMD_SETCO_HI);
 
 	/* read the result "<esc>0" if OK, unknown or no response if fail */
-	msr_serial_read (fd, &b, 2);
+	if ((r = msr_serial_read (fd, &b, 2)) != LIBMSR_ERR_OK)
+		return r;
 
 	if (b[0] == MSR_ESC && b[1] == MSR_STS_OK) {
 #ifdef DEBUG
@@ -353,11 +459,13 @@ int msr_set_hi_co (int fd)
 int msr_set_lo_co (int fd)
 {
 	char b[2] = {0};
+	int r;
 
 	msr_cmd (fd, MSR_CMD_SETCO_LO);
 
 	/* read the result "<esc>0" if OK, unknown or no response if fail */
-	msr_serial_read (fd, &b, 2);
+	if ((r = msr_serial_read (fd, &b, 2)) != LIBMSR_ERR_OK)
+		return r;
 
 	if (b[0] == MSR_ESC && b[1] == MSR_STS_OK) {
 #ifdef DEBUG
@@ -374,15 +482,90 @@ int msr_set_lo_co (int fd)
 	return LIBMSR_ERR_DEVICE;
 }
 
+/*
+ * A resetting device ignores what it is sent, so msr_reset() keeps
+ * sending it MSR_CMD_DIAG_COMM until it answers. The first probe waits
+ * MSR_RESET_PROBE ms for its answer, and later ones twice as long as the
+ * one before, up to MSR_RESET_PROBE_MAX ms. We give up after
+ * MSR_RESET_WAIT ms in all.
+ */
+#define MSR_RESET_PROBE		2
+#define MSR_RESET_PROBE_MAX	8
+#define MSR_RESET_WAIT		1000
+
+/* Send a probe and wait up to timeout ms for its answer. */
+static int msr_reset_probe (int fd, int timeout)
+{
+	uint8_t b;
+	int r, i;
+
+	if (msr_cmd (fd, MSR_CMD_DIAG_COMM) == -1)
+		return LIBMSR_ERR_SERIAL;
+
+	/* As in msr_commtest(), the escape may go missing. */
+	for (i = 0; i < 2; i++) {
+		r = msr_serial_read_timeout (fd, &b, 1, timeout);
+		if (r != LIBMSR_ERR_OK)
+			return r;
+		if (b == MSR_STS_COMM_OK)
+			return LIBMSR_ERR_OK;
+		if (b != MSR_ESC)
+			break;
+	}
+
+	return LIBMSR_ERR_DEVICE;
+}
+
+/*
+ * Probes that timed out may only have been slow, and their answers may
+ * still be on the way. Ask for the model number, whose answer comes
+ * after theirs and doesn't look like them, and skip everything before it.
+ */
+static int msr_reset_sync (int fd)
+{
+	uint8_t b;
+	int r, i;
+
+	if (msr_cmd (fd, MSR_CMD_MODEL) == -1)
+		return LIBMSR_ERR_SERIAL;
+
+	for (i = 0; i < 64; i++) {
+		r = msr_serial_read_timeout (fd, &b, 1, MSR_RESET_WAIT);
+		if (r != LIBMSR_ERR_OK)
+			return r;
+		if (b == MSR_STS_MODEL_OK)
+			return LIBMSR_ERR_OK;
+	}
+
+	return LIBMSR_ERR_DEVICE;
+}
+
 int msr_reset (int fd)
 {
-	struct timespec pause = { .tv_sec = 0, .tv_nsec = 100000000};
+	int r = LIBMSR_ERR_TIMEOUT, timeout, waited = 0;
 
-	msr_cmd (fd, MSR_CMD_RESET);
+	if (msr_cmd (fd, MSR_CMD_RESET) == -1)
+		return LIBMSR_ERR_SERIAL;
 
-	nanosleep(&pause, NULL);
+	for (timeout = MSR_RESET_PROBE; waited < MSR_RESET_WAIT;
+	    waited += timeout, timeout *= 2) {
+		if (timeout > MSR_RESET_PROBE_MAX)
+			timeout = MSR_RESET_PROBE_MAX;
+		msr_serial_flush (fd);
+		if ((r = msr_reset_probe (fd, timeout)) == LIBMSR_ERR_OK)
+			break;
+		if (MSR_IO_ERR(r) && r != LIBMSR_ERR_TIMEOUT)
+			return r;
+	}
 
-	return LIBMSR_ERR_OK;
+	if (r != LIBMSR_ERR_OK)
+		return r;
+
+	/* The first probe was answered; there's nothing else to come. */
+	if (waited == 0)
+		return LIBMSR_ERR_OK;
+
+	return msr_reset_sync (fd);
 }
 
 int msr_iso_read(int fd, msr_tracks_t * tracks)
@@ -395,26 +578,31 @@ int msr_iso_read(int fd, msr_tracks_t * tracks)
 #ifdef DEBUG
 		err(1, "Command write failed");
 #endif
+		return LIBMSR_ERR_SERIAL;
 	}
 
     /* Wait for start delimiter. */
-	if (getstart (fd) == -1) {
+	if (MSR_IO_ERR(r = getstart (fd))) {
 #ifdef DEBUG
-		err(1, "get start delimiter failed");
+		warnx("get start delimiter failed");
 #endif
+		return r;
 	}
 
     /* Read track data */
-	for (i = 0; i < MSR_MAX_TRACKS; i++)
-		gettrack_iso (fd, i + 1, tracks->msr_tracks[i].msr_tk_data,
+	for (i = 0; i < MSR_MAX_TRACKS; i++) {
+		r = gettrack_iso (fd, i + 1, tracks->msr_tracks[i].msr_tk_data,
 		    &tracks->msr_tracks[i].msr_tk_len);
+		if (MSR_IO_ERR(r))
+			return r;
+	}
 
     /* Wait for end delimiter. */
-	if (getend (fd) == -1) {
+	if (MSR_IO_ERR(r = getend (fd))) {
 #ifdef DEBUG
 		warnx("read failed");
 #endif
-		return LIBMSR_ERR_SERIAL;
+		return r;
 	}
 
 	return LIBMSR_ERR_OK;
@@ -423,14 +611,15 @@ int msr_iso_read(int fd, msr_tracks_t * tracks)
 int msr_erase (int fd, uint8_t tracks)
 {
 	uint8_t b[2];
+	int r;
 
-	msr_cmd (fd, MSR_CMD_ERASE);
-	msr_serial_write (fd, &tracks, 1);
+	msr_cmd_arg (fd, MSR_CMD_ERASE, &tracks, 1);
 
-	if (msr_serial_read (fd, b, 2) == -1) {
+	if ((r = msr_serial_read (fd, b, 2)) != LIBMSR_ERR_OK) {
 #ifdef DEBUG
-		err(1, "read erase response failed");
+		warnx("read erase response failed");
 #endif
+		return r;
 	}
 
 	if (b[0] == MSR_ESC && b[1] == MSR_STS_ERASE_OK) {
@@ -447,34 +636,14 @@ int msr_erase (int fd, uint8_t tracks)
 
 int msr_iso_write(int fd, msr_tracks_t * tracks)
 {
-	int i;
-	uint8_t buf[4];
-
-	msr_cmd(fd, MSR_CMD_WRITE);
-	msr_cmd(fd, MSR_RW_START);
-
-	for (i = 0; i < MSR_MAX_TRACKS; i++) {
-		buf[0] = MSR_ESC;
-		buf[1] = i + 1;
-		msr_serial_write (fd, buf, 2);
-		msr_serial_write (fd, tracks->msr_tracks[i].msr_tk_data,
-			tracks->msr_tracks[i].msr_tk_len);
-	}
-
-	buf[0] = MSR_RW_END;
-	buf[1] = MSR_FS;
-	msr_serial_write (fd, buf, 2);
+	msr_frame_t frame;
+	int r;
 
-	msr_serial_read(fd, buf, 2);
+	msr_frame_tracks (&frame, 0, tracks);
+	if ((r = msr_frame_send (fd, &frame)) != LIBMSR_ERR_OK)
+		return r;
 
-	if (buf[1] != MSR_STS_OK) {
-#ifdef DEBUG
-		warnx("iso write failed: 0x%02x", buf[1]);
-#endif
-		return LIBMSR_ERR_DEVICE;
-	}
-
-	return LIBMSR_ERR_OK;
+	return msr_write_status (fd);
 }
 
 int msr_raw_read(int fd, msr_tracks_t * tracks)
@@ -487,24 +656,28 @@ int msr_raw_read(int fd, msr_tracks_t * tracks)
 #ifdef DEBUG
 		err(1, "Command write failed");
 #endif
+		return LIBMSR_ERR_SERIAL;
 	}
 
-	if (getstart(fd) == -1) {
+	if (MSR_IO_ERR(r = getstart(fd))) {
 #ifdef DEBUG
-		err(1, "get start delimiter failed");
+		warnx("get start delimiter failed");
 #endif
+		return r;
 	}
 
 	for (i = 0; i < MSR_MAX_TRACKS; i++) {
-		gettrack_raw(fd, i + 1, tracks->msr_tracks[i].msr_tk_data,
+		r = gettrack_raw(fd, i + 1, tracks->msr_tracks[i].msr_tk_data,
 		    &tracks->msr_tracks[i].msr_tk_len);
+		if (MSR_IO_ERR(r))
+			return r;
 	}
 
-	if (getend(fd) == -1) {
+	if (MSR_IO_ERR(r = getend(fd))) {
 #ifdef DEBUG
-		err(1, "read failed");
+		warnx("read failed");
 #endif
-		return LIBMSR_ERR_DEVICE;
+		return r;
 	}
 
 	return LIBMSR_ERR_OK;
@@ -512,57 +685,36 @@ int msr_raw_read(int fd, msr_tracks_t * tracks)
 
 int msr_raw_write(int fd, msr_tracks_t * tracks)
 {
-	int i;
-	uint8_t buf[4];
-
-	msr_cmd(fd, MSR_CMD_RAW_WRITE);
-	msr_cmd(fd, MSR_RW_START);
-
-	for (i = 0; i < MSR_MAX_TRACKS; i++) {
-		buf[0] = MSR_ESC; /* start delimiter */
-		buf[1] = i + 1; /* track number */
-		buf[2] = tracks->msr_tracks[i].msr_tk_len; /* data length */
-		msr_serial_write (fd, buf, 3);
-		msr_serial_write (fd, tracks->msr_tracks[i].msr_tk_data,
-			tracks->msr_tracks[i].msr_tk_len);
-	}
-
-	buf[0] = MSR_RW_END;
-	buf[1] = MSR_FS;
-	msr_serial_write (fd, buf, 2);
+	msr_frame_t frame;
+	int r;
 
-	msr_serial_read(fd, buf, 2);
+	msr_frame_tracks (&frame, 1, tracks);
+	if ((r = msr_frame_send (fd, &frame)) != LIBMSR_ERR_OK)
+		return r;
 
-	if (buf[1] != MSR_STS_OK) {
-#ifdef DEBUG
-		warnx("raw write failed: 0x%02x", buf[1]);
-#endif
-		return LIBMSR_ERR_DEVICE;
-	}
-
-	return LIBMSR_ERR_OK;
+	return msr_write_status (fd);
 }
 
 int msr_init(int fd)
 {
-	msr_reset (fd);
+	int r;
 
-	if (msr_commtest (fd) == -1) {
-		return LIBMSR_ERR_DEVICE;
+	/* msr_reset() tests communications while it waits for the device. */
+	if ((r = msr_reset (fd)) != LIBMSR_ERR_OK) {
+		return MSR_IO_ERR(r) ? r : LIBMSR_ERR_DEVICE;
 	}
 
-	msr_reset (fd);
-
 	return LIBMSR_ERR_OK;
 }
 
 int msr_set_bpi (int fd, uint8_t bpi)
 {
 	uint8_t b[2] = {0};
+	int r;
 
-	msr_cmd (fd, MSR_CMD_SETBPI);
-	msr_serial_write (fd, &bpi, 1);
-	msr_serial_read (fd, &b, 2);
+	msr_cmd_arg (fd, MSR_CMD_SETBPI, &bpi, 1);
+	if ((r = msr_serial_read (fd, &b, 2)) != LIBMSR_ERR_OK)
+		return r;
 
 	if (b[0] == MSR_ESC && b[1] == MSR_STS_OK) {
 #ifdef DEBUG
@@ -582,17 +734,19 @@ int msr_set_bpc (int fd, uint8_t bpc1, uint8_t bpc2, uint8_t bpc3)
 {
 	uint8_t b[2] = {0};
 	msr_bpc_t bpc;
+	int r;
 
 	bpc.msr_bpctk1 = bpc1;
 	bpc.msr_bpctk2 = bpc2;
 	bpc.msr_bpctk3 = bpc3;
 
-	msr_cmd (fd, MSR_CMD_SETBPC);
-	msr_serial_write (fd, &bpc, sizeof(bpc));
+	msr_cmd_arg (fd, MSR_CMD_SETBPC, &bpc, sizeof(bpc));
 
-	msr_serial_read (fd, &b, 2);
+	if ((r = msr_serial_read (fd, &b, 2)) != LIBMSR_ERR_OK)
+		return r;
 	if (b[0] == MSR_ESC && b[1] == MSR_STS_OK) {
-		msr_serial_read (fd, &bpc, sizeof(bpc));
+		if ((r = msr_serial_read (fd, &bpc, sizeof(bpc))) != LIBMSR_ERR_OK)
+			return r;
 #ifdef DEBUG
 		printf ("Set bpc... %d %d %d\n", bpc.msr_bpctk1,
 		    bpc.msr_bpctk2, bpc.msr_bpctk3);
@@ -0,0 +1,14 @@
+/*
+ * Internal definitions shared by the libmsr sources. Not installed.
+ */
+#ifndef MSR_INT_H
+#define MSR_INT_H
+
+/*
+ * True for errors that end the conversation with the device: serial
+ * failures, timeouts and cancellations. Device-level errors (bad status
+ * bytes and the like) are not included.
+ */
+#define MSR_IO_ERR(r) (((r) & LIBMSR_ERR_SERIAL) != 0)
+
+#endif /* MSR_INT_H */
@@ -0,0 +1,221 @@
+#include <string.h>
+
+#include "libmsr.h"
+
+/*
+ * Incremental parser for read responses.
+ *
+ * The state machine consumes bytes exactly as getstart(), gettrack_iso(),
+ * gettrack_raw() and getend() in msr206.c do, one byte at a time, so the
+ * same response yields the same tracks whether it is read from the fd or
+ * pushed in here in arbitrary chunks.
+ */
+
+/* Parser states. */
+enum {
+	PS_START,	/* looking for the start delimiter */
+	PS_TK_ESC,	/* ESC before a track number */
+	PS_TK_NUM,	/* track number */
+	PS_TK_LEN,	/* raw track length */
+	PS_TK_DATA,	/* track data */
+	PS_TK_SKIP,	/* byte after an unexpected ESC in ISO data */
+	PS_END,		/* end delimiter and status */
+	PS_DONE
+};
+
+void msr_parser_init (msr_parser_t *p, int raw, msr_tracks_t *tracks,
+    msr_parse_cb cb, void *cookie)
+{
+	int i;
+
+	memset (p, 0, sizeof(*p));
+	p->msr_ps_raw = raw;
+	p->msr_ps_state = PS_START;
+	p->msr_ps_result = LIBMSR_ERR_GENERIC;
+	p->msr_ps_tracks = tracks;
+	p->msr_ps_cb = cb;
+	p->msr_ps_cookie = cookie;
+
+	if (tracks != NULL)
+		for (i = 0; i < MSR_MAX_TRACKS; i++)
+			p->msr_ps_cap[i] = tracks->msr_tracks[i].msr_tk_len;
+}
+
+static void msr_parser_emit (msr_parser_t *p, int type, const uint8_t *data,
+    size_t len, int result)
+{
+	msr_parse_event_t ev;
+
+	if (p->msr_ps_cb == NULL)
+		return;
+
+	ev.msr_pe_type = type;
+	ev.msr_pe_track = p->msr_ps_track;
+	ev.msr_pe_data = data;
+	ev.msr_pe_len = len;
+	ev.msr_pe_result = result;
+	ev.msr_pe_status = p->msr_ps_end[3];
+	p->msr_ps_cb (p, &ev, p->msr_ps_cookie);
+}
+
+/*
+ * Finish the current track and move on. len is the track's length, as
+ * the blocking readers would report it given unlimited room.
+ */
+static void msr_parser_next (msr_parser_t *p, int len, int result)
+{
+	if (p->msr_ps_tracks != NULL)
+		p->msr_ps_tracks->msr_tracks[p->msr_ps_track].msr_tk_len =
+		    len ? p->msr_ps_kept : 0;
+
+	msr_parser_emit (p, MSR_PE_TRACK_END, NULL, len, result);
+
+	p->msr_ps_pos = p->msr_ps_kept = 0;
+	p->msr_ps_state = (++p->msr_ps_track == MSR_MAX_TRACKS) ?
+	    PS_END : PS_TK_ESC;
+}
+
+/* Account for a run of track data bytes. */
+static void msr_parser_data (msr_parser_t *p, const uint8_t *buf, size_t n)
+{
+	msr_track_t *tk;
+	size_t room;
+
+	if (n == 0)
+		return;
+
+	/* Avoid overflowing the buffer */
+	if (p->msr_ps_tracks != NULL &&
+	    p->msr_ps_pos < p->msr_ps_cap[p->msr_ps_track]) {
+		tk = &p->msr_ps_tracks->msr_tracks[p->msr_ps_track];
+		room = p->msr_ps_cap[p->msr_ps_track] - p->msr_ps_pos;
+		if (room > n)
+			room = n;
+		memcpy (&tk->msr_tk_data[p->msr_ps_kept], buf, room);
+		p->msr_ps_kept += room;
+	}
+
+	p->msr_ps_pos += n;
+	msr_parser_emit (p, MSR_PE_TRACK_DATA, buf, n, LIBMSR_ERR_OK);
+}
+
+/* Handle bytes of ISO track data, up to the end of the track. */
+static size_t msr_parser_iso (msr_parser_t *p, const uint8_t *buf,
+    size_t len)
+{
+	size_t i, run;
+	uint8_t b;
+
+	for (i = run = 0; i < len; i++) {
+		b = buf[i];
+		if (b != '%' && b != ';' && b != MSR_RW_END && b != MSR_ESC)
+			continue;
+
+		msr_parser_data (p, &buf[run], i - run);
+		run = i + 1;
+
+		if (b == MSR_RW_END) {
+			msr_parser_next (p, p->msr_ps_pos, LIBMSR_ERR_OK);
+			return i + 1;
+		}
+		if (b == MSR_ESC) {
+			p->msr_ps_state = PS_TK_SKIP;
+			return i + 1;
+		}
+		/* start sentinels are dropped */
+	}
+
+	msr_parser_data (p, &buf[run], len - run);
+
+	return len;
+}
+
+/* Handle bytes of raw track data, up to the end of the track. */
+static size_t msr_parser_raw (msr_parser_t *p, const uint8_t *buf,
+    size_t len)
+{
+	size_t n;
+
+	n = p->msr_ps_need - p->msr_ps_pos;
+	if (n > len)
+		n = len;
+
+	msr_parser_data (p, buf, n);
+	if (p->msr_ps_pos == p->msr_ps_need)
+		msr_parser_next (p, p->msr_ps_pos, LIBMSR_ERR_OK);
+
+	return n;
+}
+
+size_t msr_parser_push (msr_parser_t *p, const void *data, size_t len)
+{
+	const uint8_t *buf = data;
+	size_t i = 0;
+	uint8_t b;
+
+	while (i < len && p->msr_ps_state != PS_DONE) {
+		if (p->msr_ps_state == PS_TK_DATA) {
+			if (p->msr_ps_raw)
+				i += msr_parser_raw (p, &buf[i], len - i);
+			else
+				i += msr_parser_iso (p, &buf[i], len - i);
+			continue;
+		}
+
+		b = buf[i++];
+
+		switch (p->msr_ps_state) {
+		case PS_START:
+			if (b == MSR_RW_START || ++p->msr_ps_tries == 3)
+				p->msr_ps_state = PS_TK_ESC;
+			break;
+		case PS_TK_ESC:
+			if (b == MSR_ESC)
+				p->msr_ps_state = PS_TK_NUM;
+			else
+				msr_parser_next (p, 0, LIBMSR_ERR_DEVICE);
+			break;
+		case PS_TK_NUM:
+			if (b != p->msr_ps_track + 1) {
+				msr_parser_next (p, 0, LIBMSR_ERR_DEVICE);
+				break;
+			}
+			msr_parser_emit (p, MSR_PE_TRACK_START, NULL, 0,
+			    LIBMSR_ERR_OK);
+			p->msr_ps_state = p->msr_ps_raw ? PS_TK_LEN : PS_TK_DATA;
+			break;
+		case PS_TK_LEN:
+			p->msr_ps_need = b;
+			if (b == 0)
+				msr_parser_next (p, 0, LIBMSR_ERR_OK);
+			else
+				p->msr_ps_state = PS_TK_DATA;
+			break;
+		case PS_TK_SKIP:
+			msr_parser_next (p, 0, LIBMSR_ERR_DEVICE);
+			break;
+		case PS_END:
+			p->msr_ps_end[p->msr_ps_endlen++] = b;
+			if (p->msr_ps_endlen < (int) sizeof(p->msr_ps_end))
+				break;
+			p->msr_ps_result = (p->msr_ps_end[3] == MSR_STS_OK) ?
+			    LIBMSR_ERR_OK : LIBMSR_ERR_DEVICE;
+			p->msr_ps_state = PS_DONE;
+			msr_parser_emit (p, MSR_PE_STATUS, NULL, 0,
+			    p->msr_ps_result);
+			break;
+		}
+	}
+
+	return i;
+}
+
+int msr_parser_done (const msr_parser_t *p)
+{
+	return p->msr_ps_state == PS_DONE;
+}
+
+int msr_parser_result (const msr_parser_t *p)
+{
+	return p->msr_ps_result;
+}
@@ -1,64 +1,784 @@
 #include <sys/types.h>
 #include <sys/fcntl.h>
 
+#include <errno.h>
+#include <poll.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <err.h>
 
 #include "libmsr.h"
+#include "uring.h"
 
 /*
  * Serial I/O routines.
  */
 static int msr_serial_setup (int fd, speed_t baud);
 
-int msr_serial_readchar (int fd, uint8_t * c)
+/*
+ * Per-descriptor receive state.
+ *
+ * The device sends each response in a burst, so rather than issuing one
+ * read() per byte we pull in everything the tty has buffered and hand it
+ * out from here. The table is indexed by fd and grown on demand.
+ */
+#define MSR_RX_BUFSZ 1024
+#define MSR_RX_TIMEOUT (-2)
+#define MSR_RX_CANCELED (-3)
+#define MSR_TX_BUFSZ 1024
+
+struct msr_rx {
+	uint8_t	buf[MSR_RX_BUFSZ];
+	size_t	head;
+	size_t	tail;
+	int	nonblock;
+	int	timeout; /* per-operation timeout in ms, or -1 */
+	struct timespec deadline; /* deadline of the current operation */
+	int	cancelfd; /* caller's cancellation fd, or -1 */
+	const msr_transport_t *tr; /* the link to the device */
+	void	*priv; /* the transport's state */
+	msr_serial_stats_t stats;
+#ifdef MSR_URING
+	int	fd;
+	int	uring; /* use the io_uring backend */
+	struct msr_uring_op poll_op; /* POLLIN on fd, linked to read_op */
+	struct msr_uring_op read_op;
+	struct msr_uring_op cancel_op; /* POLLIN on cancelfd */
+	struct msr_uring_op wpoll_op; /* POLLOUT on fd, linked to write_op */
+	struct msr_uring_op write_op;
+	int	read_res;
+	int	txerr; /* errno of a failed queued write, or 0 */
+	size_t	txoff; /* bytes of tx written so far */
+	size_t	txlen; /* bytes of tx queued */
+	uint8_t	tx[MSR_TX_BUFSZ];
+#endif
+};
+
+#ifdef MSR_URING
+static void msr_rx_uring_init (struct msr_rx *rx, int fd);
+static int msr_rx_uring_drain (struct msr_rx *rx);
+#endif
+
+
+/*
+ * The table itself is shared by every thread using the library, so
+ * lookups and growth are done under rx_lock. An entry belongs to
+ * whoever is talking to its fd; see msr_device_t for sharing a device
+ * between threads.
+ */
+static struct msr_rx **rx_table;
+static int rx_table_len;
+static pthread_mutex_t rx_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct msr_rx *msr_rx_get_locked (int fd)
 {
-	char b;
-	int	r;
+	struct msr_rx **t, *rx;
+	int len, flags;
+
+	if (fd >= rx_table_len) {
+		len = rx_table_len ? rx_table_len : 16;
+		while (len <= fd)
+			len *= 2;
+
+		t = realloc (rx_table, len * sizeof(*t));
+		if (t == NULL)
+			return NULL;
+
+		memset (t + rx_table_len, 0,
+		    (len - rx_table_len) * sizeof(*t));
+		rx_table = t;
+		rx_table_len = len;
+	}
 
-	while ((r = read (fd, &b, 1)) == -1)
-		;
+	if (rx_table[fd] == NULL) {
+		rx = calloc (1, sizeof(struct msr_rx));
+		if (rx == NULL)
+			return NULL;
+
+		flags = fcntl (fd, F_GETFL);
+		rx->nonblock = (flags != -1 && (flags & O_NONBLOCK));
+		rx->timeout = -1;
+		rx->cancelfd = -1;
+		rx->tr = &msr_transport_serial;
+#ifdef MSR_URING
+		msr_rx_uring_init (rx, fd);
+#endif
+		rx_table[fd] = rx;
+	}
 
-	if (r != -1) {
-		*c = b;
-#ifdef DEBUG
-		printf ("[0x%x]\n", b);
+	return rx_table[fd];
+}
+
+static struct msr_rx *msr_rx_get (int fd)
+{
+	struct msr_rx *rx;
+
+	if (fd < 0)
+		return NULL;
+
+	pthread_mutex_lock (&rx_lock);
+	rx = msr_rx_get_locked (fd);
+	pthread_mutex_unlock (&rx_lock);
+
+	return rx;
+}
+
+static void msr_rx_free (int fd)
+{
+#ifdef MSR_URING
+	struct msr_rx *rx = NULL;
+
+	pthread_mutex_lock (&rx_lock);
+	if (fd >= 0 && fd < rx_table_len)
+		rx = rx_table[fd];
+	pthread_mutex_unlock (&rx_lock);
+
+	/* Queued writes refer to the entry; let them finish. */
+	if (rx != NULL)
+		msr_rx_uring_drain (rx);
+#endif
+
+	pthread_mutex_lock (&rx_lock);
+	if (fd >= 0 && fd < rx_table_len) {
+		free (rx_table[fd]);
+		rx_table[fd] = NULL;
+	}
+	pthread_mutex_unlock (&rx_lock);
+}
+
+/*
+ * Turn a timeout in milliseconds into an absolute deadline. A negative
+ * timeout means wait forever, which is represented by a NULL deadline.
+ */
+static struct timespec *msr_deadline (int timeout, struct timespec *ts)
+{
+	if (timeout < 0)
+		return NULL;
+
+	clock_gettime (CLOCK_MONOTONIC, ts);
+	ts->tv_sec += timeout / 1000;
+	ts->tv_nsec += (long) (timeout % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+
+	return ts;
+}
+
+/* Milliseconds left until a deadline, rounded up, suitable for poll(). */
+static int msr_remaining (const struct timespec *deadline)
+{
+	struct timespec now;
+	long ms;
+
+	if (deadline == NULL)
+		return -1;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	ms = (deadline->tv_sec - now.tv_sec) * 1000 +
+	    (deadline->tv_nsec - now.tv_nsec + 999999) / 1000000;
+
+	return ms > 0 ? (int) ms : 0;
+}
+
+#ifdef MSR_URING
+/*
+ * io_uring backend.
+ *
+ * Writes are copied into the entry's tx buffer and queued on the
+ * calling thread's ring without a system call; they go out with the
+ * next submission, normally the one that waits for the response. A
+ * read is a POLLIN poll linked to a read(2), so no kernel worker thread
+ * sits blocked in the tty, and the whole exchange costs a single
+ * io_uring_enter(2) per wakeup.
+ */
+#define MSR_RX_OF(op, member) \
+	((struct msr_rx *) ((char *) (op) - offsetof(struct msr_rx, member)))
+
+static void msr_rx_ignore (struct msr_uring_op *op, int res)
+{
+}
+
+static void msr_rx_read_done (struct msr_uring_op *op, int res)
+{
+	MSR_RX_OF(op, read_op)->read_res = res;
+}
+
+static void msr_rx_post_write (struct msr_rx *rx, int pollfirst);
+
+static void msr_rx_write_done (struct msr_uring_op *op, int res)
+{
+	struct msr_rx *rx = MSR_RX_OF(op, write_op);
+
+	if (res == -EAGAIN || res == -EINTR) {
+		msr_rx_post_write (rx, res == -EAGAIN);
+		return;
+	}
+
+	if (res < 0) {
+		rx->txerr = -res;
+		rx->txoff = rx->txlen = 0;
+		return;
+	}
+
+	rx->txoff += res;
+	if (rx->txoff < rx->txlen)
+		msr_rx_post_write (rx, 0);
+	else
+		rx->txoff = rx->txlen = 0;
+}
+
+static void msr_rx_uring_init (struct msr_rx *rx, int fd)
+{
+	rx->fd = fd;
+	rx->poll_op.done = msr_rx_ignore;
+	rx->read_op.done = msr_rx_read_done;
+	rx->cancel_op.done = msr_rx_ignore;
+	rx->wpoll_op.done = msr_rx_ignore;
+	rx->write_op.done = msr_rx_write_done;
+}
+
+/* Queue a write of whatever is left in the tx buffer. */
+static void msr_rx_post_write (struct msr_rx *rx, int pollfirst)
+{
+	struct io_uring_sqe *sqe;
+
+	if (msr_uring_reserve (2) != 0)
+		goto fail;
+
+	if (pollfirst) {
+		if ((sqe = msr_uring_sqe (&rx->wpoll_op)) == NULL)
+			goto fail;
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = rx->fd;
+		sqe->poll32_events = POLLOUT;
+		sqe->flags = IOSQE_IO_LINK;
+	}
+
+	if ((sqe = msr_uring_sqe (&rx->write_op)) == NULL)
+		goto fail;
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = rx->fd;
+	sqe->addr = (uint64_t) (uintptr_t) &rx->tx[rx->txoff];
+	sqe->len = rx->txlen - rx->txoff;
+	return;
+
+fail:
+	rx->txerr = ENOMEM;
+	rx->txoff = rx->txlen = 0;
+}
+
+static void msr_rx_uring_cancel (struct msr_uring_op *op)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = msr_uring_sqe (NULL)) != NULL) {
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = (uint64_t) (uintptr_t) op;
+	}
+}
+
+/* Wait for the entry's queued writes to complete. */
+static int msr_rx_uring_drain (struct msr_rx *rx)
+{
+	while (rx->write_op.busy || rx->wpoll_op.busy)
+		if (msr_uring_submit (1, -1) != 0)
+			return -1;
+
+	return 0;
+}
+
+static int msr_rx_uring_write (struct msr_rx *rx, const void *buf,
+    size_t len)
+{
+	if (len > sizeof(rx->tx)) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	while (rx->txlen + len > sizeof(rx->tx) && !rx->txerr)
+		if (msr_uring_submit (1, -1) != 0)
+			return -1;
+
+	if (rx->txerr) {
+		errno = rx->txerr;
+		rx->txerr = 0;
+		return -1;
+	}
+
+	memcpy (&rx->tx[rx->txlen], buf, len);
+	rx->txlen += len;
+	if (!rx->write_op.busy)
+		msr_rx_post_write (rx, 0);
+
+	return (len);
+}
+
+static int msr_rx_uring_fill (int fd, struct msr_rx *rx,
+    const struct timespec *deadline)
+{
+	struct io_uring_sqe *sqe;
+	int stop = 0, r;
+
+	if (rx->txerr) {
+		errno = rx->txerr;
+		rx->txerr = 0;
+		return -1;
+	}
+
+again:
+	if (msr_uring_reserve (3) != 0 ||
+	    (sqe = msr_uring_sqe (&rx->poll_op)) == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLIN;
+	sqe->flags = IOSQE_IO_LINK;
+
+	if ((sqe = msr_uring_sqe (&rx->read_op)) == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t) (uintptr_t) rx->buf;
+	sqe->len = sizeof(rx->buf);
+
+	if (rx->cancelfd >= 0 && !rx->cancel_op.busy &&
+	    (sqe = msr_uring_sqe (&rx->cancel_op)) != NULL) {
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = rx->cancelfd;
+		sqe->poll32_events = POLLIN;
+	}
+
+	while (rx->read_op.busy) {
+		if (msr_uring_submit (1, stop ? -1 :
+		    msr_remaining (deadline)) != 0)
+			return -1;
+		if (!rx->read_op.busy || stop)
+			continue;
+
+		/* Out of time, or canceled: abandon the read. */
+		if (rx->cancelfd >= 0 && !rx->cancel_op.busy)
+			stop = MSR_RX_CANCELED;
+		else if (deadline != NULL && msr_remaining (deadline) == 0)
+			stop = MSR_RX_TIMEOUT;
+		if (stop)
+			msr_rx_uring_cancel (&rx->poll_op);
+	}
+
+	if (rx->cancel_op.busy) {
+		msr_rx_uring_cancel (&rx->cancel_op);
+		while (rx->cancel_op.busy)
+			if (msr_uring_submit (1, -1) != 0)
+				return -1;
+	}
+
+	r = rx->read_res;
+	if (r == -EAGAIN && !stop)
+		goto again;
+	if (r == -ECANCELED && stop)
+		return stop;
+	if (r < 0) {
+		errno = -r;
+		return -1;
+	}
+	if (r == 0)
+		return 0;
+
+	rx->head = 0;
+	rx->tail = r;
+	rx->stats.msr_rx_reads++;
+	rx->stats.msr_cmd_reads++;
+
+	return (r);
+}
+#endif /* MSR_URING */
+
+/*
+ * Sleep until the device has something for us, or until the caller's
+ * cancellation fd becomes readable.
+ * Returns 1 when readable, 0 when the deadline passed, -1 on error or
+ * MSR_RX_CANCELED on cancellation.
+ */
+static int msr_serial_wait (int fd, struct msr_rx *rx, int events,
+    const struct timespec *deadline)
+{
+	int r;
+
+	r = rx->tr->msr_tr_wait (fd, rx->priv, events, rx->cancelfd,
+	    msr_remaining (deadline));
+	if (r == -1 && errno == ECANCELED)
+		return MSR_RX_CANCELED;
+
+	return (r > 0) ? 1 : r;
+}
+
+/*
+ * Refill an empty receive buffer with whatever the device has sent.
+ * Returns the number of bytes buffered, 0 on EOF, -1 on error,
+ * MSR_RX_TIMEOUT if nothing arrived before the deadline or
+ * MSR_RX_CANCELED if the wait was canceled.
+ */
+static int msr_rx_fill (int fd, struct msr_rx *rx,
+    const struct timespec *deadline)
+{
+	ssize_t r;
+	int wait;
+
+#ifdef MSR_URING
+	if (rx->uring)
+		return msr_rx_uring_fill (fd, rx, deadline);
 #endif
+
+	/*
+	 * On a non-blocking fd we try the read first, so bytes that are
+	 * already waiting cost a single syscall. A blocking fd has to be
+	 * polled first or the read would ignore our deadline.
+	 */
+	wait = !rx->nonblock;
+
+	for (;;) {
+		if (wait) {
+			r = msr_serial_wait (fd, rx, POLLIN, deadline);
+			if (r == 0)
+				return MSR_RX_TIMEOUT;
+			if (r < 0)
+				return (r);
+		}
+
+		r = rx->tr->msr_tr_read (fd, rx->priv, rx->buf,
+		    sizeof(rx->buf));
+		if (r > 0)
+			break;
+		if (r == 0)
+			return 0;
+		if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+
+		wait = (errno != EINTR);
 	}
 
+	rx->head = 0;
+	rx->tail = r;
+	rx->stats.msr_rx_reads++;
+	rx->stats.msr_cmd_reads++;
+
 	return (r);
 }
 
-int msr_serial_read (int fd, void * buf, size_t len)
+static void msr_rx_consumed (struct msr_rx *rx, size_t n)
 {
-	size_t i;
-	uint8_t b, *p;
+	rx->head += n;
+	rx->stats.msr_rx_bytes += n;
+	rx->stats.msr_cmd_bytes += n;
+}
 
-	p = buf;
+/* The deadline for the operation in progress, if the fd has a timeout. */
+static const struct timespec *msr_rx_deadline (struct msr_rx *rx)
+{
+	return (rx->timeout >= 0) ? &rx->deadline : NULL;
+}
+
+static int msr_rx_read (int fd, struct msr_rx *rx, uint8_t *p, size_t len,
+    const struct timespec *deadline)
+{
+	size_t i, n;
+	int r;
 
 #ifdef DEBUG
 	printf("[RX %.3lu]", len);
 #endif
-	for (i = 0; i < len; i++) {
-		msr_serial_readchar (fd, &b);
-#ifdef DEBUG
-		printf(" %.2x", b);
-#endif
-		p[i] = b;
+	for (i = 0; i < len; i += n) {
+		if (rx->head == rx->tail) {
+			r = msr_rx_fill (fd, rx, deadline);
+			if (r == MSR_RX_TIMEOUT)
+				return LIBMSR_ERR_TIMEOUT;
+			if (r == MSR_RX_CANCELED)
+				return LIBMSR_ERR_CANCELED;
+			if (r <= 0)
+				return LIBMSR_ERR_SERIAL;
+		}
+
+		n = rx->tail - rx->head;
+		if (n > len - i)
+			n = len - i;
+
+		memcpy (&p[i], &rx->buf[rx->head], n);
+		msr_rx_consumed (rx, n);
 	}
 #ifdef DEBUG
+	for (i = 0; i < len; i++)
+		printf(" %.2x", p[i]);
 	printf("\n");
 #endif
 
 	return LIBMSR_ERR_OK;
 }
 
+int msr_serial_readchar (int fd, uint8_t * c)
+{
+	struct msr_rx *rx;
+	int	r;
+
+	if ((rx = msr_rx_get (fd)) == NULL)
+		return -1;
+
+	if (rx->head == rx->tail) {
+		r = msr_rx_fill (fd, rx, msr_rx_deadline (rx));
+		if (r == MSR_RX_TIMEOUT)
+			errno = ETIMEDOUT;
+		if (r == MSR_RX_CANCELED)
+			errno = ECANCELED;
+		if (r <= 0)
+			return (r < 0) ? -1 : 0;
+	}
+
+	*c = rx->buf[rx->head];
+	msr_rx_consumed (rx, 1);
+#ifdef DEBUG
+	printf ("[0x%x]\n", *c);
+#endif
+
+	return 1;
+}
+
+int msr_serial_readchar_timeout (int fd, uint8_t * c, int timeout)
+{
+	return msr_serial_read_timeout (fd, c, 1, timeout);
+}
+
+int msr_serial_read (int fd, void * buf, size_t len)
+{
+	struct msr_rx *rx;
+
+	if ((rx = msr_rx_get (fd)) == NULL)
+		return LIBMSR_ERR_SERIAL;
+
+	return msr_rx_read (fd, rx, buf, len, msr_rx_deadline (rx));
+}
+
+int msr_serial_read_timeout (int fd, void * buf, size_t len, int timeout)
+{
+	struct timespec ts;
+	struct msr_rx *rx;
+
+	if ((rx = msr_rx_get (fd)) == NULL)
+		return LIBMSR_ERR_SERIAL;
+
+	return msr_rx_read (fd, rx, buf, len, msr_deadline (timeout, &ts));
+}
+
+int msr_serial_read_avail (int fd, void * buf, size_t len)
+{
+	struct timespec now;
+	struct msr_rx *rx;
+	size_t n;
+	int r;
+
+	if ((rx = msr_rx_get (fd)) == NULL)
+		return -1;
+
+	if (rx->head == rx->tail) {
+		r = msr_rx_fill (fd, rx, msr_deadline (0, &now));
+		if (r == MSR_RX_TIMEOUT)
+			return 0;
+		if (r == MSR_RX_CANCELED)
+			errno = ECANCELED;
+		if (r == 0)
+			errno = EPIPE;
+		if (r <= 0)
+			return -1;
+	}
+
+	n = rx->tail - rx->head;
+	if (n > len)
+		n = len;
+
+	memcpy (buf, &rx->buf[rx->head], n);
+	msr_rx_consumed (rx, n);
+
+	return (n);
+}
+
 int msr_serial_write (int fd, void * buf, size_t len)
 {
-	return (write (fd, buf, len));
+	struct msr_rx *rx;
+	size_t done;
+	ssize_t r;
+
+	/*
+	 * Each write starts a new command: restart the per-command counters
+	 * and the operation deadline.
+	 */
+	if ((rx = msr_rx_get (fd)) != NULL) {
+		rx->stats.msr_cmd_bytes = 0;
+		rx->stats.msr_cmd_reads = 0;
+		msr_deadline (rx->timeout, &rx->deadline);
+	}
+
+#ifdef MSR_URING
+	if (rx != NULL && rx->uring)
+		return msr_rx_uring_write (rx, buf, len);
+#endif
+
+	/*
+	 * Commands go out as whole frames, so make sure all of it gets
+	 * written even if the tty's output queue is momentarily full.
+	 */
+	if (rx == NULL)
+		return -1;
+
+	for (done = 0; done < len; ) {
+		r = rx->tr->msr_tr_write (fd, rx->priv, (uint8_t *) buf + done,
+		    len - done);
+		if (r > 0) {
+			done += r;
+			continue;
+		}
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			r = rx->tr->msr_tr_wait (fd, rx->priv, POLLOUT, -1,
+			    msr_remaining (msr_rx_deadline (rx)));
+			if (r > 0 || (r == -1 && errno == EINTR))
+				continue;
+			if (r == 0)
+				errno = ETIMEDOUT;
+		}
+		return -1;
+	}
+
+	return (done);
+}
+
+int msr_serial_set_timeout (int fd, int timeout)
+{
+	struct msr_rx *rx;
+
+	if ((rx = msr_rx_get (fd)) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	rx->timeout = (timeout < 0) ? -1 : timeout;
+	msr_deadline (rx->timeout, &rx->deadline);
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_serial_set_cancel_fd (int fd, int cancelfd)
+{
+	struct msr_rx *rx;
+
+	if ((rx = msr_rx_get (fd)) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	rx->cancelfd = (cancelfd < 0) ? -1 : cancelfd;
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_serial_flush (int fd)
+{
+	struct msr_rx *rx;
+
+	if ((rx = msr_rx_get (fd)) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	rx->head = rx->tail = 0;
+	if (rx->tr->msr_tr_flush != NULL)
+		rx->tr->msr_tr_flush (fd, rx->priv);
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_serial_set_uring (int fd, int on)
+{
+#ifdef MSR_URING
+	struct msr_rx *rx;
+
+	if ((rx = msr_rx_get (fd)) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	/* The ring reads and writes the descriptor itself. */
+	if (on && rx->tr != &msr_transport_serial)
+		return LIBMSR_ERR_GENERIC;
+
+	if (!on) {
+		if (msr_rx_uring_drain (rx) != 0)
+			return LIBMSR_ERR_SERIAL;
+		rx->uring = 0;
+		return LIBMSR_ERR_OK;
+	}
+
+	/* Make sure this thread can have a ring. */
+	if (msr_uring_submit (0, 0) != 0)
+		return LIBMSR_ERR_GENERIC;
+
+	rx->uring = 1;
+
+	return LIBMSR_ERR_OK;
+#else
+	return on ? LIBMSR_ERR_GENERIC : LIBMSR_ERR_OK;
+#endif
+}
+
+int msr_serial_submit (void)
+{
+#ifdef MSR_URING
+	if (msr_uring_submit (0, 0) != 0)
+		return LIBMSR_ERR_SERIAL;
+#endif
+	return LIBMSR_ERR_OK;
+}
+
+int msr_serial_drain (int fd)
+{
+#ifdef MSR_URING
+	struct msr_rx *rx;
+
+	if ((rx = msr_rx_get (fd)) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	if (rx->uring && msr_rx_uring_drain (rx) != 0)
+		return LIBMSR_ERR_SERIAL;
+
+	if (rx->txerr) {
+		rx->txerr = 0;
+		return LIBMSR_ERR_SERIAL;
+	}
+#endif
+	return LIBMSR_ERR_OK;
+}
+
+int msr_serial_stats (int fd, msr_serial_stats_t *stats)
+{
+	struct msr_rx *rx;
+
+	if ((rx = msr_rx_get (fd)) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	*stats = rx->stats;
+	stats->msr_rx_saved = stats->msr_rx_bytes - stats->msr_rx_reads;
+	stats->msr_cmd_saved = stats->msr_cmd_bytes - stats->msr_cmd_reads;
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_serial_stats_reset (int fd)
+{
+	struct msr_rx *rx;
+
+	if ((rx = msr_rx_get (fd)) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	memset (&rx->stats, 0, sizeof(rx->stats));
+
+	return LIBMSR_ERR_OK;
 }
 
 static int
@@ -117,28 +837,154 @@ msr_serial_setup (int fd, speed_t baud)
 	return LIBMSR_ERR_OK;
 }
 
-int msr_serial_open(char *path, int * fd, int blocking, speed_t baud)
+/*
+ * The serial transport, which is also the default for descriptors the
+ * library didn't open itself. Apart from the termios setup, it works on
+ * any pollable descriptor, so the other fd-based transports share it.
+ */
+static int msr_serial_tr_open (const char *path, int flags, speed_t baud,
+    void **priv)
 {
 	int	f;
 
-	f = open(path, blocking | O_RDWR | O_FSYNC);
+	f = open(path, flags | O_RDWR);
 
 	if (f == -1) {
-		return LIBMSR_ERR_SERIAL;
+		return -1;
 	}
 
 	if (msr_serial_setup (f, baud) != LIBMSR_ERR_OK) {
 		close (f);
+		return -1;
+	}
+
+	*priv = NULL;
+
+	return f;
+}
+
+ssize_t msr_fd_read (int fd, void *priv, void *buf, size_t len)
+{
+	return read (fd, buf, len);
+}
+
+ssize_t msr_fd_write (int fd, void *priv, const void *buf, size_t len)
+{
+	return write (fd, buf, len);
+}
+
+int msr_fd_wait (int fd, void *priv, int events, int cancelfd, int timeout)
+{
+	struct pollfd pfd[2];
+	nfds_t n;
+	int r;
+
+	pfd[0].fd = fd;
+	pfd[0].events = events;
+	pfd[1].fd = cancelfd;
+	pfd[1].events = POLLIN;
+	n = (cancelfd >= 0) ? 2 : 1;
+
+	do {
+		pfd[0].revents = pfd[1].revents = 0;
+		r = poll (pfd, n, timeout);
+	} while (r == -1 && errno == EINTR);
+
+	if (r > 0 && pfd[1].revents) {
+		errno = ECANCELED;
+		return -1;
+	}
+
+	if (r > 0 && (pfd[0].revents & POLLNVAL)) {
+		errno = EBADF;
+		return -1;
+	}
+
+	/* POLLHUP and POLLERR fall through to read(), which reports them. */
+	return r;
+}
+
+static int msr_serial_tr_flush (int fd, void *priv)
+{
+	return tcflush (fd, TCIFLUSH);
+}
+
+int msr_fd_close (int fd, void *priv)
+{
+	return close (fd);
+}
+
+const msr_transport_t msr_transport_serial = {
+	"serial",
+	msr_serial_tr_open,
+	msr_fd_read,
+	msr_fd_write,
+	msr_fd_wait,
+	msr_serial_tr_flush,
+	msr_fd_close
+};
+
+int msr_transport_open (const msr_transport_t *tr, const char *path,
+    int *fd, int flags, speed_t baud)
+{
+	struct msr_rx *rx;
+	void	*priv = NULL;
+	int	f;
+
+	if ((f = tr->msr_tr_open (path, flags, baud, &priv)) < 0)
 		return LIBMSR_ERR_SERIAL;
+
+	/* Drop anything left over from an earlier user of this fd. */
+	msr_rx_free (f);
+
+	if ((rx = msr_rx_get (f)) == NULL) {
+		tr->msr_tr_close (f, priv);
+		return LIBMSR_ERR_GENERIC;
 	}
+	rx->tr = tr;
+	rx->priv = priv;
 
 	*fd = f;
 
 	return LIBMSR_ERR_OK;
 }
 
+int msr_transport_get (int fd, const msr_transport_t **tr, void **priv)
+{
+	struct msr_rx *rx;
+
+	if ((rx = msr_rx_get (fd)) == NULL)
+		return LIBMSR_ERR_GENERIC;
+
+	*tr = rx->tr;
+	*priv = rx->priv;
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_serial_open(char *path, int * fd, int blocking, speed_t baud)
+{
+	return msr_serial_open_flags (path, fd, blocking | O_FSYNC, baud);
+}
+
+int msr_serial_open_flags(char *path, int * fd, int flags, speed_t baud)
+{
+	return msr_transport_open (&msr_transport_serial, path, fd, flags,
+	    baud);
+}
+
 int msr_serial_close(int fd)
 {
-	close (fd);
+	const msr_transport_t *tr = &msr_transport_serial;
+	struct msr_rx *rx;
+	void	*priv = NULL;
+
+	if ((rx = msr_rx_get (fd)) != NULL) {
+		tr = rx->tr;
+		priv = rx->priv;
+	}
+
+	msr_rx_free (fd);
+	tr->msr_tr_close (fd, priv);
 	return LIBMSR_ERR_OK;
 }
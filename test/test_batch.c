@@ -0,0 +1,212 @@
+/*
+ * Checks that msr_batch_decode() gives the same output, in the same
+ * order, whatever the number of threads and the chunk size.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../libmsr.h"
+
+#define NRECS 1000
+
+static int failures;
+
+#define CHECK(cond, ...) do {						\
+	if (!(cond)) {							\
+		printf ("%s:%d: ", __FILE__, __LINE__);			\
+		printf (__VA_ARGS__);					\
+		printf ("\n");						\
+		failures++;						\
+	}								\
+} while (0)
+
+struct out {
+	char	*buf;
+	size_t	len;
+	size_t	size;
+};
+
+static uint32_t rnd (uint32_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 17;
+	*s ^= *s << 5;
+	return *s;
+}
+
+static size_t format (const msr_batch_rec_t *br, char *buf, size_t size,
+    void *cookie)
+{
+	size_t n;
+	int i;
+
+	(void) cookie;
+	n = snprintf (buf, size, "%zu %d", br->msr_br_index,
+	    br->msr_br_corrupt);
+	for (i = 0; i < MSR_MAX_TRACKS; i++)
+		n += snprintf (buf + (n < size ? n : size),
+		    n < size ? size - n : 0, " %d:%.*s", br->msr_br_result[i],
+		    (int) br->msr_br_tracks[i].msr_tv_len,
+		    (const char *) br->msr_br_tracks[i].msr_tv_data);
+	n += snprintf (buf + (n < size ? n : size), n < size ? size - n : 0,
+	    "\n");
+
+	return n;
+}
+
+static int sink (const void *buf, size_t len, void *cookie)
+{
+	struct out *o = cookie;
+	char *nbuf;
+
+	if (o->len + len > o->size) {
+		o->size = (o->len + len) * 2;
+		if ((nbuf = realloc (o->buf, o->size)) == NULL)
+			return 1;
+		o->buf = nbuf;
+	}
+	memcpy (o->buf + o->len, buf, len);
+	o->len += len;
+
+	return 0;
+}
+
+/* Write a journal of random raw and ISO swipes. */
+static int make_journal (const char *path)
+{
+	msr_journal_t *j;
+	msr_tracks_t tk;
+	uint32_t seed = 0x62617421;
+	uint8_t bpc[MSR_MAX_TRACKS];
+	int n, i, k, mode;
+
+	if (msr_journal_open (path, &j) != LIBMSR_ERR_OK)
+		return -1;
+
+	for (n = 0; n < NRECS; n++) {
+		mode = rnd (&seed) % 2 ? MSR_JOURNAL_RAW : MSR_JOURNAL_ISO;
+		for (i = 0; i < MSR_MAX_TRACKS; i++) {
+			bpc[i] = 1 + rnd (&seed) % 8;
+			tk.msr_tracks[i].msr_tk_len = rnd (&seed) % 120;
+			for (k = 0; k < tk.msr_tracks[i].msr_tk_len; k++)
+				tk.msr_tracks[i].msr_tk_data[k] = (mode ==
+				    MSR_JOURNAL_ISO) ? '0' + rnd (&seed) % 10 :
+				    rnd (&seed);
+		}
+		if (msr_journal_append (j, n + 1, n % 7, mode, bpc, &tk) !=
+		    LIBMSR_ERR_OK) {
+			msr_journal_close (j);
+			return -1;
+		}
+	}
+
+	return msr_journal_close (j);
+}
+
+static int run (const msr_journal_map_t *m, int threads, size_t chunk,
+    struct out *o)
+{
+	msr_batch_stats_t st;
+	msr_batch_t opts;
+	int r;
+
+	memset (&opts, 0, sizeof(opts));
+	opts.msr_bt_threads = threads;
+	opts.msr_bt_chunk = chunk;
+	opts.msr_bt_format = format;
+	opts.msr_bt_sink = sink;
+	opts.msr_bt_cookie = o;
+	o->len = 0;
+
+	r = msr_batch_decode (m, 0, NRECS, &opts, &st);
+	CHECK(r == LIBMSR_ERR_OK && st.msr_bs_records == NRECS,
+	    "%d threads, chunk %zu: 0x%x, %llu records", threads, chunk, r,
+	    (unsigned long long) st.msr_bs_records);
+
+	return r;
+}
+
+int main (void)
+{
+	static const int threads[] = { 1, 2, 4, 8, 16 };
+	static const size_t chunks[] = { 1, 7, 0 };
+	char dir[] = "/tmp/test_batchXXXXXX", path[64], ipath[80];
+	struct out want = { NULL, 0, 0 }, got = { NULL, 0, 0 };
+	msr_batch_rec_t br;
+	msr_journal_map_t *m;
+	msr_journal_rec_t rec;
+	msr_batch_stats_t st;
+	msr_batch_t opts;
+	uint8_t scratch[MSR_MAX_TRACKS][MSR_DECODE_MAX];
+	char line[4 * MSR_DECODE_MAX];
+	size_t len, t, c;
+	int n, i;
+
+	if (mkdtemp (dir) == NULL) {
+		perror ("mkdtemp");
+		return 1;
+	}
+	snprintf (path, sizeof(path), "%s/journal", dir);
+	snprintf (ipath, sizeof(ipath), "%s.idx", path);
+	if (make_journal (path) != 0 ||
+	    msr_journal_map (path, &m) != LIBMSR_ERR_OK) {
+		fprintf (stderr, "%s: can't write journal\n", path);
+		return 1;
+	}
+
+	/* What one record at a time gives. */
+	for (n = 0; n < NRECS; n++) {
+		memset (&br, 0, sizeof(br));
+		br.msr_br_index = n;
+		br.msr_br_rec = &rec;
+		CHECK(msr_journal_get (m, n, &rec) == LIBMSR_ERR_OK,
+		    "record %d", n);
+		for (i = 0; i < MSR_MAX_TRACKS; i++) {
+			if (rec.msr_jr_mode != MSR_JOURNAL_RAW) {
+				br.msr_br_tracks[i] = rec.msr_jr_tracks[i];
+				continue;
+			}
+			len = MSR_DECODE_MAX;
+			br.msr_br_result[i] = msr_decode_view (
+			    rec.msr_jr_tracks[i], scratch[i], &len,
+			    rec.msr_jr_bpc[i]);
+			if (br.msr_br_result[i] != LIBMSR_ERR_OK)
+				len = 0;
+			br.msr_br_tracks[i].msr_tv_data = scratch[i];
+			br.msr_br_tracks[i].msr_tv_len = len;
+		}
+		len = format (&br, line, sizeof(line), NULL);
+		sink (line, len, &want);
+	}
+
+	for (t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+		for (c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+			if (run (m, threads[t], chunks[c], &got) != 0)
+				continue;
+			CHECK(got.len == want.len && memcmp (got.buf, want.buf,
+			    want.len) == 0, "%d threads, chunk %zu: output "
+			    "differs", threads[t], chunks[c]);
+		}
+	}
+
+	/* Starting past the end fails, with the counters cleared. */
+	memset (&opts, 0, sizeof(opts));
+	memset (&st, 0xff, sizeof(st));
+	CHECK(msr_batch_decode (m, NRECS + 1, 1, &opts, &st) ==
+	    LIBMSR_ERR_GENERIC && st.msr_bs_records == 0 &&
+	    st.msr_bs_errors == 0 && st.msr_bs_corrupt == 0 &&
+	    st.msr_bs_threads == 0, "past the end");
+
+	msr_journal_unmap (m);
+	unlink (ipath);
+	unlink (path);
+	rmdir (dir);
+	free (want.buf);
+	free (got.buf);
+
+	printf ("test_batch: %s\n", failures ? "FAILED" : "ok");
+
+	return failures != 0;
+}
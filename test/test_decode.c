@@ -0,0 +1,168 @@
+/*
+ * Checks the word-at-a-time decoder and the table-driven track reversal
+ * in libmsr.c against the bit-at-a-time code they replaced.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "../libmsr.h"
+
+static int failures;
+
+#define CHECK(cond, ...) do {						\
+	if (!(cond)) {							\
+		printf ("%s:%d: ", __FILE__, __LINE__);			\
+		printf (__VA_ARGS__);					\
+		printf ("\n");						\
+		failures++;						\
+	}								\
+} while (0)
+
+static uint32_t rnd (uint32_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 17;
+	*s ^= *s << 5;
+	return *s;
+}
+
+static int ref_getbit (const uint8_t *buf, int bit)
+{
+	return (buf[bit / 8] >> (7 - bit % 8)) & 1;
+}
+
+/*
+ * The original msr_decode(), with a size_t output length so that it can
+ * stand in for msr_decode_view() too.
+ */
+static int ref_decode (const uint8_t *inbuf, size_t inlen, uint8_t *outbuf,
+    size_t *outlen, int bpc)
+{
+	int ch = 0;
+	char byte = 0;
+	size_t i, x = 0;
+
+	for (i = 0; i < inlen * 8; i++) {
+		byte |= ref_getbit (inbuf, i) << ch;
+		if (ch == (bpc - 1)) {
+			/* Strip the parity bit */
+			byte &= ~(1 << ch);
+			if (bpc < 7)
+				byte |= 0x30;
+			else {
+				if (byte < 0x20)
+					byte |= 0x20;
+				else {
+					byte |= 0x40;
+					byte -= 0x20;
+				}
+			}
+
+			outbuf[x] = byte;
+			x++;
+			/* Don't overflow output buffer */
+			if (x == *outlen)
+				break;
+			ch = 0;
+			byte = 0;
+		} else
+			ch++;
+	}
+
+	/* Output buffer was too small. */
+	if (x == *outlen)
+		return LIBMSR_ERR_GENERIC;
+	*outlen = x;
+
+	return LIBMSR_ERR_OK;
+}
+
+static void fill (uint8_t *buf, size_t len, uint32_t *seed)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = rnd (seed);
+}
+
+static void test_decode (void)
+{
+	uint8_t in[MSR_MAX_TRACK_LEN], want[MSR_MAX_TRACK_LEN * 8 + 1],
+	    got[MSR_MAX_TRACK_LEN * 8 + 1];
+	uint32_t seed = 0x64656321;
+	size_t len, wlen, glen;
+	uint8_t olen;
+	int bpc, k, rw, rg;
+
+	for (bpc = 1; bpc <= 8; bpc++) {
+		for (len = 0; len <= MSR_MAX_TRACK_LEN; len++) {
+			for (k = 0; k < 16; k++) {
+				fill (in, len, &seed);
+
+				/*
+				 * msr_decode(), with a short buffer at times.
+				 * (Not an empty one: the old code overran it.)
+				 */
+				olen = (k & 1) ? 1 + rnd (&seed) % 255 :
+				    MSR_MAX_TRACK_LEN;
+				wlen = olen;
+				rw = ref_decode (in, len, want, &wlen, bpc);
+				rg = msr_decode (in, len, got, &olen, bpc);
+				CHECK(rw == rg && (rw != LIBMSR_ERR_OK ||
+				    (wlen == olen && memcmp (want, got,
+				    wlen) == 0)), "msr_decode %d bpc, %zu "
+				    "bytes: 0x%x, want 0x%x", bpc, len, rg, rw);
+
+				/* msr_decode_view(), with room for it all. */
+				wlen = glen = sizeof(want);
+				rw = ref_decode (in, len, want, &wlen, bpc);
+				rg = msr_decode_view ((msr_track_view_t) { in,
+				    len }, got, &glen, bpc);
+				CHECK(rw == LIBMSR_ERR_OK && rg == rw &&
+				    wlen == glen && memcmp (want, got,
+				    wlen) == 0, "msr_decode_view %d bpc, %zu "
+				    "bytes: 0x%x", bpc, len, rg);
+			}
+		}
+	}
+}
+
+static void test_reverse (void)
+{
+	msr_track_t tk, orig;
+	uint32_t seed = 0x72657621;
+	size_t len, bit, nbits;
+	int k, ok;
+
+	for (len = 0; len <= MSR_MAX_TRACK_LEN; len++) {
+		for (k = 0; k < 4; k++) {
+			memset (&tk, 0, sizeof(tk));
+			fill (tk.msr_tk_data, len, &seed);
+			tk.msr_tk_len = len;
+			orig = tk;
+
+			msr_reverse_track (&tk);
+
+			/* Bit i of the result is bit n - 1 - i of the original. */
+			nbits = len * 8;
+			for (ok = 1, bit = 0; bit < nbits; bit++)
+				ok &= ref_getbit (tk.msr_tk_data, bit) ==
+				    ref_getbit (orig.msr_tk_data,
+				    nbits - 1 - bit);
+			CHECK(ok && tk.msr_tk_len == len &&
+			    memcmp (&tk.msr_tk_data[len], &orig.msr_tk_data[len],
+			    sizeof(tk.msr_tk_data) - len) == 0,
+			    "msr_reverse_track, %zu bytes", len);
+		}
+	}
+}
+
+int main (void)
+{
+	test_decode ();
+	test_reverse ();
+
+	printf ("test_decode: %s\n", failures ? "FAILED" : "ok");
+
+	return failures != 0;
+}
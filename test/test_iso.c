@@ -0,0 +1,181 @@
+/*
+ * Checks for the ISO 7811 track encoder and decoder in libmsr.c.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "../libmsr.h"
+
+static int failures;
+
+#define CHECK(cond, ...) do {						\
+	if (!(cond)) {							\
+		printf ("%s:%d: ", __FILE__, __LINE__);			\
+		printf (__VA_ARGS__);					\
+		printf ("\n");						\
+		failures++;						\
+	}								\
+} while (0)
+
+static uint32_t rnd (uint32_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 17;
+	*s ^= *s << 5;
+	return *s;
+}
+
+/* The characters a track with bpc bits per character can hold. */
+static int charset (int bpc, uint8_t *set)
+{
+	int first = bpc < 7 ? '0' : ' ', n = bpc < 7 ? 16 : 64;
+	int i, k = 0;
+
+	for (i = first; i < first + n; i++)
+		if (i != '%' && i != ';' && i != '?')
+			set[k++] = i;
+
+	return k;
+}
+
+/* Encode data, decode it again and compare. */
+static void roundtrip (const uint8_t *data, size_t len, int bpc,
+    size_t lead)
+{
+	uint8_t out[MSR_DECODE_MAX];
+	msr_iso_info_t info;
+	msr_track_t track;
+	size_t outlen = sizeof(out);
+	int r;
+
+	r = msr_iso_encode_track (data, len, bpc, lead, &track);
+	CHECK(r == LIBMSR_ERR_OK, "encode %d bpc, %zu chars: 0x%x", bpc, len,
+	    r);
+	if (r != LIBMSR_ERR_OK)
+		return;
+
+	r = msr_iso_decode_view (msr_track_view (&track), bpc, out, &outlen,
+	    &info);
+	CHECK(r == LIBMSR_ERR_OK && info.msr_ii_status == MSR_ISO_OK &&
+	    outlen == len && memcmp (out, data, len) == 0,
+	    "round trip %d bpc, %zu chars, lead %zu: 0x%x status %d, "
+	    "%zu chars back", bpc, len, lead, r, info.msr_ii_status, outlen);
+}
+
+static void test_roundtrip (void)
+{
+	uint8_t set[64], data[MSR_DECODE_MAX];
+	uint32_t seed = 0x69736f21;
+	size_t len, max, lead;
+	int bpc, n, i, k;
+
+	for (bpc = 5; bpc <= 8; bpc++) {
+		n = charset (bpc, set);
+
+		/* Every character on its own. */
+		for (i = 0; i < n; i++)
+			roundtrip (&set[i], 1, bpc, 0);
+
+		for (k = 0; k < 2000; k++) {
+			lead = rnd (&seed) % 64;
+			max = (MSR_MAX_TRACK_LEN * 8 - lead) / bpc - 3;
+			len = rnd (&seed) % (max + 1);
+			for (i = 0; i < (int) len; i++)
+				data[i] = set[rnd (&seed) % n];
+			roundtrip (data, len, bpc, lead);
+		}
+	}
+}
+
+/* Anything that wouldn't decode to itself must be refused. */
+static void test_reject (void)
+{
+	uint8_t set[64], c;
+	msr_track_t track;
+	int bpc, n, i, in, r;
+
+	for (bpc = 5; bpc <= 8; bpc++) {
+		n = charset (bpc, set);
+		for (c = 0; c < 0xFF; c++) {
+			for (in = 0, i = 0; i < n; i++)
+				in |= set[i] == c;
+			r = msr_iso_encode_track (&c, 1, bpc, 0, &track);
+			CHECK(in ? r == LIBMSR_ERR_OK : r == LIBMSR_ERR_ISO,
+			    "character 0x%02x at %d bpc: 0x%x", c, bpc, r);
+		}
+	}
+
+	CHECK(msr_iso_encode_track ((const uint8_t *) "12@A", 4, 6, 0,
+	    &track) == LIBMSR_ERR_ISO, "12@A at 6 bpc");
+	CHECK(msr_iso_encode_track ((const uint8_t *) "ABCe", 4, 8, 0,
+	    &track) == LIBMSR_ERR_ISO, "ABCe at 8 bpc");
+}
+
+/*
+ * Flip every bit of some encoded tracks, one at a time. A flip in a data
+ * character must be corrected, and no flip may be "corrected" into
+ * anything but the original track.
+ */
+static void test_correct (void)
+{
+	uint8_t set[64], data[80];
+	uint32_t seed = 0x66697821;
+	msr_track_t good, bad;
+	msr_iso_fix_t fix;
+	size_t len, lead, bit;
+	int bpc, n, i, k, r, indata;
+
+	for (bpc = 5; bpc <= 8; bpc++) {
+		n = charset (bpc, set);
+		for (k = 0; k < 200; k++) {
+			lead = rnd (&seed) % 40;
+			len = 1 + rnd (&seed) % sizeof(data);
+			for (i = 0; i < (int) len; i++)
+				data[i] = set[rnd (&seed) % n];
+			if (msr_iso_encode_track (data, len, bpc, lead,
+			    &good) != LIBMSR_ERR_OK)
+				continue;
+
+			for (bit = 0; bit < good.msr_tk_len * 8; bit++) {
+				bad = good;
+				bad.msr_tk_data[bit / 8] ^= 0x80 >> (bit % 8);
+				indata = bit >= lead + bpc &&
+				    bit < lead + (len + 1) * bpc;
+
+				r = msr_iso_correct_track (&bad, bpc, &fix);
+				CHECK(r == LIBMSR_ERR_OK || (!indata &&
+				    r == LIBMSR_ERR_ISO), "%d bpc, bit %zu: "
+				    "not corrected (0x%x)", bpc, bit, r);
+				if (r != LIBMSR_ERR_OK)
+					continue;
+
+				/*
+				 * A track left alone already decoded, which
+				 * one with a flipped data bit mustn't. (A
+				 * damaged start sentinel can make the decoder
+				 * settle on a later pattern, so flips outside
+				 * the data aren't checked any further.)
+				 */
+				CHECK(fix.msr_if_corrected || !indata,
+				    "%d bpc, bit %zu: left alone", bpc, bit);
+				CHECK(!fix.msr_if_corrected ||
+				    (fix.msr_if_bit == bit &&
+				    memcmp (bad.msr_tk_data, good.msr_tk_data,
+				    good.msr_tk_len) == 0),
+				    "%d bpc, bit %zu: corrected bit %zu", bpc,
+				    bit, fix.msr_if_bit);
+			}
+		}
+	}
+}
+
+int main (void)
+{
+	test_roundtrip ();
+	test_reject ();
+	test_correct ();
+
+	printf ("test_iso: %s\n", failures ? "FAILED" : "ok");
+
+	return failures != 0;
+}
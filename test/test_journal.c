@@ -0,0 +1,355 @@
+/*
+ * Checks that capture journals survive torn appends and damaged records,
+ * with and without their index, and that more appends than fit in one
+ * batch of index entries are all found again.
+ */
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../libmsr.h"
+
+static int failures;
+
+#define CHECK(cond, ...) do {						\
+	if (!(cond)) {							\
+		printf ("%s:%d: ", __FILE__, __LINE__);			\
+		printf (__VA_ARGS__);					\
+		printf ("\n");						\
+		failures++;						\
+	}								\
+} while (0)
+
+static char path[64], ipath[80];
+
+/* The tracks of the record with device id n. */
+static void tracks_for (uint32_t n, msr_tracks_t *tk)
+{
+	int i, k;
+
+	memset (tk, 0, sizeof(*tk));
+	for (i = 0; i < MSR_MAX_TRACKS; i++) {
+		tk->msr_tracks[i].msr_tk_len = (n * 7 + i * 13) % 41;
+		for (k = 0; k < tk->msr_tracks[i].msr_tk_len; k++)
+			tk->msr_tracks[i].msr_tk_data[k] = n + i + k;
+	}
+}
+
+static int append (uint32_t first, uint32_t count)
+{
+	msr_journal_t *j;
+	msr_tracks_t tk;
+	uint32_t n;
+
+	if (msr_journal_open (path, &j) != LIBMSR_ERR_OK)
+		return -1;
+	for (n = first; n < first + count; n++) {
+		tracks_for (n, &tk);
+		if (msr_journal_append (j, n + 1, n, MSR_JOURNAL_RAW, NULL,
+		    &tk) != LIBMSR_ERR_OK)
+			break;
+	}
+
+	return (msr_journal_close (j) == LIBMSR_ERR_OK && n == first + count) ?
+	    0 : -1;
+}
+
+/* The length of the record with device id n, without its padding. */
+static size_t rec_len (uint32_t n)
+{
+	msr_tracks_t tk;
+	size_t len = 32;
+	int i;
+
+	tracks_for (n, &tk);
+	for (i = 0; i < MSR_MAX_TRACKS; i++)
+		len += tk.msr_tracks[i].msr_tk_len;
+
+	return len;
+}
+
+static int rec_ok (const msr_journal_rec_t *rec, uint32_t n)
+{
+	msr_tracks_t tk;
+	int i;
+
+	tracks_for (n, &tk);
+	for (i = 0; i < MSR_MAX_TRACKS; i++)
+		if (rec->msr_jr_tracks[i].msr_tv_len !=
+		    tk.msr_tracks[i].msr_tk_len ||
+		    memcmp (rec->msr_jr_tracks[i].msr_tv_data,
+		    tk.msr_tracks[i].msr_tk_data,
+		    tk.msr_tracks[i].msr_tk_len) != 0)
+			return 0;
+
+	return rec->msr_jr_device == n && rec->msr_jr_time == n + 1 &&
+	    rec->msr_jr_mode == MSR_JOURNAL_RAW;
+}
+
+/*
+ * Map the journal and check that it holds the records with device ids
+ * 0 to count - 1, except for gone, and that bad is counted but can't be
+ * looked up. (-1 for neither.)
+ */
+static void check (uint32_t count, long gone, long bad, int line)
+{
+	msr_journal_map_t *m;
+	msr_journal_rec_t rec;
+	size_t i, n, want;
+	uint32_t id;
+	int r;
+
+	if (msr_journal_map (path, &m) != LIBMSR_ERR_OK) {
+		printf ("%s:%d: can't map\n", __FILE__, line);
+		failures++;
+		return;
+	}
+
+	n = msr_journal_count (m);
+	want = count - (gone >= 0);
+	if (n != want) {
+		printf ("%s:%d: %zu records, want %zu\n", __FILE__, line, n,
+		    want);
+		failures++;
+	}
+
+	for (i = 0, id = 0; i < n && i < want; i++, id++) {
+		if (id == gone)
+			id++;
+		r = msr_journal_get (m, i, &rec);
+		if (id == bad ? r == LIBMSR_ERR_OK :
+		    r != LIBMSR_ERR_OK || !rec_ok (&rec, id)) {
+			printf ("%s:%d: record %zu (%u): 0x%x\n", __FILE__,
+			    line, i, id, r);
+			failures++;
+			break;
+		}
+	}
+
+	msr_journal_unmap (m);
+}
+
+static uint8_t *slurp (const char *p, size_t *len)
+{
+	struct stat st;
+	uint8_t *buf;
+	int fd;
+
+	if ((fd = open (p, O_RDONLY)) == -1)
+		return NULL;
+	if (fstat (fd, &st) != 0 || (buf = malloc (st.st_size + 1)) == NULL) {
+		close (fd);
+		return NULL;
+	}
+	if (read (fd, buf, st.st_size) != st.st_size) {
+		free (buf);
+		buf = NULL;
+	}
+	close (fd);
+	*len = st.st_size;
+
+	return buf;
+}
+
+static void spew (const char *p, const uint8_t *buf, size_t len)
+{
+	int fd;
+
+	if ((fd = open (p, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 ||
+	    write (fd, buf, len) != (ssize_t) len) {
+		perror (p);
+		exit (1);
+	}
+	close (fd);
+}
+
+static off_t size_of (const char *p)
+{
+	struct stat st;
+
+	return stat (p, &st) == 0 ? st.st_size : -1;
+}
+
+/*
+ * Cut the last record off at every length, with and without the index,
+ * and then with zeros after it. Each time, the records before it must
+ * all be there, and msr_journal_open() must cut the journal back to
+ * them so that an append lands in the right place.
+ */
+static void test_torn (void)
+{
+	uint8_t *jbuf, *ibuf, *zbuf;
+	size_t jlen, ilen, cut, last;
+	int idx, whole;
+
+	unlink (path);
+	unlink (ipath);
+	if (append (0, 10) != 0) {
+		CHECK(0, "can't write journal");
+		return;
+	}
+	last = size_of (path);
+	/* Record 10 isn't a multiple of 8 long, so its padding is cut too. */
+	if (append (10, 1) != 0 || (jbuf = slurp (path, &jlen)) == NULL ||
+	    (ibuf = slurp (ipath, &ilen)) == NULL || rec_len (10) % 8 == 0) {
+		CHECK(0, "can't write journal");
+		return;
+	}
+
+	for (idx = 0; idx < 2; idx++) {
+		for (cut = last; cut <= jlen; cut++) {
+			spew (path, jbuf, cut);
+			unlink (ipath);
+			if (idx)
+				spew (ipath, ibuf, ilen);
+
+			whole = cut >= last + rec_len (10);
+			check (whole ? 11 : 10, -1, -1, __LINE__);
+			CHECK(append (11, 1) == 0, "cut at %zu: can't append",
+			    cut);
+			check (12, whole ? -1 : 10, -1, __LINE__);
+		}
+	}
+
+	/* What a crash can leave when the file grew but wasn't written. */
+	if ((zbuf = calloc (1, jlen + 4096)) != NULL) {
+		memcpy (zbuf, jbuf, jlen);
+		spew (path, zbuf, jlen + 4096);
+		unlink (ipath);
+		check (11, -1, -1, __LINE__);
+		CHECK(append (11, 1) == 0, "zeros: can't append");
+		check (12, -1, -1, __LINE__);
+		CHECK(size_of (path) < (off_t) jlen + 4096, "zeros left behind");
+		free (zbuf);
+	}
+
+	free (jbuf);
+	free (ibuf);
+}
+
+/*
+ * Spoil a record in the middle of the journal. Without an index, or with
+ * one that stops short of it, the records after it must still be found;
+ * with one that covers it, it must be counted but fail to look up.
+ */
+static void test_damaged (void)
+{
+	uint8_t *buf;
+	size_t len;
+	off_t off;
+	int idx;
+
+	for (idx = 0; idx < 3; idx++) {
+		unlink (path);
+		unlink (ipath);
+		if (append (0, 50) != 0) {
+			CHECK(0, "can't write journal");
+			return;
+		}
+		off = size_of (path);
+		if (append (50, 50) != 0 || (buf = slurp (path, &len)) == NULL) {
+			CHECK(0, "can't write journal");
+			return;
+		}
+		buf[off + 32] ^= 0xff;
+		spew (path, buf, len);
+		free (buf);
+
+		if (idx == 0)
+			unlink (ipath);
+		else if (idx == 2 && truncate (ipath, 16 + 20 * 8) != 0)
+			CHECK(0, "can't truncate index");
+
+		if (idx == 1) {
+			check (100, -1, 50, __LINE__);
+			/* Appending buries nothing the index doesn't find. */
+			CHECK(append (100, 1) == 0, "can't append");
+			check (101, -1, 50, __LINE__);
+			continue;
+		}
+
+		check (100, 50, -1, __LINE__);
+		/* Appending would put records after damage; refuse. */
+		CHECK(append (100, 1) != 0, "appended after damage");
+		CHECK(size_of (path) == (off_t) len, "damaged journal changed");
+		check (100, 50, -1, __LINE__);
+	}
+}
+
+/*
+ * More appends than one batch of index entries, read back while the
+ * journal is still open and after, and with the index unwritable.
+ */
+static void test_many (void)
+{
+	msr_journal_map_t *m;
+	msr_journal_t *j;
+	msr_tracks_t tk;
+	uint32_t n;
+	int noidx;
+
+	for (noidx = 0; noidx < 2; noidx++) {
+		unlink (path);
+		unlink (ipath);
+		if (noidx && mkdir (ipath, 0755) != 0) {
+			CHECK(0, "can't make %s", ipath);
+			return;
+		}
+
+		if (msr_journal_open (path, &j) != LIBMSR_ERR_OK) {
+			CHECK(0, "can't open journal");
+			return;
+		}
+		for (n = 0; n < 1500; n++) {
+			tracks_for (n, &tk);
+			CHECK(msr_journal_append (j, n + 1, n, MSR_JOURNAL_RAW,
+			    NULL, &tk) == LIBMSR_ERR_OK, "append %u", n);
+			if (n == 599 && msr_journal_map (path,
+			    &m) == LIBMSR_ERR_OK) {
+				CHECK(msr_journal_count (m) == 600,
+				    "%zu records while open",
+				    msr_journal_count (m));
+				msr_journal_unmap (m);
+			}
+		}
+		CHECK(msr_journal_close (j) == LIBMSR_ERR_OK, "close");
+
+		check (1500, -1, -1, __LINE__);
+		if (!noidx)
+			CHECK(size_of (ipath) == 16 + 1500 * 8,
+			    "index is %lld bytes", (long long) size_of (ipath));
+
+		/* Reopening picks up where it left off. */
+		CHECK(append (1500, 600) == 0, "can't append");
+		check (2100, -1, -1, __LINE__);
+	}
+	rmdir (ipath);
+}
+
+int main (void)
+{
+	char dir[] = "/tmp/test_journalXXXXXX";
+
+	if (mkdtemp (dir) == NULL) {
+		perror ("mkdtemp");
+		return 1;
+	}
+	snprintf (path, sizeof(path), "%s/journal", dir);
+	snprintf (ipath, sizeof(ipath), "%s.idx", path);
+
+	test_torn ();
+	test_damaged ();
+	test_many ();
+
+	unlink (ipath);
+	unlink (path);
+	rmdir (dir);
+
+	printf ("test_journal: %s\n", failures ? "FAILED" : "ok");
+
+	return failures != 0;
+}
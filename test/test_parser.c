@@ -0,0 +1,392 @@
+/*
+ * Checks that msr_parser_push() makes the same tracks out of a read
+ * response as msr_iso_read() and msr_raw_read() do, however the response
+ * is split up. Responses are recorded from the emulator, then damaged in
+ * various ways; each is played to the blocking readers over a socket,
+ * and pushed into a parser whole, a byte at a time and in random chunks.
+ */
+#include <sys/socket.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../tools/msremu.h"
+
+/* Room for any response, and for the filler after it. */
+#define RESP_MAX	(8 + MSR_MAX_TRACKS * (4 + 2 * MSR_MAX_TRACK_LEN))
+#define FILLER		(MSR_MAX_TRACKS * (3 + 255) + 4)
+
+static int failures;
+
+#define CHECK(cond, ...) do {						\
+	if (!(cond)) {							\
+		printf ("%s:%d: ", __FILE__, __LINE__);			\
+		printf (__VA_ARGS__);					\
+		printf ("\n");						\
+		failures++;						\
+	}								\
+} while (0)
+
+static uint32_t seed = 0x70617221;
+
+static uint32_t rnd (void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+/* The host and device ends of the loopback "serial port". */
+static int host, dev;
+
+/* What the event callback saw of each track. */
+struct events {
+	uint8_t	data[MSR_MAX_TRACKS][RESP_MAX + FILLER];
+	size_t	len[MSR_MAX_TRACKS];
+	size_t	endlen[MSR_MAX_TRACKS];
+	int	result[MSR_MAX_TRACKS];
+	int	ends;
+	int	status;
+};
+
+static void on_event (msr_parser_t *p, const msr_parse_event_t *ev,
+    void *cookie)
+{
+	struct events *e = cookie;
+
+	(void) p;
+	switch (ev->msr_pe_type) {
+	case MSR_PE_TRACK_DATA:
+		memcpy (&e->data[ev->msr_pe_track][e->len[ev->msr_pe_track]],
+		    ev->msr_pe_data, ev->msr_pe_len);
+		e->len[ev->msr_pe_track] += ev->msr_pe_len;
+		break;
+	case MSR_PE_TRACK_END:
+		e->endlen[ev->msr_pe_track] = ev->msr_pe_len;
+		e->result[ev->msr_pe_track] = ev->msr_pe_result;
+		e->ends++;
+		break;
+	case MSR_PE_STATUS:
+		e->status++;
+		break;
+	}
+}
+
+/* Have the emulator answer a read command with its next swipe. */
+static size_t record (msremu_t *emu, int raw, uint8_t *buf)
+{
+	uint8_t cmd[2] = { MSR_ESC, raw ? MSR_CMD_RAW_READ : MSR_CMD_READ };
+	size_t len = 0, n;
+
+	msremu_feed (emu, cmd, sizeof(cmd));
+	while ((n = msremu_output (emu, buf + len, RESP_MAX - len)) > 0)
+		len += n;
+
+	return len;
+}
+
+static void set_room (msr_tracks_t *tk, const uint8_t *room)
+{
+	int i;
+
+	memset (tk, 0, sizeof(*tk));
+	for (i = 0; i < MSR_MAX_TRACKS; i++)
+		tk->msr_tracks[i].msr_tk_len = room[i];
+}
+
+static int same_tracks (const msr_tracks_t *a, const msr_tracks_t *b)
+{
+	int i;
+
+	for (i = 0; i < MSR_MAX_TRACKS; i++)
+		if (a->msr_tracks[i].msr_tk_len != b->msr_tracks[i].msr_tk_len ||
+		    memcmp (a->msr_tracks[i].msr_tk_data,
+		    b->msr_tracks[i].msr_tk_data,
+		    a->msr_tracks[i].msr_tk_len) != 0)
+			return 0;
+
+	return 1;
+}
+
+/*
+ * Play buf to the blocking reader and return how much of it was used,
+ * or -1 on failure.
+ */
+static long blocking (int raw, const uint8_t *buf, size_t len,
+    msr_tracks_t *tk)
+{
+	uint8_t junk[256];
+	size_t left = 0;
+	int r, n;
+
+	if (write (dev, buf, len) != (ssize_t) len)
+		return -1;
+
+	r = raw ? msr_raw_read (host, tk) : msr_iso_read (host, tk);
+	CHECK(r == LIBMSR_ERR_OK, "%s read: 0x%x", raw ? "raw" : "ISO", r);
+
+	/* Whatever is left over is still waiting on the host's end. */
+	while ((n = msr_serial_read_avail (host, junk, sizeof(junk))) > 0)
+		left += n;
+	/* And the command went the other way. */
+	while (recv (dev, junk, sizeof(junk), MSG_DONTWAIT) > 0)
+		;
+
+	return (r == LIBMSR_ERR_OK) ? (long) (len - left) : -1;
+}
+
+/*
+ * Push buf in chunks of at most chunk bytes (0: random sizes) and check
+ * the outcome against what the blocking reader did with it.
+ */
+static void push (int raw, const uint8_t *buf, size_t len, size_t chunk,
+    const uint8_t *room, const msr_tracks_t *want, long used,
+    const char *what)
+{
+	static struct events ev;
+	msr_parser_t p;
+	msr_tracks_t tk;
+	size_t off = 0, n, took;
+	int i, r;
+
+	set_room (&tk, room);
+	memset (&ev, 0, sizeof(ev));
+	msr_parser_init (&p, raw, &tk, on_event, &ev);
+
+	while (off < len && !msr_parser_done (&p)) {
+		n = chunk ? chunk : 1 + rnd () % 64;
+		if (n > len - off)
+			n = len - off;
+		took = msr_parser_push (&p, buf + off, n);
+		CHECK(took == n || msr_parser_done (&p), "%s, chunk %zu: "
+		    "%zu of %zu bytes taken before the end", what, chunk,
+		    took, n);
+		off += took;
+		if (took < n)
+			break;
+	}
+
+	CHECK(msr_parser_done (&p) && (long) off == used, "%s, chunk %zu: "
+	    "took %zu bytes, the reader %ld", what, chunk, off, used);
+	CHECK(same_tracks (&tk, want), "%s, chunk %zu: tracks differ", what,
+	    chunk);
+	if (!msr_parser_done (&p))
+		return;
+
+	/* The status is the last byte of the response. */
+	r = msr_parser_result (&p);
+	CHECK(r == (buf[off - 1] == MSR_STS_OK ? LIBMSR_ERR_OK :
+	    LIBMSR_ERR_DEVICE) && ev.status == 1 && ev.ends == MSR_MAX_TRACKS,
+	    "%s, chunk %zu: result 0x%x for status 0x%02x", what, chunk, r,
+	    buf[off - 1]);
+
+	/*
+	 * The events carry the tracks in full, however little room; a
+	 * malformed track ends with no length, as the readers report it.
+	 */
+	for (i = 0; i < MSR_MAX_TRACKS; i++)
+		CHECK(ev.endlen[i] == (ev.result[i] == LIBMSR_ERR_OK ?
+		    ev.len[i] : 0) && tk.msr_tracks[i].msr_tk_len <= ev.len[i] &&
+		    memcmp (ev.data[i], tk.msr_tracks[i].msr_tk_data,
+		    tk.msr_tracks[i].msr_tk_len) == 0, "%s, chunk %zu: "
+		    "track %d events", what, chunk, i + 1);
+}
+
+/* Compare the parser and the reader on one response. */
+static void compare (int raw, const uint8_t *resp, size_t len,
+    const char *what)
+{
+	static const size_t chunks[] = { 1, 0, 0, RESP_MAX + FILLER };
+	uint8_t buf[RESP_MAX + FILLER], room[MSR_MAX_TRACKS];
+	msr_tracks_t want;
+	long used;
+	size_t c;
+	int k, i;
+
+	/*
+	 * A damaged response can send the reader looking for more than
+	 * there is; ESCs after it make sure that everything ends.
+	 */
+	memcpy (buf, resp, len);
+	memset (buf + len, MSR_ESC, FILLER);
+	len += FILLER;
+
+	for (k = 0; k < 3; k++) {
+		/* All the room there is, then a little, then none at all. */
+		for (i = 0; i < MSR_MAX_TRACKS; i++)
+			room[i] = k == 0 ? 255 : k == 1 ? rnd () % 40 : 0;
+
+		set_room (&want, room);
+		if ((used = blocking (raw, buf, len, &want)) < 0)
+			return;
+
+		for (c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++)
+			push (raw, buf, len, chunks[c], room, &want, used, what);
+	}
+}
+
+static void random_chars (char *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		s[i] = '0' + rnd () % 10;
+	s[len] = '\0';
+}
+
+/* Queue a swipe, ISO or raw, with tracks of random lengths. */
+static void add_swipe (msremu_t *emu, int raw)
+{
+	char iso[MSR_MAX_TRACKS][MSR_MAX_TRACK_LEN];
+	msr_tracks_t tk;
+	int i, k;
+
+	if (!raw) {
+		for (i = 0; i < MSR_MAX_TRACKS; i++)
+			random_chars (iso[i], rnd () % 4 == 0 ? 0 :
+			    rnd () % 108);
+		msremu_add_iso (emu, iso[0], iso[1], iso[2]);
+		return;
+	}
+
+	memset (&tk, 0, sizeof(tk));
+	for (i = 0; i < MSR_MAX_TRACKS; i++) {
+		tk.msr_tracks[i].msr_tk_len = rnd () % 4 == 0 ? 0 :
+		    rnd () % 256;
+		for (k = 0; k < tk.msr_tracks[i].msr_tk_len; k++)
+			tk.msr_tracks[i].msr_tk_data[k] = rnd ();
+	}
+	msremu_add_raw (emu, &tk);
+}
+
+/* Bytes that mean something to the parser, and one that doesn't. */
+static uint8_t nasty (void)
+{
+	static const uint8_t b[] = { MSR_ESC, MSR_RW_START, MSR_RW_END, '%',
+	    ';', 1, 2, 3, 0, 'x' };
+
+	return b[rnd () % sizeof(b)];
+}
+
+/* Take the response apart in the ways a noisy line might. */
+static void damaged (int raw, const uint8_t *resp, size_t len)
+{
+	uint8_t buf[RESP_MAX + 8];
+	size_t i, at;
+	int k;
+
+	/* The ESC before the start delimiter goes missing. */
+	compare (raw, resp + 1, len - 1, "no ESC before start");
+
+	/* Noise before it: still found on the third try, then not. */
+	for (k = 1; k <= 3; k++) {
+		for (i = 0; i < (size_t) k; i++)
+			buf[i] = 'x';
+		memcpy (buf + k, resp + 1, len - 1);
+		compare (raw, buf, len - 1 + k, "noise before start");
+	}
+
+	/* An ESC before a track, or a track number, goes missing. */
+	for (i = 2; i + 1 < len; i++) {
+		if (resp[i] != MSR_ESC || resp[i + 1] < 1 ||
+		    resp[i + 1] > MSR_MAX_TRACKS)
+			continue;
+		memcpy (buf, resp, i);
+		memcpy (buf + i, resp + i + 1, len - i - 1);
+		compare (raw, buf, len - 1, "no ESC before track");
+		memcpy (buf + i + 1, resp + i + 2, len - i - 2);
+		compare (raw, buf, len - 1, "no track number");
+	}
+
+	/* Bytes that matter to the parser turn up anywhere. */
+	for (k = 0; k < 20; k++) {
+		memcpy (buf, resp, len);
+		at = rnd () % len;
+		buf[at] = nasty ();
+		compare (raw, buf, len, "byte changed");
+	}
+
+	/* And bytes go missing. */
+	for (k = 0; k < 10; k++) {
+		at = rnd () % len;
+		memcpy (buf, resp, at);
+		memcpy (buf + at, resp + at + 1, len - at - 1);
+		compare (raw, buf, len - 1, "byte dropped");
+	}
+}
+
+int main (void)
+{
+	static const uint8_t errors[] = { MSR_STS_ERR, MSR_STS_RW_ERR };
+	uint8_t resp[RESP_MAX];
+	char full[MSR_MAX_TRACK_LEN + 1];
+	msremu_config_t cfg;
+	msremu_t *emu;
+	msr_tracks_t tk;
+	size_t len;
+	int fds[2], raw, k;
+
+	if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+		perror ("socketpair");
+		return 1;
+	}
+	host = fds[0];
+	dev = fds[1];
+	msr_serial_set_timeout (host, 1000);
+
+	memset (&cfg, 0, sizeof(cfg));
+	if ((emu = msremu_new (&cfg)) == NULL)
+		return 1;
+
+	for (raw = 0; raw < 2; raw++) {
+		/* Swipes as recorded, then damaged. */
+		for (k = 0; k < 40; k++) {
+			add_swipe (emu, raw);
+			len = record (emu, raw, resp);
+			compare (raw, resp, len, "swipe");
+			if (k < 8)
+				damaged (raw, resp, len);
+		}
+
+		/* Tracks filled right up, and empty ones. */
+		memset (full, '5', MSR_MAX_TRACK_LEN);
+		full[MSR_MAX_TRACK_LEN] = '\0';
+		memset (&tk, 0, sizeof(tk));
+		for (k = 0; k < MSR_MAX_TRACKS; k++) {
+			tk.msr_tracks[k].msr_tk_len = MSR_MAX_TRACK_LEN;
+			memcpy (tk.msr_tracks[k].msr_tk_data, full,
+			    MSR_MAX_TRACK_LEN);
+		}
+		for (k = 0; k < 2; k++) {
+			if (raw && k == 0)
+				msremu_add_raw (emu, &tk);
+			else if (k == 0)
+				msremu_add_iso (emu, full, full, full);
+			else
+				msremu_add_iso (emu, "", "", "");
+			len = record (emu, raw, resp);
+			compare (raw, resp, len, k ? "empty" : "full");
+		}
+
+		/* Bad swipes, and cards read in the wrong mode. */
+		for (k = 0; k < (int) sizeof(errors); k++) {
+			msremu_add_error (emu, errors[k]);
+			len = record (emu, raw, resp);
+			compare (raw, resp, len, "error status");
+			damaged (raw, resp, len);
+		}
+		add_swipe (emu, !raw);
+		len = record (emu, raw, resp);
+		compare (raw, resp, len, "wrong mode");
+	}
+
+	msremu_free (emu);
+	close (host);
+	close (dev);
+
+	printf ("test_parser: %s\n", failures ? "FAILED" : "ok");
+
+	return failures != 0;
+}
@@ -0,0 +1,145 @@
+/*
+ * msrdecode: decode a capture journal on every core.
+ *
+ * Prints one line per record: the record number, the timestamp, the
+ * device id and the three decoded tracks, separated by tabs. Characters
+ * outside printable ASCII are shown as '?', and a track that couldn't be
+ * decoded as '!'. The rate is reported on stderr.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../libmsr.h"
+
+static void usage (const char *prog)
+{
+	fprintf (stderr,
+	    "usage: %s [-q] [-j threads] [-b bpc] [-c chunk] [-f first]\n"
+	    "       [-n count] journal\n", prog);
+	exit (1);
+}
+
+static size_t format_rec (const msr_batch_rec_t *br, char *buf, size_t size,
+    void *cookie)
+{
+	const msr_journal_rec_t *rec = br->msr_br_rec;
+	char line[64 + MSR_MAX_TRACKS * (MSR_DECODE_MAX + 1)];
+	size_t len, j;
+	int i, n;
+	uint8_t c;
+
+	if (br->msr_br_corrupt)
+		n = snprintf (line, sizeof(line), "%zu\tcorrupt\n",
+		    br->msr_br_index);
+	else {
+		len = snprintf (line, sizeof(line), "%zu\t%llu\t%lu",
+		    br->msr_br_index, (unsigned long long) rec->msr_jr_time,
+		    (unsigned long) rec->msr_jr_device);
+		for (i = 0; i < MSR_MAX_TRACKS; i++) {
+			line[len++] = '\t';
+			if (br->msr_br_result[i] != LIBMSR_ERR_OK) {
+				line[len++] = '!';
+				continue;
+			}
+			for (j = 0; j < br->msr_br_tracks[i].msr_tv_len; j++) {
+				c = br->msr_br_tracks[i].msr_tv_data[j];
+				line[len++] = (c >= ' ' && c <= '~') ? c : '?';
+			}
+		}
+		line[len++] = '\n';
+		n = len;
+	}
+
+	if ((size_t) n <= size)
+		memcpy (buf, line, n);
+
+	return n;
+}
+
+static int sink (const void *buf, size_t len, void *cookie)
+{
+	const char *p = buf;
+	ssize_t r;
+
+	while (len > 0) {
+		if ((r = write (STDOUT_FILENO, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror ("write");
+			return -1;
+		}
+		p += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+int main (int argc, char **argv)
+{
+	msr_batch_stats_t stats;
+	msr_journal_map_t *m;
+	struct timespec t0, t1;
+	msr_batch_t opts;
+	size_t first = 0, count = (size_t) -1;
+	double secs;
+	int c, quiet = 0, r;
+
+	memset (&opts, 0, sizeof(opts));
+
+	while ((c = getopt (argc, argv, "b:c:f:j:n:q")) != -1) {
+		switch (c) {
+		case 'b':
+			opts.msr_bt_bpc = atoi (optarg);
+			break;
+		case 'c':
+			opts.msr_bt_chunk = strtoul (optarg, NULL, 10);
+			break;
+		case 'f':
+			first = strtoul (optarg, NULL, 10);
+			break;
+		case 'j':
+			opts.msr_bt_threads = atoi (optarg);
+			break;
+		case 'n':
+			count = strtoul (optarg, NULL, 10);
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		default:
+			usage (argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage (argv[0]);
+
+	if (msr_journal_map (argv[optind], &m) != LIBMSR_ERR_OK) {
+		fprintf (stderr, "%s: can't read journal\n", argv[optind]);
+		return 1;
+	}
+
+	opts.msr_bt_format = format_rec;
+	if (!quiet)
+		opts.msr_bt_sink = sink;
+
+	clock_gettime (CLOCK_MONOTONIC, &t0);
+	r = msr_batch_decode (m, first, count, &opts, &stats);
+	clock_gettime (CLOCK_MONOTONIC, &t1);
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+	fprintf (stderr, "%llu records in %.3f s (%.0f/s) on %d threads, "
+	    "%llu undecodable tracks, %llu corrupt records\n",
+	    (unsigned long long) stats.msr_bs_records, secs,
+	    stats.msr_bs_records / (secs > 0 ? secs : 1e-9),
+	    stats.msr_bs_threads, (unsigned long long) stats.msr_bs_errors,
+	    (unsigned long long) stats.msr_bs_corrupt);
+
+	msr_journal_unmap (m);
+
+	return r != LIBMSR_ERR_OK;
+}
@@ -0,0 +1,865 @@
+/* posix_openpt() and friends are XSI. */
+#define _XOPEN_SOURCE 700
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "msremu.h"
+
+#define MSREMU_INBUF 2048
+#define MSREMU_OUTBUF 8192
+
+/* Characters on the wire are 8N1: ten bit times per byte. */
+#define MSREMU_BITS_PER_BYTE 10
+
+enum msremu_swipe_kind {
+	MSREMU_SWIPE_ISO,
+	MSREMU_SWIPE_RAW,
+	MSREMU_SWIPE_ERROR,
+};
+
+struct msremu_swipe {
+	int kind;
+	uint8_t status;
+	msr_tracks_t tracks; /* characters for ISO swipes, bytes for raw */
+};
+
+enum msremu_state {
+	MSREMU_ST_IDLE, /* waiting for ESC */
+	MSREMU_ST_CMD, /* waiting for the command byte */
+	MSREMU_ST_ARGS, /* collecting fixed-length arguments */
+	MSREMU_ST_PAYLOAD, /* collecting a write payload */
+};
+
+/* Commands that wait for a card to be swiped before they respond. */
+enum msremu_pending {
+	MSREMU_P_NONE,
+	MSREMU_P_READ,
+	MSREMU_P_RAW_READ,
+	MSREMU_P_SENSOR,
+	MSREMU_P_STATUS, /* write or erase: acknowledge with emu->status */
+};
+
+struct msremu {
+	msremu_config_t cfg;
+
+	struct msremu_swipe *swipes;
+	size_t nswipes;
+	size_t capswipes;
+	size_t next;
+	struct msremu_swipe written;
+	int have_written;
+
+	/* Input parser */
+	int state;
+	uint8_t cmd;
+	uint8_t in[MSREMU_INBUF];
+	size_t inlen;
+	size_t need;
+
+	/* Device settings */
+	uint8_t co;
+	uint8_t bpi;
+	msr_bpc_t bpc;
+	uint8_t lz_tk1_3;
+	uint8_t lz_tk2;
+
+	/* Command waiting for a swipe */
+	int pending;
+	uint8_t status;
+	uint64_t due;
+
+	uint64_t busy_until; /* resetting until then */
+
+	unsigned ncmds;
+	unsigned nout;
+
+	uint8_t out[MSREMU_OUTBUF];
+	size_t outhead;
+	size_t outtail;
+
+	int master;
+	int slave;
+};
+
+static uint64_t msremu_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+msremu_t *msremu_new (const msremu_config_t *config)
+{
+	msremu_t *emu;
+
+	if ((emu = calloc (1, sizeof(*emu))) == NULL)
+		return NULL;
+
+	if (config != NULL)
+		emu->cfg = *config;
+
+	emu->co = MSR_CO_HI;
+	emu->bpi = 210;
+	emu->bpc.msr_bpctk1 = 7;
+	emu->bpc.msr_bpctk2 = 5;
+	emu->bpc.msr_bpctk3 = 5;
+	emu->lz_tk1_3 = 61;
+	emu->lz_tk2 = 22;
+	emu->master = emu->slave = -1;
+
+	return emu;
+}
+
+void msremu_free (msremu_t *emu)
+{
+	if (emu == NULL)
+		return;
+
+	if (emu->master != -1)
+		close (emu->master);
+	if (emu->slave != -1)
+		close (emu->slave);
+
+	free (emu->swipes);
+	free (emu);
+}
+
+static int msremu_add (msremu_t *emu, const struct msremu_swipe *swipe)
+{
+	struct msremu_swipe *s;
+	size_t cap;
+
+	if (emu->nswipes == emu->capswipes) {
+		cap = emu->capswipes ? emu->capswipes * 2 : 16;
+		s = realloc (emu->swipes, cap * sizeof(*s));
+		if (s == NULL)
+			return -1;
+		emu->swipes = s;
+		emu->capswipes = cap;
+	}
+
+	emu->swipes[emu->nswipes++] = *swipe;
+
+	/* A read that was waiting for a card now has one on its way. */
+	if (emu->pending != MSREMU_P_NONE && emu->due == UINT64_MAX)
+		emu->due = msremu_now () +
+		    (uint64_t) emu->cfg.swipe_delay * 1000000;
+
+	return 0;
+}
+
+static void msremu_set_track (msr_track_t *track, const void *data,
+    size_t len)
+{
+	if (len > MSR_MAX_TRACK_LEN)
+		len = MSR_MAX_TRACK_LEN;
+
+	memcpy (track->msr_tk_data, data, len);
+	track->msr_tk_len = len;
+}
+
+int msremu_add_iso (msremu_t *emu, const char *tk1, const char *tk2,
+    const char *tk3)
+{
+	struct msremu_swipe swipe;
+	const char *tk[MSR_MAX_TRACKS];
+	int i;
+
+	memset (&swipe, 0, sizeof(swipe));
+	swipe.kind = MSREMU_SWIPE_ISO;
+	swipe.status = MSR_STS_OK;
+
+	tk[0] = tk1;
+	tk[1] = tk2;
+	tk[2] = tk3;
+	for (i = 0; i < MSR_MAX_TRACKS; i++)
+		if (tk[i] != NULL)
+			msremu_set_track (&swipe.tracks.msr_tracks[i], tk[i],
+			    strlen (tk[i]));
+
+	return msremu_add (emu, &swipe);
+}
+
+int msremu_add_raw (msremu_t *emu, const msr_tracks_t *tracks)
+{
+	struct msremu_swipe swipe;
+
+	memset (&swipe, 0, sizeof(swipe));
+	swipe.kind = MSREMU_SWIPE_RAW;
+	swipe.status = MSR_STS_OK;
+	swipe.tracks = *tracks;
+
+	return msremu_add (emu, &swipe);
+}
+
+int msremu_add_error (msremu_t *emu, uint8_t status)
+{
+	struct msremu_swipe swipe;
+
+	memset (&swipe, 0, sizeof(swipe));
+	swipe.kind = MSREMU_SWIPE_ERROR;
+	swipe.status = status;
+
+	return msremu_add (emu, &swipe);
+}
+
+static int msremu_hexval (int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* Split "a|b|c" in place into at most MSR_MAX_TRACKS fields. */
+static void msremu_fields (char *s, char *tk[MSR_MAX_TRACKS])
+{
+	int i;
+
+	for (i = 0; i < MSR_MAX_TRACKS; i++) {
+		tk[i] = s;
+		if (s != NULL && (s = strchr (s, '|')) != NULL)
+			*s++ = '\0';
+		if (tk[i] != NULL && strcmp (tk[i], "-") == 0)
+			tk[i] = NULL;
+	}
+}
+
+static int msremu_parse_hex (const char *s, msr_track_t *track)
+{
+	int hi, lo;
+
+	track->msr_tk_len = 0;
+	if (s == NULL)
+		return 0;
+
+	while (*s != '\0') {
+		if ((hi = msremu_hexval (s[0])) < 0 ||
+		    (lo = msremu_hexval (s[1])) < 0)
+			return -1;
+		if (track->msr_tk_len == MSR_MAX_TRACK_LEN)
+			return -1;
+		track->msr_tk_data[track->msr_tk_len++] = hi << 4 | lo;
+		s += 2;
+	}
+
+	return 0;
+}
+
+int msremu_load_script (msremu_t *emu, const char *path)
+{
+	char line[2048], *p, *arg, *tk[MSR_MAX_TRACKS];
+	msr_tracks_t tracks;
+	unsigned long status;
+	FILE *f;
+	int i, lineno = 0, r = 0;
+
+	if ((f = fopen (path, "r")) == NULL)
+		return -1;
+
+	while (r == 0 && fgets (line, sizeof(line), f) != NULL) {
+		lineno++;
+		line[strcspn (line, "\r\n")] = '\0';
+
+		for (p = line; *p == ' ' || *p == '\t'; p++)
+			;
+		if (*p == '\0' || *p == '#')
+			continue;
+
+		arg = p + strcspn (p, " \t");
+		if (*arg != '\0')
+			*arg++ = '\0';
+		while (*arg == ' ' || *arg == '\t')
+			arg++;
+
+		if (strcmp (p, "iso") == 0) {
+			msremu_fields (arg, tk);
+			r = msremu_add_iso (emu, tk[0], tk[1], tk[2]);
+		} else if (strcmp (p, "raw") == 0) {
+			msremu_fields (arg, tk);
+			memset (&tracks, 0, sizeof(tracks));
+			for (i = 0; r == 0 && i < MSR_MAX_TRACKS; i++)
+				r = msremu_parse_hex (tk[i],
+				    &tracks.msr_tracks[i]);
+			if (r == 0)
+				r = msremu_add_raw (emu, &tracks);
+		} else if (strcmp (p, "error") == 0) {
+			status = strtoul (arg, NULL, 16);
+			r = msremu_add_error (emu, (uint8_t) status);
+		} else {
+			r = -1;
+		}
+
+		if (r != 0)
+			fprintf (stderr, "%s:%d: bad swipe\n", path, lineno);
+	}
+
+	fclose (f);
+
+	return r;
+}
+
+static void msremu_put (msremu_t *emu, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	size_t i;
+
+	/* A stalled device has gone quiet. */
+	if (emu->cfg.stall_after && emu->ncmds > emu->cfg.stall_after)
+		return;
+
+	for (i = 0; i < len; i++) {
+		if ((emu->outtail + 1) % MSREMU_OUTBUF == emu->outhead)
+			return;
+		emu->out[emu->outtail] = p[i];
+		emu->outtail = (emu->outtail + 1) % MSREMU_OUTBUF;
+	}
+}
+
+static void msremu_put2 (msremu_t *emu, uint8_t a, uint8_t b)
+{
+	uint8_t buf[2];
+
+	buf[0] = a;
+	buf[1] = b;
+	msremu_put (emu, buf, 2);
+}
+
+/* Take the next card to be swiped, if there is one. */
+static struct msremu_swipe *msremu_take (msremu_t *emu)
+{
+	if (emu->cfg.loopback && emu->have_written) {
+		emu->have_written = 0;
+		return &emu->written;
+	}
+
+	if (emu->next == emu->nswipes && emu->cfg.loop)
+		emu->next = 0;
+
+	if (emu->next == emu->nswipes)
+		return NULL;
+
+	return &emu->swipes[emu->next++];
+}
+
+static int msremu_have_card (msremu_t *emu)
+{
+	return (emu->cfg.loopback && emu->have_written) ||
+	    emu->next < emu->nswipes || (emu->cfg.loop && emu->nswipes);
+}
+
+static void msremu_send_read (msremu_t *emu, const struct msremu_swipe *s,
+    int raw)
+{
+	static const uint8_t ss[MSR_MAX_TRACKS] = { '%', ';', ';' };
+	const msr_track_t *tk;
+	uint8_t status, len;
+	int i, ok;
+
+	status = s->status;
+	ok = (s->kind == MSREMU_SWIPE_RAW) == raw;
+
+	/* We can't re-encode a card for the other read mode. */
+	if (s->kind != MSREMU_SWIPE_ERROR && !ok)
+		status = MSR_STS_RW_ERR;
+	ok = ok && s->kind != MSREMU_SWIPE_ERROR;
+
+	msremu_put2 (emu, MSR_ESC, MSR_RW_START);
+
+	for (i = 0; i < MSR_MAX_TRACKS; i++) {
+		tk = &s->tracks.msr_tracks[i];
+		msremu_put2 (emu, MSR_ESC, i + 1);
+
+		len = ok ? tk->msr_tk_len : 0;
+
+		if (raw) {
+			msremu_put (emu, &len, 1);
+			msremu_put (emu, tk->msr_tk_data, len);
+		} else {
+			msremu_put (emu, &ss[i], 1);
+			msremu_put (emu, tk->msr_tk_data, len);
+			msremu_put (emu, "?", 1);
+		}
+	}
+
+	msremu_put2 (emu, MSR_RW_END, MSR_FS);
+	msremu_put2 (emu, MSR_ESC, status);
+}
+
+/* Deliver the response to a command that was waiting for a swipe. */
+static void msremu_poll (msremu_t *emu)
+{
+	struct msremu_swipe *s;
+
+	if (emu->pending == MSREMU_P_NONE || msremu_now () < emu->due)
+		return;
+
+	if (emu->pending == MSREMU_P_STATUS) {
+		msremu_put2 (emu, MSR_ESC, emu->status);
+		emu->pending = MSREMU_P_NONE;
+		return;
+	}
+
+	if ((s = msremu_take (emu)) == NULL) {
+		emu->due = UINT64_MAX;
+		return;
+	}
+
+	if (emu->pending == MSREMU_P_SENSOR)
+		msremu_put2 (emu, MSR_ESC, MSR_STS_SENSOR_OK);
+	else
+		msremu_send_read (emu, s, emu->pending == MSREMU_P_RAW_READ);
+
+	emu->pending = MSREMU_P_NONE;
+}
+
+static void msremu_wait_swipe (msremu_t *emu, int pending)
+{
+	emu->pending = pending;
+
+	if (pending == MSREMU_P_STATUS || msremu_have_card (emu))
+		emu->due = msremu_now () +
+		    (uint64_t) emu->cfg.swipe_delay * 1000000;
+	else
+		emu->due = UINT64_MAX;
+}
+
+/* Strip the sentinels the host may have included in ISO write data. */
+static void msremu_iso_track (msr_track_t *tk, const uint8_t *p, size_t len)
+{
+	if (len && (p[0] == '%' || p[0] == ';')) {
+		p++;
+		len--;
+	}
+	if (len && p[len - 1] == MSR_RW_END)
+		len--;
+
+	msremu_set_track (tk, p, len);
+}
+
+/*
+ * Try to parse a complete write payload:
+ *
+ *   ESC s ESC 1 [len] data ESC 2 [len] data ESC 3 [len] data ? FS
+ *
+ * Raw payloads carry a length byte per track; ISO ones don't. Returns 1
+ * when the payload is complete (storing the card in emu->written), 0 if
+ * more bytes are needed, or -1 if the payload is malformed.
+ */
+static int msremu_parse_write (msremu_t *emu, int raw)
+{
+	struct msremu_swipe card;
+	const uint8_t *p = emu->in;
+	size_t n = emu->inlen, i = 2, start, len;
+	int t;
+
+	if (n < 2)
+		return 0;
+	if (p[0] != MSR_ESC || p[1] != MSR_RW_START)
+		return -1;
+
+	memset (&card, 0, sizeof(card));
+	card.kind = raw ? MSREMU_SWIPE_RAW : MSREMU_SWIPE_ISO;
+	card.status = MSR_STS_OK;
+
+	for (t = 0; t < MSR_MAX_TRACKS; t++) {
+		if (i + 2 > n)
+			return 0;
+		if (p[i] != MSR_ESC || p[i + 1] != t + 1)
+			return -1;
+		i += 2;
+
+		if (raw) {
+			if (i + 1 > n)
+				return 0;
+			len = p[i++];
+			if (i + len > n)
+				return 0;
+			msremu_set_track (&card.tracks.msr_tracks[t], &p[i],
+			    len);
+			i += len;
+		} else {
+			start = i;
+			while (i < n && p[i] != MSR_ESC &&
+			    !(p[i] == MSR_RW_END && i + 1 < n &&
+			    p[i + 1] == MSR_FS))
+				i++;
+			if (i == n || (p[i] == MSR_RW_END && i + 1 == n))
+				return 0;
+			msremu_iso_track (&card.tracks.msr_tracks[t],
+			    &p[start], i - start);
+		}
+	}
+
+	if (i + 2 > n)
+		return 0;
+	if (p[i] != MSR_RW_END || p[i + 1] != MSR_FS)
+		return -1;
+
+	emu->written = card;
+	emu->have_written = 1;
+
+	return 1;
+}
+
+static void msremu_command (msremu_t *emu, uint8_t cmd)
+{
+	emu->cmd = cmd;
+	emu->ncmds++;
+	emu->state = MSREMU_ST_IDLE;
+	emu->inlen = 0;
+
+	switch (cmd) {
+	case MSR_CMD_READ:
+		msremu_wait_swipe (emu, MSREMU_P_READ);
+		break;
+	case MSR_CMD_RAW_READ:
+		msremu_wait_swipe (emu, MSREMU_P_RAW_READ);
+		break;
+	case MSR_CMD_DIAG_SENSOR:
+		msremu_wait_swipe (emu, MSREMU_P_SENSOR);
+		break;
+	case MSR_CMD_WRITE:
+	case MSR_CMD_RAW_WRITE:
+		emu->state = MSREMU_ST_PAYLOAD;
+		break;
+	case MSR_CMD_ERASE:
+	case MSR_CMD_SETBPI:
+		emu->state = MSREMU_ST_ARGS;
+		emu->need = 1;
+		break;
+	case MSR_CMD_SLZ:
+		emu->state = MSREMU_ST_ARGS;
+		emu->need = 2;
+		break;
+	case MSR_CMD_SETBPC:
+		emu->state = MSREMU_ST_ARGS;
+		emu->need = sizeof(msr_bpc_t);
+		break;
+	case MSR_CMD_DIAG_COMM:
+		msremu_put2 (emu, MSR_ESC, MSR_STS_COMM_OK);
+		break;
+	case MSR_CMD_DIAG_RAM:
+		msremu_put2 (emu, MSR_ESC, MSR_STS_RAM_OK);
+		break;
+	case MSR_CMD_CLZ:
+		msremu_put2 (emu, MSR_ESC, emu->lz_tk1_3);
+		msremu_put (emu, &emu->lz_tk2, 1);
+		break;
+	case MSR_CMD_SETCO_HI:
+		emu->co = MSR_CO_HI;
+		msremu_put2 (emu, MSR_ESC, MSR_STS_CO_OK);
+		break;
+	case MSR_CMD_SETCO_LO:
+		emu->co = MSR_CO_LO;
+		msremu_put2 (emu, MSR_ESC, MSR_STS_CO_OK);
+		break;
+	case MSR_CMD_GETCO:
+		msremu_put2 (emu, MSR_ESC, emu->co);
+		break;
+	case MSR_CMD_MODEL:
+		msremu_put2 (emu, MSR_ESC, MSR_MODEL_MSR206_3);
+		msremu_put (emu, "S", 1);
+		break;
+	case MSR_CMD_FWREV:
+		msremu_put (emu, "\033REVE1.00", 9);
+		break;
+	case MSR_CMD_RESET:
+		emu->pending = MSREMU_P_NONE;
+		if (emu->cfg.reset_time)
+			emu->busy_until = msremu_now () +
+			    (uint64_t) emu->cfg.reset_time * 1000000;
+		break;
+	default:
+		/* LED commands and anything we don't know: no response. */
+		break;
+	}
+}
+
+static void msremu_args (msremu_t *emu)
+{
+	const uint8_t *a = emu->in;
+
+	emu->state = MSREMU_ST_IDLE;
+	emu->inlen = 0;
+
+	switch (emu->cmd) {
+	case MSR_CMD_ERASE:
+		emu->status = MSR_STS_ERASE_OK;
+		msremu_wait_swipe (emu, MSREMU_P_STATUS);
+		break;
+	case MSR_CMD_SETBPI:
+		emu->bpi = a[0];
+		msremu_put2 (emu, MSR_ESC, MSR_STS_BPI_OK);
+		break;
+	case MSR_CMD_SLZ:
+		emu->lz_tk1_3 = a[0];
+		emu->lz_tk2 = a[1];
+		msremu_put2 (emu, MSR_ESC, MSR_STS_SLZ_OK);
+		break;
+	case MSR_CMD_SETBPC:
+		memcpy (&emu->bpc, a, sizeof(emu->bpc));
+		msremu_put2 (emu, MSR_ESC, MSR_STS_BPC_OK);
+		msremu_put (emu, &emu->bpc, sizeof(emu->bpc));
+		break;
+	}
+}
+
+void msremu_feed (msremu_t *emu, const uint8_t *buf, size_t len)
+{
+	size_t i;
+	int r;
+
+	for (i = 0; i < len; i++) {
+		uint8_t b = buf[i];
+
+		/* A device that is resetting doesn't hear a thing. */
+		if (emu->busy_until && msremu_now () < emu->busy_until)
+			continue;
+
+		switch (emu->state) {
+		case MSREMU_ST_IDLE:
+			if (b == MSR_ESC)
+				emu->state = MSREMU_ST_CMD;
+			break;
+		case MSREMU_ST_CMD:
+			msremu_command (emu, b);
+			break;
+		case MSREMU_ST_ARGS:
+			emu->in[emu->inlen++] = b;
+			if (emu->inlen == emu->need)
+				msremu_args (emu);
+			break;
+		case MSREMU_ST_PAYLOAD:
+			if (emu->inlen == sizeof(emu->in)) {
+				r = -1;
+			} else {
+				emu->in[emu->inlen++] = b;
+				r = msremu_parse_write (emu,
+				    emu->cmd == MSR_CMD_RAW_WRITE);
+			}
+
+			if (r != 0) {
+				emu->status = (r > 0) ? MSR_STS_OK :
+				    MSR_STS_RW_CMDFMT_ERR;
+				emu->state = MSREMU_ST_IDLE;
+				emu->inlen = 0;
+				msremu_wait_swipe (emu, MSREMU_P_STATUS);
+			}
+			break;
+		}
+	}
+}
+
+size_t msremu_output (msremu_t *emu, uint8_t *buf, size_t len)
+{
+	size_t n = 0;
+	uint8_t b;
+
+	msremu_poll (emu);
+
+	while (n < len && emu->outhead != emu->outtail) {
+		b = emu->out[emu->outhead];
+		emu->outhead = (emu->outhead + 1) % MSREMU_OUTBUF;
+		emu->nout++;
+
+		if (emu->cfg.drop_every &&
+		    emu->nout % emu->cfg.drop_every == 0)
+			continue;
+		if (emu->cfg.corrupt_every &&
+		    emu->nout % emu->cfg.corrupt_every == 0)
+			b = ~b;
+
+		buf[n++] = b;
+	}
+
+	return n;
+}
+
+int msremu_next_event (msremu_t *emu)
+{
+	uint64_t now;
+
+	if (emu->pending == MSREMU_P_NONE || emu->due == UINT64_MAX)
+		return -1;
+
+	now = msremu_now ();
+	if (now >= emu->due)
+		return 0;
+
+	return (int) ((emu->due - now + 999999) / 1000000);
+}
+
+/* Put the slave side in raw mode so nothing is echoed or translated. */
+static int msremu_raw (int fd)
+{
+	struct termios t;
+
+	if (tcgetattr (fd, &t) == -1)
+		return -1;
+
+	t.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR |
+	    ICRNL | IXON | IXOFF | IXANY);
+	t.c_oflag &= ~OPOST;
+	t.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+	t.c_cflag &= ~(CSIZE | PARENB | CSTOPB);
+	t.c_cflag |= CS8 | CLOCAL | CREAD;
+	t.c_cc[VMIN] = 1;
+	t.c_cc[VTIME] = 0;
+
+	return tcsetattr (fd, TCSANOW, &t);
+}
+
+int msremu_open_pty (msremu_t *emu, char *path, size_t len)
+{
+	const char *name;
+	int m, s;
+
+	if ((m = posix_openpt (O_RDWR | O_NOCTTY)) == -1)
+		return -1;
+
+	if (grantpt (m) == -1 || unlockpt (m) == -1 ||
+	    (name = ptsname (m)) == NULL || strlen (name) >= len) {
+		close (m);
+		return -1;
+	}
+	strcpy (path, name);
+
+	/*
+	 * Hold the slave open ourselves: otherwise the master reports a
+	 * hangup whenever no client happens to have it open.
+	 */
+	if ((s = open (path, O_RDWR | O_NOCTTY)) == -1 || msremu_raw (s)) {
+		if (s != -1)
+			close (s);
+		close (m);
+		return -1;
+	}
+
+	fcntl (m, F_SETFL, fcntl (m, F_GETFL) | O_NONBLOCK);
+
+	emu->master = m;
+	emu->slave = s;
+
+	return 0;
+}
+
+int msremu_run (msremu_t *emu, int stopfd)
+{
+	struct pollfd pfd[2];
+	uint8_t in[512], stage[MSREMU_OUTBUF];
+	size_t stlen = 0, stoff = 0, n;
+	uint64_t byte_ns = 0, tx_next = 0, now;
+	ssize_t r;
+	int timeout, t, idle = 1;
+
+	if (emu->cfg.baud)
+		byte_ns = 1000000000ULL * MSREMU_BITS_PER_BYTE / emu->cfg.baud;
+
+	for (;;) {
+		now = msremu_now ();
+
+		/*
+		 * Pull whatever output the line could have carried by now.
+		 * While output is backed up, tx_next keeps the line's pace;
+		 * once it drains, the line is idle until the next byte.
+		 */
+		if (stoff == stlen) {
+			stoff = stlen = 0;
+			n = sizeof(stage);
+
+			if (byte_ns) {
+				if (idle && tx_next < now)
+					tx_next = now;
+				n = (tx_next <= now) ?
+				    (now - tx_next) / byte_ns + 1 : 0;
+				if (n > sizeof(stage))
+					n = sizeof(stage);
+			}
+
+			if (n) {
+				stlen = msremu_output (emu, stage, n);
+				idle = (stlen < n);
+				tx_next += stlen * byte_ns;
+			}
+		}
+
+		if (stoff < stlen) {
+			r = write (emu->master, &stage[stoff], stlen - stoff);
+			if (r > 0)
+				stoff += r;
+			else if (r == -1 && errno != EAGAIN && errno != EINTR)
+				return -1;
+		}
+
+		timeout = msremu_next_event (emu);
+		if (byte_ns && emu->outhead != emu->outtail) {
+			t = (tx_next > now) ?
+			    (int) ((tx_next - now + 999999) / 1000000) : 0;
+			if (timeout < 0 || t < timeout)
+				timeout = t;
+		}
+		if (stoff < stlen)
+			timeout = 1;
+
+		pfd[0].fd = emu->master;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = stopfd;
+		pfd[1].events = POLLIN;
+
+		if (poll (pfd, stopfd >= 0 ? 2 : 1, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		if (stopfd >= 0 && pfd[1].revents)
+			return 0;
+
+		if (pfd[0].revents & POLLIN) {
+			r = read (emu->master, in, sizeof(in));
+			if (r > 0)
+				msremu_feed (emu, in, r);
+			else if (r == 0 || (errno != EAGAIN && errno != EINTR))
+				return -1;
+		} else if (pfd[0].revents & (POLLERR | POLLNVAL)) {
+			return -1;
+		}
+	}
+}
+
+pid_t msremu_spawn (msremu_t *emu, char *path, size_t len)
+{
+	pid_t pid;
+
+	if (msremu_open_pty (emu, path, len) == -1)
+		return -1;
+
+	fflush (NULL);
+
+	if ((pid = fork ()) == 0) {
+		msremu_run (emu, -1);
+		_exit (0);
+	}
+
+	/* The child owns the pseudo-terminal now. */
+	close (emu->master);
+	close (emu->slave);
+	emu->master = emu->slave = -1;
+
+	return pid;
+}
@@ -0,0 +1,89 @@
+/*
+ * msremu: an MSR206 device emulator.
+ *
+ * The emulator speaks the subset of the MSR206 command set that libmsr
+ * implements. The protocol engine is transport-agnostic: bytes from the
+ * host are pushed in with msremu_feed() and the device's responses are
+ * pulled out with msremu_output(). msremu_open_pty() and msremu_run()
+ * serve the engine over a pseudo-terminal, so that a program linked
+ * against libmsr can talk to it exactly as it would to real hardware.
+ */
+#ifndef MSREMU_H
+#define MSREMU_H
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../libmsr.h"
+
+/**
+ * @brief Emulator configuration.
+ */
+typedef struct msremu_config {
+	unsigned drop_every; /**< Drop every Nth byte sent to the host (0: never) */
+	unsigned corrupt_every; /**< Invert every Nth byte sent to the host (0: never) */
+	unsigned stall_after; /**< Stop responding after N commands (0: never) */
+	unsigned baud; /**< Throttle output to this baud rate (0: unthrottled) */
+	unsigned swipe_delay; /**< Delay before a card is "swiped", in ms */
+	unsigned reset_time; /**< Input is ignored for this long after a reset, in ms */
+	int loop; /**< Replay the swipe script once it runs out */
+	int loopback; /**< Written cards are swiped back on the next read */
+} msremu_config_t;
+
+typedef struct msremu msremu_t;
+
+extern msremu_t *msremu_new(const msremu_config_t *config);
+extern void msremu_free(msremu_t *emu);
+
+/*
+ * Queue swipes. ISO track data excludes the start and end sentinels; NULL
+ * or "" means the track is empty. A raw swipe is served as-is.
+ */
+extern int msremu_add_iso(msremu_t *emu, const char *tk1, const char *tk2,
+    const char *tk3);
+extern int msremu_add_raw(msremu_t *emu, const msr_tracks_t *tracks);
+extern int msremu_add_error(msremu_t *emu, uint8_t status);
+
+/*
+ * Load a swipe script. Each non-blank line that doesn't start with '#'
+ * queues one swipe:
+ *
+ *   iso <tk1>|<tk2>|<tk3>	ISO character data, '-' for an empty track
+ *   raw <hex>|<hex>|<hex>	raw track bytes in hex, '-' for an empty track
+ *   error <hex>		a bad swipe, reported with the given status
+ */
+extern int msremu_load_script(msremu_t *emu, const char *path);
+
+/* Push bytes sent by the host into the protocol engine. */
+extern void msremu_feed(msremu_t *emu, const uint8_t *buf, size_t len);
+
+/*
+ * Pull up to len bytes of device output. Pending swipes whose delay has
+ * passed are delivered first. Faults are applied here; throttling is the
+ * transport's job (see msremu_run()).
+ */
+extern size_t msremu_output(msremu_t *emu, uint8_t *buf, size_t len);
+
+/* Milliseconds until a pending swipe is due, or -1 if none is. */
+extern int msremu_next_event(msremu_t *emu);
+
+/*
+ * Create a pseudo-terminal for the emulator and store the path of its
+ * slave side (the "serial port" to hand to msr_serial_open()) in path.
+ */
+extern int msremu_open_pty(msremu_t *emu, char *path, size_t len);
+
+/*
+ * Serve the pseudo-terminal until stopfd (if not -1) becomes readable
+ * or an I/O error occurs.
+ */
+extern int msremu_run(msremu_t *emu, int stopfd);
+
+/*
+ * Fork a child that serves the emulator on a fresh pseudo-terminal.
+ * The slave path is stored in path; kill the returned pid to stop it.
+ */
+extern pid_t msremu_spawn(msremu_t *emu, char *path, size_t len);
+
+#endif /* MSREMU_H */
@@ -0,0 +1,99 @@
+/*
+ * msremu: serve an emulated MSR206 on a pseudo-terminal.
+ *
+ * Prints the path of the emulated serial port and runs until killed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "msremu.h"
+
+static void usage (const char *prog)
+{
+	fprintf (stderr,
+	    "usage: %s [-lw] [-s script] [-b baud] [-D delay_ms]\n"
+	    "       [-d drop_every] [-c corrupt_every] [-S stall_after]\n"
+	    "       [-L link] [-R reset_ms]\n", prog);
+	exit (1);
+}
+
+int main (int argc, char **argv)
+{
+	msremu_config_t cfg;
+	msremu_t *emu;
+	const char *script = NULL, *link = NULL;
+	char path[256];
+	int c;
+
+	memset (&cfg, 0, sizeof(cfg));
+
+	while ((c = getopt (argc, argv, "b:c:d:D:lL:R:s:S:w")) != -1) {
+		switch (c) {
+		case 'b':
+			cfg.baud = strtoul (optarg, NULL, 10);
+			break;
+		case 'c':
+			cfg.corrupt_every = strtoul (optarg, NULL, 10);
+			break;
+		case 'd':
+			cfg.drop_every = strtoul (optarg, NULL, 10);
+			break;
+		case 'D':
+			cfg.swipe_delay = strtoul (optarg, NULL, 10);
+			break;
+		case 'l':
+			cfg.loop = 1;
+			break;
+		case 'L':
+			link = optarg;
+			break;
+		case 'R':
+			cfg.reset_time = strtoul (optarg, NULL, 10);
+			break;
+		case 's':
+			script = optarg;
+			break;
+		case 'S':
+			cfg.stall_after = strtoul (optarg, NULL, 10);
+			break;
+		case 'w':
+			cfg.loopback = 1;
+			break;
+		default:
+			usage (argv[0]);
+		}
+	}
+
+	if ((emu = msremu_new (&cfg)) == NULL) {
+		perror ("msremu_new");
+		return 1;
+	}
+
+	if (script != NULL && msremu_load_script (emu, script) != 0) {
+		fprintf (stderr, "%s: can't load swipe script\n", script);
+		return 1;
+	}
+
+	if (msremu_open_pty (emu, path, sizeof(path)) != 0) {
+		perror ("msremu_open_pty");
+		return 1;
+	}
+
+	if (link != NULL) {
+		unlink (link);
+		if (symlink (path, link) != 0) {
+			perror (link);
+			return 1;
+		}
+	}
+
+	printf ("%s\n", path);
+	fflush (stdout);
+
+	msremu_run (emu, -1);
+	msremu_free (emu);
+
+	return 0;
+}
@@ -0,0 +1,336 @@
+#define _DEFAULT_SOURCE /* for MSG_NOSIGNAL */
+
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libmsr.h"
+
+/*
+ * Transports other than the serial port, which lives in serialio.c.
+ */
+
+/*
+ * In-memory loopback.
+ *
+ * Bytes for the host sit in a queue; the eventfd is only there to give
+ * the connection a descriptor, and to wake up anyone polling it. It is
+ * signaled when the queue becomes non-empty and cleared when it is
+ * drained, so a command and its response cost no system calls unless
+ * someone actually has to wait.
+ */
+struct msr_loopback {
+	pthread_mutex_t	lock;
+	uint8_t		*buf;
+	size_t		head;
+	size_t		tail;
+	size_t		size;
+	int		signaled;
+	msr_loopback_cb	cb;
+	void		*cookie;
+};
+
+static int msr_loopback_open (const char *path, int flags, speed_t baud,
+    void **priv)
+{
+	struct msr_loopback *lb;
+	int fd;
+
+	if ((lb = calloc (1, sizeof(*lb))) == NULL)
+		return -1;
+
+	if ((fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		free (lb);
+		return -1;
+	}
+
+	pthread_mutex_init (&lb->lock, NULL);
+	*priv = lb;
+
+	return fd;
+}
+
+static int msr_loopback_get (int fd, struct msr_loopback **lbp)
+{
+	const msr_transport_t *tr;
+	void *priv;
+
+	if (msr_transport_get (fd, &tr, &priv) != LIBMSR_ERR_OK ||
+	    tr != &msr_transport_loopback)
+		return LIBMSR_ERR_GENERIC;
+
+	*lbp = priv;
+
+	return LIBMSR_ERR_OK;
+}
+
+/* Queue bytes for the host. Called with lb->lock held. */
+static int msr_loopback_queue (int fd, struct msr_loopback *lb,
+    const void *buf, size_t len)
+{
+	uint64_t one = 1;
+	uint8_t *nbuf;
+	size_t size;
+
+	if (lb->head == lb->tail)
+		lb->head = lb->tail = 0;
+
+	if (lb->tail + len > lb->size) {
+		/* Slide what's left to the front, then grow if need be. */
+		memmove (lb->buf, &lb->buf[lb->head], lb->tail - lb->head);
+		lb->tail -= lb->head;
+		lb->head = 0;
+
+		for (size = lb->size ? lb->size : 1024; lb->tail + len > size; )
+			size *= 2;
+		if (size != lb->size) {
+			if ((nbuf = realloc (lb->buf, size)) == NULL)
+				return -1;
+			lb->buf = nbuf;
+			lb->size = size;
+		}
+	}
+
+	memcpy (&lb->buf[lb->tail], buf, len);
+	lb->tail += len;
+
+	if (!lb->signaled && len > 0) {
+		lb->signaled = 1;
+		write (fd, &one, sizeof(one));
+	}
+
+	return 0;
+}
+
+static ssize_t msr_loopback_read (int fd, void *priv, void *buf, size_t len)
+{
+	struct msr_loopback *lb = priv;
+	uint64_t n;
+
+	pthread_mutex_lock (&lb->lock);
+
+	if (lb->head == lb->tail) {
+		pthread_mutex_unlock (&lb->lock);
+		errno = EAGAIN;
+		return -1;
+	}
+
+	if (len > lb->tail - lb->head)
+		len = lb->tail - lb->head;
+	memcpy (buf, &lb->buf[lb->head], len);
+	lb->head += len;
+
+	if (lb->head == lb->tail && lb->signaled) {
+		lb->signaled = 0;
+		read (fd, &n, sizeof(n));
+	}
+
+	pthread_mutex_unlock (&lb->lock);
+
+	return (len);
+}
+
+static ssize_t msr_loopback_write (int fd, void *priv, const void *buf,
+    size_t len)
+{
+	struct msr_loopback *lb = priv;
+	msr_loopback_cb cb;
+	void *cookie;
+	int r;
+
+	pthread_mutex_lock (&lb->lock);
+	cb = lb->cb;
+	cookie = lb->cookie;
+	r = (cb == NULL) ? msr_loopback_queue (fd, lb, buf, len) : 0;
+	pthread_mutex_unlock (&lb->lock);
+
+	if (r != 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (cb != NULL)
+		cb (fd, buf, len, cookie);
+
+	return (len);
+}
+
+static int msr_loopback_wait (int fd, void *priv, int events, int cancelfd,
+    int timeout)
+{
+	struct msr_loopback *lb = priv;
+	int ready;
+
+	if (!(events & POLLIN))
+		return 1;
+
+	pthread_mutex_lock (&lb->lock);
+	ready = (lb->head != lb->tail);
+	pthread_mutex_unlock (&lb->lock);
+
+	if (ready)
+		return 1;
+
+	/* Someone else has to push the data; sleep on the eventfd. */
+	return msr_fd_wait (fd, NULL, POLLIN, cancelfd, timeout);
+}
+
+static int msr_loopback_flush (int fd, void *priv)
+{
+	struct msr_loopback *lb = priv;
+	uint64_t n;
+
+	pthread_mutex_lock (&lb->lock);
+	lb->head = lb->tail = 0;
+	if (lb->signaled) {
+		lb->signaled = 0;
+		read (fd, &n, sizeof(n));
+	}
+	pthread_mutex_unlock (&lb->lock);
+
+	return 0;
+}
+
+static int msr_loopback_close (int fd, void *priv)
+{
+	struct msr_loopback *lb = priv;
+
+	pthread_mutex_destroy (&lb->lock);
+	free (lb->buf);
+	free (lb);
+
+	return close (fd);
+}
+
+const msr_transport_t msr_transport_loopback = {
+	"loopback",
+	msr_loopback_open,
+	msr_loopback_read,
+	msr_loopback_write,
+	msr_loopback_wait,
+	msr_loopback_flush,
+	msr_loopback_close
+};
+
+int msr_loopback_attach (int fd, msr_loopback_cb cb, void *cookie)
+{
+	struct msr_loopback *lb;
+
+	if (msr_loopback_get (fd, &lb) != LIBMSR_ERR_OK)
+		return LIBMSR_ERR_GENERIC;
+
+	pthread_mutex_lock (&lb->lock);
+	lb->cb = cb;
+	lb->cookie = cookie;
+	pthread_mutex_unlock (&lb->lock);
+
+	return LIBMSR_ERR_OK;
+}
+
+int msr_loopback_push (int fd, const void *buf, size_t len)
+{
+	struct msr_loopback *lb;
+	int r;
+
+	if (msr_loopback_get (fd, &lb) != LIBMSR_ERR_OK)
+		return LIBMSR_ERR_GENERIC;
+
+	pthread_mutex_lock (&lb->lock);
+	r = msr_loopback_queue (fd, lb, buf, len);
+	pthread_mutex_unlock (&lb->lock);
+
+	return (r == 0) ? LIBMSR_ERR_OK : LIBMSR_ERR_GENERIC;
+}
+
+/*
+ * File replay. A regular file is always readable, so the plain
+ * descriptor operations do for everything but writes.
+ */
+static int msr_file_open (const char *path, int flags, speed_t baud,
+    void **priv)
+{
+	*priv = NULL;
+
+	return open (path, O_RDONLY | O_CLOEXEC);
+}
+
+static ssize_t msr_file_write (int fd, void *priv, const void *buf,
+    size_t len)
+{
+	return (len);
+}
+
+const msr_transport_t msr_transport_file = {
+	"file",
+	msr_file_open,
+	msr_fd_read,
+	msr_file_write,
+	msr_fd_wait,
+	NULL,
+	msr_fd_close
+};
+
+/* Unix domain sockets. */
+static int msr_unix_open (const char *path, int flags, speed_t baud,
+    void **priv)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	if (strlen (path) >= sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	memset (&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy (sun.sun_path, path);
+
+	if ((fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+		return -1;
+
+	if (connect (fd, (struct sockaddr *) &sun, sizeof(sun)) == -1 ||
+	    ((flags & O_NONBLOCK) &&
+	    fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK) == -1)) {
+		close (fd);
+		return -1;
+	}
+
+	*priv = NULL;
+
+	return fd;
+}
+
+/* Don't let a peer that went away kill us with SIGPIPE. */
+static ssize_t msr_unix_write (int fd, void *priv, const void *buf,
+    size_t len)
+{
+	return send (fd, buf, len, MSG_NOSIGNAL);
+}
+
+static int msr_unix_flush (int fd, void *priv)
+{
+	uint8_t buf[256];
+
+	while (recv (fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+		;
+
+	return 0;
+}
+
+const msr_transport_t msr_transport_unix = {
+	"unix",
+	msr_unix_open,
+	msr_fd_read,
+	msr_unix_write,
+	msr_fd_wait,
+	msr_unix_flush,
+	msr_fd_close
+};
@@ -0,0 +1,289 @@
+#ifdef MSR_URING
+
+#define _DEFAULT_SOURCE /* for syscall() */
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+/*
+ * A minimal io_uring, driven through the raw system calls so that we
+ * don't depend on liburing. Each thread gets its own ring, so nothing
+ * here is locked: a thread only ever submits to and reaps from its own.
+ */
+#define MSR_URING_ENTRIES 256
+
+struct msr_uring {
+	int		fd;
+	void		*sq_ring;
+	size_t		sq_ring_sz;
+	void		*cq_ring;
+	size_t		cq_ring_sz;
+	struct io_uring_sqe *sqes;
+	size_t		sqes_sz;
+
+	unsigned	*sq_head;
+	unsigned	*sq_tail;
+	unsigned	sq_mask;
+	unsigned	sq_entries;
+	unsigned	*sq_array;
+	unsigned	sq_local; /* our copy of the tail */
+
+	unsigned	*cq_head;
+	unsigned	*cq_tail;
+	unsigned	cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+static pthread_key_t msr_uring_key;
+static pthread_once_t msr_uring_once = PTHREAD_ONCE_INIT;
+static int msr_uring_key_ok;
+
+static void msr_uring_free (void *arg)
+{
+	struct msr_uring *r = arg;
+
+	munmap (r->sqes, r->sqes_sz);
+	if (r->cq_ring != r->sq_ring)
+		munmap (r->cq_ring, r->cq_ring_sz);
+	munmap (r->sq_ring, r->sq_ring_sz);
+	close (r->fd);
+	free (r);
+}
+
+static void msr_uring_key_init (void)
+{
+	msr_uring_key_ok = (pthread_key_create (&msr_uring_key,
+	    msr_uring_free) == 0);
+}
+
+static struct msr_uring *msr_uring_new (void)
+{
+	struct io_uring_params p;
+	struct msr_uring *r;
+	uint8_t *sq, *cq;
+
+	if ((r = calloc (1, sizeof(*r))) == NULL)
+		return NULL;
+
+	memset (&p, 0, sizeof(p));
+	r->fd = syscall (__NR_io_uring_setup, MSR_URING_ENTRIES, &p);
+	if (r->fd < 0) {
+		free (r);
+		return NULL;
+	}
+
+	/* We wait with a timeout, which needs IORING_ENTER_EXT_ARG. */
+	if (!(p.features & IORING_FEAT_EXT_ARG)) {
+		close (r->fd);
+		free (r);
+		errno = ENOSYS;
+		return NULL;
+	}
+
+	r->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_ring_sz = p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_ring_sz > r->sq_ring_sz)
+			r->sq_ring_sz = r->cq_ring_sz;
+		r->cq_ring_sz = r->sq_ring_sz;
+	}
+
+	r->sq_ring = mmap (NULL, r->sq_ring_sz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED)
+		goto fail;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cq_ring = r->sq_ring;
+	else {
+		r->cq_ring = mmap (NULL, r->cq_ring_sz,
+		    PROT_READ | PROT_WRITE, MAP_SHARED,
+		    r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED) {
+			munmap (r->sq_ring, r->sq_ring_sz);
+			goto fail;
+		}
+	}
+
+	r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap (NULL, r->sqes_sz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		if (r->cq_ring != r->sq_ring)
+			munmap (r->cq_ring, r->cq_ring_sz);
+		munmap (r->sq_ring, r->sq_ring_sz);
+		goto fail;
+	}
+
+	sq = r->sq_ring;
+	r->sq_head = (unsigned *) (sq + p.sq_off.head);
+	r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	r->sq_mask = *(unsigned *) (sq + p.sq_off.ring_mask);
+	r->sq_entries = *(unsigned *) (sq + p.sq_off.ring_entries);
+	r->sq_array = (unsigned *) (sq + p.sq_off.array);
+	r->sq_local = *r->sq_tail;
+
+	cq = r->cq_ring;
+	r->cq_head = (unsigned *) (cq + p.cq_off.head);
+	r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	r->cq_mask = *(unsigned *) (cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+	return r;
+
+fail:
+	close (r->fd);
+	free (r);
+	return NULL;
+}
+
+static struct msr_uring *msr_uring_get (void)
+{
+	struct msr_uring *r;
+
+	pthread_once (&msr_uring_once, msr_uring_key_init);
+	if (!msr_uring_key_ok)
+		return NULL;
+
+	if ((r = pthread_getspecific (msr_uring_key)) == NULL) {
+		if ((r = msr_uring_new ()) == NULL)
+			return NULL;
+		pthread_setspecific (msr_uring_key, r);
+	}
+
+	return r;
+}
+
+/* Run the handlers of every completion in the queue. */
+static void msr_uring_reap (struct msr_uring *r)
+{
+	struct io_uring_cqe *cqe;
+	struct msr_uring_op *op;
+	unsigned head, tail;
+
+	head = *r->cq_head;
+	for (;;) {
+		tail = __atomic_load_n (r->cq_tail, __ATOMIC_ACQUIRE);
+		if (head == tail)
+			break;
+
+		cqe = &r->cqes[head & r->cq_mask];
+		op = (struct msr_uring_op *) (uintptr_t) cqe->user_data;
+		head++;
+		__atomic_store_n (r->cq_head, head, __ATOMIC_RELEASE);
+
+		if (op != NULL) {
+			op->busy = 0;
+			op->done (op, cqe->res);
+		}
+		/* Handlers may queue more work; pick up its completions too. */
+		head = *r->cq_head;
+	}
+}
+
+/* Hand queued entries to the kernel, waiting as asked. */
+static int msr_uring_enter (struct msr_uring *r, unsigned wait_nr,
+    int timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned flags = IORING_ENTER_EXT_ARG, nsub;
+	int ret;
+
+	nsub = r->sq_local - *r->sq_head;
+
+	if (wait_nr)
+		flags |= IORING_ENTER_GETEVENTS;
+
+	memset (&arg, 0, sizeof(arg));
+	if (timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (long long) (timeout % 1000) * 1000000;
+		arg.ts = (uint64_t) (uintptr_t) &ts;
+	}
+
+	ret = syscall (__NR_io_uring_enter, r->fd, nsub, wait_nr, flags,
+	    &arg, sizeof(arg));
+	if (ret < 0 && (errno == ETIME || errno == EINTR))
+		ret = 0;
+
+	return (ret < 0) ? -1 : 0;
+}
+
+/* Make room for n more entries, submitting what's queued if needed. */
+static int msr_uring_room (struct msr_uring *r, unsigned n)
+{
+	if (r->sq_entries - (r->sq_local - *r->sq_head) >= n)
+		return 0;
+
+	if (msr_uring_enter (r, 0, 0) != 0)
+		return -1;
+	msr_uring_reap (r);
+
+	return 0;
+}
+
+int msr_uring_reserve (unsigned n)
+{
+	struct msr_uring *r;
+
+	if ((r = msr_uring_get ()) == NULL)
+		return -1;
+
+	return msr_uring_room (r, n);
+}
+
+struct io_uring_sqe *msr_uring_sqe (struct msr_uring_op *op)
+{
+	struct io_uring_sqe *sqe;
+	struct msr_uring *r;
+	unsigned idx;
+
+	if ((r = msr_uring_get ()) == NULL || msr_uring_room (r, 1) != 0)
+		return NULL;
+
+	idx = r->sq_local & r->sq_mask;
+	sqe = &r->sqes[idx];
+	memset (sqe, 0, sizeof(*sqe));
+	sqe->user_data = (uint64_t) (uintptr_t) op;
+	if (op != NULL)
+		op->busy = 1;
+
+	r->sq_array[idx] = idx;
+	r->sq_local++;
+	__atomic_store_n (r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+
+	return sqe;
+}
+
+int msr_uring_submit (unsigned wait_nr, int timeout)
+{
+	struct msr_uring *r;
+
+	if ((r = msr_uring_get ()) == NULL)
+		return -1;
+
+	if (msr_uring_enter (r, wait_nr, timeout) != 0)
+		return -1;
+
+	msr_uring_reap (r);
+
+	return 0;
+}
+
+#else
+
+/* ISO C forbids an empty translation unit. */
+typedef int msr_uring_unused;
+
+#endif /* MSR_URING */
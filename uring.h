@@ -0,0 +1,47 @@
+/*
+ * Internal interface to the per-thread io_uring used by the io_uring
+ * serial backend. Not installed.
+ */
+#ifndef MSR_URING_H
+#define MSR_URING_H
+
+#ifdef MSR_URING
+
+#include <linux/io_uring.h>
+
+/*
+ * Every submission carries a pointer to one of these as its user_data
+ * (or 0, for submissions whose completions are of no interest). The
+ * handler runs on the submitting thread when the completion is reaped.
+ */
+struct msr_uring_op {
+	void	(*done)(struct msr_uring_op *op, int res);
+	int	busy; /* submitted and not yet completed */
+};
+
+/*
+ * Get a submission queue entry on the calling thread's ring, creating
+ * the ring on first use. The entry is zeroed and tied to op (which is
+ * marked busy), but is not submitted until msr_uring_submit(). Returns
+ * NULL if io_uring is unavailable.
+ */
+extern struct io_uring_sqe *msr_uring_sqe(struct msr_uring_op *op);
+
+/*
+ * Make sure the next n calls to msr_uring_sqe() won't have to submit
+ * what's already queued, so that linked entries go in together.
+ * Returns 0, or -1 with errno set.
+ */
+extern int msr_uring_reserve(unsigned n);
+
+/*
+ * Submit everything queued on the calling thread's ring, wait for at
+ * least wait_nr completions (or timeout ms; -1 waits forever), and run
+ * the handlers of every completion available. Returns 0, or -1 with
+ * errno set.
+ */
+extern int msr_uring_submit(unsigned wait_nr, int timeout);
+
+#endif /* MSR_URING */
+
+#endif /* MSR_URING_H */